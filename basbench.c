@@ -0,0 +1,445 @@
+/*
+ * basbench - BASIC tokenizer/detokenizer benchmark on a synthetic corpus.
+ *
+ * Generates VZ200/300 BASIC programs that use every keyword in the token
+ * table plus strings, REM and ' comments, ';' comments, tabs, lower case
+ * and maximum-length (254-byte) lines.  The programs are run through the
+ * shared code in basictok.h -- the tokenizer behind vzpack -B and
+ * text2bas, and the detokenizer behind vzexport --out-bas -- timed in
+ * lines/s and MB/s, and every program must come back byte for byte from
+ * detokenize + retokenize.
+ *
+ * Nothing is packaged; build it with `make bench`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <direct.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
+#endif
+
+#include "basictok.h"
+
+#ifndef TOOL_VERSION
+#define TOOL_VERSION "dev"
+#endif
+
+/* Source, program and listing of one program must fit the DOS data segment. */
+#if SIZE_MAX > 0xFFFFu
+#define DEFAULT_LINES 250u
+#else
+#define DEFAULT_LINES 40u
+#endif
+#define MAX_LINES     6000u
+#define SRC_LINE_MAX  (6u + BASTOK_LINE_MAX + 2u)      /* number, blank, text, CRLF */
+#define BENCH_FLAGS   (BASTOK_TOKENIZE | BASTOK_SQUEEZE | BASTOK_UPCASE)
+
+typedef struct {
+    unsigned char *p;
+    size_t len;
+    size_t cap;
+    int failed;
+} Bytes;
+
+typedef struct {
+    uint32_t rng;
+    unsigned word;                      /* next keyword for coverage lines */
+} Gen;
+
+static BasKeywords keywords;
+static BasDetok detok;
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "basbench: %s\n", msg);
+    exit(1);
+}
+
+static void bytes_sink(void *user, const unsigned char *p, size_t n)
+{
+    Bytes *b = (Bytes *)user;
+
+    if (b->failed) return;
+    if (b->cap - b->len < n) {
+        size_t ncap = b->cap ? b->cap : 4096u;
+        unsigned char *np;
+        while (ncap - b->len < n) ncap *= 2u;
+        if ((np = (unsigned char *)realloc(b->p, ncap)) == NULL) {
+            b->failed = 1;
+            return;
+        }
+        b->p = np;
+        b->cap = ncap;
+    }
+    memcpy(b->p + b->len, p, n);
+    b->len += n;
+}
+
+static void tokenize(Bytes *out, const unsigned char *src, size_t n)
+{
+    BasTok tok;
+
+    out->len = 0;
+    bastok_init(&tok, &keywords, BENCH_FLAGS, BASTOK_VZ_START, bytes_sink, out);
+    bastok_feed(&tok, src, n);
+    bastok_finish(&tok);
+}
+
+/*
+ * Corpus generator.  xorshift32 keeps the corpus identical for a given
+ * seed on every platform.
+ */
+static uint32_t gen_next(Gen *g)
+{
+    g->rng ^= g->rng << 13;
+    g->rng ^= g->rng >> 17;
+    g->rng ^= g->rng << 5;
+    return g->rng;
+}
+
+static char *put_str(char *s, const char *t)
+{
+    size_t n = strlen(t);
+    memcpy(s, t, n);
+    return s + n;
+}
+
+static char *put_word(Gen *g, char *s, int lower)
+{
+    static const char *const syl[] = {
+        "KA", "ZO", "MI", "RU", "TE", "BLA", "QUI", "VEX", "DR", "PH", "YL", "WO"
+    };
+    unsigned n = 1u + gen_next(g) % 3u;
+    while (n--) {
+        const char *t = syl[gen_next(g) % (sizeof(syl) / sizeof(syl[0]))];
+        while (*t) *s++ = lower ? (char)(*t++ | 0x20) : *t++;
+    }
+    return s;
+}
+
+/* Keywords from the table in order, so every one shows up in each program. */
+static const char *next_keyword(Gen *g)
+{
+    for (;;) {
+        const char *w = bastok_vz_words[g->word];
+        g->word = bastok_vz_words[g->word + 1] ? g->word + 1 : 0;
+        if (*w) return w;
+    }
+}
+
+/* Text of one line (no number); returns its end. */
+static char *gen_line(Gen *g, char *s, unsigned index)
+{
+    unsigned k, n;
+
+    if (index % 16u == 15u) {
+        /* 253 characters + NUL: the longest line the tokenizer keeps whole. */
+        s = put_str(s, "A$=\"");
+        for (k = 0; k < BASTOK_LINE_MAX - 6u; k++)
+            *s++ = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789 .,"[gen_next(g) % 39u];
+        *s++ = '"';
+        return s;
+    }
+    switch (index % 4u == 0u ? 0u : gen_next(g) % 8u) {
+    case 0:
+        for (k = 0; k < 6u; k++) {
+            if (k) *s++ = ' ';
+            s = put_str(s, next_keyword(g));
+        }
+        break;
+    case 1:
+        s = put_str(s, "PRINT \"");
+        s = put_word(g, s, 0);
+        s = put_str(s, ", ");
+        s = put_word(g, s, 1);
+        s = put_str(s, "\",A$,B");
+        break;
+    case 2:
+        s = put_str(s, "REM");
+        for (n = 1u + gen_next(g) % 6u; n > 0; n--) {
+            *s++ = ' ';
+            s = put_word(g, s, (int)(n & 1u));
+        }
+        break;
+    case 3:
+        s = put_str(s, "X=X+1 ' ");
+        s = put_word(g, s, 1);
+        s = put_str(s, " COUNTER");
+        break;
+    case 4:
+        s = put_str(s, "FOR\tI=1\tTO\t");
+        *s++ = (char)('1' + gen_next(g) % 9u);
+        s = put_str(s, "\tSTEP 2:POKE 28672+I,PEEK(I)");
+        break;
+    case 5:
+        s = put_str(s, "if a>b then print \"");
+        s = put_word(g, s, 1);
+        s = put_str(s, "\" else gosub 100");
+        break;
+    case 6:
+        s = put_str(s, "PRINT \"TOTAL:\";T;\" ITEMS\"");
+        break;
+    default:
+        s = put_str(s, "A(I)=INT(RND(0)*100)+SQR(ABS(B-C))/2:Z$=MID$(");
+        s = put_word(g, s, 0);
+        s = put_str(s, "$,2,3)");
+        break;
+    }
+    return s;
+}
+
+/* Program number index as source text; CRLF for odd programs, LF otherwise. */
+static size_t gen_program(char *out, unsigned index, unsigned lines, uint32_t seed)
+{
+    Gen g;
+    char *s = out;
+    unsigned i;
+
+    g.rng = seed * 2654435761u + index * 40503u + 1u;
+    if (!g.rng) g.rng = 1;
+    g.word = (unsigned)(index % 120u);
+    for (i = 0; i < lines; i++) {
+        char num[8];
+        sprintf(num, "%u ", 10u * (i + 1u));
+        s = put_str(s, num);
+        s = gen_line(&g, s, i);
+        if (index & 1u) *s++ = '\r';
+        *s++ = '\n';
+    }
+    return (size_t)(s - out);
+}
+
+/* Whole file into memory; NULL on failure. */
+static unsigned char *load_file(const char *path, size_t *size)
+{
+    FILE *in = fopen(path, "rb");
+    unsigned char *buf = NULL;
+    long sz;
+
+    if (!in) return NULL;
+    if (fseek(in, 0, SEEK_END) == 0 && (sz = ftell(in)) >= 0 && fseek(in, 0, SEEK_SET) == 0 &&
+        (buf = (unsigned char *)malloc(sz ? (size_t)sz : 1u)) != NULL &&
+        fread(buf, 1, (size_t)sz, in) != (size_t)sz) {
+        free(buf);
+        buf = NULL;
+    }
+    if (buf) *size = (size_t)sz;
+    fclose(in);
+    return buf;
+}
+
+typedef struct {
+    unsigned long programs, lines, failed;
+    double src_bytes, prog_bytes, text_bytes;
+    clock_t tok, detok;
+} Totals;
+
+/* Time one program and check its round trip. */
+static void bench_one(Totals *t, const char *label, const unsigned char *src, size_t n,
+                      unsigned rounds, Bytes *prog, Bytes *again, BasText *text)
+{
+    unsigned long lines = 0;
+    clock_t c0;
+    size_t i;
+    unsigned r;
+
+    /* CR, LF and CR LF each end a line, as in the tokenizer. */
+    for (i = 0; i < n; i++) {
+        if (src[i] == '\r') {
+            lines++;
+            if (i + 1 < n && src[i + 1] == '\n') i++;
+        } else if (src[i] == '\n') {
+            lines++;
+        }
+    }
+    if (n && src[n - 1] != '\n' && src[n - 1] != '\r') lines++;
+
+    c0 = clock();
+    for (r = 0; r < rounds; r++)
+        tokenize(prog, src, n);
+    t->tok += clock() - c0;
+
+    c0 = clock();
+    for (r = 0; r < rounds; r++) {
+        text->len = 0;
+        if (bastok_render(&detok, text, prog->p, prog->len, BASTOK_VZ_START) != 0)
+            die("out of memory");
+    }
+    t->detok += clock() - c0;
+
+    tokenize(again, (const unsigned char *)text->p, text->len);
+    if (prog->failed || again->failed)
+        die("out of memory");
+    if (prog->len > 0x10000ul - BASTOK_VZ_START)
+        fprintf(stderr, "basbench: warning: %s is too large for VZ memory (%lu bytes)\n",
+                label, (unsigned long)prog->len);
+    if (again->len != prog->len || memcmp(again->p, prog->p, prog->len) != 0) {
+        size_t d = 0;
+        while (d < prog->len && d < again->len && again->p[d] == prog->p[d]) d++;
+        printf("MISMATCH  %s: first difference at program offset %lu\n", label, (unsigned long)d);
+        t->failed++;
+    }
+
+    t->programs++;
+    t->lines += lines;
+    t->src_bytes += (double)n;
+    t->prog_bytes += (double)prog->len;
+    t->text_bytes += (double)text->len;
+}
+
+static void report(const char *what, clock_t ticks, unsigned rounds, unsigned long lines, double bytes,
+                   const char *of)
+{
+    double secs = (double)ticks / CLOCKS_PER_SEC;
+
+    if (ticks <= 0) {
+        printf("%-12s: too fast to time (raise --rounds)\n", what);
+        return;
+    }
+    printf("%-12s: %10.0f lines/s  %8.2f MB/s %s  (%.3f s)\n", what,
+           (double)lines * rounds / secs, bytes * rounds / secs / 1e6, of, secs);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "basbench version %s\n"
+        "Usage: %s [options] [input.bas...]\n"
+        "       %s --gen DIR [options]\n"
+        "\n"
+        "Options:\n"
+        "  --programs, -p N        Programs in the generated corpus (default 64)\n"
+        "  --lines,    -l N        Lines per generated program (default %u)\n"
+        "  --seed,     -s N        Corpus seed (default 1)\n"
+        "  --rounds,   -r N        Times each program is converted (default 10)\n"
+        "  --gen,      -g DIR      Write the corpus as DIR/benchNNN.bas and exit\n"
+        "  --help,     -h          Show this help\n"
+        "  --version,  -V          Print version and exit\n"
+        "\n"
+        "Input files replace the generated corpus.  Exit status is 1 if any\n"
+        "program does not survive detokenize + retokenize unchanged.\n",
+        TOOL_VERSION, prog, prog, DEFAULT_LINES);
+}
+
+static unsigned long parse_count(const char *s, unsigned long lo, unsigned long hi, const char *msg)
+{
+    char *end = NULL;
+    unsigned long v = strtoul(s, &end, 0);
+    if (*end != '\0' || v < lo || v > hi) die(msg);
+    return v;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned long programs = 64;
+    unsigned lines = DEFAULT_LINES;
+    uint32_t seed = 1;
+    unsigned rounds = 10;
+    const char *gen_dir = NULL;
+    const char **inputs;
+    int ninputs = 0;
+    Bytes prog = { NULL, 0, 0, 0 }, again = { NULL, 0, 0, 0 };
+    BasText text = { NULL, 0, 0 };
+    Totals t;
+    char *src = NULL;
+    unsigned long k;
+    int i;
+
+    inputs = (const char **)malloc((size_t)argc * sizeof(*inputs));
+    if (!inputs) die("out of memory");
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
+            printf("basbench version %s\n", TOOL_VERSION);
+            return 0;
+        } else if ((strcmp(argv[i], "--programs") == 0 || strcmp(argv[i], "-p") == 0) && i + 1 < argc) {
+            programs = parse_count(argv[++i], 1, 100000ul, "invalid --programs value (expected 1..100000)");
+        } else if ((strcmp(argv[i], "--lines") == 0 || strcmp(argv[i], "-l") == 0) && i + 1 < argc) {
+            lines = (unsigned)parse_count(argv[++i], 1, MAX_LINES, "invalid --lines value (expected 1..6000)");
+        } else if ((strcmp(argv[i], "--seed") == 0 || strcmp(argv[i], "-s") == 0) && i + 1 < argc) {
+            seed = (uint32_t)parse_count(argv[++i], 0, 0xFFFFFFFFul, "invalid --seed value");
+        } else if ((strcmp(argv[i], "--rounds") == 0 || strcmp(argv[i], "-r") == 0) && i + 1 < argc) {
+            rounds = (unsigned)parse_count(argv[++i], 1, 100000ul, "invalid --rounds value (expected 1..100000)");
+        } else if ((strcmp(argv[i], "--gen") == 0 || strcmp(argv[i], "-g") == 0) && i + 1 < argc) {
+            gen_dir = argv[++i];
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            inputs[ninputs++] = argv[i];
+        }
+    }
+    if (gen_dir && ninputs)
+        die("--gen takes no input files");
+
+    if (bastok_keywords_build(&keywords, bastok_vz_words) != 0)
+        die("keyword trie overflow");
+    bastok_detok_init(&detok, bastok_vz_words);
+    if (!ninputs && (src = (char *)malloc((size_t)lines * SRC_LINE_MAX)) == NULL)
+        die("out of memory");
+
+    if (gen_dir) {
+#if defined(_WIN32)
+        _mkdir(gen_dir);
+#elif defined(__unix__) || defined(__APPLE__)
+        mkdir(gen_dir, 0777);
+#endif
+        for (k = 0; k < programs; k++) {
+            char path[1024];
+            size_t n = gen_program(src, (unsigned)k, lines, seed);
+            FILE *f;
+            if ((size_t)snprintf(path, sizeof(path), "%s/bench%03lu.bas", gen_dir, k) >= sizeof(path))
+                die("--gen path too long");
+            if ((f = fopen(path, "wb")) == NULL)
+                die("cannot create corpus file (is --gen DIR writable?)");
+            if (fwrite(src, 1, n, f) != n || fclose(f) != 0)
+                die("failed writing corpus file");
+        }
+        printf("Generated   : %lu programs of %u lines in %s\n", programs, lines, gen_dir);
+        free(src);
+        free(inputs);
+        return 0;
+    }
+
+    memset(&t, 0, sizeof(t));
+    if (ninputs) {
+        for (i = 0; i < ninputs; i++) {
+            size_t n;
+            unsigned char *buf = load_file(inputs[i], &n);
+            if (!buf) {
+                fprintf(stderr, "basbench: cannot read '%s'\n", inputs[i]);
+                return 1;
+            }
+            bench_one(&t, inputs[i], buf, n, rounds, &prog, &again, &text);
+            free(buf);
+        }
+    } else {
+        for (k = 0; k < programs; k++) {
+            char label[32];
+            size_t n = gen_program(src, (unsigned)k, lines, seed);
+            sprintf(label, "program %lu", k);
+            bench_one(&t, label, (const unsigned char *)src, n, rounds, &prog, &again, &text);
+        }
+    }
+
+    printf("Corpus      : %lu programs, %lu lines, %.2f MB source, %.2f MB tokenized\n",
+           t.programs, t.lines, t.src_bytes / 1e6, t.prog_bytes / 1e6);
+    printf("Rounds      : %u\n", rounds);
+    report("Tokenize", t.tok, rounds, t.lines, t.src_bytes, "source");
+    report("Detokenize", t.detok, rounds, t.lines, t.text_bytes, "text  ");
+    printf("Round trip  : %lu ok, %lu failed\n", t.programs - t.failed, t.failed);
+
+    free(prog.p);
+    free(again.p);
+    free(text.p);
+    free(src);
+    free(inputs);
+    return t.failed ? 1 : 0;
+}
@@ -0,0 +1,530 @@
+/*
+ * basictok.h  --  ASCII BASIC tokenizer shared by vzpack and text2bas,
+ * and the detokenizer used by vzexport.
+ *
+ * All state for one source lives in a BasTok, so any number of sources
+ * can be tokenized at once (vzpack batch mode does this from worker
+ * threads).  Source bytes are pushed in with bastok_feed() in chunks of
+ * any size; each finished program line is passed to the sink as one
+ * block: link address (LE), line number (LE), tokenized text, NUL.
+ * bastok_finish() flushes an unterminated last line and emits the
+ * two-byte end-of-program link.
+ *
+ * Keywords are matched through a trie (BasKeywords) built once from a
+ * token table.  It is read-only afterwards and may be shared by every
+ * tokenizer, so build it before starting threads.
+ *
+ * Header-only; everything is static so each tool gets its own copy.
+ */
+#ifndef BASICTOK_H
+#define BASICTOK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/* Bumped whenever the bytes produced for some source change (build caches key on it). */
+#define BASTOK_VERSION   1
+
+/* Longest program line, not counting the 4-byte link/number header. */
+#define BASTOK_LINE_MAX  254
+
+/* BasTok flags */
+#define BASTOK_TOKENIZE  0x01   /* replace keywords by tokens */
+#define BASTOK_SQUEEZE   0x02   /* collapse runs of blanks outside strings */
+#define BASTOK_UPCASE    0x04   /* upper-case all text, strings included */
+
+#define BASTOK_VZ_START  0x7AE9u
+#define BASTOK_CG_START  0x5801u
+
+/* VZ200/300 BASIC, token = index + 0x80.  "" marks an unused slot. */
+static const char *const bastok_vz_words[128 + 1] = {
+    "END","FOR","RESET","SET","CLS",""/* CMD */,"RANDOM","NEXT",
+    "DATA","INPUT","DIM","READ","LET","GOTO","RUN","IF",
+    "RESTORE","GOSUB","RETURN","REM","STOP","ELSE","COPY","COLOR",
+    "VERIFY","DEFINT","DEFSNG","DEFDBL","CRUN","MODE","SOUND","RESUME",
+    "OUT","ON","OPEN","FIELD","GET","PUT","CLOSE","LOAD",
+    "MERGE","NAME","KILL","LSET","RSET","SAVE","SYSTEM","LPRINT",
+    "DEF","POKE","PRINT","CONT","LIST","LLIST","DELETE","AUTO",
+    "CLEAR","CLOAD","CSAVE","NEW","TAB(","TO","FN","USING",
+    "VARPTR","USR","ERL","ERR","STRING$","INSTR","POINT","TIME$",
+    "MEM","INKEY$","THEN","NOT","STEP","+","-","*",
+    "/","^","AND","OR",">","=","<","SGN",
+    "INT","ABS","FRE","INP","POS","SQR","RND","LOG",
+    "EXP","COS","SIN","TAN","ATN","PEEK","CVI","CVS",
+    "CVD","EOF","LOC","LOF","MKI$","MKS$","MKD$","CINT",
+    "CSNG","CDBL","FIX","LEN","STR$","VAL","ASC","CHR$",
+    "LEFT$","RIGHT$","MID$","'","","","","",NULL
+};
+
+/*
+ * Colour Genie BASIC.  Entries past 0xFF are extended keywords, stored
+ * as 0xFF followed by (token - 0x80).
+ */
+static const char *const bastok_cg_words[128 + 26 + 1] = {
+    "END","FOR","RESET","SET","CLS","CMD","RANDOM","NEXT",
+    "DATA","INPUT","DIM","READ","LET","GOTO","RUN","IF",
+    "RESTORE","GOSUB","RETURN","REM","STOP","ELSE","TRON","TROFF",
+    "DEFSTR","DEFINT","DEFSNG","DEFDBL","LINE","EDIT","ERROR","RESUME",
+    "OUT","ON","OPEN","FIELD","GET","PUT","CLOSE","LOAD",
+    "MERGE","NAME","KILL","LSET","RSET","SAVE","SYSTEM","LPRINT",
+    "DEF","POKE","PRINT","CONT","LIST","LLIST","DELETE","AUTO",
+    "CLEAR","CLOAD","CSAVE","NEW","TAB(","TO","FN","USING",
+    "VARPTR","USR","ERL","ERR","STRING$","INSTR","CHECK","TIME$",
+    "MEM","INKEY$","THEN","NOT","STEP","+","-","*",
+    "/","[","AND","OR",">","=","<","SGN",
+    "INT","ABS","FRE","INP","POS","SQR","RND","LOG",
+    "EXP","COS","SIN","TAN","ATN","PEEK","CVI","CVS",
+    "CVD","EOF","LOC","LOF","MKI$","MKS$","MKD$","CINT",
+    "CSNG","CDBL","FIX","LEN","STR$","VAL","ASC","CHR$",
+    "LEFT$","RIGHT$","MID$","'","","","","",
+    "COLOUR","FCOLOU","KEYPAD","JOY","PLOT","FGR","LGR","FCLS",
+    "PLAY","CIRCLE","SCALE","SHAPE","NSHAPE","XSHAPE","PAINT","CPOINT",
+    "NPLOT","SOUND","CHAR","RENUM","SWAP","FKEY","CALL","VERIFY",
+    "BGRD","NBGRD",NULL
+};
+
+/*
+ * Keyword trie.  The first character indexes root[] directly; deeper
+ * levels are first-child/next-sibling lists.  A node's tok is the lowest
+ * token value whose keyword ends there, so walking the input yields the
+ * first keyword in table order that matches (not necessarily the
+ * longest), as the ROM tokenizer does.
+ */
+#define BASTOK_TRIE_MAX  1024
+
+typedef struct {
+    unsigned char ch;
+    short child;
+    short sibling;
+    short tok;
+} BasTrieNode;
+
+typedef struct {
+    BasTrieNode node[BASTOK_TRIE_MAX];
+    short root[256];
+    unsigned char upper[256];   /* toupper() of every byte */
+    int count;
+} BasKeywords;
+
+static inline short bastok_node_new(BasKeywords *kw, unsigned char ch)
+{
+    BasTrieNode *n;
+
+    if (kw->count == BASTOK_TRIE_MAX) return -1;
+    n = &kw->node[kw->count];
+    n->ch = ch;
+    n->child = -1;
+    n->sibling = -1;
+    n->tok = -1;
+    return (short)kw->count++;
+}
+
+/* Build the trie from a NULL-terminated table; -1 if it does not fit. */
+static inline int bastok_keywords_build(BasKeywords *kw, const char *const *words)
+{
+    int t, c;
+    const char *s;
+    short n = -1;
+    short *link;
+
+    for (c = 0; c < 256; c++) {
+        kw->root[c] = -1;
+        kw->upper[c] = (unsigned char)toupper(c);
+    }
+    kw->count = 0;
+    for (t = 0x80; words[t - 0x80]; t++) {
+        s = words[t - 0x80];
+        if (!*s) continue;
+        link = &kw->root[toupper((unsigned char)*s)];
+        for (;;) {
+            if (*link < 0 &&
+                (*link = bastok_node_new(kw, (unsigned char)toupper((unsigned char)*s))) < 0)
+                return -1;
+            n = *link;
+            if (!*++s) break;
+            link = &kw->node[n].child;
+            while (*link >= 0 && kw->node[*link].ch != toupper((unsigned char)*s))
+                link = &kw->node[*link].sibling;
+        }
+        if (kw->node[n].tok < 0) kw->node[n].tok = (short)t;
+    }
+    return 0;
+}
+
+/* Token starting at text[0..n), or -1; *len receives the keyword length. */
+static inline int bastok_match(const BasKeywords *kw, const unsigned char *text, int n, int *len)
+{
+    int best = -1;
+    int d = 0;
+    short node = kw->root[kw->upper[text[0]]];
+
+    while (node >= 0) {
+        d++;
+        if (kw->node[node].tok >= 0 && (best < 0 || kw->node[node].tok < best)) {
+            best = kw->node[node].tok;
+            *len = d;
+        }
+        if (d >= n) break;
+        for (node = kw->node[node].child; node >= 0; node = kw->node[node].sibling)
+            if (kw->node[node].ch == kw->upper[text[d]]) break;
+    }
+    return best;
+}
+
+/* Receives one finished line (or the end link); bytes are only valid during the call. */
+typedef void (*BasTokSink)(void *user, const unsigned char *bytes, size_t n);
+
+enum { BASTOK_LINE_START, BASTOK_LINE_NUMBER, BASTOK_TEXT };
+
+typedef struct {
+    const BasKeywords *kw;
+    int flags;
+    BasTokSink sink;
+    void *user;
+    unsigned char buf[4 + BASTOK_LINE_MAX];  /* header, then line text */
+    int len;                    /* text bytes in buf */
+    unsigned short lineaddr;    /* link address of the line being built */
+    unsigned short linenum;
+    int mode;                   /* BASTOK_LINE_START etc. */
+    unsigned char str;          /* closing quote, 0x0D for ';' comments, or 0 */
+    int skip_lf;                /* previous byte was CR */
+} BasTok;
+
+static inline void bastok_init(BasTok *t, const BasKeywords *kw, int flags,
+                               unsigned short start, BasTokSink sink, void *user)
+{
+    t->kw = kw;
+    t->flags = flags;
+    t->sink = sink;
+    t->user = user;
+    t->len = 0;
+    t->lineaddr = start;
+    t->linenum = 1;
+    t->mode = BASTOK_LINE_START;
+    t->str = 0;
+    t->skip_lf = 0;
+}
+
+/*
+ * Tokenize and squeeze the pending line in one forward pass and hand it
+ * to the sink.  A keyword is never shorter than its encoding, so the
+ * text is rewritten in place.  An empty line becomes REM.
+ */
+static inline void bastok_flush_line(BasTok *t)
+{
+    unsigned char *text = t->buf + 4;
+    int r, w, n, tok, len;
+    unsigned char c;
+    unsigned char str = 0;
+
+    if (!t->len) return;
+    if (t->len == 1) {
+        text[0] = 'R';
+        text[1] = 'E';
+        text[2] = 'M';
+        text[3] = 0;
+        t->len = 4;
+    }
+
+    n = t->len;
+    for (r = 0, w = 0; r < n; ) {
+        c = text[r];
+        if (str && c != str) {
+            text[w++] = c;
+            r++;
+            continue;
+        }
+        if (c == str) {
+            str = 0;
+        } else if (c == 0x22) {
+            str = 0x22;
+        } else if (c == 0x27) {
+            str = 0x27;
+        } else if ((t->flags & BASTOK_TOKENIZE) &&
+                   (tok = bastok_match(t->kw, text + r, n - r, &len)) >= 0) {
+            if (tok > 0xFF) {
+                text[w++] = 0xFF;
+                text[w++] = (unsigned char)(tok - 0x80);
+            } else {
+                text[w++] = (unsigned char)tok;
+            }
+            r += len;
+            continue;
+        }
+        text[w++] = c;
+        r++;
+        if ((t->flags & BASTOK_SQUEEZE) && c == ' ') {
+            while (r < n && text[r] == ' ') r++;
+        }
+    }
+
+    /* Link and line number are known here, so the header goes out final. */
+    t->lineaddr = (unsigned short)(t->lineaddr + (unsigned short)(4 + w));
+    t->buf[0] = (unsigned char)(t->lineaddr & 0xFFu);
+    t->buf[1] = (unsigned char)(t->lineaddr >> 8);
+    t->buf[2] = (unsigned char)(t->linenum & 0xFFu);
+    t->buf[3] = (unsigned char)(t->linenum >> 8);
+    t->linenum++;
+    t->sink(t->user, t->buf, (size_t)(4 + w));
+    t->len = 0;
+}
+
+/* Append one byte of line text; consecutive NULs collapse into one. */
+static inline void bastok_put(BasTok *t, unsigned char c)
+{
+    if (c == 0 && t->len > 0 && t->buf[4 + t->len - 1] == 0)
+        return;
+    t->buf[4 + t->len] = c;
+    if (++t->len == BASTOK_LINE_MAX)
+        bastok_flush_line(t);
+}
+
+static inline void bastok_end_line(BasTok *t, unsigned char c)
+{
+    t->skip_lf = (c == 0x0D);
+    bastok_put(t, 0);
+    bastok_flush_line(t);
+    t->mode = BASTOK_LINE_START;
+    t->str = 0;
+}
+
+static inline unsigned char bastok_case(const BasTok *t, unsigned char c)
+{
+    return (t->flags & BASTOK_UPCASE) ? t->kw->upper[c] : c;
+}
+
+/*
+ * One source byte.  A line starts with an optional number, followed by
+ * at most one blank that is dropped.  CR, LF and CRLF all end a line;
+ * outside strings ^Z does too.  Tabs expand to the next multiple of 8.
+ * ';' starts a comment that runs to the end of the line.
+ */
+static inline void bastok_byte(BasTok *t, unsigned char c)
+{
+    if (t->skip_lf) {
+        t->skip_lf = 0;
+        if (c == 0x0A) return;
+    }
+
+    if (t->str) {
+        if (c == 0x0D || c == 0x0A) {
+            bastok_end_line(t, c);
+            return;
+        }
+        bastok_put(t, bastok_case(t, c));
+        if (c == t->str) t->str = 0;
+        return;
+    }
+
+    if (t->mode == BASTOK_LINE_START) {
+        t->mode = BASTOK_TEXT;
+        if (isdigit(c)) {
+            t->linenum = (unsigned short)(c - '0');
+            t->mode = BASTOK_LINE_NUMBER;
+            return;
+        }
+    } else if (t->mode == BASTOK_LINE_NUMBER) {
+        if (isdigit(c)) {
+            t->linenum = (unsigned short)(t->linenum * 10u + (unsigned)(c - '0'));
+            return;
+        }
+        t->mode = BASTOK_TEXT;
+        if (c == ' ') return;
+    }
+
+    switch (c) {
+        case 0x0A:
+        case 0x0D:
+        case 0x1A:
+            bastok_end_line(t, c);
+            break;
+        case 0x09:
+            bastok_put(t, 0x20);
+            while (t->len & 7)
+                bastok_put(t, 0x20);
+            break;
+        case 0x22:
+        case 0x27:
+            t->str = c;
+            bastok_put(t, c);
+            break;
+        case ';':
+            t->str = 0x0D;
+            bastok_put(t, c);
+            break;
+        default:
+            bastok_put(t, bastok_case(t, c));
+            break;
+    }
+}
+
+/* Bytes bastok_byte() would just append to the line outside strings. */
+static inline int bastok_plain(unsigned char c)
+{
+    if (c >= 0x28) return c != ';';
+    return c != 0 && c != 0x09 && c != 0x0A && c != 0x0D && c != 0x1A && c != 0x22 && c != 0x27;
+}
+
+/*
+ * Runs of ordinary line text (and string contents) are copied straight
+ * into the line; everything else, and the byte that fills a line, goes
+ * through bastok_byte().
+ */
+static inline void bastok_feed(BasTok *t, const unsigned char *src, size_t n)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        if (t->mode == BASTOK_TEXT) {
+            unsigned char str = t->str;
+            if (!str) {
+                while (i < n && t->len < BASTOK_LINE_MAX - 1 && bastok_plain(src[i]))
+                    t->buf[4 + t->len++] = bastok_case(t, src[i++]);
+            } else {
+                while (i < n && t->len < BASTOK_LINE_MAX - 1 && src[i] != str &&
+                       src[i] != 0 && src[i] != 0x0D && src[i] != 0x0A)
+                    t->buf[4 + t->len++] = bastok_case(t, src[i++]);
+            }
+            if (i == n) break;
+        }
+        bastok_byte(t, src[i++]);
+    }
+}
+
+/*
+ * Flush an unterminated last line and write the end-of-program link.
+ * A bare line number at end of input counts as an empty line.
+ */
+static inline void bastok_finish(BasTok *t)
+{
+    static const unsigned char end_link[2] = {0, 0};
+
+    if (t->len > 0 || t->mode != BASTOK_LINE_START) {
+        bastok_put(t, 0);
+        bastok_flush_line(t);
+    }
+    t->sink(t->user, end_link, 2);
+}
+
+/*
+ * Detokenizer.  Lines are rendered into one growable buffer; each line
+ * reserves its worst case up front (every byte a longest keyword or a
+ * \xNN escape) so the inner loop does no bounds checks.  Only single-byte
+ * tokens are expanded, which covers the VZ200/300 table.
+ */
+typedef struct {
+    char *p;
+    size_t len;
+    size_t cap;
+} BasText;
+
+typedef struct {
+    const char *const *words;
+    unsigned char len[128];
+    size_t expand_max;
+} BasDetok;
+
+static inline void bastok_detok_init(BasDetok *d, const char *const *words)
+{
+    int i;
+
+    d->words = words;
+    d->expand_max = 4;                  /* "\xNN" */
+    for (i = 0; i < 128; i++) {
+        d->len[i] = (unsigned char)strlen(words[i]);
+        if (d->len[i] > d->expand_max) d->expand_max = d->len[i];
+    }
+}
+
+static inline int bastok_text_reserve(BasText *b, size_t n)
+{
+    size_t ncap;
+    char *np;
+
+    if (b->cap - b->len >= n) return 0;
+    if (n > SIZE_MAX / 2u - b->len) return -1;
+    ncap = b->cap ? b->cap : 4096u;
+    while (ncap - b->len < n) ncap *= 2u;
+    np = (char *)realloc(b->p, ncap);
+    if (!np) return -1;
+    b->p = np;
+    b->cap = ncap;
+    return 0;
+}
+
+static inline char *bastok_put_dec(char *s, unsigned v)
+{
+    char tmp[5];
+    int n = 0;
+    do {
+        tmp[n++] = (char)('0' + v % 10u);
+        v /= 10u;
+    } while (v);
+    while (n > 0) *s++ = tmp[--n];
+    return s;
+}
+
+/*
+ * Append the listing of a tokenized program to b; -1 if out of memory.
+ * Lines are linked by absolute "next line" addresses.  Follow link
+ * pointers when sane; otherwise fall back to a linear scan so partially
+ * damaged payloads still produce useful text.
+ */
+static inline int bastok_render(const BasDetok *d, BasText *b, const unsigned char *data,
+                                size_t len, unsigned start_addr)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    size_t pos = 0;
+
+    while (pos + 4 <= len) {
+        unsigned next_addr = data[pos] | ((unsigned)data[pos + 1] << 8);
+        const unsigned char *p = data + pos + 4;
+        const unsigned char *end = (const unsigned char *)memchr(p, 0, len - pos - 4);
+        size_t n = end ? (size_t)(end - p) : len - pos - 4;
+        char *s;
+
+        if (next_addr == 0u)
+            break;
+        if (n > (SIZE_MAX - 8u) / d->expand_max || bastok_text_reserve(b, 7u + n * d->expand_max) != 0)
+            return -1;
+
+        s = b->p + b->len;
+        s = bastok_put_dec(s, data[pos + 2] | ((unsigned)data[pos + 3] << 8));
+        *s++ = ' ';
+        for (; n > 0; n--, p++) {
+            unsigned char c = *p;
+            if (c >= 0x80u && d->len[c - 0x80u]) {
+                memcpy(s, d->words[c - 0x80u], d->len[c - 0x80u]);
+                s += d->len[c - 0x80u];
+            } else if (c >= 32u && c <= 126u) {
+                *s++ = (char)c;
+            } else {
+                *s++ = '\\';
+                *s++ = 'x';
+                *s++ = hex[c >> 4];
+                *s++ = hex[c & 15u];
+            }
+        }
+        *s++ = '\n';
+        b->len = (size_t)(s - b->p);
+
+        if (!end)
+            break;
+
+        if (next_addr > start_addr) {
+            size_t next_pos = (size_t)(next_addr - start_addr);
+            if (next_pos > pos && next_pos <= len) {
+                pos = next_pos;
+                continue;
+            }
+        }
+
+        pos = (size_t)(end - data) + 1u;
+    }
+    return 0;
+}
+
+#endif /* BASICTOK_H */
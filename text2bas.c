@@ -3,191 +3,71 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <strings.h>
 #include <ctype.h>
 
 #ifndef TOOL_VERSION
 #define TOOL_VERSION "dev"
 #endif
 
-#if defined(_WIN32) && !defined(strncasecmp)
-#define strncasecmp _strnicmp
-#endif
-
 /* set to 1 for Colour Genie tokenizer, 0 for VZ200/300 */
 #ifndef CGENIE
 #define CGENIE  0
 #endif
 
-typedef struct tagLINE {
-    unsigned short next;
-    unsigned short num;
-    unsigned char text[254];
-} BLABLA;
-
-BLABLA line = {0, 0, {0, }};
+#include "basictok.h"
 
-unsigned short lineaddr = 0;
-unsigned short linenum = 1;
 int flag_tokenize = 1;
 int flag_squeeze_blanks = 1;
 
 #if CGENIE
 #define EXT ".cas"
-#define ADR 0x5801
-
-static char *token[128+26+1] = {
-    "END","FOR","RESET","SET","CLS","CMD","RANDOM","NEXT",
-    "DATA","INPUT","DIM","READ","LET","GOTO","RUN","IF",
-    "RESTORE","GOSUB","RETURN","REM","STOP","ELSE","TRON","TROFF",
-    "DEFSTR","DEFINT","DEFSNG","DEFDBL","LINE","EDIT","ERROR","RESUME",
-    "OUT","ON","OPEN","FIELD","GET","PUT","CLOSE","LOAD",
-    "MERGE","NAME","KILL","LSET","RSET","SAVE","SYSTEM","LPRINT",
-    "DEF","POKE","PRINT","CONT","LIST","LLIST","DELETE","AUTO",
-    "CLEAR","CLOAD","CSAVE","NEW","TAB(","TO","FN", "USING",
-    "VARPTR","USR","ERL","ERR","STRING$","INSTR","CHECK","TIME$",
-    "MEM","INKEY$","THEN","NOT","STEP","+","-","*",
-    "/","[","AND","OR",">","=","<","SGN",
-    "INT","ABS","FRE","INP","POS","SQR","RND","LOG",
-    "EXP","COS","SIN","TAN","ATN","PEEK","CVI","CVS",
-    "CVD","EOF","LOC","LOF","MKI$","MKS$","MKD$","CINT",
-    "CSNG","CDBL","FIX","LEN","STR$","VAL","ASC","CHR$",
-    "LEFT$","RIGHT$","MID$","'","","","","",
-    "COLOUR","FCOLOU","KEYPAD","JOY","PLOT","FGR","LGR","FCLS",
-    "PLAY","CIRCLE","SCALE","SHAPE","NSHAPE","XSHAPE","PAINT","CPOINT",
-    "NPLOT","SOUND","CHAR","RENUM","SWAP","FKEY","CALL","VERIFY",
-    "BGRD","NBGRD", NULL};
+#define ADR BASTOK_CG_START
+#define WORDS bastok_cg_words
+#define CASE_FLAGS 0
 #else
 #define EXT ".vz"
-#define ADR 0x7ae9
-
-static char *token[128+1] = {
-    "END","FOR","RESET","SET","CLS",""/* CMD */,"RANDOM","NEXT",
-    "DATA","INPUT","DIM","READ","LET","GOTO","RUN","IF",
-    "RESTORE","GOSUB","RETURN","REM","STOP","ELSE","COPY","COLOR",
-    "VERIFY","DEFINT","DEFSNG","DEFDBL","CRUN","MODE","SOUND","RESUME",
-    "OUT","ON","OPEN","FIELD","GET","PUT","CLOSE","LOAD",
-    "MERGE","NAME","KILL","LSET","RSET","SAVE","SYSTEM","LPRINT",
-    "DEF","POKE","PRINT","CONT","LIST","LLIST","DELETE","AUTO",
-    "CLEAR","CLOAD","CSAVE","NEW","TAB(","TO","FN", "USING",
-    "VARPTR","USR","ERL","ERR","STRING$","INSTR","POINT","TIME$",
-    "MEM","INKEY$","THEN","NOT","STEP","+","-","*",
-    "/","^","AND","OR",">","=","<","SGN",
-    "INT","ABS","FRE","INP","POS","SQR","RND","LOG",
-    "EXP","COS","SIN","TAN","ATN","PEEK","CVI","CVS",
-    "CVD","EOF","LOC","LOF","MKI$","MKS$","MKD$","CINT",
-    "CSNG","CDBL","FIX","LEN","STR$","VAL","ASC","CHR$",
-    "LEFT$","RIGHT$","MID$","'","","","","",NULL};
+#define ADR BASTOK_VZ_START
+#define WORDS bastok_vz_words
+#define CASE_FLAGS BASTOK_UPCASE
 #endif
 
-void tokenize(int i)
-{
-    int t;
-    int len;
-    size_t move_len;
-
-    for (t = 0x80; token[t-0x80]; t++)
-    {
-        len = strlen(token[t-0x80]);
-        if (len && strncasecmp((char*)(line.text+i), token[t-0x80], len) == 0)
-        {
-            if (t > 0xFF)
-            {
-                move_len = strlen((char*)(line.text + i + len)) + 1;
-                memmove((char*)(line.text + i + 2), (char*)(line.text + i + len), move_len);
-                line.text[i+0] = 0xFF;
-                line.text[i+1] = t - 0x80;
-                line.next -= len - 2;
-            }
-            else
-            {
-                move_len = strlen((char*)(line.text + i + len)) + 1;
-                memmove((char*)(line.text + i + 1), (char*)(line.text + i + len), move_len);
-                line.text[i+0] = t;
-                line.next -= len - 1;
-            }
-        }
-    }
-}
+/*
+ * Source is read and output written in blocks; tokenized lines are
+ * gathered in out_buf and go to the file with one fwrite per block.
+ */
+#if SIZE_MAX > 0xFFFFu
+#define IO_BLOCK 65536u
+#else
+#define IO_BLOCK 4096u
+#endif
 
-void squeeze_blanks(int i)
-{
-    int j;
-    size_t move_len;
+typedef struct {
+    FILE *f;
+    size_t len;
+    int err;
+} OutBuf;
 
-    if (line.text[i] != ' ')
-        return;
+static BasKeywords keywords;
+static unsigned char in_buf[IO_BLOCK];
+static unsigned char out_buf[IO_BLOCK];
 
-    for (j = i+1; j < line.next; j++)
-    {
-        if (line.text[j] != ' ')
-            break;
-    }
-    if (j > i+1)
-    {
-        move_len = strlen((char*)(line.text + j)) + 1;
-        memmove((char*)(line.text + i + 1), (char*)(line.text + j), move_len);
-        line.next -= j - i - 1;
-    }
-}
-
-void outline(FILE * out)
+static void out_flush(OutBuf *o)
 {
-    int i;
-    int len;
-    char str = 0;
-
-    if (line.next)
-    {
-        if (line.next == 1)  /* avoid empty lines */
-        {
-            line.text[0] = 'R';
-            line.text[1] = 'E';
-            line.text[2] = 'M';
-            line.text[3] = 0;
-            line.next = 4;
-        }
-        for (i = 0; i < line.next; i++)
-        {
-            if (str && (line.text[i] != str))
-                continue;
-            if (line.text[i] == str)
-            {
-                str = 0;
-            }
-            else if (line.text[i] == 0x22)
-            {
-                str = 0x22;
-            }
-            else if (line.text[i] == 0x27)
-            {
-                str = 0x27;
-            }
-            else if (flag_tokenize)
-                tokenize(i);
-            if (flag_squeeze_blanks)
-                squeeze_blanks(i);
-        }
-
-        len = 4 + line.next;
-        lineaddr += len;
-        line.next = lineaddr;
-        line.num = linenum++;
-        fwrite(&line, 1, len, out);
-        line.next = 0;
-    }
+    if (o->len && !o->err && fwrite(out_buf, 1, o->len, o->f) != o->len)
+        o->err = 1;
+    o->len = 0;
 }
 
-void outbyte(FILE * out, char c)
+static void write_line(void *user, const unsigned char *bytes, size_t n)
 {
-    if (c == 0 && line.next > 0 && line.text[line.next-1] == 0)
-        return;
-
-    line.text[line.next] = c;
+    OutBuf *o = (OutBuf *)user;
 
-    if (++line.next == 254)
-        outline(out);
+    if (IO_BLOCK - o->len < n)
+        out_flush(o);
+    memcpy(out_buf + o->len, bytes, n);
+    o->len += n;
 }
 
 void print_usage(const char *progname)
@@ -214,9 +94,9 @@ int main(int ac, char **av)
     char outfilename[256];
     char *p;
     FILE *inp, *out;
-    int num = 1;
-    char str = 0;
-    char c;
+    OutBuf ob;
+    BasTok tok;
+    size_t got;
     int arg_idx = 1;
 
     memset(inpfilename, 0, sizeof(inpfilename));
@@ -324,6 +204,12 @@ int main(int ac, char **av)
         strcat(outfilename, EXT);
     }
 
+    if (bastok_keywords_build(&keywords, WORDS) != 0)
+    {
+        fprintf(stderr, "Error: keyword trie overflow\n");
+        return 1;
+    }
+
     /* Open input file */
     inp = fopen(inpfilename, "rb");
     if (!inp)
@@ -340,18 +226,21 @@ int main(int ac, char **av)
         fclose(inp);
         return 1;
     }
+    ob.f = out;
+    ob.len = 0;
+    ob.err = 0;
 
 #if CGENIE
     /* Colour Genie header */
     p = strrchr(inpfilename, '/');
     if (!p)
         p = inpfilename - 1;
-    fputc(0x66, out);
+    out_buf[ob.len++] = 0x66;
     /* Basic name is first char of filename */
-    fputc(toupper((unsigned char)p[1]), out);
+    out_buf[ob.len++] = (unsigned char)toupper((unsigned char)p[1]);
 #else
     /* VZ magic header */
-    fwrite("VZF0", 1, 4, out);
+    write_line(&ob, (const unsigned char *)"VZF0", 4);
     /* Write input basename (without extension), uppercased, NUL-padded to 17 bytes. */
     {
         char basename[17];
@@ -384,124 +273,40 @@ int main(int ac, char **av)
         for (j = 0; j < copy_len; j++)
             basename[j] = (char)toupper((unsigned char)name_start[j]);
 
-        fwrite(basename, 1, 17, out);
+        write_line(&ob, (const unsigned char *)basename, 17);
     }
     
     /* VZ magic value 0xf0 */
-    fputc(0xf0, out);
+    out_buf[ob.len++] = 0xf0;
     /* VZ basic load address */
-    fputc(ADR & 0xff, out);
-    fputc(ADR >> 8, out);
+    out_buf[ob.len++] = ADR & 0xff;
+    out_buf[ob.len++] = ADR >> 8;
 #endif
 
-    lineaddr = ADR;
-    
+    bastok_init(&tok, &keywords,
+                (flag_tokenize ? BASTOK_TOKENIZE : 0) |
+                (flag_squeeze_blanks ? BASTOK_SQUEEZE : 0) | CASE_FLAGS,
+                ADR, write_line, &ob);
+
     /* Process input file */
-    while (!feof(inp))
+    while ((got = fread(in_buf, 1, sizeof(in_buf), inp)) > 0)
+        bastok_feed(&tok, in_buf, got);
+    if (ferror(inp))
     {
-        c = fgetc(inp);
-        if (feof(inp))
-            break;
-            
-        if (str)  /* inside string/comment ? */
-        {
-            if (c == 0x0d || c == 0x0a)  /* new line ? (handle both CR and LF) */
-            {
-                /* Skip LF if it follows CR */
-                if (c == 0x0d)
-                {
-                    int next = fgetc(inp);
-                    if (next != 0x0a && next != EOF)
-                        ungetc(next, inp);
-                }
-                outbyte(out, 0x00);
-                outline(out);
-                num = 1;
-                str = 0;  /* End string/comment at line end */
-            }
-            else
-            {
-#if CGENIE
-                /* put any char */
-                outbyte(out, c);
-#else
-                /* upper case letters only */
-                outbyte(out, toupper((unsigned char)c));
-#endif
-            }
-            if (c == str)  /* end of string/comment ? */
-                str = 0;
-        }
-        else  /* normal text */
-        {
-            if (num)  /* expecting line number ? */
-            {
-                if (isdigit(c))  /* digit follows ?? */
-                {
-                    linenum = c - '0';
-                    while (!feof(inp) && isdigit(c = fgetc(inp)))
-                    {
-                        linenum *= 10;
-                        linenum += c - '0';
-                    }
-                    if (c == ' ')  /* skip one space after the line number */
-                        c = fgetc(inp);
-                }
-                num = 0;
-            }
-            switch (c)
-            {
-            case 0x0a:  /* LF - Unix line ending */
-            case 0x0d:  /* CR - Mac/DOS line ending */
-            case 0x1a:  /* End of text marker */
-                /* Skip LF if it follows CR (handle CRLF) */
-                if (c == 0x0d)
-                {
-                    int next = fgetc(inp);
-                    if (next != 0x0a && next != EOF)
-                        ungetc(next, inp);
-                }
-                outbyte(out, 0x00);
-                outline(out);
-                num = 1;
-                break;
-            case 9:  /* expand tabs */
-                outbyte(out, 0x20);
-                while (line.next & 7)
-                    outbyte(out, 0x20);
-                break;
-            case 0x22:  /* inside string ? */
-            case 0x27:
-                str = c;
-                outbyte(out, c);
-                break;
-            case ';':  /* comment line ? */
-                str = 0x0d;  /* skip until next return */
-                outbyte(out, c);
-                break;
-            default:
-#if CGENIE
-                outbyte(out, c);
-#else
-                outbyte(out, toupper((unsigned char)c));
-#endif
-                break;
-            }
-        }
-    }
-    /* If the last line had content but no newline, flush it */
-    if (line.next > 0)
-    {
-        outbyte(out, 0x00);
-        outline(out);
+        fprintf(stderr, "Error: Failed to read input file '%s'\n", inpfilename);
+        fclose(inp);
+        fclose(out);
+        return 1;
     }
-    
-    /* Write end marker */
-    line.next = 0;
-    fwrite(&line, 1, 2, out);
+    bastok_finish(&tok);
+    out_flush(&ob);
 
     fclose(inp);
-    fclose(out);
+    if (fclose(out) != 0 || ob.err)
+    {
+        fprintf(stderr, "Error: Failed writing output file '%s'\n", outfilename);
+        return 1;
+    }
 
     printf("Successfully converted '%s' to '%s'\n", inpfilename, outfilename);
     printf("Tokenization: %s\n", flag_tokenize ? "enabled" : "disabled");
@@ -6,7 +6,7 @@
  * output produced by the original DOS application.
  *
  * Usage:
- *   vz2wav [--compat|-c] [--artifact|-a] [--robust|-r] [--gain|-g <percent>] <input.vz> <output.wav>
+ *   vz2wav [--compat|-c] [--artifact|-a] [--robust|-r] [--gain|-g <percent>] [--stats] [--bas|-b] [--cas] <input.vz|input.bas|input.cas> <output.wav>
  *
  *   --compat, -c
  *               Produce a "malformed" WAV file that matches the DOS original
@@ -32,6 +32,16 @@
  *   --gain, -g  Signed percent delta applied around 0x7F center.
  *               Example: --gain 10 => 110% amplitude, --gain -10 => 90%.
  *
+ *   --stats     Print a per-phase wall/CPU time breakdown and encoder
+ *               counters.  Build with -DVZ_STATS=0 to compile them out.
+ *
+ *   --bas, -b   Treat the input as ASCII BASIC source (implied by a .bas
+ *               extension).  It is tokenized as by vzpack -B and streamed
+ *               straight into the encoder; no .vz file is written.  A
+ *               counting pass first fixes the end address and checksum,
+ *               and refuses a program that does not fit, before the WAV
+ *               is created.
+ *
  * Build (Linux / GCC):
  *   gcc -Wall -o vz2wav vz2wav.c
  *
@@ -39,12 +49,21 @@
  *   gcc -Wall -o vz2wav.exe vz2wav.c
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 199309L     /* clock_gettime() for --stats */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <inttypes.h>
 
+#include "vzstats.h"
+#include "basictok.h"
+#include "vztape.h"
+
 #ifndef TOOL_VERSION
 #define TOOL_VERSION "dev"
 #endif
@@ -56,19 +75,15 @@
 #define SAMPLE_RATE         22050
 #define SILENCE_BYTE        0x7F
 #define SILENCE_SAMPLES     22050
-#define LEADER_BYTE         0x80
-#define LEADER_COUNT        255
-#define SYNC_BYTE           0xFE
-#define SYNC_COUNT          5
 #define PADDING_RAW_BYTES   80
 #define VZ_HEADER_SIZE      24
-#define FILENAME_FIELD_LEN  16
+#define FILENAME_FIELD_LEN  VZTAPE_NAME_LEN
 #define SAMPLES_PER_BIT     38
 #define POST_CKSUM_GUARD    0x00
 #define ROBUST_PRE_SILENCE_SAMPLES  ((uint32_t)SAMPLE_RATE * 2u)
 #define ROBUST_POST_SILENCE_SAMPLES ((uint32_t)SAMPLE_RATE * 2u)
 #define ROBUST_LEADER_COUNT         384
-#define ROBUST_SYNC_COUNT           SYNC_COUNT
+#define ROBUST_SYNC_COUNT           VZTAPE_SYNC_COUNT
 #define SIGNAL_CENTER               127
 #define DEFAULT_GAIN_PERCENT        10
 #define MIN_GAIN_PERCENT           -90
@@ -76,6 +91,16 @@
 
 static int g_output_gain_percent = DEFAULT_GAIN_PERCENT;
 
+/* Encoder counters for --stats (no-ops with -DVZ_STATS=0). */
+static struct {
+    unsigned long long samples;
+    unsigned long long bytes;
+    unsigned long long ones;
+    unsigned long long zeros;
+} g_stats;
+
+enum { PH_READ = 0, PH_LEADER, PH_HEADER, PH_BODY, PH_TRAILER, PH_COUNT };
+
 /* -------------------------------------------------------------------------
  * Bit waveform tables  (exact values from the DOS binary)
  * ------------------------------------------------------------------------- */
@@ -158,21 +183,27 @@ static void build_wav_header(unsigned char hdr[44], uint32_t data_bytes, int com
  * Tape encoding primitives
  * ------------------------------------------------------------------------- */
 
-static int write_bit(FILE *out, int bit)
+/*
+ * Bit waveforms with the output gain applied, built once by init_waves()
+ * so a byte is rendered by copying eight table rows.
+ */
+static unsigned char g_wave[2][SAMPLES_PER_BIT];
+
+static void init_waves(void)
 {
-    int i;
-    const unsigned char *src = bit ? BIT1_WAVE : BIT0_WAVE;
     int gain_num = 100 + g_output_gain_percent;
-
-    for (i = 0; i < SAMPLES_PER_BIT; i++) {
-        int centered = (int)src[i] - SIGNAL_CENTER;
-        int scaled = SIGNAL_CENTER + (centered * gain_num) / 100;
-        if (scaled < 0) scaled = 0;
-        if (scaled > 255) scaled = 255;
-        if (fputc((unsigned char)scaled, out) == EOF)
-            return -1;
+    int b, i;
+
+    for (b = 0; b < 2; b++) {
+        const unsigned char *src = b ? BIT1_WAVE : BIT0_WAVE;
+        for (i = 0; i < SAMPLES_PER_BIT; i++) {
+            int centered = (int)src[i] - SIGNAL_CENTER;
+            int scaled = SIGNAL_CENTER + (centered * gain_num) / 100;
+            if (scaled < 0) scaled = 0;
+            if (scaled > 255) scaled = 255;
+            g_wave[b][i] = (unsigned char)scaled;
+        }
     }
-    return 0;
 }
 
 static int parse_gain_percent(const char *s, int *out)
@@ -190,12 +221,23 @@ static int parse_gain_percent(const char *s, int *out)
     return 0;
 }
 
+/* One byte, MSB first, as 8 * SAMPLES_PER_BIT samples in a single write. */
 static int write_vz_byte(FILE *out, unsigned char val)
 {
-    int i;
-    for (i = 7; i >= 0; i--)
-        if (write_bit(out, (val >> i) & 1) < 0)
-            return -1;
+    unsigned char buf[8 * SAMPLES_PER_BIT];
+    int i, ones = 0;
+
+    for (i = 0; i < 8; i++) {
+        int bit = (val >> (7 - i)) & 1;
+        memcpy(buf + i * SAMPLES_PER_BIT, g_wave[bit], SAMPLES_PER_BIT);
+        ones += bit;
+    }
+    if (fwrite(buf, 1, sizeof(buf), out) != sizeof(buf))
+        return -1;
+    STAT_ADD(g_stats, samples, 8 * SAMPLES_PER_BIT);
+    STAT_ADD(g_stats, ones, ones);
+    STAT_ADD(g_stats, zeros, 8 - ones);
+    STAT_ADD(g_stats, bytes, 1);
     return 0;
 }
 
@@ -205,20 +247,172 @@ static int write_raw(FILE *out, unsigned char fill, uint32_t count)
     for (i = 0; i < count; i++)
         if (fputc(fill, out) == EOF)
             return -1;
+    STAT_ADD(g_stats, samples, count);
     return 0;
 }
 
 static int write_artifact_padding(FILE *out)
 {
     size_t n = fwrite(BORLAND_ARTIFACT_PADDING, 1, PADDING_RAW_BYTES, out);
+    STAT_ADD(g_stats, samples, n);
     return (n == (size_t)PADDING_RAW_BYTES) ? 0 : -1;
 }
 
+/* -------------------------------------------------------------------------
+ * BASIC source input (--bas)
+ * ------------------------------------------------------------------------- */
+
+static BasKeywords g_keywords;
+
+/*
+ * Body bytes go to the encoder as the tokenizer finishes each line.
+ * With no output the sink only counts, which sizes the body before the
+ * WAV is created.
+ */
+typedef struct {
+    FILE     *out;
+    uint32_t  len;
+    uint32_t  sum;
+    int       err;
+} BodySink;
+
+static void body_sink(void *user, const unsigned char *bytes, size_t n)
+{
+    BodySink *b = (BodySink *)user;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (b->out && !b->err && write_vz_byte(b->out, bytes[i]) < 0)
+            b->err = 1;
+        b->sum += bytes[i];
+    }
+    b->len += (uint32_t)n;
+}
+
+/* Tokenize fin into the encoder; 0 ok, -1 read error, -2 write error. */
+static int stream_basic(FILE *fin, BodySink *b)
+{
+    unsigned char buf[4096];
+    BasTok tok;
+    size_t n;
+
+    bastok_init(&tok, &g_keywords, BASTOK_TOKENIZE | BASTOK_SQUEEZE | BASTOK_UPCASE,
+                BASTOK_VZ_START, body_sink, b);
+    while ((n = fread(buf, 1, sizeof(buf), fin)) > 0)
+        bastok_feed(&tok, buf, n);
+    if (ferror(fin))
+        return -1;
+    bastok_finish(&tok);
+    return b->err ? -2 : 0;
+}
+
+static int has_bas_extension(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    return dot && (dot[1] == 'b' || dot[1] == 'B') && (dot[2] == 'a' || dot[2] == 'A') &&
+           (dot[3] == 's' || dot[3] == 'S') && dot[4] == '\0';
+}
+
+/* -------------------------------------------------------------------------
+ * .cas input (--cas)
+ * ------------------------------------------------------------------------- */
+
+/* A .cas tape byte stream split at the points the encoder cares about. */
+typedef struct {
+    uint32_t       leader;      /* VZTAPE_LEADER_BYTE run */
+    uint32_t       sync;        /* VZTAPE_SYNC_BYTE run */
+    uint8_t        type;
+    unsigned char  name[FILENAME_FIELD_LEN + 1];
+    uint16_t       start, end;
+    uint32_t       data;        /* offset of the data bytes */
+    uint32_t       len;
+    uint8_t        ck_lo, ck_hi;
+    uint32_t       trailing;    /* bytes after the checksum (ignored) */
+} CasImage;
+
+static int has_cas_extension(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    return dot && (dot[1] == 'c' || dot[1] == 'C') && (dot[2] == 'a' || dot[2] == 'A') &&
+           (dot[3] == 's' || dot[3] == 'S') && dot[4] == '\0';
+}
+
+/* NULL on success, else what is wrong with the image. */
+static const char *parse_cas(const unsigned char *p, uint32_t n, CasImage *c)
+{
+    uint32_t pos = 0;
+    uint32_t k;
+
+    memset(c, 0, sizeof(*c));
+    while (pos < n && p[pos] == VZTAPE_LEADER_BYTE) pos++;
+    c->leader = pos;
+    while (pos < n && p[pos] == VZTAPE_SYNC_BYTE) pos++;
+    c->sync = pos - c->leader;
+    if (!c->leader || !c->sync)
+        return "no leader/sync (not a VZ .cas image)";
+    if (pos >= n)
+        return "truncated header";
+    c->type = p[pos++];
+    for (k = 0; pos < n && p[pos] != 0; k++, pos++) {
+        if (k == FILENAME_FIELD_LEN)
+            return "file name longer than 16 characters";
+        c->name[k] = p[pos];
+    }
+    if (n - pos < 5)
+        return "truncated header";
+    pos++;
+    c->start = (uint16_t)(p[pos] | (p[pos + 1] << 8));
+    c->end   = (uint16_t)(p[pos + 2] | (p[pos + 3] << 8));
+    pos += 4;
+    c->data = pos;
+    c->len  = (uint16_t)(c->end - c->start);
+    if (n - pos < c->len + 2u)
+        return "truncated data";
+    c->ck_lo = p[pos + c->len];
+    c->ck_hi = p[pos + c->len + 1];
+    c->trailing = n - pos - c->len - 2u;
+    return NULL;
+}
+
+/* VZ header name from a path: basename without extension, upper case. */
+static void name_from_path(unsigned char out[FILENAME_FIELD_LEN + 1], const char *path)
+{
+    const char *name = path;
+    const char *slash1 = strrchr(path, '/');
+    const char *slash2 = strrchr(path, '\\');
+    const char *dot;
+    size_t n, i;
+
+    memset(out, 0, FILENAME_FIELD_LEN + 1);
+    if (slash1 && (!slash2 || slash1 > slash2))
+        name = slash1 + 1;
+    else if (slash2)
+        name = slash2 + 1;
+    dot = strrchr(name, '.');
+    n = (dot && dot > name) ? (size_t)(dot - name) : strlen(name);
+    if (n > FILENAME_FIELD_LEN) n = FILENAME_FIELD_LEN;
+    for (i = 0; i < n; i++)
+        out[i] = (unsigned char)toupper((unsigned char)name[i]);
+}
+
+static void print_input_info(const char *path, const unsigned char *filename,
+                             uint8_t file_type, uint16_t load_addr, uint32_t body_len)
+{
+    printf("Input : %s\n", path);
+    printf("  Filename  : %.16s\n", (const char *)filename);
+    printf("  File type : %s (0x%02" PRIX8 ")\n",
+           file_type == 0xF0 ? "BASIC" :
+           file_type == 0xF1 ? "Machine code" : "Unknown",
+           file_type);
+    printf("  Load addr : 0x%04" PRIX16 "\n", load_addr);
+    printf("  Body size : %" PRIu32 " bytes\n", body_len);
+}
+
 static void print_usage(void)
 {
     fprintf(stderr,
         "vz2wav v%s - Convert VZ-200/VZ-300 tape image to WAV audio\n"
-        "Usage: vz2wav [--compat|-c] [--artifact|-a] [--robust|-r] [--gain|-g <percent>] <input.vz> <output.wav>\n"
+        "Usage: vz2wav [--compat|-c] [--artifact|-a] [--robust|-r] [--gain|-g <percent>] [--stats] [--bas|-b] [--cas] <input.vz|input.bas|input.cas> <output.wav>\n"
         "\n"
         "  --compat,-c   Write a malformed WAV matching the original DOS program\n"
         "                (RIFF and data size fields use raw DOS stack garbage).\n"
@@ -226,6 +420,11 @@ static void print_usage(void)
         "                the 80-byte padding gap instead of 0x7F silence.\n"
         "  --robust,-r   Use longer settle/leader/sync timing for noisy analog paths.\n"
         "  --gain,-g N   Amplitude delta in percent (range -90..300, default +10).\n"
+        "  --stats       Print per-phase timing and encoder counters.\n"
+        "  --bas,-b      Input is ASCII BASIC source (default for *.bas); it is\n"
+        "                tokenized and streamed into the encoder.\n"
+        "  --cas         Input is a .cas tape byte stream (default for *.cas); its\n"
+        "                leader, sync, header and checksum bytes are encoded as is.\n"
         "  --version,-V  Print version and exit.\n",
         TOOL_VERSION);
 }
@@ -241,6 +440,8 @@ int main(int argc, char *argv[])
     int            compat_mode   = 0;
     int            artifact_mode = 0;
     int            robust_mode   = 0;
+    int            bas_mode      = 0;
+    int            cas_mode      = 0;
 
     FILE          *fin  = NULL;
     FILE          *fout = NULL;
@@ -264,6 +465,17 @@ int main(int argc, char *argv[])
     uint32_t       leader_count;
     uint32_t       sync_count;
     unsigned char  wav_hdr[44];
+    BodySink       sink;
+    CasImage       cas;
+    int            stats_mode = 0;
+    StatPhase      phases[PH_COUNT] = {
+        { "read input", 0, 0.0, 0.0, 0ULL }, { "leader", 0, 0.0, 0.0, 0ULL },
+        { "header", 0, 0.0, 0.0, 0ULL },     { "body", 0, 0.0, 0.0, 0ULL },
+        { "trailer", 0, 0.0, 0.0, 0ULL }
+    };
+    StatTimer      timer;
+
+    stat_timer_init(&timer, phases, PH_COUNT);
 
     /* Argument parsing */
     for (i = 1; i < argc; i++) {
@@ -280,6 +492,12 @@ int main(int argc, char *argv[])
             artifact_mode = 1;
         else if (strcmp(argv[i], "--robust") == 0 || strcmp(argv[i], "-r") == 0)
             robust_mode = 1;
+        else if (strcmp(argv[i], "--stats") == 0)
+            stats_mode = 1;
+        else if (strcmp(argv[i], "--bas") == 0 || strcmp(argv[i], "-b") == 0)
+            bas_mode = 1;
+        else if (strcmp(argv[i], "--cas") == 0)
+            cas_mode = 1;
         else if (strcmp(argv[i], "--gain") == 0 || strcmp(argv[i], "-g") == 0) {
             if (i + 1 >= argc || parse_gain_percent(argv[++i], &g_output_gain_percent) != 0) {
                 fprintf(stderr, "vz2wav: invalid --gain value\n");
@@ -306,6 +524,15 @@ usage:
         print_usage();
         return 1;
     }
+    if (has_bas_extension(arg_input))
+        bas_mode = 1;
+    if (has_cas_extension(arg_input) && !bas_mode)
+        cas_mode = 1;
+    if (bas_mode && cas_mode) {
+        fprintf(stderr, "vz2wav: --bas and --cas are exclusive\n");
+        goto usage;
+    }
+    init_waves();
 
     printf("\nvz2wav - VZ tape image to WAV converter\n");
     printf("Mode: %s%s%s\n\n",
@@ -315,15 +542,91 @@ usage:
 
     pre_silence_samples  = robust_mode ? (uint32_t)ROBUST_PRE_SILENCE_SAMPLES  : (uint32_t)SILENCE_SAMPLES;
     post_silence_samples = robust_mode ? (uint32_t)ROBUST_POST_SILENCE_SAMPLES : (uint32_t)SILENCE_SAMPLES;
-    leader_count         = robust_mode ? (uint32_t)ROBUST_LEADER_COUNT         : (uint32_t)LEADER_COUNT;
-    sync_count           = robust_mode ? (uint32_t)ROBUST_SYNC_COUNT           : (uint32_t)SYNC_COUNT;
+    leader_count         = robust_mode ? (uint32_t)ROBUST_LEADER_COUNT         : (uint32_t)VZTAPE_LEADER_COUNT;
+    sync_count           = robust_mode ? (uint32_t)ROBUST_SYNC_COUNT           : (uint32_t)VZTAPE_SYNC_COUNT;
 
     /* Read VZ file */
+    stat_phase(&timer, PH_READ, g_stats.samples);
     fin = fopen(arg_input, "rb");
     if (!fin) {
         fprintf(stderr, "vz2wav: cannot open '%s'\n", arg_input);
         goto done;
     }
+    if (bas_mode) {
+        /*
+         * BASIC source: header fields are fixed.  A first pass only
+         * counts the tokenized body, so the end address, checksum and
+         * fit are known before the output exists; the second pass
+         * (below) streams it into the encoder.
+         */
+        if (bastok_keywords_build(&g_keywords, bastok_vz_words) != 0) {
+            fprintf(stderr, "vz2wav: keyword trie overflow\n");
+            goto done;
+        }
+        name_from_path(filename, arg_input);
+        file_type = 0xF0;
+        load_addr = (uint16_t)BASTOK_VZ_START;
+        addr_lo   = (uint8_t)(load_addr & 0xFF);
+        addr_hi   = (uint8_t)(load_addr >> 8);
+        memset(&sink, 0, sizeof(sink));
+        if (stream_basic(fin, &sink) != 0) {
+            fprintf(stderr, "vz2wav: read error on '%s'\n", arg_input);
+            goto done;
+        }
+        if ((uint32_t)load_addr + sink.len > 0x10000u) {
+            fprintf(stderr, "vz2wav: '%s' does not fit in memory (%" PRIu32 " bytes)\n",
+                    arg_input, sink.len);
+            goto done;
+        }
+        if (fseek(fin, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "vz2wav: cannot seek '%s'\n", arg_input);
+            goto done;
+        }
+        body_len = sink.len;
+        print_input_info(arg_input, filename, file_type, load_addr, body_len);
+        goto encode;
+    }
+    if (cas_mode) {
+        /*
+         * .cas: the whole tape byte stream is given.  Leader and sync
+         * lengths, header and checksum come from the file, so only the
+         * silences and the name/address gap are added here.
+         */
+        const char *why;
+        if (fseek(fin, 0, SEEK_END) != 0 || (file_size = ftell(fin)) < 0 ||
+            fseek(fin, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "vz2wav: cannot seek '%s'\n", arg_input);
+            goto done;
+        }
+        body = (unsigned char *)malloc(file_size ? (size_t)file_size : 1u);
+        if (!body) {
+            fprintf(stderr, "vz2wav: out of memory\n");
+            goto done;
+        }
+        if (fread(body, 1, (size_t)file_size, fin) != (size_t)file_size) {
+            fprintf(stderr, "vz2wav: read error on '%s'\n", arg_input);
+            goto done;
+        }
+        fclose(fin); fin = NULL;
+        if ((why = parse_cas(body, (uint32_t)file_size, &cas)) != NULL) {
+            fprintf(stderr, "vz2wav: '%s': %s\n", arg_input, why);
+            goto done;
+        }
+        if (cas.trailing)
+            fprintf(stderr, "vz2wav: warning: %" PRIu32 " bytes after the checksum in '%s' ignored\n",
+                    cas.trailing, arg_input);
+        memmove(body, body + cas.data, cas.len);
+        memcpy(filename, cas.name, sizeof(filename));
+        file_type    = cas.type;
+        load_addr    = cas.start;
+        addr_lo      = (uint8_t)(load_addr & 0xFF);
+        addr_hi      = (uint8_t)(load_addr >> 8);
+        body_len     = cas.len;
+        leader_count = cas.leader;
+        sync_count   = cas.sync;
+        print_input_info(arg_input, filename, file_type, load_addr, body_len);
+        goto encode;
+    }
     if (fread(vz_hdr, 1, VZ_HEADER_SIZE, fin) != VZ_HEADER_SIZE) {
         fprintf(stderr, "vz2wav: '%s' is too short (need %d bytes for header)\n",
                 arg_input, VZ_HEADER_SIZE);
@@ -382,34 +685,28 @@ usage:
     }
     fclose(fin); fin = NULL;
 
-    /* Info */
-    printf("Input : %s\n", arg_input);
-    printf("  Filename  : %.16s\n", (char *)filename);
-    printf("  File type : %s (0x%02" PRIX8 ")\n",
-           file_type == 0xF0 ? "BASIC" :
-           file_type == 0xF1 ? "Machine code" : "Unknown",
-           file_type);
-    printf("  Load addr : 0x%04" PRIX16 "\n", load_addr);
-    printf("  Body size : %" PRIu32 " bytes\n", body_len);
+    print_input_info(arg_input, filename, file_type, load_addr, body_len);
 
+encode:
     /* Compute tape header fields */
     end_addr    = (uint16_t)(load_addr + body_len);
     end_addr_lo = (uint8_t)( end_addr       & 0xFF);
     end_addr_hi = (uint8_t)((end_addr >> 8) & 0xFF);
 
-    checksum = (uint32_t)addr_lo + addr_hi + end_addr_lo + end_addr_hi;
-    for (i = 0; i < (int)body_len; i++)
-        checksum += body[i];
+    checksum = vztape_checksum(load_addr, end_addr,
+                               bas_mode ? sink.sum : vztape_sum(0, body, body_len));
     cksum_lo = (uint8_t)( checksum       & 0xFF);
     cksum_hi = (uint8_t)((checksum >> 8) & 0xFF);
 
-    fn_write_len = 0;
-    while (fn_write_len < (uint32_t)FILENAME_FIELD_LEN) {
-        fn_write_len++;
-        if (filename[fn_write_len - 1] == '\0') break;
+    if (cas_mode && (cas.ck_lo != cksum_lo || cas.ck_hi != cksum_hi)) {
+        fprintf(stderr, "vz2wav: warning: '%s' checksum 0x%02" PRIX8 "%02" PRIX8
+                " does not match its data (0x%02" PRIX8 "%02" PRIX8 "); kept as is\n",
+                arg_input, cas.ck_hi, cas.ck_lo, cksum_hi, cksum_lo);
+        cksum_lo = cas.ck_lo;
+        cksum_hi = cas.ck_hi;
     }
-    if (fn_write_len == (uint32_t)FILENAME_FIELD_LEN)
-        fn_write_len++;
+
+    fn_write_len = (uint32_t)vztape_name_len(filename);
 
     printf("  End addr  : 0x%04" PRIX16 "\n", end_addr);
     printf("  Checksum  : 0x%02" PRIX8 "%02" PRIX8 "\n\n", cksum_hi, cksum_lo);
@@ -440,17 +737,19 @@ usage:
     if (fwrite(wav_hdr, 1, 44, fout) != (size_t)44) goto write_err;
 
     /* Pre-silence */
+    stat_phase(&timer, PH_LEADER, g_stats.samples);
     if (write_raw(fout, SILENCE_BYTE, pre_silence_samples) < 0) goto write_err;
 
     /* Leader */
     for (i = 0; i < (int)leader_count; i++)
-        if (write_vz_byte(fout, LEADER_BYTE) < 0) goto write_err;
+        if (write_vz_byte(fout, VZTAPE_LEADER_BYTE) < 0) goto write_err;
 
     /* Sync preamble */
     for (i = 0; i < (int)sync_count; i++)
-        if (write_vz_byte(fout, SYNC_BYTE) < 0) goto write_err;
+        if (write_vz_byte(fout, VZTAPE_SYNC_BYTE) < 0) goto write_err;
 
     /* File-type byte */
+    stat_phase(&timer, PH_HEADER, g_stats.samples);
     if (write_vz_byte(fout, file_type) < 0) goto write_err;
 
     /* Filename */
@@ -474,13 +773,32 @@ usage:
     if (write_vz_byte(fout, end_addr_hi) < 0) goto write_err;
 
     /* Body */
-    {
+    stat_phase(&timer, PH_BODY, g_stats.samples);
+    if (bas_mode) {
+        uint32_t counted = sink.len, sum = sink.sum;
+
+        memset(&sink, 0, sizeof(sink));
+        sink.out = fout;
+        switch (stream_basic(fin, &sink)) {
+            case -1:
+                fprintf(stderr, "vz2wav: read error on '%s'\n", arg_input);
+                goto done;
+            case -2:
+                goto write_err;
+        }
+        fclose(fin); fin = NULL;
+        if (sink.len != counted || sink.sum != sum) {
+            fprintf(stderr, "vz2wav: '%s' changed while encoding\n", arg_input);
+            goto done;
+        }
+    } else {
         uint32_t j;
         for (j = 0; j < body_len; j++)
             if (write_vz_byte(fout, body[j]) < 0) goto write_err;
     }
 
     /* Checksum */
+    stat_phase(&timer, PH_TRAILER, g_stats.samples);
     if (write_vz_byte(fout, cksum_lo) < 0) goto write_err;
     if (write_vz_byte(fout, cksum_hi) < 0) goto write_err;
     /*
@@ -493,6 +811,9 @@ usage:
     /* Post-silence */
     if (write_raw(fout, SILENCE_BYTE, post_silence_samples) < 0) goto write_err;
 
+    if (fflush(fout) != 0) goto write_err;
+    stat_phase(&timer, -1, g_stats.samples);
+
     printf("Output: %s\n", arg_output);
     printf("  Total audio : %" PRIu32 " samples (%.2f seconds)\n",
            total_samples, (double)total_samples / SAMPLE_RATE);
@@ -505,6 +826,17 @@ usage:
            pre_silence_samples, leader_count, sync_count, post_silence_samples);
     printf("  Gain        : %+d%% (scale %.2fx)\n",
            g_output_gain_percent, (100.0 + (double)g_output_gain_percent) / 100.0);
+    if (stats_mode) {
+        printf("\nEncoder statistics:\n");
+#if VZ_STATS
+        stat_print_phases(&timer, "Samples");
+        printf("  Samples written : %llu\n", g_stats.samples);
+        printf("  Bytes encoded   : %llu\n", g_stats.bytes);
+        printf("  Bits            : one=%llu zero=%llu\n", g_stats.ones, g_stats.zeros);
+#else
+        printf("  not available (built with VZ_STATS=0)\n");
+#endif
+    }
     printf("\nDone.\n");
 
     ret = 0;
@@ -516,6 +848,11 @@ write_err:
 done:
     if (body) free(body);
     if (fin)  fclose(fin);
-    if (fout) fclose(fout);
+    if (fout) {
+        /* A failed conversion leaves no partial WAV behind. */
+        fclose(fout);
+        if (ret != 0)
+            remove(arg_output);
+    }
     return ret;
 }
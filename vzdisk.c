@@ -0,0 +1,854 @@
+/*
+ * vzdisk - put .vz files on and take them off VZ DOS floppy images (.dsk).
+ *
+ * The image is opened once, memory-mapped where the platform allows, and
+ * its directory, allocation map and sector layout are read into memory
+ * up front.  A whole batch of adds, extracts or deletes then works on
+ * that index, and the directory and map go back to the image once, when
+ * it is closed.
+ */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define DSK_MMAP 1
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define DSK_MMAP 1
+#else
+#define DSK_MMAP 0
+#endif
+
+#ifndef TOOL_VERSION
+#define TOOL_VERSION "dev"
+#endif
+
+#define VZ_HEADER_SIZE 24
+#define VZ_NAME_LEN 17
+
+/*
+ * Disk layout.  40 tracks of 16 sectors; the image holds each sector as
+ * it is on the floppy, 154 bytes:
+ *
+ *   0   gap       80 80 80 80 80 80 00
+ *   7   ID mark   FE E7 18 C3, track, sector, track + sector
+ *   14  gap       80 80 80 80 80 00
+ *   20  data mark C3 18 E7 FE
+ *   24  data      126 file bytes, then next track and next sector
+ *   152 checksum  16-bit sum of the 128 data bytes, little-endian
+ *
+ * Sectors are written around a track in interleaved order.  Track 0
+ * holds the directory (sectors 0-14, eight 16-byte entries each) and the
+ * allocation map (sector 15: one bit per sector of tracks 1-39, two
+ * bytes per track, set when used).  A directory entry is:
+ *
+ *   type ('T' BASIC, 'B' binary; 0 never used, 1 deleted), ':',
+ *   8-character name padded with blanks, first track, first sector,
+ *   start address, end address (both little-endian)
+ */
+#define DSK_TRACKS      40
+#define DSK_SECTORS     16
+#define DSK_SLOT        154
+#define DSK_DATA        128
+#define DSK_PAYLOAD     126
+#define DSK_IMAGE_SIZE  ((unsigned long)DSK_TRACKS * DSK_SECTORS * DSK_SLOT)
+#define SLOT_IDAM       7
+#define SLOT_DATA       24
+
+#define DIR_SECTORS     15
+#define DIR_ENTRY       16
+#define DIR_PER_SECTOR  (DSK_DATA / DIR_ENTRY)
+#define DIR_MAX         (DIR_SECTORS * DIR_PER_SECTOR)
+#define DIR_NAME_LEN    8
+#define MAP_SECTOR      15
+#define DIR_FREE        0x00
+#define DIR_DELETED     0x01
+
+/* Longest chain a 64 KB file can need. */
+#define CHAIN_MAX       ((0xFFFFu + DSK_PAYLOAD - 1u) / DSK_PAYLOAD)
+
+static const uint8_t interleave[DSK_SECTORS] = {
+    0, 11, 6, 1, 12, 7, 2, 13, 8, 3, 14, 9, 4, 15, 10, 5
+};
+static const uint8_t idam[4] = { 0xFE, 0xE7, 0x18, 0xC3 };
+static const uint8_t dam[4]  = { 0xC3, 0x18, 0xE7, 0xFE };
+
+typedef struct {
+    const char *path;
+    int writable;
+    uint8_t *map;                       /* the whole image when mapped */
+    FILE *f;                            /* otherwise sector reads/writes */
+#if DSK_MMAP && defined(_WIN32)
+    HANDLE file, mapping;
+#elif DSK_MMAP
+    int fd;
+#endif
+    unsigned long size;
+    uint16_t slot[DSK_TRACKS][DSK_SECTORS];     /* image slot of each sector */
+    uint8_t dir[DIR_SECTORS][DSK_DATA];
+    uint8_t map_sec[DSK_DATA];
+    unsigned free_count;
+    int dirty;
+    int io_err;
+} Disk;
+
+static void die(const char *msg)
+{
+    fprintf(stderr, "vzdisk: %s\n", msg);
+    exit(1);
+}
+
+static uint16_t le16(const uint8_t *p)
+{
+    return (uint16_t)p[0] | (uint16_t)((uint16_t)p[1] << 8);
+}
+
+static unsigned data_sum(const uint8_t *p)
+{
+    unsigned sum = 0, i;
+    for (i = 0; i < DSK_DATA; i++)
+        sum += p[i];
+    return sum & 0xFFFFu;
+}
+
+/* One formatted, empty sector slot. */
+static void slot_format(uint8_t *p, unsigned track, unsigned sector)
+{
+    memset(p, 0, DSK_SLOT);
+    memset(p, 0x80, 6);
+    memcpy(p + SLOT_IDAM, idam, 4);
+    p[11] = (uint8_t)track;
+    p[12] = (uint8_t)sector;
+    p[13] = (uint8_t)(track + sector);
+    memset(p + 14, 0x80, 5);
+    memcpy(p + 20, dam, 4);
+}
+
+/*
+ * Sector access.  Mapped images are read and written in place; the stdio
+ * fallback (DOS, or a file that cannot be mapped) seeks to the slot.
+ */
+static unsigned long slot_offset(const Disk *d, unsigned track, unsigned sector)
+{
+    return (unsigned long)d->slot[track][sector] * DSK_SLOT;
+}
+
+/* 128 data bytes into out; 0 if the stored checksum matches. */
+static int sec_read(Disk *d, unsigned track, unsigned sector, uint8_t *out)
+{
+    unsigned long off = slot_offset(d, track, sector) + SLOT_DATA;
+    uint8_t ck[2];
+
+    if (d->map) {
+        memcpy(out, d->map + off, DSK_DATA);
+        memcpy(ck, d->map + off + DSK_DATA, 2);
+    } else if (fseek(d->f, (long)off, SEEK_SET) != 0 ||
+               fread(out, 1, DSK_DATA, d->f) != DSK_DATA ||
+               fread(ck, 1, 2, d->f) != 2) {
+        d->io_err = 1;
+        memset(out, 0, DSK_DATA);
+        return -1;
+    }
+    return le16(ck) == data_sum(out) ? 0 : -1;
+}
+
+static void sec_write(Disk *d, unsigned track, unsigned sector, const uint8_t *in)
+{
+    unsigned long off = slot_offset(d, track, sector) + SLOT_DATA;
+    unsigned sum = data_sum(in);
+    uint8_t ck[2];
+
+    ck[0] = (uint8_t)(sum & 0xFFu);
+    ck[1] = (uint8_t)(sum >> 8);
+    if (d->map) {
+        memcpy(d->map + off, in, DSK_DATA);
+        memcpy(d->map + off + DSK_DATA, ck, 2);
+    } else if (fseek(d->f, (long)off, SEEK_SET) != 0 ||
+               fwrite(in, 1, DSK_DATA, d->f) != DSK_DATA ||
+               fwrite(ck, 1, 2, d->f) != 2) {
+        d->io_err = 1;
+    }
+}
+
+/* Allocation map: bit (sector & 7) of byte (track - 1) * 2 + sector / 8. */
+static int map_used(const Disk *d, unsigned track, unsigned sector)
+{
+    return (d->map_sec[(track - 1u) * 2u + sector / 8u] >> (sector & 7u)) & 1;
+}
+
+static void map_set(Disk *d, unsigned track, unsigned sector, int used)
+{
+    uint8_t *b = &d->map_sec[(track - 1u) * 2u + sector / 8u];
+    uint8_t bit = (uint8_t)(1u << (sector & 7u));
+
+    if (used && !(*b & bit)) {
+        *b |= bit;
+        d->free_count--;
+    } else if (!used && (*b & bit)) {
+        *b &= (uint8_t)~bit;
+        d->free_count++;
+    }
+    d->dirty = 1;
+}
+
+static uint8_t *dir_entry(Disk *d, unsigned i)
+{
+    return d->dir[i / DIR_PER_SECTOR] + (i % DIR_PER_SECTOR) * DIR_ENTRY;
+}
+
+static int dir_in_use(const uint8_t *e)
+{
+    return e[0] != DIR_FREE && e[0] != DIR_DELETED;
+}
+
+/* Directory name without the padding, NUL-terminated. */
+static void dir_name(const uint8_t *e, char out[DIR_NAME_LEN + 1])
+{
+    int n = DIR_NAME_LEN;
+    memcpy(out, e + 2, DIR_NAME_LEN);
+    while (n > 0 && (out[n - 1] == ' ' || out[n - 1] == 0)) n--;
+    out[n] = 0;
+}
+
+/* Entry named name (compared as stored: upper case, at most 8 characters), or -1. */
+static int dir_find(Disk *d, const char *name)
+{
+    char want[DIR_NAME_LEN + 1], have[DIR_NAME_LEN + 1];
+    unsigned i;
+    size_t k;
+
+    for (k = 0; k < DIR_NAME_LEN && name[k]; k++)
+        want[k] = (char)toupper((unsigned char)name[k]);
+    want[k] = 0;
+    for (i = 0; i < DIR_MAX; i++) {
+        uint8_t *e = dir_entry(d, i);
+        if (!dir_in_use(e)) continue;
+        dir_name(e, have);
+        if (strcmp(have, want) == 0) return (int)i;
+    }
+    return -1;
+}
+
+static int valid_data_sector(unsigned track, unsigned sector)
+{
+    return track >= 1u && track < DSK_TRACKS && sector < DSK_SECTORS;
+}
+
+/* Create a formatted, empty image. */
+static void disk_format(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    uint8_t slot[DSK_SLOT];
+    unsigned t, i;
+
+    if (!f) die("cannot create disk image");
+    for (t = 0; t < DSK_TRACKS; t++) {
+        for (i = 0; i < DSK_SECTORS; i++) {
+            slot_format(slot, t, interleave[i]);
+            if (fwrite(slot, 1, DSK_SLOT, f) != DSK_SLOT) {
+                fclose(f);
+                die("failed writing disk image");
+            }
+        }
+    }
+    if (fclose(f) != 0) die("failed writing disk image");
+}
+
+#if DSK_MMAP && defined(_WIN32)
+static int disk_map(Disk *d)
+{
+    DWORD hi = 0, lo;
+
+    d->file = CreateFileA(d->path, GENERIC_READ | (d->writable ? GENERIC_WRITE : 0),
+                          FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (d->file == INVALID_HANDLE_VALUE) return -1;
+    lo = GetFileSize(d->file, &hi);
+    d->size = hi ? 0xFFFFFFFFul : (unsigned long)lo;
+    if (lo == INVALID_FILE_SIZE || d->size < DSK_IMAGE_SIZE) goto fail;
+    d->mapping = CreateFileMappingA(d->file, NULL, d->writable ? PAGE_READWRITE : PAGE_READONLY,
+                                    0, 0, NULL);
+    if (!d->mapping) goto fail;
+    d->map = (uint8_t *)MapViewOfFile(d->mapping, d->writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+                                      0, 0, 0);
+    if (d->map) return 0;
+    CloseHandle(d->mapping);
+fail:
+    CloseHandle(d->file);
+    return -1;
+}
+
+static int disk_unmap(Disk *d)
+{
+    int rc = 0;
+    if (d->writable && !FlushViewOfFile(d->map, 0)) rc = -1;
+    UnmapViewOfFile(d->map);
+    CloseHandle(d->mapping);
+    CloseHandle(d->file);
+    return rc;
+}
+#elif DSK_MMAP
+static int disk_map(Disk *d)
+{
+    struct stat st;
+    void *p;
+
+    d->fd = open(d->path, d->writable ? O_RDWR : O_RDONLY);
+    if (d->fd < 0) return -1;
+    if (fstat(d->fd, &st) != 0 || !S_ISREG(st.st_mode) || (unsigned long)st.st_size < DSK_IMAGE_SIZE)
+        goto fail;
+    d->size = (unsigned long)st.st_size;
+    p = mmap(NULL, (size_t)d->size, PROT_READ | (d->writable ? PROT_WRITE : 0), MAP_SHARED, d->fd, 0);
+    if (p == MAP_FAILED) goto fail;
+    d->map = (uint8_t *)p;
+    return 0;
+fail:
+    close(d->fd);
+    return -1;
+}
+
+static int disk_unmap(Disk *d)
+{
+    int rc = munmap(d->map, (size_t)d->size);
+    if (close(d->fd) != 0) rc = -1;
+    return rc;
+}
+#endif
+
+/*
+ * Open an image and build the index: where each sector sits (from its ID
+ * mark, or the standard interleave if the mark is damaged), the
+ * directory, the allocation map and the free count.
+ */
+static void disk_open(Disk *d, const char *path, int writable)
+{
+    unsigned t, i;
+
+    memset(d, 0, sizeof(*d));
+    d->path = path;
+    d->writable = writable;
+#if DSK_MMAP
+    if (disk_map(d) != 0)
+        d->map = NULL;
+#endif
+    if (!d->map) {
+        long sz;
+        d->f = fopen(path, writable ? "r+b" : "rb");
+        if (!d->f) die("cannot open disk image");
+        if (fseek(d->f, 0, SEEK_END) != 0 || (sz = ftell(d->f)) < 0)
+            die("cannot size disk image");
+        d->size = (unsigned long)sz;
+    }
+    if (d->size < DSK_IMAGE_SIZE)
+        die("disk image is too short (expected 40 tracks of 16 sectors)");
+
+    for (t = 0; t < DSK_TRACKS; t++) {
+        for (i = 0; i < DSK_SECTORS; i++)
+            d->slot[t][interleave[i]] = (uint16_t)(t * DSK_SECTORS + i);
+        for (i = 0; i < DSK_SECTORS; i++) {
+            unsigned long off = (unsigned long)(t * DSK_SECTORS + i) * DSK_SLOT + SLOT_IDAM;
+            uint8_t id[6];
+            if (d->map) {
+                memcpy(id, d->map + off, 6);
+            } else if (fseek(d->f, (long)off, SEEK_SET) != 0 || fread(id, 1, 6, d->f) != 6) {
+                die("failed to read disk image");
+            }
+            if (memcmp(id, idam, 4) == 0 && id[4] == t && id[5] < DSK_SECTORS)
+                d->slot[t][id[5]] = (uint16_t)(t * DSK_SECTORS + i);
+        }
+    }
+
+    for (i = 0; i < DIR_SECTORS; i++)
+        if (sec_read(d, 0, i, d->dir[i]) != 0)
+            fprintf(stderr, "vzdisk: warning: directory sector %u has a bad checksum\n", i);
+    if (sec_read(d, 0, MAP_SECTOR, d->map_sec) != 0)
+        fprintf(stderr, "vzdisk: warning: allocation map has a bad checksum\n");
+    if (d->io_err)
+        die("failed to read disk image");
+    for (t = 1; t < DSK_TRACKS; t++)
+        for (i = 0; i < DSK_SECTORS; i++)
+            if (!map_used(d, t, i)) d->free_count++;
+    d->dirty = 0;
+}
+
+/* Write the directory and map back if they changed, then release the image. */
+static int disk_close(Disk *d)
+{
+    unsigned i;
+    int rc = 0;
+
+    if (d->dirty) {
+        for (i = 0; i < DIR_SECTORS; i++)
+            sec_write(d, 0, i, d->dir[i]);
+        sec_write(d, 0, MAP_SECTOR, d->map_sec);
+    }
+    if (d->io_err) rc = -1;
+#if DSK_MMAP
+    if (d->map) {
+        if (disk_unmap(d) != 0) rc = -1;
+        return rc;
+    }
+#endif
+    if (fclose(d->f) != 0) rc = -1;
+    return rc;
+}
+
+/* Sectors a file's chain takes, from its directory entry. */
+static unsigned chain_length(const uint8_t *e)
+{
+    unsigned len = (unsigned)((le16(e + 14) - le16(e + 12)) & 0xFFFFu);
+    unsigned n = (len + DSK_PAYLOAD - 1u) / DSK_PAYLOAD;
+    return n ? n : 1u;
+}
+
+/*
+ * Sectors disk_remove would free for entry index: the used sectors its
+ * chain actually reaches, each counted once.  The length field is not
+ * trusted, since a damaged entry can claim more than the chain holds.
+ */
+static unsigned chain_reclaim(Disk *d, unsigned index)
+{
+    const uint8_t *e = dir_entry(d, index);
+    uint8_t seen[DSK_TRACKS * 2];
+    uint8_t buf[DSK_DATA];
+    unsigned t = e[10], s = e[11], n, count = 0;
+
+    memset(seen, 0, sizeof(seen));
+    for (n = 0; n < CHAIN_MAX && valid_data_sector(t, s); n++) {
+        uint8_t *b = &seen[t * 2u + s / 8u];
+        uint8_t bit = (uint8_t)(1u << (s & 7u));
+        if (!(*b & bit) && map_used(d, t, s)) count++;
+        *b |= bit;
+        sec_read(d, t, s, buf);
+        t = buf[DSK_PAYLOAD];
+        s = buf[DSK_PAYLOAD + 1];
+        if (t == 0) break;
+    }
+    return count;
+}
+
+/* Free a file's sectors and its directory entry. */
+static void disk_remove(Disk *d, unsigned index)
+{
+    uint8_t *e = dir_entry(d, index);
+    uint8_t buf[DSK_DATA];
+    unsigned t = e[10], s = e[11], n;
+
+    for (n = 0; n < CHAIN_MAX && valid_data_sector(t, s); n++) {
+        map_set(d, t, s, 0);
+        sec_read(d, t, s, buf);
+        t = buf[DSK_PAYLOAD];
+        s = buf[DSK_PAYLOAD + 1];
+        if (t == 0) break;
+    }
+    e[0] = DIR_DELETED;
+    d->dirty = 1;
+}
+
+/* 8-character directory name from the VZ header, or the file name if that is blank. */
+static void disk_name(char out[DIR_NAME_LEN + 1], const uint8_t *hdr, const char *path)
+{
+    const char *base = path, *p;
+    size_t n = 0, k;
+
+    for (k = 4; k < 4 + VZ_NAME_LEN - 1 && hdr[k] != 0 && n < DIR_NAME_LEN; k++)
+        if (hdr[k] != ' ' || n > 0)
+            out[n++] = (char)toupper(hdr[k]);
+    while (n > 0 && out[n - 1] == ' ') n--;
+    if (n == 0) {
+        for (p = path; *p; p++)
+            if (*p == '/' || *p == '\\' || *p == ':') base = p + 1;
+        for (p = base; *p && *p != '.' && n < DIR_NAME_LEN; p++)
+            out[n++] = (char)toupper((unsigned char)*p);
+    }
+    out[n] = 0;
+}
+
+/* Add one .vz file; 0 on success, otherwise a message in err. */
+static int disk_add(Disk *d, const char *path, int replace, char *err, size_t errlen)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t hdr[VZ_HEADER_SIZE];
+    uint8_t buf[DSK_DATA];
+    uint8_t *data = NULL;
+    uint8_t chain[CHAIN_MAX][2];
+    char name[DIR_NAME_LEN + 1];
+    unsigned long size;
+    unsigned start, len, need, n, t, s, k;
+    int old, slot = -1;
+    uint8_t *e;
+    long sz;
+
+    if (!f) {
+        snprintf(err, errlen, "cannot open file");
+        return -1;
+    }
+    if (fread(hdr, 1, VZ_HEADER_SIZE, f) != VZ_HEADER_SIZE || fseek(f, 0, SEEK_END) != 0 ||
+        (sz = ftell(f)) < VZ_HEADER_SIZE || fseek(f, VZ_HEADER_SIZE, SEEK_SET) != 0) {
+        snprintf(err, errlen, "not a VZ file");
+        goto fail;
+    }
+    if (hdr[21] != 0xF0u && hdr[21] != 0xF1u) {
+        snprintf(err, errlen, "type 0x%02X has no VZ DOS equivalent", (unsigned)hdr[21]);
+        goto fail;
+    }
+    size = (unsigned long)sz - VZ_HEADER_SIZE;
+    start = le16(hdr + 22);
+    if (start + size > 0xFFFFul) {
+        snprintf(err, errlen, "payload runs past 0xFFFF");
+        goto fail;
+    }
+    len = (unsigned)size;
+    need = (len + DSK_PAYLOAD - 1u) / DSK_PAYLOAD;
+    if (need == 0) need = 1;
+
+    /*
+     * The payload is read whole before the disk is touched: with --force
+     * the old copy's sectors are freed and reused below, so a read error
+     * part way through would otherwise lose both.
+     */
+    data = (uint8_t *)malloc(len ? len : 1u);
+    if (!data) {
+        snprintf(err, errlen, "out of memory");
+        goto fail;
+    }
+    if (fread(data, 1, len, f) != len) {
+        snprintf(err, errlen, "failed to read file");
+        goto fail;
+    }
+    fclose(f);
+    f = NULL;
+
+    disk_name(name, hdr, path);
+    if (name[0] == 0) {
+        snprintf(err, errlen, "no usable name");
+        goto fail;
+    }
+    old = dir_find(d, name);
+    if (old >= 0 && !replace) {
+        snprintf(err, errlen, "'%s' is already on the disk (use --force to replace it)", name);
+        goto fail;
+    }
+    if (need > d->free_count + (old >= 0 ? chain_reclaim(d, (unsigned)old) : 0u)) {
+        snprintf(err, errlen, "disk full (%u sectors needed, %u free)", need, d->free_count);
+        goto fail;
+    }
+    if (old >= 0) {
+        disk_remove(d, (unsigned)old);
+        slot = old;
+        if (need > d->free_count) {
+            snprintf(err, errlen, "disk full after removing the old copy (%u sectors needed, %u free)",
+                     need, d->free_count);
+            goto fail;
+        }
+    } else {
+        for (k = 0; k < DIR_MAX && slot < 0; k++)
+            if (!dir_in_use(dir_entry(d, k))) slot = (int)k;
+        if (slot < 0) {
+            snprintf(err, errlen, "directory full");
+            goto fail;
+        }
+    }
+
+    /* Claim the whole chain first so every sector can carry its link. */
+    for (n = 0, t = 1; t < DSK_TRACKS && n < need; t++)
+        for (s = 0; s < DSK_SECTORS && n < need; s++)
+            if (!map_used(d, t, s)) {
+                map_set(d, t, s, 1);
+                chain[n][0] = (uint8_t)t;
+                chain[n][1] = (uint8_t)s;
+                n++;
+            }
+    if (n < need) {
+        /* The map disagrees with free_count; give back what was claimed. */
+        snprintf(err, errlen, "allocation map inconsistent (%u of %u sectors found)", n, need);
+        for (k = 0; k < n; k++)
+            map_set(d, chain[k][0], chain[k][1], 0);
+        goto fail;
+    }
+
+    for (n = 0; n < need; n++) {
+        unsigned take = len - n * DSK_PAYLOAD;
+        if (take > DSK_PAYLOAD) take = DSK_PAYLOAD;
+        memset(buf, 0, sizeof(buf));
+        memcpy(buf, data + n * DSK_PAYLOAD, take);
+        if (n + 1 < need) {
+            buf[DSK_PAYLOAD] = chain[n + 1][0];
+            buf[DSK_PAYLOAD + 1] = chain[n + 1][1];
+        }
+        sec_write(d, chain[n][0], chain[n][1], buf);
+    }
+    free(data);
+
+    e = dir_entry(d, (unsigned)slot);
+    e[0] = hdr[21] == 0xF0u ? 'T' : 'B';
+    e[1] = ':';
+    memset(e + 2, ' ', DIR_NAME_LEN);
+    memcpy(e + 2, name, strlen(name));
+    e[10] = chain[0][0];
+    e[11] = chain[0][1];
+    e[12] = (uint8_t)(start & 0xFFu);
+    e[13] = (uint8_t)(start >> 8);
+    e[14] = (uint8_t)((start + len) & 0xFFu);
+    e[15] = (uint8_t)((start + len) >> 8);
+    d->dirty = 1;
+    printf("Added       : %-8s %s %04X-%04X %5u bytes, %u sectors\n", name,
+           e[0] == 'T' ? "BASIC" : "MC   ", start, start + len, len, need);
+    return 0;
+fail:
+    free(data);
+    if (f) fclose(f);
+    return -1;
+}
+
+/* Write entry index as DIR/NAME.vz; 0 on success, otherwise a message in err. */
+static int disk_extract(Disk *d, unsigned index, const char *out_dir, char *err, size_t errlen)
+{
+    const uint8_t *e = dir_entry(d, index);
+    char name[DIR_NAME_LEN + 1], file[DIR_NAME_LEN + 1];
+    char path[1024];
+    uint8_t hdr[VZ_HEADER_SIZE];
+    uint8_t buf[DSK_DATA];
+    unsigned start = le16(e + 12);
+    unsigned left = (unsigned)((le16(e + 14) - start) & 0xFFFFu);
+    unsigned t = e[10], s = e[11], n, bad = 0;
+    size_t k;
+    FILE *f;
+
+    dir_name(e, name);
+    for (k = 0; name[k]; k++)
+        file[k] = (isalnum((unsigned char)name[k]) || name[k] == '-' || name[k] == '_') ? name[k] : '_';
+    file[k] = 0;
+    if (file[0] == 0) {
+        file[0] = '_';
+        file[1] = 0;
+    }
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s.vz", out_dir ? out_dir : ".", file) >= sizeof(path)) {
+        snprintf(err, errlen, "output path too long");
+        return -1;
+    }
+    f = fopen(path, "wb");
+    if (!f) {
+        snprintf(err, errlen, "cannot create '%.200s'", path);
+        return -1;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, e[0] == 'T' ? "VZF0" : "VZFO", 4);
+    memcpy(hdr + 4, name, strlen(name));
+    hdr[21] = e[0] == 'T' ? 0xF0u : 0xF1u;
+    hdr[22] = (uint8_t)(start & 0xFFu);
+    hdr[23] = (uint8_t)(start >> 8);
+    if (fwrite(hdr, 1, VZ_HEADER_SIZE, f) != VZ_HEADER_SIZE)
+        goto write_fail;
+
+    for (n = 0; left > 0; n++) {
+        unsigned take = left < DSK_PAYLOAD ? left : DSK_PAYLOAD;
+        if (n == CHAIN_MAX || !valid_data_sector(t, s)) {
+            snprintf(err, errlen, "sector chain broken at track %u sector %u", t, s);
+            fclose(f);
+            remove(path);
+            return -1;
+        }
+        if (sec_read(d, t, s, buf) != 0) bad++;
+        if (fwrite(buf, 1, take, f) != take)
+            goto write_fail;
+        left -= take;
+        t = buf[DSK_PAYLOAD];
+        s = buf[DSK_PAYLOAD + 1];
+    }
+    if (fclose(f) != 0) {
+        snprintf(err, errlen, "failed writing '%.200s'", path);
+        return -1;
+    }
+    if (bad)
+        fprintf(stderr, "vzdisk: warning: '%s': %u sectors with a bad checksum\n", name, bad);
+    printf("Extracted   : %-8s -> %s\n", name, path);
+    return 0;
+write_fail:
+    fclose(f);
+    snprintf(err, errlen, "failed writing '%.200s'", path);
+    return -1;
+}
+
+static void disk_list(Disk *d)
+{
+    char name[DIR_NAME_LEN + 1];
+    unsigned i, files = 0;
+
+    for (i = 0; i < DIR_MAX; i++) {
+        const uint8_t *e = dir_entry(d, i);
+        unsigned start, end, len;
+        if (!dir_in_use(e)) continue;
+        if (files++ == 0)
+            printf("Name      Type   Start End    Bytes  Sectors  Track/Sector\n");
+        dir_name(e, name);
+        start = le16(e + 12);
+        end = le16(e + 14);
+        len = (end - start) & 0xFFFFu;
+        printf("%-8s  %-5s  %04X  %04X  %5u  %7u  %2u/%-2u\n", name,
+               e[0] == 'T' ? "BASIC" : e[0] == 'B' ? "MC" : "?", start, end, len,
+               chain_length(e), (unsigned)e[10], (unsigned)e[11]);
+    }
+    printf("Files       : %u of %u\n", files, (unsigned)DIR_MAX);
+    printf("Free        : %u sectors (%lu bytes)\n", d->free_count,
+           (unsigned long)d->free_count * DSK_PAYLOAD);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+        "vzdisk version %s\n"
+        "Usage: %s IMAGE.dsk [--list]\n"
+        "       %s IMAGE.dsk [--new] --add FILE.vz... [--force]\n"
+        "       %s IMAGE.dsk --extract [NAME...] [--out-dir DIR]\n"
+        "       %s IMAGE.dsk --delete NAME...\n"
+        "\n"
+        "Options:\n"
+        "  --list,    -l           List the directory and free space (default)\n"
+        "  --new,     -n           Create a blank formatted image first (an existing\n"
+        "                          image needs --force)\n"
+        "  --add,     -a           Copy the given .vz files onto the disk\n"
+        "  --force,   -f           Replace files that are already on the disk, and\n"
+        "                          let --new overwrite an existing image\n"
+        "  --extract, -x           Write the named files (default: all) as NAME.vz\n"
+        "  --out-dir, -o DIR       Directory for --extract (default: current)\n"
+        "  --delete,  -d           Remove the named files\n"
+        "  --help,    -h           Show this help\n"
+        "  --version, -V           Print version and exit\n",
+        TOOL_VERSION, prog, prog, prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+    enum { ACT_LIST, ACT_ADD, ACT_EXTRACT, ACT_DELETE } action = ACT_LIST;
+    const char *image = NULL;
+    const char *out_dir = NULL;
+    const char **args;
+    int nargs = 0, actions = 0;
+    int want_new = 0, replace = 0;
+    unsigned long done = 0, failed = 0;
+    char err[256];
+    Disk d;
+    int i;
+
+    if (argc < 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    args = (const char **)malloc((size_t)argc * sizeof(*args));
+    if (!args)
+        die("out of memory");
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
+            printf("vzdisk version %s\n", TOOL_VERSION);
+            return 0;
+        } else if (strcmp(argv[i], "--list") == 0 || strcmp(argv[i], "-l") == 0) {
+            action = ACT_LIST;
+            actions++;
+        } else if (strcmp(argv[i], "--add") == 0 || strcmp(argv[i], "-a") == 0) {
+            action = ACT_ADD;
+            actions++;
+        } else if (strcmp(argv[i], "--extract") == 0 || strcmp(argv[i], "-x") == 0) {
+            action = ACT_EXTRACT;
+            actions++;
+        } else if (strcmp(argv[i], "--delete") == 0 || strcmp(argv[i], "-d") == 0) {
+            action = ACT_DELETE;
+            actions++;
+        } else if (strcmp(argv[i], "--new") == 0 || strcmp(argv[i], "-n") == 0) {
+            want_new = 1;
+        } else if (strcmp(argv[i], "--force") == 0 || strcmp(argv[i], "-f") == 0) {
+            replace = 1;
+        } else if ((strcmp(argv[i], "--out-dir") == 0 || strcmp(argv[i], "-o") == 0) && i + 1 < argc) {
+            out_dir = argv[++i];
+        } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else if (!image) {
+            image = argv[i];
+        } else {
+            args[nargs++] = argv[i];
+        }
+    }
+
+    if (!image || actions > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    if ((action == ACT_ADD || action == ACT_DELETE) && nargs == 0)
+        die(action == ACT_ADD ? "--add needs one or more .vz files" : "--delete needs one or more names");
+    if (action == ACT_LIST && nargs > 0)
+        die("unexpected arguments (missing --add, --extract or --delete?)");
+    if (out_dir && action != ACT_EXTRACT)
+        die("--out-dir only applies to --extract");
+    if (want_new && action != ACT_ADD && action != ACT_LIST)
+        die("--new only combines with --add or --list");
+
+    if (want_new) {
+        FILE *f = fopen(image, "rb");
+        if (f) {
+            fclose(f);
+            if (!replace)
+                die("image already exists (use --force with --new to overwrite it)");
+        }
+        disk_format(image);
+    }
+    disk_open(&d, image, action == ACT_ADD || action == ACT_DELETE);
+
+    for (i = 0; i < nargs || (action == ACT_EXTRACT && nargs == 0 && i < DIR_MAX); i++) {
+        int idx;
+
+        if (action == ACT_ADD) {
+            if (disk_add(&d, args[i], replace, err, sizeof(err)) == 0) {
+                done++;
+                continue;
+            }
+            fprintf(stderr, "vzdisk: '%s': %s\n", args[i], err);
+            failed++;
+            continue;
+        }
+        if (action == ACT_EXTRACT && nargs == 0) {
+            if (!dir_in_use(dir_entry(&d, (unsigned)i))) continue;
+            idx = i;
+        } else if ((idx = dir_find(&d, args[i])) < 0) {
+            fprintf(stderr, "vzdisk: '%s': not on the disk\n", args[i]);
+            failed++;
+            continue;
+        }
+        if (action == ACT_DELETE) {
+            disk_remove(&d, (unsigned)idx);
+            printf("Deleted     : %s\n", args[i]);
+            done++;
+        } else if (disk_extract(&d, (unsigned)idx, out_dir, err, sizeof(err)) == 0) {
+            done++;
+        } else {
+            fprintf(stderr, "vzdisk: %s\n", err);
+            failed++;
+        }
+    }
+
+    if (action == ACT_LIST)
+        disk_list(&d);
+    else
+        printf("Free        : %u sectors\n", d.free_count);
+    if (disk_close(&d) != 0)
+        die("failed writing disk image");
+    if (failed)
+        fprintf(stderr, "vzdisk: %lu of %lu files failed\n", failed, failed + done);
+    free(args);
+    return failed ? 1 : 0;
+}
@@ -4,12 +4,27 @@
  * The tool is intentionally strict about I/O errors but permissive about
  * output selection: callers can request one or many export formats in one run.
  */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
 
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "basictok.h"
+#include "vztape.h"
+#include "vzthread.h"
+
 #ifndef TOOL_VERSION
 #define TOOL_VERSION "dev"
 #endif
@@ -17,29 +32,6 @@
 /* 24-byte VZ header, followed by raw payload bytes. */
 #define VZ_HEADER_SIZE 24
 
-/*
- * VZ BASIC token table used for detokenization.
- * Index is token_byte - 0x80.
- */
-static const char *vz_tokens[128 + 1] = {
-    "END","FOR","RESET","SET","CLS","","RANDOM","NEXT",
-    "DATA","INPUT","DIM","READ","LET","GOTO","RUN","IF",
-    "RESTORE","GOSUB","RETURN","REM","STOP","ELSE","COPY","COLOR",
-    "VERIFY","DEFINT","DEFSNG","DEFDBL","CRUN","MODE","SOUND","RESUME",
-    "OUT","ON","OPEN","FIELD","GET","PUT","CLOSE","LOAD",
-    "MERGE","NAME","KILL","LSET","RSET","SAVE","SYSTEM","LPRINT",
-    "DEF","POKE","PRINT","CONT","LIST","LLIST","DELETE","AUTO",
-    "CLEAR","CLOAD","CSAVE","NEW","TAB(","TO","FN","USING",
-    "VARPTR","USR","ERL","ERR","STRING$","INSTR","POINT","TIME$",
-    "MEM","INKEY$","THEN","NOT","STEP","+","-","*",
-    "/","^","AND","OR",">","=","<","SGN",
-    "INT","ABS","FRE","INP","POS","SQR","RND","LOG",
-    "EXP","COS","SIN","TAN","ATN","PEEK","CVI","CVS",
-    "CVD","EOF","LOC","LOF","MKI$","MKS$","MKD$","CINT",
-    "CSNG","CDBL","FIX","LEN","STR$","VAL","ASC","CHR$",
-    "LEFT$","RIGHT$","MID$","'","","","","",NULL
-};
-
 typedef struct {
     uint8_t magic[4];
     char filename[17];
@@ -58,226 +50,1279 @@ static uint16_t le16(const uint8_t *p)
     return (uint16_t)p[0] | (uint16_t)((uint16_t)p[1] << 8);
 }
 
-static int write_bin(const char *path, const uint8_t *data, size_t len)
+/*
+ * Buffered output for the export sinks.  Records are formatted (or raw
+ * bytes copied) straight into a large block that goes to the file with one fwrite per
+ * block (a single one for anything but very large payloads); I/O errors
+ * stick in err and are reported by tout_close().
+ */
+#if SIZE_MAX > 0xFFFFu
+#define TOUT_BLOCK 65536u
+#else
+#define TOUT_BLOCK 4096u
+#endif
+#define REC_LINE_MAX 600        /* longest record line (255 data bytes) */
+
+typedef struct {
+    FILE *f;
+    char *buf;
+    size_t len;
+    int err;
+} TextOut;
+
+static char hex_pair[256][2];
+
+static void hex_pair_init(void)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    unsigned i;
+    for (i = 0; i < 256u; i++) {
+        hex_pair[i][0] = digits[i >> 4];
+        hex_pair[i][1] = digits[i & 15u];
+    }
+}
+
+static char *put_hex8(char *s, unsigned v)
+{
+    s[0] = hex_pair[v & 0xFFu][0];
+    s[1] = hex_pair[v & 0xFFu][1];
+    return s + 2;
+}
+
+static int tout_open(TextOut *t, const char *path)
 {
-    FILE *f = fopen(path, "wb");
-    if (!f) return -1;
-    if (len > 0 && fwrite(data, 1, len, f) != len) {
-        fclose(f);
+    t->len = 0;
+    t->err = 0;
+    t->buf = (char *)malloc(TOUT_BLOCK);
+    if (!t->buf) return -1;
+    t->f = fopen(path, "wb");
+    if (!t->f) {
+        free(t->buf);
         return -1;
     }
-    fclose(f);
     return 0;
 }
 
-static int write_ihex_record(FILE *f, uint8_t type, uint16_t addr, const uint8_t *data, uint8_t len)
+static void tout_flush(TextOut *t)
+{
+    if (t->len && !t->err && fwrite(t->buf, 1, t->len, t->f) != t->len)
+        t->err = 1;
+    t->len = 0;
+}
+
+/* Space for one record line. */
+static char *tout_line(TextOut *t)
+{
+    if (TOUT_BLOCK - t->len < REC_LINE_MAX)
+        tout_flush(t);
+    return t->buf + t->len;
+}
+
+static void tout_commit(TextOut *t, const char *end)
+{
+    t->len = (size_t)(end - t->buf);
+}
+
+/* Raw bytes, for the binary output. */
+static void tout_write(TextOut *t, const uint8_t *p, size_t n)
+{
+    while (n > 0) {
+        size_t room = TOUT_BLOCK - t->len;
+        if (room == 0) {
+            tout_flush(t);
+            room = TOUT_BLOCK;
+        }
+        if (room > n) room = n;
+        memcpy(t->buf + t->len, p, room);
+        t->len += room;
+        p += room;
+        n -= room;
+    }
+}
+
+static int tout_close(TextOut *t)
+{
+    tout_flush(t);
+    if (fclose(t->f) != 0) t->err = 1;
+    free(t->buf);
+    return t->err ? -1 : 0;
+}
+
+/* One Intel HEX record; the checksum is summed while the bytes are formatted. */
+static char *ihex_record(char *s, uint8_t type, uint16_t addr, const uint8_t *data, uint8_t len)
 {
-    uint8_t sum = (uint8_t)(len + (uint8_t)(addr >> 8) + (uint8_t)(addr & 0xFF) + type);
+    unsigned sum = (unsigned)len + (addr >> 8) + (addr & 0xFFu) + type;
     uint8_t i;
 
-    if (fprintf(f, ":%02X%04X%02X", (unsigned)len, (unsigned)addr, (unsigned)type) < 0)
-        return -1;
+    *s++ = ':';
+    s = put_hex8(s, len);
+    s = put_hex8(s, addr >> 8);
+    s = put_hex8(s, addr);
+    s = put_hex8(s, type);
+    for (i = 0; i < len; i++) {
+        sum += data[i];
+        s = put_hex8(s, data[i]);
+    }
+    s = put_hex8(s, 0u - sum);
+    *s++ = '\n';
+    return s;
+}
+
+/* One S-record with an addr_bytes-byte address; type is the digit after 'S'. */
+static char *srec_record(char *s, char type, uint32_t addr, int addr_bytes, const uint8_t *data, size_t len)
+{
+    unsigned count = (unsigned)(len + (size_t)addr_bytes + 1u);
+    unsigned sum = count;
+    size_t i;
+    int k;
 
+    *s++ = 'S';
+    *s++ = type;
+    s = put_hex8(s, count);
+    for (k = addr_bytes - 1; k >= 0; k--) {
+        unsigned b = (unsigned)(addr >> (8 * k)) & 0xFFu;
+        sum += b;
+        s = put_hex8(s, b);
+    }
     for (i = 0; i < len; i++) {
-        sum = (uint8_t)(sum + data[i]);
-        if (fprintf(f, "%02X", (unsigned)data[i]) < 0)
-            return -1;
+        sum += data[i];
+        s = put_hex8(s, data[i]);
+    }
+    s = put_hex8(s, ~sum);
+    *s++ = '\n';
+    return s;
+}
+
+/*
+ * Export engine.  Each requested output is a sink; a single walk over the
+ * payload hands every sink the same EXPORT_CHUNK-sized piece in turn, so a
+ * chunk is formatted into all outputs while it is still in cache.  Sinks
+ * own their buffered output and never touch each other, which is what
+ * lets --jobs give each one its own thread (and its own walk) instead.
+ */
+#define EXPORT_CHUNK 4096u
+#define EXPORT_MAX_SINKS 5
+
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+    uint32_t base;
+    unsigned rec_max;
+    uint8_t type;
+    unsigned char name[VZTAPE_NAME_LEN + 1];
+} ExportSrc;
+
+typedef struct ExportSink ExportSink;
+struct ExportSink {
+    const char *path;
+    const char *fail;                   /* die() message if this output fails */
+    int (*begin)(ExportSink *s, const ExportSrc *src);
+    void (*data)(ExportSink *s, const uint8_t *p, size_t n);
+    int (*end)(ExportSink *s, const ExportSrc *src);
+    void (*record)(ExportSink *s, uint32_t addr, const uint8_t *p, unsigned n);
+    int failed;
+    TextOut t;
+    uint32_t addr;                      /* address of the next payload byte */
+    uint32_t ext;                       /* HEX: upper 16 bits last emitted */
+    uint32_t mask;                      /* SREC: 16- or 24-bit address mask */
+    unsigned rec_max;
+    int split64;                        /* HEX: records stop at 64K boundaries */
+    int addr_bytes;
+    unsigned long sum;                  /* CAS: data checksum so far */
+    unsigned pend;                      /* bytes of a partial record in rec[] */
+    uint8_t rec[255];
+};
+
+/*
+ * Cut the byte stream into records exactly as a whole-buffer writer
+ * would: rec_max bytes each (less at a HEX 64K boundary), with only a
+ * record straddling two chunks going through the rec[] buffer.
+ */
+static void record_data(ExportSink *s, const uint8_t *p, size_t n)
+{
+    while (n > 0) {
+        uint32_t at = s->addr - s->pend;
+        unsigned lim = s->rec_max;
+        unsigned take;
+
+        if (s->split64 && 0x10000u - (at & 0xFFFFu) < lim)
+            lim = (unsigned)(0x10000u - (at & 0xFFFFu));
+        if (s->pend == 0 && n >= lim) {
+            s->record(s, at, p, lim);
+            take = lim;
+        } else {
+            take = lim - s->pend;
+            if (take > n) take = (unsigned)n;
+            memcpy(s->rec + s->pend, p, take);
+            s->pend += take;
+            if (s->pend == lim) {
+                s->record(s, at, s->rec, lim);
+                s->pend = 0;
+            }
+        }
+        s->addr += take;
+        p += take;
+        n -= take;
     }
+}
 
-    sum = (uint8_t)(0u - sum);
-    if (fprintf(f, "%02X\n", (unsigned)sum) < 0)
-        return -1;
-    return 0;
+static void record_flush(ExportSink *s)
+{
+    if (s->pend > 0) {
+        s->record(s, s->addr - s->pend, s->rec, s->pend);
+        s->pend = 0;
+    }
+}
+
+static int bin_begin(ExportSink *s, const ExportSrc *src)
+{
+    (void)src;
+    return tout_open(&s->t, s->path);
 }
 
-static int write_ihex(const char *path, const uint8_t *data, size_t len, uint32_t base_addr)
+static void bin_data(ExportSink *s, const uint8_t *p, size_t n)
 {
-    FILE *f = fopen(path, "wb");
-    size_t off = 0;
-    uint32_t ext = 0xFFFFFFFFu;
+    tout_write(&s->t, p, n);
+}
 
-    if (!f) return -1;
+static int text_end(ExportSink *s, const ExportSrc *src)
+{
+    (void)src;
+    return tout_close(&s->t);
+}
 
-    /*
-     * Emit 16-byte data records and only change type-04 extended address
-     * records when the upper 16 bits actually move.
-     */
-    while (off < len) {
-        uint8_t rec_len = (uint8_t)((len - off) > 16 ? 16 : (len - off));
-        uint32_t addr32 = base_addr + (uint32_t)off;
-        uint32_t need_ext = addr32 >> 16;
-        uint16_t addr16 = (uint16_t)(addr32 & 0xFFFFu);
-
-        if (need_ext != ext) {
-            uint8_t ext_data[2];
-            ext_data[0] = (uint8_t)((need_ext >> 8) & 0xFFu);
-            ext_data[1] = (uint8_t)(need_ext & 0xFFu);
-            if (write_ihex_record(f, 0x04u, 0x0000u, ext_data, 2) < 0) {
-                fclose(f);
-                return -1;
+/* Only change type-04 extended address records when the upper 16 bits move. */
+static void ihex_data_record(ExportSink *s, uint32_t addr, const uint8_t *p, unsigned n)
+{
+    if ((addr >> 16) != s->ext) {
+        uint8_t ext_data[2];
+        s->ext = addr >> 16;
+        ext_data[0] = (uint8_t)((s->ext >> 8) & 0xFFu);
+        ext_data[1] = (uint8_t)(s->ext & 0xFFu);
+        tout_commit(&s->t, ihex_record(tout_line(&s->t), 0x04u, 0x0000u, ext_data, 2));
+    }
+    tout_commit(&s->t, ihex_record(tout_line(&s->t), 0x00u, (uint16_t)(addr & 0xFFFFu), p, (uint8_t)n));
+}
+
+static int ihex_begin(ExportSink *s, const ExportSrc *src)
+{
+    s->addr = src->base;
+    s->ext = 0xFFFFFFFFu;
+    s->rec_max = src->rec_max;
+    s->split64 = 1;
+    s->pend = 0;
+    s->record = ihex_data_record;
+    return tout_open(&s->t, s->path);
+}
+
+static int ihex_end(ExportSink *s, const ExportSrc *src)
+{
+    (void)src;
+    record_flush(s);
+    tout_commit(&s->t, ihex_record(tout_line(&s->t), 0x01u, 0x0000u, NULL, 0));
+    return tout_close(&s->t);
+}
+
+static void srec_data_record(ExportSink *s, uint32_t addr, const uint8_t *p, unsigned n)
+{
+    tout_commit(&s->t, srec_record(tout_line(&s->t), s->addr_bytes == 3 ? '2' : '1',
+                                   addr & s->mask, s->addr_bytes, p, n));
+}
+
+/*
+ * Pick S1/S9 for 16-bit space, S2/S8 when payload spills above 64K.
+ * This keeps the output compact while still handling larger bases.
+ * The count byte covers address and checksum too, which caps the
+ * data per record at 252 (S1) or 251 (S2) bytes.
+ */
+static int srec_begin(ExportSink *s, const ExportSrc *src)
+{
+    int use_s2 = ((src->base + (uint32_t)src->len) > 0x10000u);
+
+    s->addr = src->base;
+    s->addr_bytes = use_s2 ? 3 : 2;
+    s->mask = use_s2 ? 0xFFFFFFu : 0xFFFFu;
+    s->rec_max = (unsigned)(255 - s->addr_bytes - 1);
+    if (src->rec_max < s->rec_max) s->rec_max = src->rec_max;
+    s->split64 = 0;
+    s->pend = 0;
+    s->record = srec_data_record;
+    return tout_open(&s->t, s->path);
+}
+
+static int srec_end(ExportSink *s, const ExportSrc *src)
+{
+    record_flush(s);
+    tout_commit(&s->t, srec_record(tout_line(&s->t), s->addr_bytes == 3 ? '8' : '9',
+                                   src->base & s->mask, s->addr_bytes, NULL, 0));
+    return tout_close(&s->t);
+}
+
+/* BASIC detokenizer: the shared one from basictok.h, written with a single fwrite. */
+static BasDetok bas_detok;
+
+static int write_basic_text(const char *path, const uint8_t *data, size_t len, uint16_t start_addr)
+{
+    BasText b = { NULL, 0, 0 };
+    FILE *out;
+    int rc = -1;
+
+    if (bastok_render(&bas_detok, &b, data, len, start_addr) == 0 && (out = fopen(path, "wb")) != NULL) {
+        rc = (b.len == 0 || fwrite(b.p, 1, b.len, out) == b.len) ? 0 : -1;
+        if (fclose(out) != 0) rc = -1;
+    }
+    free(b.p);
+    return rc;
+}
+
+/*
+ * --verify-roundtrip: detokenize, feed the text back through the shared
+ * tokenizer with vzpack's settings and compare with the original bytes up
+ * to the program's end link.  Anything after it (variables, padding) is
+ * not part of the listing and is not compared.
+ */
+typedef struct {
+    const uint8_t *want;
+    size_t len;
+    size_t pos;
+    size_t diff;                        /* first differing offset, or SIZE_MAX */
+} RoundTrip;
+
+static BasKeywords bas_keywords;
+
+static void roundtrip_sink(void *user, const unsigned char *bytes, size_t n)
+{
+    RoundTrip *rt = (RoundTrip *)user;
+    size_t i;
+
+    if (rt->diff == SIZE_MAX) {
+        for (i = 0; i < n; i++) {
+            if (rt->pos + i >= rt->len || rt->want[rt->pos + i] != bytes[i]) {
+                rt->diff = rt->pos + i;
+                break;
             }
-            ext = need_ext;
         }
+    }
+    rt->pos += n;
+}
+
+/* 0 if the payload survives the round trip, else 1 with *diff set; -1 if out of memory. */
+static int verify_roundtrip(const uint8_t *data, size_t len, uint16_t start_addr, size_t *diff)
+{
+    BasText b = { NULL, 0, 0 };
+    RoundTrip rt;
+    BasTok tok;
+
+    if (bastok_render(&bas_detok, &b, data, len, start_addr) != 0) {
+        free(b.p);
+        return -1;
+    }
+    rt.want = data;
+    rt.len = len;
+    rt.pos = 0;
+    rt.diff = SIZE_MAX;
+    bastok_init(&tok, &bas_keywords, BASTOK_TOKENIZE | BASTOK_SQUEEZE | BASTOK_UPCASE,
+                start_addr, roundtrip_sink, &rt);
+    bastok_feed(&tok, (const unsigned char *)b.p, b.len);
+    bastok_finish(&tok);
+    free(b.p);
+    *diff = rt.diff;
+    return rt.diff == SIZE_MAX ? 0 : 1;
+}
+
+/* .cas: the tape byte stream as vz2wav encodes it, with a 128-byte leader. */
+static int cas_begin(ExportSink *s, const ExportSrc *src)
+{
+    unsigned char head[VZTAPE_CAS_LEADER + VZTAPE_SYNC_COUNT + VZTAPE_HEAD_MAX];
+    size_t n;
+
+    if (tout_open(&s->t, s->path) != 0) return -1;
+    memset(head, VZTAPE_LEADER_BYTE, VZTAPE_CAS_LEADER);
+    memset(head + VZTAPE_CAS_LEADER, VZTAPE_SYNC_BYTE, VZTAPE_SYNC_COUNT);
+    n = VZTAPE_CAS_LEADER + VZTAPE_SYNC_COUNT;
+    n += vztape_head(head + n, src->type, src->name, src->base & 0xFFFFu,
+                     (unsigned)((src->base + src->len) & 0xFFFFu));
+    tout_write(&s->t, head, n);
+    s->sum = 0;
+    return 0;
+}
+
+static void cas_data(ExportSink *s, const uint8_t *p, size_t n)
+{
+    s->sum = vztape_sum(s->sum, p, n);
+    tout_write(&s->t, p, n);
+}
+
+static int cas_end(ExportSink *s, const ExportSrc *src)
+{
+    uint8_t ck[2];
+    unsigned sum = vztape_checksum(src->base & 0xFFFFu,
+                                   (unsigned)((src->base + src->len) & 0xFFFFu), s->sum);
+    ck[0] = (uint8_t)(sum & 0xFFu);
+    ck[1] = (uint8_t)(sum >> 8);
+    tout_write(&s->t, ck, 2);
+    return tout_close(&s->t);
+}
+
+/* Detokenizing follows line links, so the BASIC sink works on the whole payload. */
+static int bas_end(ExportSink *s, const ExportSrc *src)
+{
+    return write_basic_text(s->path, src->data, src->len, (uint16_t)src->base);
+}
+
+/* One walk over the payload for every sink in the list. */
+static void export_pass(ExportSink **sink, int count, const ExportSrc *src)
+{
+    size_t off, n;
+    int k;
+
+    for (k = 0; k < count; k++)
+        sink[k]->failed = sink[k]->begin && sink[k]->begin(sink[k], src) != 0;
+
+    for (off = 0; off < src->len; off += n) {
+        n = src->len - off;
+        if (n > EXPORT_CHUNK) n = EXPORT_CHUNK;
+        for (k = 0; k < count; k++)
+            if (!sink[k]->failed && sink[k]->data)
+                sink[k]->data(sink[k], src->data + off, n);
+    }
+
+    for (k = 0; k < count; k++)
+        if (!sink[k]->failed && sink[k]->end(sink[k], src) != 0)
+            sink[k]->failed = 1;
+}
+
+#if VZ_THREADS
+typedef struct {
+    ExportSink **sink;
+    int count;
+    int next;
+    const ExportSrc *src;
+    vz_mutex_t lock;
+} ExportRun;
 
-        if (write_ihex_record(f, 0x00u, addr16, data + off, rec_len) < 0) {
-            fclose(f);
-            return -1;
+static void export_worker(ExportRun *r)
+{
+    for (;;) {
+        int i;
+        vz_mutex_lock(&r->lock);
+        i = r->next++;
+        vz_mutex_unlock(&r->lock);
+        if (i >= r->count) break;
+        export_pass(&r->sink[i], 1, r->src);
+    }
+}
+
+#if defined(_WIN32)
+static DWORD WINAPI export_thread(LPVOID arg)
+{
+    export_worker((ExportRun *)arg);
+    return 0;
+}
+#else
+static void *export_thread(void *arg)
+{
+    export_worker((ExportRun *)arg);
+    return NULL;
+}
+#endif
+#endif /* VZ_THREADS */
+
+/*
+ * Write every sink: one shared pass by default, or with jobs > 1 one
+ * sink per worker; the calling thread works too, so a failed spawn only
+ * costs speed.
+ */
+static void export_run(ExportSink **sink, int count, const ExportSrc *src, int jobs)
+{
+#if VZ_THREADS
+    ExportRun r;
+    vz_thread_t th[EXPORT_MAX_SINKS];
+    int started = 0, i;
+
+    if (jobs > 1 && count > 1 && vz_mutex_init(&r.lock) == 0) {
+        r.sink = sink;
+        r.count = count;
+        r.next = 0;
+        r.src = src;
+        for (i = 1; i < jobs && i < count; i++) {
+            if (vz_thread_start(&th[started], export_thread, &r) != 0) break;
+            started++;
         }
-        off += rec_len;
+        export_worker(&r);
+        for (i = 0; i < started; i++)
+            vz_thread_join(th[i]);
+        vz_mutex_destroy(&r.lock);
+        return;
     }
+#else
+    (void)jobs;
+#endif
+    export_pass(sink, count, src);
+}
 
-    if (write_ihex_record(f, 0x01u, 0x0000u, NULL, 0) < 0) {
-        fclose(f);
-        return -1;
+/*
+ * Catalog mode.  --catalog walks a directory tree for *.vz files and, on
+ * a small worker pool, reads each header plus an FNV-1a hash of the
+ * payload; --index gets one tab-separated line per file:
+ *
+ *   VZCAT 1 <count>
+ *   <hash> <type> <start> <end> <size> <name> <path>
+ *
+ * hash is 16 hex digits, type/start/end are hex, size is the payload
+ * length in decimal and end is start + size.  Queries filter that file
+ * without opening any .vz again.
+ */
+#define CAT_MAGIC "VZCAT 1"
+#define CAT_PATH_MAX 1024
+#define CAT_LINE_MAX (CAT_PATH_MAX + 128)
+#define FNV64_BASIS 0xCBF29CE484222325ULL
+#define FNV64_PRIME 0x100000001B3ULL
+
+typedef struct {
+    char *path;
+    char name[18];
+    uint8_t type;
+    uint16_t start;
+    uint32_t size;
+    uint64_t hash;
+    int ok;
+} CatEntry;
+
+typedef struct {
+    CatEntry *ent;
+    size_t count;
+    size_t cap;
+    size_t next;
+    vz_mutex_t lock;
+} Catalog;
+
+typedef struct {
+    const char *name;                   /* glob on the VZ name, or NULL */
+    int type;                           /* type byte, or -1 */
+    int addr_set;
+    uint32_t lo, hi;
+    int dups;
+} CatQuery;
+
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+static CatEntry *cat_add(Catalog *c, const char *path)
+{
+    size_t n = strlen(path) + 1u;
+    CatEntry *e;
+
+    if (c->count == c->cap) {
+        size_t ncap = c->cap ? c->cap * 2u : 256u;
+        CatEntry *ne = (CatEntry *)realloc(c->ent, ncap * sizeof(*ne));
+        if (!ne) die("out of memory");
+        c->ent = ne;
+        c->cap = ncap;
     }
+    e = &c->ent[c->count++];
+    memset(e, 0, sizeof(*e));
+    e->path = (char *)malloc(n);
+    if (!e->path) die("out of memory");
+    memcpy(e->path, path, n);
+    return e;
+}
+
+static void cat_free(Catalog *c)
+{
+    size_t i;
+    for (i = 0; i < c->count; i++)
+        free(c->ent[i].path);
+    free(c->ent);
+    c->ent = NULL;
+    c->count = c->cap = 0;
+}
+
+static int has_vz_extension(const char *path)
+{
+    const char *dot = strrchr(path, '.');
+    return dot && tolower((unsigned char)dot[1]) == 'v' &&
+           tolower((unsigned char)dot[2]) == 'z' && dot[3] == '\0';
+}
+
+#if defined(_WIN32)
+static void cat_walk(Catalog *c, const char *dir)
+{
+    char path[CAT_PATH_MAX];
+    WIN32_FIND_DATAA fd;
+    HANDLE h;
 
+    if (snprintf(path, sizeof(path), "%s/*", dir) >= (int)sizeof(path)) return;
+    h = FindFirstFileA(path, &fd);
+    if (h == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "vzexport: cannot read directory %s\n", dir);
+        return;
+    }
+    do {
+        if (strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, fd.cFileName) >= (int)sizeof(path)) continue;
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            cat_walk(c, path);
+        else if (has_vz_extension(path))
+            cat_add(c, path);
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+}
+#elif defined(__unix__) || defined(__APPLE__)
+/* Symlinked files are indexed, symlinked directories are not followed. */
+static void cat_walk(Catalog *c, const char *dir)
+{
+    char path[CAT_PATH_MAX];
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    struct stat st;
+
+    if (!d) {
+        fprintf(stderr, "vzexport: cannot read directory %s\n", dir);
+        return;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) continue;
+        if (lstat(path, &st) != 0) continue;
+        if (S_ISDIR(st.st_mode))
+            cat_walk(c, path);
+        else if ((S_ISREG(st.st_mode) || (S_ISLNK(st.st_mode) && stat(path, &st) == 0 &&
+                  S_ISREG(st.st_mode))) && has_vz_extension(path))
+            cat_add(c, path);
+    }
+    closedir(d);
+}
+#else
+static void cat_walk(Catalog *c, const char *dir)
+{
+    (void)c;
+    (void)dir;
+    die("--catalog is not supported in this build");
+}
+#endif
+
+/* Header fields and payload hash of one file; e->ok stays 0 if unreadable. */
+static void cat_scan(CatEntry *e)
+{
+    uint8_t buf[4096];
+    uint64_t h = FNV64_BASIS;
+    uint32_t size = 0;
+    size_t n;
+    int k;
+    FILE *f = fopen(e->path, "rb");
+
+    if (!f) return;
+    if (fread(buf, 1, VZ_HEADER_SIZE, f) == VZ_HEADER_SIZE) {
+        for (k = 0; k < 17 && buf[4 + k] != 0u; k++)
+            e->name[k] = (buf[4 + k] >= 0x20u && buf[4 + k] < 0x7Fu) ? (char)buf[4 + k] : '?';
+        e->name[k] = '\0';
+        e->type = buf[21];
+        e->start = le16(buf + 22);
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            h = fnv1a64(h, buf, n);
+            size += (uint32_t)n;
+        }
+        if (!ferror(f)) {
+            e->hash = h;
+            e->size = size;
+            e->ok = 1;
+        }
+    }
     fclose(f);
+}
+
+static void cat_worker(Catalog *c)
+{
+    for (;;) {
+        size_t i;
+        vz_mutex_lock(&c->lock);
+        i = c->next++;
+        vz_mutex_unlock(&c->lock);
+        if (i >= c->count) break;
+        cat_scan(&c->ent[i]);
+    }
+}
+
+#if VZ_THREADS && defined(_WIN32)
+static DWORD WINAPI cat_thread(LPVOID arg)
+{
+    cat_worker((Catalog *)arg);
     return 0;
 }
+#elif VZ_THREADS
+static void *cat_thread(void *arg)
+{
+    cat_worker((Catalog *)arg);
+    return NULL;
+}
+#endif
+
+static void cat_run(Catalog *c, int jobs)
+{
+#if VZ_THREADS
+    vz_thread_t th[VZ_MAX_THREADS];
+    int started = 0, i;
+
+    for (i = 1; i < jobs && (size_t)i < c->count; i++) {
+        if (vz_thread_start(&th[started], cat_thread, c) != 0) break;
+        started++;
+    }
+    cat_worker(c);
+    for (i = 0; i < started; i++)
+        vz_thread_join(th[i]);
+#else
+    (void)jobs;
+    cat_worker(c);
+#endif
+}
 
-static int write_srec(const char *path, const uint8_t *data, size_t len, uint32_t base_addr)
+static int cat_cmp_path(const void *a, const void *b)
 {
-    FILE *f = fopen(path, "wb");
-    size_t off = 0;
-    int use_s2 = ((base_addr + (uint32_t)len) > 0x10000u);
+    return strcmp(((const CatEntry *)a)->path, ((const CatEntry *)b)->path);
+}
 
-    if (!f) return -1;
+static int cat_cmp_hash(const void *a, const void *b)
+{
+    const CatEntry *x = (const CatEntry *)a;
+    const CatEntry *y = (const CatEntry *)b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
 
-    /*
-     * Pick S1/S9 for 16-bit space, S2/S8 when payload spills above 64K.
-     * This keeps the output compact while still handling larger bases.
-     */
-    while (off < len) {
-        uint8_t rec_len = (uint8_t)((len - off) > 16 ? 16 : (len - off));
-        uint32_t addr = base_addr + (uint32_t)off;
-        uint8_t count;
-        uint8_t cksum;
-        size_t i;
+/* Scan dir into c and write the index, sorted by path, via a temp file. */
+static void cat_build(Catalog *c, const char *dir, const char *index_path, int jobs)
+{
+    char tmp[CAT_PATH_MAX];
+    unsigned long written = 0, skipped = 0;
+    size_t i, keep = 0;
+    FILE *f;
 
-        if (use_s2) {
-            count = (uint8_t)(rec_len + 4u);
-            cksum = count;
-            cksum = (uint8_t)(cksum + ((addr >> 16) & 0xFFu));
-            cksum = (uint8_t)(cksum + ((addr >> 8) & 0xFFu));
-            cksum = (uint8_t)(cksum + (addr & 0xFFu));
-            if (fprintf(f, "S2%02X%06lX", (unsigned)count, (unsigned long)(addr & 0xFFFFFFu)) < 0) {
-                fclose(f);
-                return -1;
-            }
+    cat_walk(c, dir);
+    if (vz_mutex_init(&c->lock) != 0) die("cannot create catalog lock");
+    c->next = 0;
+    cat_run(c, jobs);
+    vz_mutex_destroy(&c->lock);
+
+    /* Paths with tabs or newlines would break the line format. */
+    for (i = 0; i < c->count; i++) {
+        CatEntry *e = &c->ent[i];
+        if (!e->ok || strpbrk(e->path, "\t\r\n")) {
+            fprintf(stderr, "vzexport: skipped %s\n", e->path);
+            free(e->path);
+            skipped++;
+            continue;
+        }
+        c->ent[keep++] = *e;
+    }
+    c->count = keep;
+    qsort(c->ent, c->count, sizeof(*c->ent), cat_cmp_path);
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", index_path) >= (int)sizeof(tmp))
+        die("index path too long");
+    f = fopen(tmp, "wb");
+    if (!f) die("cannot create index file");
+    fprintf(f, "%s %lu\n", CAT_MAGIC, (unsigned long)c->count);
+    for (i = 0; i < c->count; i++) {
+        const CatEntry *e = &c->ent[i];
+        fprintf(f, "%08lx%08lx\t%02X\t%04X\t%04lX\t%lu\t%s\t%s\n",
+                (unsigned long)(e->hash >> 32), (unsigned long)(e->hash & 0xFFFFFFFFu),
+                (unsigned)e->type, (unsigned)e->start,
+                (unsigned long)e->start + (unsigned long)e->size, (unsigned long)e->size,
+                e->name, e->path);
+        written++;
+    }
+    if (fclose(f) != 0) {
+        remove(tmp);
+        die("failed writing index file");
+    }
+    remove(index_path);
+    if (rename(tmp, index_path) != 0) {
+        remove(tmp);
+        die("cannot replace index file");
+    }
+    printf("Catalog     : %lu files indexed, %lu skipped -> %s\n", written, skipped, index_path);
+}
+
+/* Split the next tab-terminated field off *pp, in place. */
+static char *next_tab_field(char **pp)
+{
+    char *p = *pp;
+    char *t = strchr(p, '\t');
+    if (!t) return NULL;
+    *t = '\0';
+    *pp = t + 1;
+    return p;
+}
+
+static void cat_load(Catalog *c, const char *index_path)
+{
+    char line[CAT_LINE_MAX];
+    unsigned long lineno = 1;
+    FILE *f = fopen(index_path, "rb");
+
+    if (!f) die("cannot open index file");
+    if (!fgets(line, sizeof(line), f) || strncmp(line, CAT_MAGIC " ", sizeof(CAT_MAGIC)) != 0)
+        die("not a vzexport catalog index");
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line, *fld[6];
+        size_t n = strlen(line);
+        CatEntry *e;
+        int k;
+
+        lineno++;
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+            line[--n] = '\0';
+        for (k = 0; k < 6; k++)
+            if ((fld[k] = next_tab_field(&p)) == NULL) break;
+        if (k < 6 || strlen(fld[0]) != 16 || strlen(fld[5]) > 17) {
+            fprintf(stderr, "vzexport: %s:%lu: malformed entry\n", index_path, lineno);
+            continue;
+        }
+        e = cat_add(c, p);
+        e->hash = (uint64_t)strtoull(fld[0], NULL, 16);
+        e->type = (uint8_t)strtoul(fld[1], NULL, 16);
+        e->start = (uint16_t)strtoul(fld[2], NULL, 16);
+        e->size = (uint32_t)strtoul(fld[4], NULL, 10);
+        strcpy(e->name, fld[5]);
+        e->ok = 1;
+    }
+    fclose(f);
+}
+
+/* Case-insensitive glob with * and ?. */
+static int glob_match(const char *pat, const char *s)
+{
+    const char *star = NULL, *resume = NULL;
+
+    while (*s) {
+        if (*pat == '*') {
+            star = ++pat;
+            resume = s;
+        } else if (*pat == '?' || toupper((unsigned char)*pat) == toupper((unsigned char)*s)) {
+            pat++;
+            s++;
+        } else if (star) {
+            pat = star;
+            s = ++resume;
         } else {
-            count = (uint8_t)(rec_len + 3u);
-            cksum = count;
-            cksum = (uint8_t)(cksum + ((addr >> 8) & 0xFFu));
-            cksum = (uint8_t)(cksum + (addr & 0xFFu));
-            if (fprintf(f, "S1%02X%04X", (unsigned)count, (unsigned)(addr & 0xFFFFu)) < 0) {
-                fclose(f);
-                return -1;
-            }
+            return 0;
         }
+    }
+    while (*pat == '*') pat++;
+    return *pat == '\0';
+}
 
-        for (i = 0; i < rec_len; i++) {
-            cksum = (uint8_t)(cksum + data[off + i]);
-            if (fprintf(f, "%02X", (unsigned)data[off + i]) < 0) {
-                fclose(f);
-                return -1;
-            }
+static int cat_match(const CatEntry *e, const CatQuery *q)
+{
+    if (q->name && !glob_match(q->name, e->name)) return 0;
+    if (q->type >= 0 && e->type != (uint8_t)q->type) return 0;
+    if (q->addr_set) {
+        uint32_t last = e->start + (e->size ? e->size - 1u : 0u);
+        if (last > 0xFFFFu && e->size < 0x10000u) {
+            /* Wraps past 0xFFFF: [start, 0xFFFF] and [0, last & 0xFFFF]. */
+            if ((e->start > q->hi || 0xFFFFu < q->lo) && (last & 0xFFFFu) < q->lo) return 0;
+        } else if (last <= 0xFFFFu) {
+            if (e->start > q->hi || last < q->lo) return 0;
         }
+    }
+    return 1;
+}
+
+static void cat_print(const CatEntry *e)
+{
+    printf("%-17s %-5s %04X-%04lX %7lu  %s\n", e->name,
+           e->type == 0xF0u ? "BASIC" : e->type == 0xF1u ? "MC" : "?",
+           (unsigned)e->start, ((unsigned long)e->start + (unsigned long)e->size) & 0xFFFFul,
+           (unsigned long)e->size, e->path);
+}
+
+/* Matching entries in index order, or with --dups grouped by payload hash. */
+static void cat_query(Catalog *c, const CatQuery *q)
+{
+    size_t i, keep = 0, groups = 0;
+
+    for (i = 0; i < c->count; i++) {
+        if (cat_match(&c->ent[i], q))
+            c->ent[keep++] = c->ent[i];
+        else
+            free(c->ent[i].path);
+    }
+    c->count = keep;
 
-        cksum = (uint8_t)(~cksum);
-        if (fprintf(f, "%02X\n", (unsigned)cksum) < 0) {
-            fclose(f);
-            return -1;
+    if (!q->dups) {
+        for (i = 0; i < c->count; i++)
+            cat_print(&c->ent[i]);
+        return;
+    }
+
+    qsort(c->ent, c->count, sizeof(*c->ent), cat_cmp_hash);
+    for (i = 0; i < c->count; ) {
+        size_t j = i + 1;
+        while (j < c->count && c->ent[j].hash == c->ent[i].hash) j++;
+        if (j - i > 1) {
+            printf("%s%08lx%08lx (%lu files)\n", groups ? "\n" : "",
+                   (unsigned long)(c->ent[i].hash >> 32),
+                   (unsigned long)(c->ent[i].hash & 0xFFFFFFFFu), (unsigned long)(j - i));
+            for (; i < j; i++)
+                cat_print(&c->ent[i]);
+            groups++;
         }
+        i = j;
+    }
+}
+
+/* Whole file into memory; NULL with *err set on failure. */
+static uint8_t *load_file(const char *path, size_t *size, const char **err)
+{
+    FILE *in = fopen(path, "rb");
+    uint8_t *buf;
+    long sz;
 
-        off += rec_len;
+    *err = "cannot open input file";
+    if (!in)
+        return NULL;
+    *err = "cannot seek input file";
+    if (fseek(in, 0, SEEK_END) != 0)
+        goto fail;
+    *err = "cannot tell input file size";
+    if ((sz = ftell(in)) < 0)
+        goto fail;
+    *err = "cannot seek input file";
+    if (fseek(in, 0, SEEK_SET) != 0)
+        goto fail;
+    *err = "out of memory";
+    if ((buf = (uint8_t *)malloc(sz ? (size_t)sz : 1u)) == NULL)
+        goto fail;
+    if (fread(buf, 1, (size_t)sz, in) != (size_t)sz) {
+        *err = "failed to read input file";
+        free(buf);
+        goto fail;
     }
+    fclose(in);
+    *size = (size_t)sz;
+    return buf;
+fail:
+    fclose(in);
+    return NULL;
+}
+
+/* --verify-roundtrip over every input; 0 only if all BASIC files pass. */
+static int verify_files(const char **paths, int count)
+{
+    unsigned long ok = 0, bad = 0, skipped = 0;
+    int i;
 
-    if (use_s2) {
-        uint32_t addr = base_addr & 0xFFFFFFu;
-        uint8_t count = 4u;
-        uint8_t cksum = (uint8_t)(count + ((addr >> 16) & 0xFFu) + ((addr >> 8) & 0xFFu) + (addr & 0xFFu));
-        cksum = (uint8_t)(~cksum);
-        if (fprintf(f, "S804%06lX%02X\n", (unsigned long)addr, (unsigned)cksum) < 0) {
-            fclose(f);
-            return -1;
+    if (bastok_keywords_build(&bas_keywords, bastok_vz_words) != 0)
+        die("keyword trie overflow");
+    hex_pair_init();
+    bastok_detok_init(&bas_detok, bastok_vz_words);
+    for (i = 0; i < count; i++) {
+        const char *err;
+        size_t size, diff;
+        uint8_t *buf = load_file(paths[i], &size, &err);
+        int rc;
+
+        if (!buf || size < VZ_HEADER_SIZE) {
+            printf("ERROR     %s: %s\n", paths[i], buf ? "too short to be a VZ file" : err);
+            free(buf);
+            bad++;
+            continue;
         }
-    } else {
-        uint16_t addr = (uint16_t)(base_addr & 0xFFFFu);
-        uint8_t count = 3u;
-        uint8_t cksum = (uint8_t)(count + ((addr >> 8) & 0xFFu) + (addr & 0xFFu));
-        cksum = (uint8_t)(~cksum);
-        if (fprintf(f, "S903%04X%02X\n", (unsigned)addr, (unsigned)cksum) < 0) {
-            fclose(f);
-            return -1;
+        if (buf[21] != 0xF0u) {
+            printf("SKIPPED   %s: not BASIC\n", paths[i]);
+            free(buf);
+            skipped++;
+            continue;
+        }
+        rc = verify_roundtrip(buf + VZ_HEADER_SIZE, size - VZ_HEADER_SIZE, le16(buf + 22), &diff);
+        if (rc == 0) {
+            printf("OK        %s\n", paths[i]);
+            ok++;
+        } else if (rc > 0) {
+            printf("MISMATCH  %s: first difference at 0x%04X (payload offset %lu)\n", paths[i],
+                   (unsigned)((le16(buf + 22) + diff) & 0xFFFFu), (unsigned long)diff);
+            bad++;
+        } else {
+            printf("ERROR     %s: out of memory\n", paths[i]);
+            bad++;
         }
+        free(buf);
     }
+    printf("Verified    : %lu ok, %lu failed, %lu skipped\n", ok, bad, skipped);
+    return bad ? 1 : 0;
+}
 
-    fclose(f);
-    return 0;
+/*
+ * Tape images.  A .cvz container (or a .cas, which is the one-file case)
+ * is read in TOUT_BLOCK pieces through the vztape.h scanner, so neither
+ * listing nor unpacking ever holds more than one block -- plus, when a
+ * file is picked for export, its payload.
+ */
+typedef int (*TapeEvent)(void *user, int ev, const VzTapeScan *s);
+
+static int has_tape_extension(const char *path)
+{
+    size_t n = strlen(path);
+    const char *ext = n >= 4 ? path + n - 4 : "";
+    return ext[0] == '.' &&
+           (((ext[1] | 0x20) == 'c' && (ext[2] | 0x20) == 'v' && (ext[3] | 0x20) == 'z') ||
+            ((ext[1] | 0x20) == 'c' && (ext[2] | 0x20) == 'a' && (ext[3] | 0x20) == 's'));
 }
 
-static void emit_bas_byte(FILE *out, uint8_t b)
+/* Stream path through the scanner; fn sees HEAD, DATA and END and may stop the walk. */
+static void tape_walk(const char *path, TapeEvent fn, void *user)
 {
-    if (b >= 0x80u) {
-        const char *t = vz_tokens[b - 0x80u];
-        if (t && *t) {
-            fputs(t, out);
-            return;
+    FILE *in = fopen(path, "rb");
+    uint8_t *block = (uint8_t *)malloc(TOUT_BLOCK);
+    VzTapeScan s;
+    const char *why;
+    size_t got;
+    char msg[128];
+
+    if (!in || !block) {
+        snprintf(msg, sizeof(msg), "cannot read '%.80s'", path);
+        die(msg);
+    }
+    vztape_scan_init(&s);
+    while ((got = fread(block, 1, TOUT_BLOCK, in)) > 0) {
+        const uint8_t *p = block;
+        while (got > 0) {
+            int ev;
+            size_t used = vztape_scan(&s, p, got, &ev);
+            p += used;
+            got -= used;
+            if (ev == VZTAPE_EV_ERROR)
+                goto bad;
+            if (ev != VZTAPE_EV_MORE && fn(user, ev, &s) != 0)
+                goto done;
         }
     }
+    if (ferror(in)) {
+        snprintf(msg, sizeof(msg), "failed to read '%.80s'", path);
+        die(msg);
+    }
+bad:
+    if ((why = vztape_scan_finish(&s)) != NULL) {
+        snprintf(msg, sizeof(msg), "'%.60s' at offset %lu: %s", path, s.pos, why);
+        die(msg);
+    }
+    if (s.skipped)
+        fprintf(stderr, "vzexport: warning: %lu bytes outside any file in '%s' ignored\n",
+                s.skipped, path);
+done:
+    free(block);
+    fclose(in);
+}
 
-    if (b >= 32u && b <= 126u) {
-        fputc((int)b, out);
-    } else {
-        fprintf(out, "\\x%02X", (unsigned)b);
+static const char *type_label(unsigned type)
+{
+    return type == 0xF0u ? "BASIC" : type == 0xF1u ? "MC" : "?";
+}
+
+static void tape_bad_checksum(const char *path, unsigned long n, const VzTapeEntry *e)
+{
+    fprintf(stderr, "vzexport: warning: file %lu (%s) in '%s' has a bad checksum\n",
+            n, (const char *)e->name, path);
+}
+
+/* --info on a tape image: one line per file. */
+typedef struct {
+    unsigned long count;
+} TapeList;
+
+static int tape_list_event(void *user, int ev, const VzTapeScan *s)
+{
+    TapeList *l = (TapeList *)user;
+    const VzTapeEntry *e = &s->ent;
+
+    if (ev != VZTAPE_EV_END) return 0;
+    if (l->count++ == 0)
+        printf("  #  Name              Type  Load       Bytes  Offset   Check\n");
+    printf("%3lu  %-17s %-5s %04X-%04X %6u  %07lX  %s\n", l->count, (const char *)e->name,
+           type_label(e->type), e->start, (e->start + e->len) & 0xFFFFu, e->len, e->offset,
+           e->checksum_ok ? "ok" : "BAD");
+    return 0;
+}
+
+/* --entry: copy one file's payload out for the usual exports. */
+typedef struct {
+    unsigned long want, seen;
+    const char *path;
+    ExportSrc *src;
+    uint8_t *buf;
+    size_t fill;
+    int found;
+} TapePick;
+
+static int tape_pick_event(void *user, int ev, const VzTapeScan *s)
+{
+    TapePick *t = (TapePick *)user;
+
+    if (ev == VZTAPE_EV_HEAD && ++t->seen == t->want) {
+        t->buf = (uint8_t *)malloc(s->ent.len ? s->ent.len : 1u);
+        if (!t->buf) die("out of memory");
+        t->fill = 0;
+    } else if (ev == VZTAPE_EV_DATA && t->seen == t->want) {
+        memcpy(t->buf + t->fill, s->chunk, s->chunk_len);
+        t->fill += s->chunk_len;
+    } else if (ev == VZTAPE_EV_END && t->seen == t->want) {
+        if (!s->ent.checksum_ok)
+            tape_bad_checksum(t->path, t->seen, &s->ent);
+        t->src->data = t->buf;
+        t->src->len = s->ent.len;
+        t->src->base = s->ent.start;
+        t->src->type = (uint8_t)s->ent.type;
+        memcpy(t->src->name, s->ent.name, sizeof(t->src->name));
+        t->found = 1;
+        return 1;
     }
+    return 0;
 }
 
-static int write_basic_text(const char *path, const uint8_t *data, size_t len, uint16_t start_addr)
+/* The VZ header vzpack writes: VZF0 for BASIC, VZFO otherwise. */
+static void vz_header(uint8_t *h, unsigned type, const unsigned char *name, unsigned start)
 {
-    FILE *out = fopen(path, "wb");
-    size_t pos = 0;
+    memset(h, 0, VZ_HEADER_SIZE);
+    memcpy(h, type == 0xF0u ? "VZF0" : "VZFO", 4);
+    memcpy(h + 4, name, VZTAPE_NAME_LEN);
+    h[21] = (uint8_t)type;
+    h[22] = (uint8_t)(start & 0xFFu);
+    h[23] = (uint8_t)(start >> 8);
+}
 
-    if (!out) return -1;
+/* --unpack PREFIX: every file as PREFIX01.vz, PREFIX02.vz, ... */
+typedef struct {
+    const char *path, *prefix;
+    unsigned long count;
+    char name[CAT_PATH_MAX];
+    TextOut t;
+} TapeUnpack;
 
-    /*
-     * BASIC lines are linked by absolute "next line" addresses.
-     * Follow link pointers when sane; otherwise fall back to linear scan
-     * so partially damaged payloads still produce useful text.
-     */
-    while (pos + 4 <= len) {
-        uint16_t next_addr = le16(data + pos);
-        uint16_t line_num = le16(data + pos + 2);
-        size_t p = pos + 4;
-
-        if (next_addr == 0u)
-            break;
-
-        fprintf(out, "%u ", (unsigned)line_num);
-        while (p < len && data[p] != 0u) {
-            emit_bas_byte(out, data[p]);
-            p++;
+static int tape_unpack_event(void *user, int ev, const VzTapeScan *s)
+{
+    TapeUnpack *u = (TapeUnpack *)user;
+    char msg[CAT_PATH_MAX + 32];
+
+    if (ev == VZTAPE_EV_HEAD) {
+        uint8_t h[VZ_HEADER_SIZE];
+        snprintf(u->name, sizeof(u->name), "%s%02lu.vz", u->prefix, ++u->count);
+        if (tout_open(&u->t, u->name) != 0) {
+            snprintf(msg, sizeof(msg), "cannot create '%s'", u->name);
+            die(msg);
+        }
+        vz_header(h, s->ent.type, s->ent.name, s->ent.start);
+        tout_write(&u->t, h, VZ_HEADER_SIZE);
+    } else if (ev == VZTAPE_EV_DATA) {
+        tout_write(&u->t, s->chunk, s->chunk_len);
+    } else {
+        if (tout_close(&u->t) != 0) {
+            snprintf(msg, sizeof(msg), "failed writing '%s'", u->name);
+            die(msg);
         }
-        fputc('\n', out);
+        if (!s->ent.checksum_ok)
+            tape_bad_checksum(u->path, u->count, &s->ent);
+        printf("%s  %-17s %-5s %04X  %u bytes\n", u->name, (const char *)s->ent.name,
+               type_label(s->ent.type), s->ent.start, s->ent.len);
+    }
+    return 0;
+}
 
-        if (p >= len)
-            break;
+/* --out-cvz: .vz files and the contents of tape images, one after another. */
+typedef struct {
+    TextOut *t;
+    const char *path;
+    unsigned long count;
+} CvzPack;
 
-        if (next_addr > start_addr) {
-            size_t next_pos = (size_t)(next_addr - start_addr);
-            if (next_pos > pos && next_pos <= len) {
-                pos = next_pos;
-                continue;
-            }
-        }
+static void cvz_head(TextOut *t, unsigned type, const unsigned char *name, unsigned start, unsigned len)
+{
+    unsigned char head[VZTAPE_CAS_LEADER + VZTAPE_SYNC_COUNT + VZTAPE_HEAD_MAX];
+    size_t n = VZTAPE_CAS_LEADER + VZTAPE_SYNC_COUNT;
 
-        pos = p + 1;
-    }
+    memset(head, VZTAPE_LEADER_BYTE, VZTAPE_CAS_LEADER);
+    memset(head + VZTAPE_CAS_LEADER, VZTAPE_SYNC_BYTE, VZTAPE_SYNC_COUNT);
+    n += vztape_head(head + n, type, name, start, (start + len) & 0xFFFFu);
+    tout_write(t, head, n);
+}
+
+static void cvz_checksum(TextOut *t, unsigned sum)
+{
+    uint8_t ck[2];
+    ck[0] = (uint8_t)(sum & 0xFFu);
+    ck[1] = (uint8_t)(sum >> 8);
+    tout_write(t, ck, 2);
+}
+
+/* Tape input is copied through unchanged apart from the leader, bad checksums included. */
+static int cvz_pack_event(void *user, int ev, const VzTapeScan *s)
+{
+    CvzPack *c = (CvzPack *)user;
 
-    fclose(out);
+    if (ev == VZTAPE_EV_HEAD) {
+        cvz_head(c->t, s->ent.type, s->ent.name, s->ent.start, s->ent.len);
+        c->count++;
+    } else if (ev == VZTAPE_EV_DATA) {
+        tout_write(c->t, s->chunk, s->chunk_len);
+    } else {
+        if (!s->ent.checksum_ok)
+            tape_bad_checksum(c->path, c->count, &s->ent);
+        cvz_checksum(c->t, s->ent.checksum);
+    }
     return 0;
 }
 
+static void cvz_pack(const char *out_path, const char **paths, int count)
+{
+    TextOut t;
+    CvzPack c;
+    unsigned long files = 0;
+    int i;
+
+    if (tout_open(&t, out_path) != 0)
+        die("cannot create .cvz output");
+    c.t = &t;
+    for (i = 0; i < count; i++) {
+        if (has_tape_extension(paths[i])) {
+            c.path = paths[i];
+            c.count = 0;
+            tape_walk(paths[i], cvz_pack_event, &c);
+            files += c.count;
+        } else {
+            const char *err;
+            size_t size;
+            uint8_t *buf = load_file(paths[i], &size, &err);
+            unsigned start;
+            unsigned char name[VZTAPE_NAME_LEN + 1];
+
+            if (!buf) die(err);
+            if (size < VZ_HEADER_SIZE || size - VZ_HEADER_SIZE > 0xFFFFu)
+                die("input is not a VZ file");
+            start = le16(buf + 22);
+            memcpy(name, buf + 4, VZTAPE_NAME_LEN);
+            name[VZTAPE_NAME_LEN] = 0;
+            size -= VZ_HEADER_SIZE;
+            cvz_head(&t, buf[21], name, start, (unsigned)size);
+            tout_write(&t, buf + VZ_HEADER_SIZE, size);
+            cvz_checksum(&t, vztape_checksum(start, (start + (unsigned)size) & 0xFFFFu,
+                                             vztape_sum(0, buf + VZ_HEADER_SIZE, size)));
+            free(buf);
+            files++;
+        }
+    }
+    if (tout_close(&t) != 0)
+        die("failed writing .cvz output");
+    printf("Packed      : %lu files into %s\n", files, out_path);
+}
+
 static void print_info(const VzHeader *hdr, size_t payload_len)
 {
     char name[18];
@@ -301,15 +1346,35 @@ static void usage(const char *prog)
     fprintf(stderr,
         "vzexport version %s\n"
         "Usage: %s input.vz [options]\n"
+        "       %s input.cvz [--entry N] [options] | --unpack PREFIX\n"
+        "       %s --out-cvz FILE input.vz|input.cvz...\n"
+        "       %s --verify-roundtrip input.vz...\n"
+        "       %s --index FILE [--catalog DIR] [query]\n"
         "\n"
         "Options:\n"
         "  --info, -i              Print VZ metadata\n"
         "  --out-bin,  -b FILE     Write raw payload bytes\n"
         "  --out-hex,  -x FILE     Write Intel HEX\n"
         "  --out-srec, -s FILE     Write Motorola S-record\n"
+        "  --rec-len,  -l N        Data bytes per HEX/SREC record (1..255, default 16)\n"
+        "  --out-cas,  -c FILE     Write a .cas tape image (the cassette byte stream)\n"
         "  --out-bas,  -B FILE     Detokenize BASIC to ASCII (BASIC only)\n"
+        "  --out-cvz  FILE         Pack every input into one .cvz container\n"
+        "  --entry     N           File of a .cvz/.cas input to export (default 1)\n"
+        "  --unpack    PREFIX      Write each file of a .cvz/.cas as PREFIX01.vz, ...\n"
+        "  --verify-roundtrip      Re-tokenize each BASIC input's listing and compare\n"
+        "  --jobs,     -j N        Write up to N outputs in parallel (default 1), or\n"
+        "                          scan with N workers (default: CPU count)\n"
+        "\n"
+        "Catalog:\n"
+        "  --catalog,  -C DIR      Index every .vz under DIR into --index FILE\n"
+        "  --index,    -I FILE     Catalog index to write or query\n"
+        "  --name PATTERN          Query: VZ name matches PATTERN (* and ?)\n"
+        "  --type T                Query: basic, mc or a type byte\n"
+        "  --addr LO[-HI]          Query: load range overlaps LO..HI\n"
+        "  --dups                  Query: files whose payload occurs more than once\n"
         "  --version, -V           Print version and exit\n",
-        TOOL_VERSION, prog);
+        TOOL_VERSION, prog, prog, prog, prog, prog);
 }
 
 int main(int argc, char **argv)
@@ -319,19 +1384,39 @@ int main(int argc, char **argv)
     const char *out_hex = NULL;
     const char *out_srec = NULL;
     const char *out_bas = NULL;
+    const char *out_cas = NULL;
+    const char *out_cvz = NULL;
+    const char *unpack_prefix = NULL;
+    unsigned long entry = 0;
     int want_info = 0;
-    FILE *in = NULL;
+    unsigned rec_len = 16;
+    int jobs = 0;
+    const char *catalog_dir = NULL;
+    const char *index_path = NULL;
+    CatQuery query;
+    int want_query = 0;
+    const char **inputs;
+    int ninputs = 0;
+    int want_verify = 0;
+    const char *err;
     uint8_t *buf = NULL;
     size_t fsize;
     VzHeader hdr;
-    const uint8_t *payload;
-    size_t payload_len;
+    ExportSrc src;
+    ExportSink sinks[EXPORT_MAX_SINKS];
+    ExportSink *list[EXPORT_MAX_SINKS];
+    int nsinks = 0;
     int i;
 
     if (argc < 2) {
         usage(argv[0]);
         return 1;
     }
+    memset(&query, 0, sizeof(query));
+    query.type = -1;
+    inputs = (const char **)malloc((size_t)argc * sizeof(*inputs));
+    if (!inputs)
+        die("out of memory");
 
     /*
      * Keep CLI parsing "compiler-like": options can appear before/after
@@ -350,75 +1435,236 @@ int main(int argc, char **argv)
             out_hex = argv[++i];
         } else if ((strcmp(argv[i], "--out-srec") == 0 || strcmp(argv[i], "-s") == 0) && i + 1 < argc) {
             out_srec = argv[++i];
+        } else if ((strcmp(argv[i], "--out-cas") == 0 || strcmp(argv[i], "-c") == 0) && i + 1 < argc) {
+            out_cas = argv[++i];
+        } else if (strcmp(argv[i], "--out-cvz") == 0 && i + 1 < argc) {
+            out_cvz = argv[++i];
+        } else if (strcmp(argv[i], "--unpack") == 0 && i + 1 < argc) {
+            unpack_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            entry = strtoul(argv[++i], &end, 0);
+            if (*end != '\0' || entry < 1u)
+                die("invalid --entry value (expected 1 or more)");
         } else if ((strcmp(argv[i], "--out-bas") == 0 || strcmp(argv[i], "-B") == 0) && i + 1 < argc) {
             out_bas = argv[++i];
+        } else if ((strcmp(argv[i], "--rec-len") == 0 || strcmp(argv[i], "-l") == 0) && i + 1 < argc) {
+            char *end = NULL;
+            unsigned long v = strtoul(argv[++i], &end, 0);
+            if (*end != '\0' || v < 1u || v > 255u)
+                die("invalid --rec-len value (expected 1..255)");
+            rec_len = (unsigned)v;
+        } else if ((strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            char *end = NULL;
+            unsigned long v = strtoul(argv[++i], &end, 0);
+            if (*end != '\0' || v < 1u || v > VZ_MAX_THREADS)
+                die("invalid --jobs value (expected 1..64)");
+            jobs = (int)v;
+        } else if ((strcmp(argv[i], "--catalog") == 0 || strcmp(argv[i], "-C") == 0) && i + 1 < argc) {
+            catalog_dir = argv[++i];
+        } else if ((strcmp(argv[i], "--index") == 0 || strcmp(argv[i], "-I") == 0) && i + 1 < argc) {
+            index_path = argv[++i];
+        } else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc) {
+            query.name = argv[++i];
+            want_query = 1;
+        } else if (strcmp(argv[i], "--type") == 0 && i + 1 < argc) {
+            const char *t = argv[++i];
+            char *end = NULL;
+            unsigned long v;
+            if (strcmp(t, "basic") == 0)
+                v = 0xF0u;
+            else if (strcmp(t, "mc") == 0)
+                v = 0xF1u;
+            else if ((v = strtoul(t, &end, 0)) > 0xFFu || *end != '\0')
+                die("invalid --type value (expected basic, mc or 0..255)");
+            query.type = (int)v;
+            want_query = 1;
+        } else if (strcmp(argv[i], "--addr") == 0 && i + 1 < argc) {
+            char *end = NULL;
+            query.lo = (uint32_t)strtoul(argv[++i], &end, 0);
+            query.hi = query.lo;
+            if (*end == '-')
+                query.hi = (uint32_t)strtoul(end + 1, &end, 0);
+            if (*end != '\0' || query.hi < query.lo)
+                die("invalid --addr value (expected LO or LO-HI)");
+            query.addr_set = 1;
+            want_query = 1;
+        } else if (strcmp(argv[i], "--verify-roundtrip") == 0) {
+            want_verify = 1;
+        } else if (strcmp(argv[i], "--dups") == 0) {
+            query.dups = 1;
+            want_query = 1;
         } else if (argv[i][0] == '-') {
             usage(argv[0]);
             return 1;
-        } else if (!in_path) {
-            in_path = argv[i];
         } else {
-            usage(argv[0]);
-            return 1;
+            inputs[ninputs++] = argv[i];
         }
     }
 
-    if (!in_path) {
+    /* Several inputs only make sense for a verify run. */
+    if (want_verify) {
+        if (ninputs == 0 || out_bin || out_hex || out_srec || out_bas || out_cas || out_cvz ||
+            catalog_dir || index_path)
+            die("--verify-roundtrip takes one or more input files and no other outputs");
+        i = verify_files(inputs, ninputs);
+        free(inputs);
+        return i;
+    }
+    /* Likewise packing a container. */
+    if (out_cvz) {
+        if (ninputs == 0 || out_bin || out_hex || out_srec || out_bas || out_cas || unpack_prefix ||
+            catalog_dir || index_path)
+            die("--out-cvz takes one or more input files and no other outputs");
+        cvz_pack(out_cvz, inputs, ninputs);
+        free(inputs);
+        return 0;
+    }
+    if (ninputs > 1) {
         usage(argv[0]);
         return 1;
     }
+    in_path = ninputs ? inputs[0] : NULL;
 
-    in = fopen(in_path, "rb");
-    if (!in)
-        die("cannot open input file");
-
-    if (fseek(in, 0, SEEK_END) != 0)
-        die("cannot seek input file");
-    {
-        long sz = ftell(in);
-        if (sz < 0)
-            die("cannot tell input file size");
-        fsize = (size_t)sz;
+    if (catalog_dir || index_path || want_query) {
+        Catalog cat;
+        if (!index_path)
+            die("--catalog and queries need --index FILE");
+        if (in_path)
+            die("catalog mode takes no input file");
+        memset(&cat, 0, sizeof(cat));
+        if (catalog_dir)
+            cat_build(&cat, catalog_dir, index_path, jobs ? jobs : vz_cpu_count());
+        else
+            cat_load(&cat, index_path);
+        if (want_query || !catalog_dir)
+            cat_query(&cat, &query);
+        cat_free(&cat);
+        free(inputs);
+        return 0;
     }
-    if (fseek(in, 0, SEEK_SET) != 0)
-        die("cannot seek input file");
 
-    if (fsize < VZ_HEADER_SIZE)
-        die("input is too short to be a VZ file");
+    if (!in_path) {
+        usage(argv[0]);
+        return 1;
+    }
 
-    buf = (uint8_t *)malloc(fsize);
-    if (!buf)
-        die("out of memory");
+    if (has_tape_extension(in_path)) {
+        int any_out = out_bin || out_hex || out_srec || out_bas || out_cas;
+        if (unpack_prefix) {
+            TapeUnpack u;
+            if (any_out || entry)
+                die("--unpack writes every file and takes no other outputs");
+            u.path = in_path;
+            u.prefix = unpack_prefix;
+            u.count = 0;
+            tape_walk(in_path, tape_unpack_event, &u);
+            free(inputs);
+            return 0;
+        }
+        if (want_info || !any_out) {
+            TapeList l;
+            l.count = 0;
+            tape_walk(in_path, tape_list_event, &l);
+            printf("Files       : %lu\n", l.count);
+        }
+        if (!any_out) {
+            free(inputs);
+            return 0;
+        }
+        {
+            TapePick t;
+            memset(&t, 0, sizeof(t));
+            t.want = entry ? entry : 1u;
+            t.path = in_path;
+            t.src = &src;
+            tape_walk(in_path, tape_pick_event, &t);
+            if (!t.found)
+                die("no such --entry in the input");
+            buf = t.buf;
+        }
+        hdr.file_type = src.type;
+        src.rec_max = rec_len;
+    } else {
+        if (unpack_prefix || entry)
+            die("--unpack and --entry need a .cvz or .cas input");
+        buf = load_file(in_path, &fsize, &err);
+        if (!buf)
+            die(err);
+        if (fsize < VZ_HEADER_SIZE)
+            die("input is too short to be a VZ file");
 
-    if (fread(buf, 1, fsize, in) != fsize)
-        die("failed to read input file");
-    fclose(in);
-    in = NULL;
+        memcpy(hdr.magic, buf, 4);
+        memcpy(hdr.filename, buf + 4, 17);
+        hdr.file_type = buf[21];
+        hdr.start_addr = le16(buf + 22);
 
-    memcpy(hdr.magic, buf, 4);
-    memcpy(hdr.filename, buf + 4, 17);
-    hdr.file_type = buf[21];
-    hdr.start_addr = le16(buf + 22);
+        src.data = buf + VZ_HEADER_SIZE;
+        src.len = fsize - VZ_HEADER_SIZE;
+        src.base = (uint32_t)hdr.start_addr;
+        src.rec_max = rec_len;
+        src.type = hdr.file_type;
+        memcpy(src.name, hdr.filename, VZTAPE_NAME_LEN);
+        src.name[VZTAPE_NAME_LEN] = 0;
 
-    payload = buf + VZ_HEADER_SIZE;
-    payload_len = fsize - VZ_HEADER_SIZE;
+        if (want_info || (!out_bin && !out_hex && !out_srec && !out_bas && !out_cas))
+            print_info(&hdr, src.len);
+    }
 
-    if (want_info || (!out_bin && !out_hex && !out_srec && !out_bas))
-        print_info(&hdr, payload_len);
+    /* Refuse before any output exists rather than after the others are written. */
+    if (out_bas && hdr.file_type != 0xF0u)
+        die("--out-bas requested but file is not BASIC (type 0xF0)");
 
-    if (out_bin && write_bin(out_bin, payload, payload_len) != 0)
-        die("failed writing binary output");
-    if (out_hex && write_ihex(out_hex, payload, payload_len, (uint32_t)hdr.start_addr) != 0)
-        die("failed writing Intel HEX output");
-    if (out_srec && write_srec(out_srec, payload, payload_len, (uint32_t)hdr.start_addr) != 0)
-        die("failed writing SREC output");
+    memset(sinks, 0, sizeof(sinks));
+    if (out_bin) {
+        ExportSink *s = &sinks[nsinks++];
+        s->path = out_bin;
+        s->fail = "failed writing binary output";
+        s->begin = bin_begin;
+        s->data = bin_data;
+        s->end = text_end;
+    }
+    if (out_hex) {
+        ExportSink *s = &sinks[nsinks++];
+        s->path = out_hex;
+        s->fail = "failed writing Intel HEX output";
+        s->begin = ihex_begin;
+        s->data = record_data;
+        s->end = ihex_end;
+    }
+    if (out_srec) {
+        ExportSink *s = &sinks[nsinks++];
+        s->path = out_srec;
+        s->fail = "failed writing SREC output";
+        s->begin = srec_begin;
+        s->data = record_data;
+        s->end = srec_end;
+    }
+    if (out_cas) {
+        ExportSink *s = &sinks[nsinks++];
+        s->path = out_cas;
+        s->fail = "failed writing CAS output";
+        s->begin = cas_begin;
+        s->data = cas_data;
+        s->end = cas_end;
+    }
     if (out_bas) {
-        if (hdr.file_type != 0xF0u)
-            die("--out-bas requested but file is not BASIC (type 0xF0)");
-        if (write_basic_text(out_bas, payload, payload_len, hdr.start_addr) != 0)
-            die("failed writing BASIC text output");
+        ExportSink *s = &sinks[nsinks++];
+        s->path = out_bas;
+        s->fail = "failed writing BASIC text output";
+        s->end = bas_end;
     }
+    for (i = 0; i < nsinks; i++)
+        list[i] = &sinks[i];
+
+    hex_pair_init();
+    bastok_detok_init(&bas_detok, bastok_vz_words);
+    export_run(list, nsinks, &src, jobs ? jobs : 1);
+    for (i = 0; i < nsinks; i++)
+        if (sinks[i].failed)
+            die(sinks[i].fail);
 
     free(buf);
+    free(inputs);
     return 0;
 }
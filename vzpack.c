@@ -4,20 +4,27 @@
  * Design goal is determinism: once input is accepted, output layout is fixed
  * and uses a normalized VZ name and explicit start/type metadata.
  */
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
 #include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <limits.h>
 
-#ifndef TOOL_VERSION
-#define TOOL_VERSION "dev"
+#if defined(_WIN32)
+#include <direct.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/stat.h>
 #endif
 
-#if defined(_WIN32) && !defined(strncasecmp)
-#define strncasecmp _strnicmp
+#include "basictok.h"
+#include "vzthread.h"
+
+#ifndef TOOL_VERSION
+#define TOOL_VERSION "dev"
 #endif
 
 #define VZ_HEADER_SIZE 24
@@ -50,14 +57,22 @@ typedef struct {
  * Sparse-address staging map for HEX/SREC import.
  * We only accept a final contiguous byte range, because .vz stores one
  * flat payload with a single start address.
+ *
+ * Kept as a sorted list of disjoint, non-adjacent extents: records are
+ * merged into their neighbours as they arrive, so a well-formed file ends
+ * up as one extent and finalize is a single memcpy.
  */
 typedef struct {
-    uint8_t *bytes;
-    uint8_t *used;
-    size_t size;
-    uint32_t min_addr;
-    uint32_t max_addr;
-    int seen_any;
+    uint32_t start;
+    uint32_t len;
+    uint32_t cap;
+    uint8_t *data;
+} AddrExtent;
+
+typedef struct {
+    AddrExtent *ext;
+    size_t count;
+    size_t cap;
 } AddrMap;
 
 #if SIZE_MAX >= 65536u
@@ -66,34 +81,16 @@ typedef struct {
 #define ADDRMAP_CAPACITY 65535u
 #endif
 
-typedef struct tagLINE {
-    unsigned short next;
-    unsigned short num;
-    unsigned char text[254];
-} BasicLine;
-
-static BasicLine g_line = {0, 0, {0}};
-static unsigned short g_lineaddr = 0;
-static unsigned short g_linenum = 1;
-
-static char *vz_token[128 + 1] = {
-    "END","FOR","RESET","SET","CLS",""/* CMD */,"RANDOM","NEXT",
-    "DATA","INPUT","DIM","READ","LET","GOTO","RUN","IF",
-    "RESTORE","GOSUB","RETURN","REM","STOP","ELSE","COPY","COLOR",
-    "VERIFY","DEFINT","DEFSNG","DEFDBL","CRUN","MODE","SOUND","RESUME",
-    "OUT","ON","OPEN","FIELD","GET","PUT","CLOSE","LOAD",
-    "MERGE","NAME","KILL","LSET","RSET","SAVE","SYSTEM","LPRINT",
-    "DEF","POKE","PRINT","CONT","LIST","LLIST","DELETE","AUTO",
-    "CLEAR","CLOAD","CSAVE","NEW","TAB(","TO","FN","USING",
-    "VARPTR","USR","ERL","ERR","STRING$","INSTR","POINT","TIME$",
-    "MEM","INKEY$","THEN","NOT","STEP","+","-","*",
-    "/","^","AND","OR",">","=","<","SGN",
-    "INT","ABS","FRE","INP","POS","SQR","RND","LOG",
-    "EXP","COS","SIN","TAN","ATN","PEEK","CVI","CVS",
-    "CVD","EOF","LOC","LOF","MKI$","MKS$","MKD$","CINT",
-    "CSNG","CDBL","FIX","LEN","STR$","VAL","ASC","CHR$",
-    "LEFT$","RIGHT$","MID$","'","","","","",NULL
-};
+/*
+ * Growable buffer the tokenized program is assembled in.  It becomes the
+ * payload as-is; a failed grow sets failed and drops further output.
+ */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} Arena;
 
 static void die(const char *msg)
 {
@@ -106,6 +103,7 @@ static void usage(const char *prog)
     fprintf(stderr,
         "vzpack version %s\n"
         "Usage: %s [input] -o output.vz [options]\n"
+        "       %s --manifest FILE [--jobs N] [--force] [--cache-dir DIR]\n"
         "\n"
         "Input (exactly one):\n"
         "  --in-bin,  -b FILE      Raw binary payload\n"
@@ -119,9 +117,23 @@ static void usage(const char *prog)
         "  --type,  -t TYPE        basic | mc | auto (default auto)\n"
         "  --start, -s ADDR        Start address (required for --in-bin)\n"
         "  --fill,  -f BYTE        Fill holes for HEX/SREC sparse ranges (0..255)\n"
+        "  --segments, -g          Keep HEX/SREC holes out of the file; a loader scatters\n"
+        "                          the segments (--start = entry point)\n"
+        "  --compress, -z          LZ-compress machine code behind a Z80 unpacker\n"
+        "\n"
+        "Batch:\n"
+        "  --manifest, -m FILE     Pack every entry listed in FILE (replaces input/-o)\n"
+        "  --jobs,     -j N        Worker threads for --manifest (default: CPU count)\n"
+        "  --force                 Repack entries even if their inputs are unchanged\n"
+        "\n"
+        "Cache:\n"
+        "  --cache-dir DIR         Reuse earlier results for identical input and options\n"
+        "  --cache-max N           Keep at most N cache entries (default 1024)\n"
+        "  --cache-stats           Report cache use (alone with --cache-dir: just report)\n"
+        "\n"
         "  --help,  -h             Show this help\n"
         "  --version, -V           Print version and exit\n",
-        TOOL_VERSION, prog);
+        TOOL_VERSION, prog, prog);
 }
 
 static int parse_u32(const char *s, uint32_t *out)
@@ -200,161 +212,549 @@ static int read_entire_file(const char *path, uint8_t **out_data, size_t *out_si
     return 0;
 }
 
-static int addrmap_init(AddrMap *m)
+static void addrmap_init(AddrMap *m)
 {
-    m->size = ADDRMAP_CAPACITY;
-    m->bytes = (uint8_t *)calloc(m->size, 1);
-    m->used = (uint8_t *)calloc(m->size, 1);
-    m->min_addr = 0xFFFFFFFFu;
-    m->max_addr = 0u;
-    m->seen_any = 0;
-    if (!m->bytes || !m->used) {
-        free(m->bytes);
-        free(m->used);
-        m->bytes = NULL;
-        m->used = NULL;
-        return -1;
-    }
-    return 0;
+    m->ext = NULL;
+    m->count = 0;
+    m->cap = 0;
 }
 
 static void addrmap_free(AddrMap *m)
 {
-    free(m->bytes);
-    free(m->used);
-    m->bytes = NULL;
-    m->used = NULL;
+    size_t i;
+    for (i = 0; i < m->count; i++)
+        free(m->ext[i].data);
+    free(m->ext);
+    m->ext = NULL;
+    m->count = 0;
+    m->cap = 0;
 }
 
-static int addrmap_set(AddrMap *m, uint32_t addr, uint8_t val)
+static int extent_reserve(AddrExtent *e, uint32_t len)
 {
-    if (addr >= m->size) return -1;
-    if (m->used[addr] && m->bytes[addr] != val) return -2;
-    m->bytes[addr] = val;
-    m->used[addr] = 1;
-    if (!m->seen_any) {
-        m->min_addr = addr;
-        m->max_addr = addr;
-        m->seen_any = 1;
-    } else {
-        if (addr < m->min_addr) m->min_addr = addr;
-        if (addr > m->max_addr) m->max_addr = addr;
+    uint8_t *nd;
+    uint32_t ncap;
+    if (len <= e->cap) return 0;
+    ncap = e->cap ? e->cap : 256u;
+    while (ncap < len) ncap *= 2u;
+    if (ncap > ADDRMAP_CAPACITY) ncap = ADDRMAP_CAPACITY;
+    nd = (uint8_t *)realloc(e->data, (size_t)ncap);
+    if (!nd) return -1;
+    e->data = nd;
+    e->cap = ncap;
+    return 0;
+}
+
+/*
+ * Store one record's bytes at addr.  Re-sending identical bytes is fine;
+ * a different value for an address already set is a conflict (-2).  The
+ * new range absorbs every extent it overlaps or touches, so in-order
+ * records just extend the last extent.  Returns -1 for out-of-range
+ * addresses and -3 on allocation failure.
+ */
+static int addrmap_put(AddrMap *m, uint32_t addr, const uint8_t *src, uint32_t n)
+{
+    uint32_t end = addr + n;
+    size_t lo, hi, idx, j;
+    AddrExtent *e;
+    uint32_t new_start, new_end;
+
+    if (n == 0) return 0;
+    if (addr >= ADDRMAP_CAPACITY || n > ADDRMAP_CAPACITY - addr) return -1;
+
+    /* idx = first extent starting after addr. */
+    lo = 0;
+    hi = m->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2u;
+        if (m->ext[mid].start <= addr) lo = mid + 1u;
+        else hi = mid;
+    }
+    idx = lo;
+
+    lo = (idx > 0 && m->ext[idx - 1].start + m->ext[idx - 1].len >= addr) ? idx - 1 : idx;
+    hi = idx;
+    while (hi < m->count && m->ext[hi].start <= end) hi++;
+
+    /* Conflict check against every overlapped extent before changing anything. */
+    for (j = lo; j < hi; j++) {
+        const AddrExtent *x = &m->ext[j];
+        uint32_t a = (x->start > addr) ? x->start : addr;
+        uint32_t b = (x->start + x->len < end) ? x->start + x->len : end;
+        for (; a < b; a++)
+            if (x->data[a - x->start] != src[a - addr]) return -2;
     }
+
+    if (lo == hi) {
+        AddrExtent ne;
+        if (m->count == m->cap) {
+            size_t ncap = m->cap ? m->cap * 2u : 16u;
+            AddrExtent *nx = (AddrExtent *)realloc(m->ext, ncap * sizeof(*nx));
+            if (!nx) return -3;
+            m->ext = nx;
+            m->cap = ncap;
+        }
+        ne.start = addr;
+        ne.len = 0;
+        ne.cap = 0;
+        ne.data = NULL;
+        if (extent_reserve(&ne, n) != 0) return -3;
+        memcpy(ne.data, src, n);
+        ne.len = n;
+        memmove(m->ext + idx + 1, m->ext + idx, (m->count - idx) * sizeof(*m->ext));
+        m->ext[idx] = ne;
+        m->count++;
+        return 0;
+    }
+
+    e = &m->ext[lo];
+    new_start = (addr < e->start) ? addr : e->start;
+    new_end = m->ext[hi - 1].start + m->ext[hi - 1].len;
+    if (end > new_end) new_end = end;
+
+    if (extent_reserve(e, new_end - new_start) != 0) return -3;
+    if (new_start < e->start)
+        memmove(e->data + (e->start - new_start), e->data, e->len);
+    e->start = new_start;
+    for (j = lo + 1; j < hi; j++) {
+        memcpy(e->data + (m->ext[j].start - new_start), m->ext[j].data, m->ext[j].len);
+        free(m->ext[j].data);
+    }
+    memcpy(e->data + (addr - new_start), src, n);
+    e->len = new_end - new_start;
+    memmove(m->ext + lo + 1, m->ext + hi, (m->count - hi) * sizeof(*m->ext));
+    m->count -= hi - lo - 1u;
     return 0;
 }
 
+/*
+ * Require a single linear image by address range.  Out-of-order source
+ * records are fine (they were coalesced on arrival); more than one
+ * extent means holes, which require --fill/-f.
+ */
 static int addrmap_finalize(const AddrMap *m, Payload *p, int allow_fill, uint8_t fill_byte)
 {
-    uint32_t addr;
-    size_t len;
-    if (!m->seen_any) return -1;
-    len = (size_t)(m->max_addr - m->min_addr + 1u);
+    uint32_t min_addr, max_end;
+    size_t len, i;
+    if (m->count == 0) return -1;
+    if (m->count > 1 && !allow_fill) return -2;
+    min_addr = m->ext[0].start;
+    max_end = m->ext[m->count - 1].start + m->ext[m->count - 1].len;
+    len = (size_t)(max_end - min_addr);
     p->data = (uint8_t *)malloc(len);
     if (!p->data) return -3;
-    if (allow_fill)
-        memset(p->data, fill_byte, len);
+    for (i = 0; i < m->count; i++) {
+        const AddrExtent *x = &m->ext[i];
+        size_t off = (size_t)(x->start - min_addr);
+        if (i + 1 < m->count) {
+            size_t gap_end = (size_t)(m->ext[i + 1].start - min_addr);
+            memset(p->data + off + x->len, fill_byte, gap_end - off - x->len);
+        }
+        memcpy(p->data + off, x->data, x->len);
+    }
+    p->size = len;
+    p->start = (uint16_t)min_addr;
+    p->start_set = 1;
+    return 0;
+}
+/* Copy [addr, addr + n) out of the map, with fill_byte where nothing was loaded. */
+static void addrmap_read(const AddrMap *m, uint32_t addr, uint32_t n, uint8_t *out, uint8_t fill_byte)
+{
+    size_t i;
+    memset(out, fill_byte, n);
+    for (i = 0; i < m->count; i++) {
+        const AddrExtent *x = &m->ext[i];
+        uint32_t a = (x->start > addr) ? x->start : addr;
+        uint32_t b = (x->start + x->len < addr + n) ? x->start + x->len : addr + n;
+        if (a < b)
+            memcpy(out + (a - addr), x->data + (a - x->start), b - a);
+    }
+}
 
-    /*
-     * Require a single linear image by address range. Out-of-order source
-     * records are fine; holes require --fill/-f.
-     */
-    for (addr = m->min_addr; addr <= m->max_addr; addr++) {
-        size_t off = (size_t)(addr - m->min_addr);
-        if (m->used[addr]) {
-            p->data[off] = m->bytes[addr];
+/*
+ * Multi-segment image (--segments).
+ *
+ * Loaded at A0, the lowest segment address:
+ *   segment 0 (first 3 bytes replaced by JP loader) | loader | saved 3
+ *   bytes | table | data of segments 1..n-1
+ * The loader puts the saved bytes back, copies segments n-1..1 to their
+ * addresses with LDDR (highest first, walking the data backwards), and
+ * jumps to the entry point.  Table entries are (last dest address, length),
+ * highest segment first, ended by a zero address.
+ *
+ * Copying top-down is safe as long as every segment's destination is at
+ * or above its copy in the image, which holds when the gap after segment
+ * 0 is at least the loader and table size.  Smaller gaps are filled and
+ * the segments merged; so are gaps no larger than a table entry.
+ */
+#define SEG_LOADER_SIZE 38
+#define SEG_ENTRY_SIZE 4
+#define SEG_SMALL_GAP 4u
+
+static const uint8_t seg_loader[SEG_LOADER_SIZE] = {
+    0x21, 0x00, 0x00,       /*        ld   hl,saved             */
+    0x11, 0x00, 0x00,       /*        ld   de,A0                */
+    0x01, 0x03, 0x00,       /*        ld   bc,3                 */
+    0xED, 0xB0,             /*        ldir                      */
+    0x5E,                   /* loop:  ld   e,(hl)               */
+    0x23,                   /*        inc  hl                   */
+    0x56,                   /*        ld   d,(hl)               */
+    0x23,                   /*        inc  hl                   */
+    0x7A,                   /*        ld   a,d                  */
+    0xB3,                   /*        or   e                    */
+    0xCA, 0x00, 0x00,       /*        jp   z,entry              */
+    0x4E,                   /*        ld   c,(hl)               */
+    0x23,                   /*        inc  hl                   */
+    0x46,                   /*        ld   b,(hl)               */
+    0x23,                   /*        inc  hl                   */
+    0xE5,                   /*        push hl                   */
+    0x2A, 0x00, 0x00,       /*        ld   hl,(src)             */
+    0xED, 0xB8,             /*        lddr                      */
+    0x22, 0x00, 0x00,       /*        ld   (src),hl             */
+    0xE1,                   /*        pop  hl                   */
+    0x18, 0xE7,             /*        jr   loop                 */
+    0x00, 0x00              /* src:   dw   last data byte       */
+};
+#define SEG_LOADER_SAVED 1
+#define SEG_LOADER_A0 4
+#define SEG_LOADER_ENTRY 18
+#define SEG_LOADER_SRC_LD 26
+#define SEG_LOADER_SRC_ST 31
+#define SEG_LOADER_SRC 36
+
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+} Segment;
+
+static void put_le16(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v & 0xFFu);
+    p[1] = (uint8_t)((v >> 8) & 0xFFu);
+}
+
+static uint32_t seg_header_size(size_t n)
+{
+    return SEG_LOADER_SIZE + 3u + SEG_ENTRY_SIZE * (uint32_t)(n - 1u) + 2u;
+}
+
+/*
+ * Build the segmented payload.  entry < 0 means "start of the lowest
+ * segment".  A single segment entered at its own start is emitted flat.
+ * Returns 0, -1 (no data), -3 (out of memory) or -4 (does not fit).
+ */
+static int addrmap_scatter(const AddrMap *m, Payload *p, uint8_t fill_byte, long entry, size_t *nseg_out)
+{
+    Segment *seg;
+    size_t n = 0, i, k;
+    uint32_t a0, hdr, total, pos, src_end;
+    uint8_t *img, *t;
+
+    if (m->count == 0) return -1;
+    seg = (Segment *)malloc(m->count * sizeof(*seg));
+    if (!seg) return -3;
+
+    for (i = 0; i < m->count; i++) {
+        const AddrExtent *x = &m->ext[i];
+        if (n > 0 && x->start - (seg[n - 1].start + seg[n - 1].len) <= SEG_SMALL_GAP) {
+            seg[n - 1].len = x->start + x->len - seg[n - 1].start;
         } else {
-            if (!allow_fill) {
-                free(p->data);
-                p->data = NULL;
-                return -2;
-            }
+            seg[n].start = x->start;
+            seg[n].len = x->len;
+            n++;
         }
     }
-    p->size = len;
-    p->start = (uint16_t)m->min_addr;
+    while (n > 1 && (seg[0].len < 3u ||
+                     seg[1].start - (seg[0].start + seg[0].len) < seg_header_size(n))) {
+        seg[0].len = seg[1].start + seg[1].len - seg[0].start;
+        memmove(seg + 1, seg + 2, (n - 2u) * sizeof(*seg));
+        n--;
+    }
+
+    a0 = seg[0].start;
+    if (entry < 0) entry = (long)a0;
+    if (n == 1 && (uint32_t)entry == a0) {
+        img = (uint8_t *)malloc(seg[0].len);
+        if (!img) { free(seg); return -3; }
+        addrmap_read(m, a0, seg[0].len, img, fill_byte);
+        p->data = img;
+        p->size = seg[0].len;
+        p->start = (uint16_t)a0;
+        p->start_set = 1;
+        *nseg_out = 1;
+        free(seg);
+        return 0;
+    }
+    if (seg[0].len < 3u) { free(seg); return -4; }
+
+    hdr = seg_header_size(n);
+    total = seg[0].len + hdr;
+    for (k = 1; k < n; k++) total += seg[k].len;
+    if (a0 + total > 0x10000u) { free(seg); return -4; }
+
+    img = (uint8_t *)malloc(total);
+    if (!img) { free(seg); return -3; }
+
+    /* Segment 0 in place, then loader, saved bytes, table, other segments. */
+    addrmap_read(m, a0, seg[0].len, img, fill_byte);
+    pos = seg[0].len;
+    memcpy(img + pos, seg_loader, SEG_LOADER_SIZE);
+    src_end = a0 + total - 1u;
+    put_le16(img + pos + SEG_LOADER_SAVED, a0 + pos + SEG_LOADER_SIZE);
+    put_le16(img + pos + SEG_LOADER_A0, a0);
+    put_le16(img + pos + SEG_LOADER_ENTRY, (uint32_t)entry);
+    put_le16(img + pos + SEG_LOADER_SRC_LD, a0 + pos + SEG_LOADER_SRC);
+    put_le16(img + pos + SEG_LOADER_SRC_ST, a0 + pos + SEG_LOADER_SRC);
+    put_le16(img + pos + SEG_LOADER_SRC, src_end);
+
+    t = img + pos + SEG_LOADER_SIZE;
+    memcpy(t, img, 3);
+    t += 3;
+    for (k = n - 1u; k >= 1u; k--) {
+        put_le16(t, seg[k].start + seg[k].len - 1u);
+        put_le16(t + 2, seg[k].len);
+        t += SEG_ENTRY_SIZE;
+    }
+    put_le16(t, 0);
+
+    pos += hdr;
+    for (k = 1; k < n; k++) {
+        addrmap_read(m, seg[k].start, seg[k].len, img + pos, fill_byte);
+        pos += seg[k].len;
+    }
+
+    img[0] = 0xC3;
+    put_le16(img + 1, a0 + seg[0].len);
+
+    p->data = img;
+    p->size = total;
+    p->start = (uint16_t)a0;
     p->start_set = 1;
+    *nseg_out = n;
+    free(seg);
     return 0;
 }
 
-static int parse_hex_nibble(char c)
+
+/*
+ * Hex digit values; 0xFF marks a non-hex character.  Two digits are
+ * combined and checked with one OR, so the per-byte decode has no
+ * character-class branches.
+ */
+static const uint8_t hex_lut[256] = {
+#define X 0xFF
+    X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+    X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, 0,1,2,3,4,5,6,7,8,9,X,X,X,X,X,X,
+    X,10,11,12,13,14,15,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+    X,10,11,12,13,14,15,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+    X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+    X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+    X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,
+    X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X, X,X,X,X,X,X,X,X,X,X,X,X,X,X,X,X
+#undef X
+};
+
+/* Where and why a HEX/SREC import was rejected; line 0 = whole file. */
+typedef struct {
+    unsigned long line;
+    unsigned long col;
+    const char *msg;
+} LoadError;
+
+static int load_fail(LoadError *err, unsigned long line, size_t col, const char *msg, int rc)
 {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'a' && c <= 'f') return 10 + (c - 'a');
-    if (c >= 'A' && c <= 'F') return 10 + (c - 'A');
-    return -1;
+    err->line = line;
+    err->col = (unsigned long)col;
+    err->msg = msg;
+    return rc;
+}
+
+static void format_load_error(char *buf, size_t size, const char *what, const char *path, const LoadError *err)
+{
+    if (err->line == 0)
+        snprintf(buf, size, "%s: %s: %s", what, path, err->msg);
+    else
+        snprintf(buf, size, "%s: %s:%lu:%lu: %s", what, path, err->line, err->col, err->msg);
+}
+
+/*
+ * Decode n hex pairs from s into out and return their 8-bit sum, or -1
+ * with *bad set to the offset of the first non-hex character.
+ */
+static int hex_decode_sum(const uint8_t *s, size_t n, uint8_t *out, size_t *bad)
+{
+    unsigned sum = 0;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        uint8_t hi = hex_lut[s[2 * i]];
+        uint8_t lo = hex_lut[s[2 * i + 1]];
+        if ((hi | lo) & 0xF0u) {
+            *bad = 2 * i + ((hi & 0xF0u) ? 0 : 1);
+            return -1;
+        }
+        out[i] = (uint8_t)((hi << 4) | lo);
+        sum += out[i];
+    }
+    return (int)(sum & 0xFFu);
+}
+
+/*
+ * Block reader for line-oriented record files.  Lines are returned as
+ * pointers into the buffer, so a record is touched once, by the decoder.
+ * A valid HEX or SREC line is at most 521 characters; anything that does
+ * not fit in the buffer is reported as too long instead of being split.
+ * CR, LF and CRLF all end a line.
+ */
+#define REC_BUF_SIZE 4096
+
+typedef struct {
+    FILE *f;
+    size_t pos;
+    size_t len;
+    int eof;
+    int skip_lf;
+    unsigned long line;
+    uint8_t buf[REC_BUF_SIZE];
+} RecReader;
+
+/* 1 = next non-empty line in s and n, 0 = end of file, -1 = line too long, -2 = read error. */
+static int rec_next_line(RecReader *r, const uint8_t **s, size_t *n)
+{
+    for (;;) {
+        size_t i = r->pos;
+        if (r->skip_lf && i < r->len) {
+            if (r->buf[i] == '\n') r->pos = ++i;
+            r->skip_lf = 0;
+        }
+        while (i < r->len && r->buf[i] != '\n' && r->buf[i] != '\r') i++;
+        if (i < r->len || (r->eof && i > r->pos)) {
+            const uint8_t *start = r->buf + r->pos;
+            size_t len = i - r->pos;
+            r->line++;
+            if (i < r->len) {
+                r->skip_lf = (r->buf[i] == '\r');
+                i++;
+            }
+            r->pos = i;
+            if (len == 0) continue;
+            *s = start;
+            *n = len;
+            return 1;
+        }
+        if (r->eof) return 0;
+        if (r->pos == 0 && r->len == REC_BUF_SIZE) {
+            r->line++;
+            return -1;
+        }
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+        r->len += fread(r->buf + r->len, 1, REC_BUF_SIZE - r->len, r->f);
+        if (r->len < REC_BUF_SIZE) {
+            if (ferror(r->f)) return -2;
+            r->eof = 1;
+        }
+    }
+}
+
+static RecReader *rec_open(const char *path)
+{
+    RecReader *r = (RecReader *)malloc(sizeof(*r));
+    if (!r) return NULL;
+    r->f = fopen(path, "rb");
+    if (!r->f) { free(r); return NULL; }
+    r->pos = 0;
+    r->len = 0;
+    r->eof = 0;
+    r->skip_lf = 0;
+    r->line = 0;
+    return r;
+}
+
+static void rec_close(RecReader *r)
+{
+    fclose(r->f);
+    free(r);
+}
+
+static int rec_line_error(RecReader *r, int rc, LoadError *err)
+{
+    if (rc == -1) return load_fail(err, r->line, 1, "line too long for a HEX/SREC record", -2);
+    return load_fail(err, 0, 0, "read error", -1);
+}
+
+static const char *addrmap_put_msg(int rc)
+{
+    if (rc == -1) return "address outside the 64 KB VZ address space";
+    if (rc == -2) return "data conflicts with an earlier record";
+    return "out of memory";
 }
 
-static int parse_hex_byte(const char *s, uint8_t *out)
+static int finalize_or_fail(AddrMap *m, Payload *p, int allow_fill, uint8_t fill_byte, LoadError *err)
 {
-    int hi = parse_hex_nibble(s[0]);
-    int lo = parse_hex_nibble(s[1]);
-    if (hi < 0 || lo < 0) return -1;
-    *out = (uint8_t)((hi << 4) | lo);
+    int rc = addrmap_finalize(m, p, allow_fill, fill_byte);
+    if (rc == -1) return load_fail(err, 0, 0, "no data records", -5);
+    if (rc == -2) return load_fail(err, 0, 0, "records are not contiguous (use --fill)", -5);
+    if (rc != 0) return load_fail(err, 0, 0, "out of memory", -5);
     return 0;
 }
 
-static int load_from_ihex(const char *path, Payload *p, int allow_fill, uint8_t fill_byte)
+static int scatter_or_fail(AddrMap *m, Payload *p, uint8_t fill_byte, long entry, size_t *nseg, LoadError *err)
 {
-    FILE *f = fopen(path, "rb");
-    char line[1024];
-    AddrMap map;
+    int rc = addrmap_scatter(m, p, fill_byte, entry, nseg);
+    if (rc == -1) return load_fail(err, 0, 0, "no data records", -5);
+    if (rc == -4) return load_fail(err, 0, 0, "segment loader does not fit below 0x10000", -5);
+    if (rc != 0) return load_fail(err, 0, 0, "out of memory", -5);
+    return 0;
+}
+
+static int load_from_ihex(const char *path, AddrMap *map, LoadError *err)
+{
+    RecReader *r = rec_open(path);
     uint32_t upper = 0;
     int eof_seen = 0;
-    if (!f) return -1;
-    if (addrmap_init(&map) != 0) { fclose(f); return -1; }
+    const uint8_t *s;
+    size_t len;
+    int rc = 0, lrc;
+    if (!r) return load_fail(err, 0, 0, "cannot open input", -1);
 
     /*
      * Accept data, EOF, and common addressing records (02/04).
      * Unknown record types are ignored rather than treated as fatal.
+     *
+     * raw[] = reclen, addr hi, addr lo, type, data..., checksum; the sum
+     * of all of them is zero for a good record, so one decode pass both
+     * verifies the checksum and yields the payload bytes.
      */
-    while (fgets(line, sizeof(line), f)) {
-        size_t len = strcspn(line, "\r\n");
-        uint8_t reclen, rectype, cksum, calc;
-        uint8_t b;
+    while ((lrc = rec_next_line(r, &s, &len)) == 1) {
+        uint8_t raw[260];
+        uint8_t reclen, rectype;
         uint16_t addr16;
-        uint32_t addr;
-        size_t i;
-        if (len == 0) continue;
-        if (line[0] != ':') { addrmap_free(&map); fclose(f); return -2; }
-        if (len < 11) { addrmap_free(&map); fclose(f); return -2; }
-
-        if (parse_hex_byte(line + 1, &reclen) != 0 ||
-            parse_hex_byte(line + 3, &b) != 0) { addrmap_free(&map); fclose(f); return -2; }
-        addr16 = (uint16_t)b << 8;
-        if (parse_hex_byte(line + 5, &b) != 0) { addrmap_free(&map); fclose(f); return -2; }
-        addr16 = (uint16_t)(addr16 | b);
-        if (parse_hex_byte(line + 7, &rectype) != 0) { addrmap_free(&map); fclose(f); return -2; }
-
-        if (len != (size_t)(11 + reclen * 2)) { addrmap_free(&map); fclose(f); return -2; }
-        if (parse_hex_byte(line + 9 + reclen * 2, &cksum) != 0) { addrmap_free(&map); fclose(f); return -2; }
-
-        calc = (uint8_t)(reclen + (uint8_t)(addr16 >> 8) + (uint8_t)(addr16 & 0xFF) + rectype);
-        for (i = 0; i < reclen; i++) {
-            if (parse_hex_byte(line + 9 + i * 2, &b) != 0) { addrmap_free(&map); fclose(f); return -2; }
-            calc = (uint8_t)(calc + b);
+        size_t bad;
+        int sum;
+        if (s[0] != ':') { rc = load_fail(err, r->line, 1, "expected ':' record mark", -2); break; }
+        if (len < 11) { rc = load_fail(err, r->line, len + 1, "record too short", -2); break; }
+        if (hex_decode_sum(s + 1, 1, &reclen, &bad) < 0) { rc = load_fail(err, r->line, 2 + bad, "invalid hex digit", -2); break; }
+        if (len != (size_t)(11 + reclen * 2)) {
+            rc = load_fail(err, r->line, (len < (size_t)(11 + reclen * 2)) ? len + 1 : (size_t)(12 + reclen * 2),
+                           "record length does not match byte count", -2);
+            break;
         }
-        calc = (uint8_t)(0u - calc);
-        if (calc != cksum) { addrmap_free(&map); fclose(f); return -3; }
+        sum = hex_decode_sum(s + 1, (size_t)reclen + 5u, raw, &bad);
+        if (sum < 0) { rc = load_fail(err, r->line, 2 + bad, "invalid hex digit", -2); break; }
+        if (sum != 0) { rc = load_fail(err, r->line, len - 1, "checksum mismatch", -3); break; }
 
+        addr16 = (uint16_t)(((uint16_t)raw[1] << 8) | raw[2]);
+        rectype = raw[3];
         if (rectype == 0x00u) {
-            for (i = 0; i < reclen; i++) {
-                if (parse_hex_byte(line + 9 + i * 2, &b) != 0) { addrmap_free(&map); fclose(f); return -2; }
-                addr = upper + (uint32_t)addr16 + (uint32_t)i;
-                if (addrmap_set(&map, addr, b) != 0) { addrmap_free(&map); fclose(f); return -4; }
-            }
+            int prc = addrmap_put(map, upper + (uint32_t)addr16, raw + 4, reclen);
+            if (prc != 0) { rc = load_fail(err, r->line, 4, addrmap_put_msg(prc), -4); break; }
         } else if (rectype == 0x01u) {
             eof_seen = 1;
             break;
-        } else if (rectype == 0x02u) {
-            uint8_t hi, lo;
-            if (reclen != 2) { addrmap_free(&map); fclose(f); return -2; }
-            if (parse_hex_byte(line + 9, &hi) != 0 || parse_hex_byte(line + 11, &lo) != 0) { addrmap_free(&map); fclose(f); return -2; }
-            upper = (uint32_t)(((uint32_t)hi << 8) | lo) << 4;
-        } else if (rectype == 0x04u) {
-            uint8_t hi, lo;
-            if (reclen != 2) { addrmap_free(&map); fclose(f); return -2; }
-            if (parse_hex_byte(line + 9, &hi) != 0 || parse_hex_byte(line + 11, &lo) != 0) { addrmap_free(&map); fclose(f); return -2; }
-            upper = (uint32_t)(((uint32_t)hi << 8) | lo) << 16;
+        } else if (rectype == 0x02u || rectype == 0x04u) {
+            if (reclen != 2) { rc = load_fail(err, r->line, 2, "address record must have 2 data bytes", -2); break; }
+            upper = (uint32_t)(((uint32_t)raw[4] << 8) | raw[5]) << (rectype == 0x02u ? 4 : 16);
         } else {
             /*
              * Keep import tolerant for producer-specific metadata records
@@ -362,307 +762,396 @@ static int load_from_ihex(const char *path, Payload *p, int allow_fill, uint8_t
              */
         }
     }
-
-    fclose(f);
-    if (!eof_seen) {
-        addrmap_free(&map);
-        return -2;
-    }
-
-    if (addrmap_finalize(&map, p, allow_fill, fill_byte) != 0) {
-        addrmap_free(&map);
-        return -5;
-    }
-    addrmap_free(&map);
-    return 0;
+    if (rc == 0 && lrc < 0) rc = rec_line_error(r, lrc, err);
+    else if (rc == 0 && !eof_seen) rc = load_fail(err, 0, 0, "missing end-of-file record", -2);
+    rec_close(r);
+    return rc;
 }
 
-static int srec_hexbyte(const char *s, uint8_t *out)
+static int load_from_srec(const char *path, AddrMap *map, LoadError *err)
 {
-    return parse_hex_byte(s, out);
-}
-
-static int load_from_srec(const char *path, Payload *p, int allow_fill, uint8_t fill_byte)
-{
-    FILE *f = fopen(path, "rb");
-    char line[1024];
-    AddrMap map;
+    RecReader *r = rec_open(path);
     int eof_seen = 0;
-    if (!f) return -1;
-    if (addrmap_init(&map) != 0) { fclose(f); return -1; }
+    const uint8_t *s;
+    size_t len;
+    int rc = 0, lrc;
+    if (!r) return load_fail(err, 0, 0, "cannot open input", -1);
 
     /*
      * Load S1/S2/S3 data records into the sparse map and require one of
      * S7/S8/S9 termination records before accepting the file.
+     *
+     * raw[] = count, address, data..., checksum; count through data sum
+     * to the one's complement of the checksum, so the whole record sums
+     * to 0xFF and is verified in the same pass that decodes it.
      */
-    while (fgets(line, sizeof(line), f)) {
-        size_t len = strcspn(line, "\r\n");
-        uint8_t count, cksum = 0, read_cksum;
-        int addr_bytes;
+    while ((lrc = rec_next_line(r, &s, &len)) == 1) {
+        uint8_t raw[256];
+        uint8_t count;
+        int addr_bytes, i;
         uint32_t addr = 0;
-        size_t i, pos;
+        size_t bad;
+        int sum;
 
-        if (len == 0) continue;
-        if (line[0] != 'S' || len < 4) { addrmap_free(&map); fclose(f); return -2; }
-        if (srec_hexbyte(line + 2, &count) != 0) { addrmap_free(&map); fclose(f); return -2; }
+        if (s[0] != 'S') { rc = load_fail(err, r->line, 1, "expected 'S' record mark", -2); break; }
+        if (len < 4) { rc = load_fail(err, r->line, len + 1, "record too short", -2); break; }
+        if (hex_decode_sum(s + 2, 1, &count, &bad) < 0) { rc = load_fail(err, r->line, 3 + bad, "invalid hex digit", -2); break; }
 
-        if (line[1] == '1') addr_bytes = 2;
-        else if (line[1] == '2') addr_bytes = 3;
-        else if (line[1] == '3') addr_bytes = 4;
-        else if (line[1] == '7' || line[1] == '8' || line[1] == '9') {
+        if (s[1] == '1') addr_bytes = 2;
+        else if (s[1] == '2') addr_bytes = 3;
+        else if (s[1] == '3') addr_bytes = 4;
+        else if (s[1] == '7' || s[1] == '8' || s[1] == '9') {
             eof_seen = 1;
             continue;
-        } else if (line[1] == '0' || line[1] == '5' || line[1] == '6') {
+        } else if (s[1] == '0' || s[1] == '5' || s[1] == '6') {
             continue;
         } else {
-            addrmap_free(&map);
-            fclose(f);
-            return -2;
+            rc = load_fail(err, r->line, 2, "unsupported record type", -2);
+            break;
         }
 
-        if (len != (size_t)(4 + count * 2)) { addrmap_free(&map); fclose(f); return -2; }
-
-        cksum = count;
-        pos = 4;
-        for (i = 0; i < (size_t)addr_bytes; i++) {
-            uint8_t b;
-            if (srec_hexbyte(line + pos, &b) != 0) { addrmap_free(&map); fclose(f); return -2; }
-            cksum = (uint8_t)(cksum + b);
-            addr = (addr << 8) | b;
-            pos += 2;
+        if (len != (size_t)(4 + count * 2)) {
+            rc = load_fail(err, r->line, (len < (size_t)(4 + count * 2)) ? len + 1 : (size_t)(5 + count * 2),
+                           "record length does not match byte count", -2);
+            break;
         }
+        if (count < (uint8_t)(addr_bytes + 1)) { rc = load_fail(err, r->line, 3, "byte count too small for address", -2); break; }
 
-        if (count < (uint8_t)(addr_bytes + 1)) { addrmap_free(&map); fclose(f); return -2; }
+        sum = hex_decode_sum(s + 2, (size_t)count + 1u, raw, &bad);
+        if (sum < 0) { rc = load_fail(err, r->line, 3 + bad, "invalid hex digit", -2); break; }
+        if (sum != 0xFF) { rc = load_fail(err, r->line, len - 1, "checksum mismatch", -3); break; }
+
+        for (i = 0; i < addr_bytes; i++)
+            addr = (addr << 8) | raw[1 + i];
         {
-            uint8_t data_len = (uint8_t)(count - addr_bytes - 1);
-            for (i = 0; i < data_len; i++) {
-                uint8_t b;
-                if (srec_hexbyte(line + pos, &b) != 0) { addrmap_free(&map); fclose(f); return -2; }
-                cksum = (uint8_t)(cksum + b);
-                if (addrmap_set(&map, addr + (uint32_t)i, b) != 0) { addrmap_free(&map); fclose(f); return -4; }
-                pos += 2;
-            }
+            int prc = addrmap_put(map, addr, raw + 1 + addr_bytes, (uint32_t)(count - addr_bytes - 1));
+            if (prc != 0) { rc = load_fail(err, r->line, 5, addrmap_put_msg(prc), -4); break; }
         }
-
-        if (srec_hexbyte(line + pos, &read_cksum) != 0) { addrmap_free(&map); fclose(f); return -2; }
-        cksum = (uint8_t)(~cksum);
-        if (cksum != read_cksum) { addrmap_free(&map); fclose(f); return -3; }
     }
-
-    fclose(f);
-    if (!eof_seen) {
-        addrmap_free(&map);
-        return -2;
-    }
-
-    if (addrmap_finalize(&map, p, allow_fill, fill_byte) != 0) {
-        addrmap_free(&map);
-        return -5;
-    }
-    addrmap_free(&map);
-    return 0;
+    if (rc == 0 && lrc < 0) rc = rec_line_error(r, lrc, err);
+    else if (rc == 0 && !eof_seen) rc = load_fail(err, 0, 0, "missing S7/S8/S9 termination record", -2);
+    rec_close(r);
+    return rc;
 }
 
-static void basic_tokenize_at(int i)
+static void arena_put(Arena *a, const uint8_t *src, size_t n)
 {
-    int t;
-    int len;
-    size_t move_len;
-    /* Greedy table walk preserves original text2bas behavior. */
-    for (t = 0x80; vz_token[t - 0x80]; t++) {
-        len = (int)strlen(vz_token[t - 0x80]);
-        if (len && strncasecmp((char *)(g_line.text + i), vz_token[t - 0x80], (size_t)len) == 0) {
-            move_len = strlen((char *)(g_line.text + i + len)) + 1;
-            memmove((char *)(g_line.text + i + 1), (char *)(g_line.text + i + len), move_len);
-            g_line.text[i] = (unsigned char)t;
-            g_line.next = (unsigned short)(g_line.next - (unsigned short)(len - 1));
+    if (a->failed) return;
+    if (n > a->cap - a->len) {
+        size_t ncap = a->cap ? a->cap : 1024u;
+        uint8_t *nd;
+        while (n > ncap - a->len) {
+            if (ncap > SIZE_MAX / 2u) { a->failed = 1; return; }
+            ncap *= 2u;
         }
+        nd = (uint8_t *)realloc(a->data, ncap);
+        if (!nd) { a->failed = 1; return; }
+        a->data = nd;
+        a->cap = ncap;
     }
+    memcpy(a->data + a->len, src, n);
+    a->len += n;
 }
 
-static void basic_squeeze_blanks(int i)
+static BasKeywords g_keywords;
+
+static void basic_keywords_init(void)
 {
-    int j;
-    size_t move_len;
-    if (g_line.text[i] != ' ') return;
-    for (j = i + 1; j < g_line.next; j++) {
-        if (g_line.text[j] != ' ')
-            break;
-    }
-    if (j > i + 1) {
-        move_len = strlen((char *)(g_line.text + j)) + 1;
-        memmove((char *)(g_line.text + i + 1), (char *)(g_line.text + j), move_len);
-        g_line.next = (unsigned short)(g_line.next - (unsigned short)(j - i - 1));
-    }
+    if (!g_keywords.count && bastok_keywords_build(&g_keywords, bastok_vz_words) != 0)
+        die("keyword trie overflow");
 }
 
-static void basic_outline(FILE *out)
+static void basic_sink(void *user, const unsigned char *bytes, size_t n)
 {
-    int i;
-    int len;
-    char str = 0;
+    arena_put((Arena *)user, bytes, n);
+}
 
-    if (!g_line.next) return;
+static int load_from_bas(const char *path, Payload *p)
+{
+    FILE *inp = fopen(path, "rb");
+    BasTok tok;
+    Arena out;
+    unsigned char buf[4096];
+    size_t n;
+    long in_size;
 
-    if (g_line.next == 1) {
-        g_line.text[0] = 'R';
-        g_line.text[1] = 'E';
-        g_line.text[2] = 'M';
-        g_line.text[3] = 0;
-        g_line.next = 4;
-    }
+    if (!inp) return -1;
+    memset(&out, 0, sizeof(out));
 
-    for (i = 0; i < g_line.next; i++) {
-        if (str && (g_line.text[i] != (unsigned char)str))
-            continue;
-        if (g_line.text[i] == (unsigned char)str) {
-            str = 0;
-        } else if (g_line.text[i] == 0x22) {
-            str = 0x22;
-        } else if (g_line.text[i] == 0x27) {
-            str = 0x27;
-        } else {
-            basic_tokenize_at(i);
-        }
-        basic_squeeze_blanks(i);
+    /*
+     * Tokenized text is rarely longer than the source, so sizing the
+     * arena from the input normally makes this the only allocation.
+     */
+    if (fseek(inp, 0, SEEK_END) == 0 && (in_size = ftell(inp)) > 0 &&
+        (unsigned long)in_size < (unsigned long)(SIZE_MAX / 2u)) {
+        out.cap = (size_t)in_size + (size_t)in_size / 2u + 16u;
+        out.data = (uint8_t *)malloc(out.cap);
+        if (!out.data) out.cap = 0;
+    }
+    if (fseek(inp, 0, SEEK_SET) != 0) { free(out.data); fclose(inp); return -1; }
+
+    basic_keywords_init();
+    bastok_init(&tok, &g_keywords, BASTOK_TOKENIZE | BASTOK_SQUEEZE | BASTOK_UPCASE,
+                VZ_BASIC_START, basic_sink, &out);
+    while ((n = fread(buf, 1, sizeof(buf), inp)) > 0)
+        bastok_feed(&tok, buf, n);
+    if (ferror(inp)) out.failed = 1;
+    bastok_finish(&tok);
+    fclose(inp);
+    if (out.failed) {
+        free(out.data);
+        return -1;
     }
 
-    len = 4 + g_line.next;
-    g_lineaddr = (unsigned short)(g_lineaddr + (unsigned short)len);
-    g_line.next = g_lineaddr;
-    g_line.num = g_linenum++;
-    fwrite(&g_line, 1, (size_t)len, out);
-    g_line.next = 0;
+    p->data = out.data;
+    p->size = out.len;
+    p->start = VZ_BASIC_START;
+    p->start_set = 1;
+    return 0;
 }
 
-static void basic_outbyte(FILE *out, char c)
+/*
+ * --compress: LZ-packed machine code with a Z80 depacker stub.
+ *
+ * Stream: a control byte c, then
+ *   c == 0x00        end of data
+ *   c  < 0x80        c literal bytes follow
+ *   c >= 0x80        match: (c & 0x7F) + 3 bytes copied from
+ *                    dest - offset, offset = next two bytes (LE)
+ * Matches are copied forward a byte at a time (LDIR), so an offset
+ * shorter than the length repeats a pattern.
+ *
+ * Image loaded at L:  JP stub | stream | stub
+ * The stub unpacks to the original start address S and jumps there.  L
+ * is chosen so the depacker never overwrites stream bytes it has not
+ * read yet, and the stub sits above S + original length.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_MATCH 130
+#define LZ_MAX_LITERALS 127
+#define LZ_WINDOW 4096u
+#define LZ_HASH_SIZE 4096u
+#define LZ_MAX_CHAIN 128
+#define LZ_NONE 0xFFFFu
+#define LZ_STUB_SIZE 45
+
+static const uint8_t lz_stub[LZ_STUB_SIZE] = {
+    0x21, 0x00, 0x00,       /*        ld   hl,stream            */
+    0x11, 0x00, 0x00,       /*        ld   de,S                 */
+    0x7E,                   /* loop:  ld   a,(hl)               */
+    0x23,                   /*        inc  hl                   */
+    0xB7,                   /*        or   a                    */
+    0xCA, 0x00, 0x00,       /*        jp   z,S                  */
+    0xCB, 0x7F,             /*        bit  7,a                  */
+    0x20, 0x07,             /*        jr   nz,match             */
+    0x4F,                   /*        ld   c,a                  */
+    0x06, 0x00,             /*        ld   b,0                  */
+    0xED, 0xB0,             /*        ldir                      */
+    0x18, 0xEF,             /*        jr   loop                 */
+    0xE6, 0x7F,             /* match: and  7Fh                  */
+    0xC6, 0x03,             /*        add  a,3                  */
+    0x4E,                   /*        ld   c,(hl)               */
+    0x23,                   /*        inc  hl                   */
+    0x46,                   /*        ld   b,(hl)               */
+    0x23,                   /*        inc  hl                   */
+    0xE5,                   /*        push hl                   */
+    0x62,                   /*        ld   h,d                  */
+    0x6B,                   /*        ld   l,e                  */
+    0xB7,                   /*        or   a                    */
+    0xED, 0x42,             /*        sbc  hl,bc                */
+    0x4F,                   /*        ld   c,a                  */
+    0x06, 0x00,             /*        ld   b,0                  */
+    0xED, 0xB0,             /*        ldir                      */
+    0xE1,                   /*        pop  hl                   */
+    0x18, 0xD9              /*        jr   loop                 */
+};
+#define LZ_STUB_STREAM 1
+#define LZ_STUB_DEST 4
+#define LZ_STUB_ENTRY 10
+
+typedef struct {
+    uint8_t *out;
+    size_t len;
+    long in_pos;        /* payload bytes produced so far */
+    long max_lead;      /* max of produced - consumed after any token */
+} LzStream;
+
+static void lz_token_done(LzStream *z)
 {
-    if (c == 0 && g_line.next > 0 && g_line.text[g_line.next - 1] == 0)
-        return;
-    g_line.text[g_line.next] = (unsigned char)c;
-    if (++g_line.next == 254)
-        basic_outline(out);
+    long lead = z->in_pos - (long)z->len;
+    if (lead > z->max_lead) z->max_lead = lead;
 }
 
-static int load_from_bas(const char *path, Payload *p)
+static void lz_literals(LzStream *z, const uint8_t *src, size_t n)
 {
-    FILE *inp = fopen(path, "rb");
-    FILE *tmp = NULL;
-    int c;
-    int num = 1;
-    char str = 0;
-    uint8_t *buf = NULL;
-    size_t sz = 0;
+    while (n > 0) {
+        size_t k = (n > LZ_MAX_LITERALS) ? LZ_MAX_LITERALS : n;
+        z->out[z->len++] = (uint8_t)k;
+        memcpy(z->out + z->len, src, k);
+        z->len += k;
+        z->in_pos += (long)k;
+        lz_token_done(z);
+        src += k;
+        n -= k;
+    }
+}
 
-    if (!inp) return -1;
-    tmp = tmpfile();
-    if (!tmp) { fclose(inp); return -1; }
+static uint16_t lz_hash(const uint8_t *p)
+{
+    return (uint16_t)((((unsigned)p[0] << 6) ^ ((unsigned)p[1] << 3) ^ p[2]) & (LZ_HASH_SIZE - 1u));
+}
 
-    memset(&g_line, 0, sizeof(g_line));
-    g_lineaddr = VZ_BASIC_START;
-    g_linenum = 1;
+static void lz_insert(uint16_t *head, uint16_t *prev, const uint8_t *src, size_t n, size_t pos)
+{
+    uint16_t h;
+    if (pos + 3u > n) return;
+    h = lz_hash(src + pos);
+    prev[pos & (LZ_WINDOW - 1u)] = head[h];
+    head[h] = (uint16_t)pos;
+}
 
-    /*
-     * Tokenization flow mirrors the existing text2bas behavior so packed
-     * BASIC payloads stay compatible with current toolchain expectations.
-     */
-    while (!feof(inp)) {
-        c = fgetc(inp);
-        if (feof(inp)) break;
-
-        if (str) {
-            if (c == 0x0d || c == 0x0a) {
-                if (c == 0x0d) {
-                    int next = fgetc(inp);
-                    if (next != 0x0a && next != EOF)
-                        ungetc(next, inp);
-                }
-                basic_outbyte(tmp, 0);
-                basic_outline(tmp);
-                num = 1;
-                str = 0;
-            } else {
-                basic_outbyte(tmp, (char)toupper((unsigned char)c));
+static size_t lz_longest(const uint16_t *head, const uint16_t *prev, const uint8_t *src, size_t n,
+                         size_t pos, size_t *best_off)
+{
+    size_t best = 0;
+    size_t limit = n - pos;
+    int chain = LZ_MAX_CHAIN;
+    uint16_t cand;
+
+    if (limit < LZ_MIN_MATCH) return 0;
+    if (limit > LZ_MAX_MATCH) limit = LZ_MAX_MATCH;
+    cand = head[lz_hash(src + pos)];
+    while (cand != LZ_NONE && chain-- > 0) {
+        size_t c = cand, k = 0;
+        if (c >= pos || pos - c >= LZ_WINDOW) break;
+        while (k < limit && src[c + k] == src[pos + k]) k++;
+        if (k > best) {
+            best = k;
+            *best_off = pos - c;
+            if (k == limit) break;
+        }
+        cand = prev[c & (LZ_WINDOW - 1u)];
+    }
+    return best >= LZ_MIN_MATCH ? best : 0;
+}
+
+/*
+ * Compress n bytes into out (room for n + n / 127 + 2 bytes).  Greedy
+ * with one step of lazy matching over hash chains; returns the stream
+ * length and the largest lead of output over input for placing it.
+ */
+static int lz_compress(const uint8_t *src, size_t n, uint8_t *out, size_t *out_len, long *max_lead)
+{
+    uint16_t *head = (uint16_t *)malloc(LZ_HASH_SIZE * sizeof(uint16_t));
+    uint16_t *prev = (uint16_t *)malloc(LZ_WINDOW * sizeof(uint16_t));
+    LzStream z;
+    size_t pos = 0, lit = 0, i;
+
+    if (!head || !prev) {
+        free(head);
+        free(prev);
+        return -1;
+    }
+    for (i = 0; i < LZ_HASH_SIZE; i++) head[i] = LZ_NONE;
+    z.out = out;
+    z.len = 0;
+    z.in_pos = 0;
+    z.max_lead = 0;
+
+    while (pos < n) {
+        size_t off = 0, len = lz_longest(head, prev, src, n, pos, &off);
+        if (len) {
+            size_t off2 = 0, len2;
+            lz_insert(head, prev, src, n, pos);
+            len2 = (pos + 1u < n) ? lz_longest(head, prev, src, n, pos + 1u, &off2) : 0;
+            if (len2 > len) {
+                pos++;
+                continue;
             }
-            if (c == str) str = 0;
+            lz_literals(&z, src + lit, pos - lit);
+            z.out[z.len++] = (uint8_t)(0x80u | (len - 3u));
+            z.out[z.len++] = (uint8_t)(off & 0xFFu);
+            z.out[z.len++] = (uint8_t)(off >> 8);
+            z.in_pos += (long)len;
+            lz_token_done(&z);
+            for (i = 1; i < len; i++)
+                lz_insert(head, prev, src, n, pos + i);
+            pos += len;
+            lit = pos;
         } else {
-            if (num) {
-                if (isdigit(c)) {
-                    g_linenum = (unsigned short)(c - '0');
-                    while (!feof(inp) && isdigit(c = fgetc(inp))) {
-                        g_linenum = (unsigned short)(g_linenum * 10 + (unsigned short)(c - '0'));
-                    }
-                    if (c == ' ')
-                        c = fgetc(inp);
-                }
-                num = 0;
-            }
-            switch (c) {
-                case 0x0a:
-                case 0x0d:
-                case 0x1a:
-                    if (c == 0x0d) {
-                        int next = fgetc(inp);
-                        if (next != 0x0a && next != EOF)
-                            ungetc(next, inp);
-                    }
-                    basic_outbyte(tmp, 0);
-                    basic_outline(tmp);
-                    num = 1;
-                    break;
-                case 9:
-                    basic_outbyte(tmp, 0x20);
-                    while (g_line.next & 7)
-                        basic_outbyte(tmp, 0x20);
-                    break;
-                case 0x22:
-                case 0x27:
-                    str = (char)c;
-                    basic_outbyte(tmp, (char)c);
-                    break;
-                case ';':
-                    str = 0x0d;
-                    basic_outbyte(tmp, (char)c);
-                    break;
-                default:
-                    basic_outbyte(tmp, (char)toupper((unsigned char)c));
-                    break;
-            }
+            lz_insert(head, prev, src, n, pos);
+            pos++;
         }
     }
+    lz_literals(&z, src + lit, n - lit);
+    z.out[z.len++] = 0x00;
 
-    if (g_line.next > 0) {
-        basic_outbyte(tmp, 0x00);
-        basic_outline(tmp);
-    }
+    free(head);
+    free(prev);
+    *out_len = z.len;
+    *max_lead = z.max_lead;
+    return 0;
+}
 
-    g_line.next = 0;
-    fwrite(&g_line, 1, 2, tmp);
+/*
+ * Replace p with a self-unpacking image.  Returns 0 on success, 1 if
+ * compression does not pay off, 2 if the image would not fit below
+ * 64 KB (p is unchanged in both cases), -1 on allocation failure.
+ */
+static int lz_pack_payload(Payload *p)
+{
+    uint8_t *stream, *img;
+    size_t clen, total;
+    long lead;
+    uint32_t load, stub;
+
+    if (p->size == 0) return 1;
+    stream = (uint8_t *)malloc(p->size + p->size / LZ_MAX_LITERALS + 2u);
+    if (!stream) return -1;
+    if (lz_compress(p->data, p->size, stream, &clen, &lead) != 0) {
+        free(stream);
+        return -1;
+    }
 
-    if (fseek(tmp, 0, SEEK_END) != 0) { fclose(inp); fclose(tmp); return -1; }
-    {
-        long lsz = ftell(tmp);
-        if (lsz < 0) { fclose(inp); fclose(tmp); return -1; }
-        sz = (size_t)lsz;
+    total = 3u + clen + LZ_STUB_SIZE;
+    if (total >= p->size) {
+        free(stream);
+        return 1;
+    }
+    /*
+     * Lowest load address at which the unread stream always stays ahead
+     * of the output; this also puts the stub above the unpacked program.
+     */
+    if (lead < 3) lead = 3;
+    load = (uint32_t)p->start + (uint32_t)lead - 3u;
+    stub = load + 3u + (uint32_t)clen;
+    if (stub + LZ_STUB_SIZE > 0x10000u) {
+        free(stream);
+        return 2;
     }
-    if (fseek(tmp, 0, SEEK_SET) != 0) { fclose(inp); fclose(tmp); return -1; }
 
-    buf = (uint8_t *)malloc(sz);
-    if (!buf) { fclose(inp); fclose(tmp); return -1; }
-    if (sz > 0 && fread(buf, 1, sz, tmp) != sz) {
-        free(buf);
-        fclose(inp);
-        fclose(tmp);
+    img = (uint8_t *)malloc(total);
+    if (!img) {
+        free(stream);
         return -1;
     }
+    img[0] = 0xC3;
+    img[1] = (uint8_t)(stub & 0xFFu);
+    img[2] = (uint8_t)(stub >> 8);
+    memcpy(img + 3, stream, clen);
+    memcpy(img + 3 + clen, lz_stub, LZ_STUB_SIZE);
+    img[3 + clen + LZ_STUB_STREAM] = (uint8_t)((load + 3u) & 0xFFu);
+    img[3 + clen + LZ_STUB_STREAM + 1] = (uint8_t)((load + 3u) >> 8);
+    img[3 + clen + LZ_STUB_DEST] = (uint8_t)(p->start & 0xFFu);
+    img[3 + clen + LZ_STUB_DEST + 1] = (uint8_t)(p->start >> 8);
+    img[3 + clen + LZ_STUB_ENTRY] = (uint8_t)(p->start & 0xFFu);
+    img[3 + clen + LZ_STUB_ENTRY + 1] = (uint8_t)(p->start >> 8);
+    free(stream);
 
-    fclose(inp);
-    fclose(tmp);
-
-    p->data = buf;
-    p->size = sz;
-    p->start = VZ_BASIC_START;
-    p->start_set = 1;
+    free(p->data);
+    p->data = img;
+    p->size = total;
+    p->start = (uint16_t)load;
     return 0;
 }
 
@@ -690,31 +1179,848 @@ static int write_vz_file(const char *out_path, const char name[VZ_NAME_LEN], VzT
     return 0;
 }
 
-int main(int argc, char **argv)
+/*
+ * One pack request: what to read and how to label it, plus what was
+ * written.  Used for the single command-line pack and for each manifest
+ * entry; errors land in err instead of exiting so a batch can go on.
+ */
+typedef struct {
+    InputKind kind;
+    const char *in_path;
+    const char *out_path;
+    const char *name_override;
+    VzType forced_type;
+    uint32_t start;
+    int start_set;
+    uint32_t fill;
+    int fill_set;
+    int compress;
+    int segments;
+
+    char name[VZ_NAME_LEN];
+    VzType type;
+    uint16_t load_addr;
+    size_t size;
+    size_t seg_count;
+    int compressed;
+    int compress_rc;
+    uint16_t unpack_addr;
+    size_t unpack_size;
+    int cached;
+    char err[320];
+} PackJob;
+
+static int pack_one(PackJob *j)
 {
-    InputKind in_kind = INPUT_NONE;
-    const char *in_path = NULL;
-    const char *out_path = NULL;
-    const char *name_override = NULL;
-    VzType forced_type = TYPE_AUTO;
-    uint32_t start_override = 0;
-    uint32_t fill_override = 0;
-    int start_set = 0;
-    int fill_set = 0;
     Payload p = {0};
-    int i;
+    LoadError lerr = {0, 0, NULL};
+
+    j->err[0] = '\0';
+    if (j->segments && j->kind != INPUT_HEX && j->kind != INPUT_SREC) {
+        snprintf(j->err, sizeof(j->err), "--segments only applies to HEX/SREC input");
+        return -1;
+    }
+    if (j->kind == INPUT_BIN) {
+        if (read_entire_file(j->in_path, &p.data, &p.size) != 0) {
+            snprintf(j->err, sizeof(j->err), "failed reading binary input");
+            return -1;
+        }
+        if (!j->start_set) {
+            payload_free(&p);
+            snprintf(j->err, sizeof(j->err), "--start is required for --in-bin");
+            return -1;
+        }
+        p.start = (uint16_t)j->start;
+        p.start_set = 1;
+    } else if (j->kind == INPUT_HEX || j->kind == INPUT_SREC) {
+        AddrMap map;
+        int rc;
+        addrmap_init(&map);
+        if (j->kind == INPUT_HEX)
+            rc = load_from_ihex(j->in_path, &map, &lerr);
+        else
+            rc = load_from_srec(j->in_path, &map, &lerr);
+        if (rc == 0 && j->segments)
+            rc = scatter_or_fail(&map, &p, (uint8_t)j->fill, j->start_set ? (long)j->start : -1L,
+                                 &j->seg_count, &lerr);
+        else if (rc == 0)
+            rc = finalize_or_fail(&map, &p, j->fill_set, (uint8_t)j->fill, &lerr);
+        addrmap_free(&map);
+        if (rc != 0) {
+            format_load_error(j->err, sizeof(j->err),
+                              j->kind == INPUT_HEX ? "failed loading Intel HEX" : "failed loading S-record",
+                              j->in_path, &lerr);
+            return -1;
+        }
+    } else if (j->kind == INPUT_BAS) {
+        if (load_from_bas(j->in_path, &p) != 0) {
+            snprintf(j->err, sizeof(j->err), "failed tokenizing BASIC input");
+            return -1;
+        }
+    } else {
+        snprintf(j->err, sizeof(j->err), "internal input selection error");
+        return -1;
+    }
+
+    if (p.size > 65535u) {
+        payload_free(&p);
+        snprintf(j->err, sizeof(j->err), "payload too large for VZ container");
+        return -1;
+    }
+
+    /* With --segments, --start names the entry point, which the loader already jumps to. */
+    if (j->start_set && !j->segments)
+        p.start = (uint16_t)j->start;
+
+    j->type = j->forced_type;
+    if (j->type == TYPE_AUTO)
+        j->type = (j->kind == INPUT_BAS) ? TYPE_BASIC : TYPE_MC;
+
+    j->compressed = 0;
+    j->unpack_addr = p.start;
+    j->unpack_size = p.size;
+    if (j->compress) {
+        int rc;
+        if (j->type != TYPE_MC) {
+            payload_free(&p);
+            snprintf(j->err, sizeof(j->err), "--compress only applies to machine-code payloads");
+            return -1;
+        }
+        rc = lz_pack_payload(&p);
+        if (rc < 0) {
+            payload_free(&p);
+            snprintf(j->err, sizeof(j->err), "out of memory compressing payload");
+            return -1;
+        }
+        j->compressed = (rc == 0);
+        j->compress_rc = rc;
+    }
+
+    normalize_name(j->name, j->name_override ? j->name_override : j->in_path);
+    j->load_addr = p.start;
+    j->size = p.size;
+
+    if (write_vz_file(j->out_path, j->name, j->type, j->load_addr, p.data, p.size) != 0) {
+        payload_free(&p);
+        snprintf(j->err, sizeof(j->err), "failed writing output .vz");
+        return -1;
+    }
+    payload_free(&p);
+    return 0;
+}
+
+/*
+ * Build cache (--cache-dir).
+ *
+ * Each finished pack is stored as DIR/<job hash>.vzc: a 16-byte record
+ * of the result fields that the .vz header does not carry, then the .vz
+ * file itself.  A job whose hash is found is written out from there
+ * without reading its input again.  Outputs are copied, not hard-linked:
+ * vzpack rewrites outputs in place, which would go through a link into
+ * the cache.
+ *
+ * DIR/index lists entries least recently used first, with lifetime hit,
+ * miss and eviction counters.  It is read at start, updated in memory,
+ * and written once at exit, evicting the oldest entries beyond the
+ * limit.  Entry files are written under a temporary name and renamed, so
+ * a concurrent vzpack never sees a partial entry; a .vzc file the index
+ * does not list is still used, and is listed again on its next hit.
+ */
+#define CACHE_MAGIC "VZC1"
+#define CACHE_META_SIZE 16
+#define CACHE_DEFAULT_MAX 1024u
+#define CACHE_PATH_MAX 1024
+
+typedef struct {
+    uint64_t key;
+    uint32_t bytes;
+    unsigned long stamp;
+} CacheEntry;
+
+typedef struct {
+    const char *dir;
+    CacheEntry *ent;
+    size_t count;
+    size_t cap;
+    size_t max;
+    unsigned long clock;
+    unsigned long hits, misses, stores, evicted;     /* this run */
+    unsigned long total_hits, total_misses, total_evicted;
+    vz_mutex_t lock;
+} Cache;
+
+static int cache_path(char *buf, size_t size, const Cache *c, uint64_t key, const char *ext)
+{
+    int n = snprintf(buf, size, "%s/%08lx%08lx%s", c->dir, (unsigned long)(key >> 32),
+                     (unsigned long)(key & 0xFFFFFFFFu), ext);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/* Mark key as most recently used; caller holds the lock. */
+static void cache_touch(Cache *c, uint64_t key, uint32_t bytes)
+{
+    size_t i;
+    for (i = 0; i < c->count; i++)
+        if (c->ent[i].key == key) break;
+    if (i == c->count) {
+        if (c->count == c->cap) {
+            size_t ncap = c->cap ? c->cap * 2u : 64u;
+            CacheEntry *ne = (CacheEntry *)realloc(c->ent, ncap * sizeof(*ne));
+            if (!ne) return;
+            c->ent = ne;
+            c->cap = ncap;
+        }
+        c->ent[c->count].key = key;
+        c->count++;
+    }
+    c->ent[i].bytes = bytes;
+    c->ent[i].stamp = ++c->clock;
+}
+
+static void cache_open(Cache *c, const char *dir, size_t max)
+{
+    char path[CACHE_PATH_MAX];
+    char line[128];
+    FILE *f;
+
+    memset(c, 0, sizeof(*c));
+    c->dir = dir;
+    c->max = max;
+    if (vz_mutex_init(&c->lock) != 0) die("cannot create cache lock");
+#if defined(_WIN32)
+    _mkdir(dir);
+#elif defined(__unix__) || defined(__APPLE__)
+    mkdir(dir, 0777);
+#endif
+    if (snprintf(path, sizeof(path), "%s/index", dir) >= (int)sizeof(path))
+        die("cache directory path too long");
+    f = fopen(path, "rb");
+    if (!f) return;
+    if (!fgets(line, sizeof(line), f) ||
+        sscanf(line, "VZPACK-CACHE 1 %lu %lu %lu", &c->total_hits, &c->total_misses,
+               &c->total_evicted) != 3) {
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *end = NULL;
+        unsigned long long key = strtoull(line, &end, 16);
+        unsigned long bytes;
+        if (end != line + 16 || sscanf(end, " %lu", &bytes) != 1) continue;
+        cache_touch(c, (uint64_t)key, (uint32_t)bytes);
+    }
+    fclose(f);
+}
+
+/* Write the job's output from the cache; 0 on a hit. */
+static int cache_fetch(Cache *c, uint64_t key, PackJob *j)
+{
+    char path[CACHE_PATH_MAX];
+    uint8_t *data = NULL;
+    size_t size = 0;
+    const uint8_t *m, *vz;
+    FILE *f;
+    int ok;
+
+    if (cache_path(path, sizeof(path), c, key, ".vzc") != 0 ||
+        read_entire_file(path, &data, &size) != 0) {
+        free(data);
+        return -1;
+    }
+    m = data;
+    vz = data + CACHE_META_SIZE;
+    if (size < CACHE_META_SIZE + VZ_HEADER_SIZE || memcmp(m, CACHE_MAGIC, 4) != 0 ||
+        size - CACHE_META_SIZE - VZ_HEADER_SIZE > 65535u) {
+        free(data);
+        return -1;
+    }
+    f = fopen(j->out_path, "wb");
+    ok = f && fwrite(vz, 1, size - CACHE_META_SIZE, f) == size - CACHE_META_SIZE;
+    if (f && fclose(f) != 0) ok = 0;
+    if (!ok) {
+        free(data);
+        return -1;
+    }
+
+    memcpy(j->name, vz + 4, VZ_NAME_LEN);
+    j->type = (vz[21] == 0xF0u) ? TYPE_BASIC : TYPE_MC;
+    j->load_addr = (uint16_t)(vz[22] | (vz[23] << 8));
+    j->size = size - CACHE_META_SIZE - VZ_HEADER_SIZE;
+    j->seg_count = (size_t)(m[4] | (m[5] << 8));
+    j->compressed = m[6];
+    j->compress_rc = m[7];
+    j->unpack_addr = (uint16_t)(m[8] | (m[9] << 8));
+    j->unpack_size = (size_t)(m[10] | (m[11] << 8));
+    j->cached = 1;
+    free(data);
+    vz_mutex_lock(&c->lock);
+    c->hits++;
+    cache_touch(c, key, (uint32_t)size);
+    vz_mutex_unlock(&c->lock);
+    return 0;
+}
+
+/* Store a freshly written output under key; a failure only costs the next hit. */
+static void cache_store(Cache *c, uint64_t key, const PackJob *j)
+{
+    char path[CACHE_PATH_MAX], tmp[CACHE_PATH_MAX];
+    uint8_t meta[CACHE_META_SIZE];
+    uint8_t *vz = NULL;
+    size_t size = 0;
+    FILE *f;
+    int ok;
+
+    if (cache_path(path, sizeof(path), c, key, ".vzc") != 0 ||
+        cache_path(tmp, sizeof(tmp), c, key, ".tmp") != 0 ||
+        read_entire_file(j->out_path, &vz, &size) != 0) {
+        free(vz);
+        return;
+    }
+    memset(meta, 0, sizeof(meta));
+    memcpy(meta, CACHE_MAGIC, 4);
+    put_le16(meta + 4, (uint32_t)j->seg_count);
+    meta[6] = (uint8_t)j->compressed;
+    meta[7] = (uint8_t)j->compress_rc;
+    put_le16(meta + 8, j->unpack_addr);
+    put_le16(meta + 10, (uint32_t)j->unpack_size);
+
+    /* Jobs with equal keys would share the temporary name, so stores are serialized. */
+    vz_mutex_lock(&c->lock);
+    f = fopen(tmp, "wb");
+    ok = f && fwrite(meta, 1, sizeof(meta), f) == sizeof(meta) &&
+         fwrite(vz, 1, size, f) == size;
+    if (f && fclose(f) != 0) ok = 0;
+    if (ok) {
+        remove(path);
+        ok = (rename(tmp, path) == 0);
+    }
+    if (ok) {
+        c->stores++;
+        cache_touch(c, key, (uint32_t)(sizeof(meta) + size));
+    } else {
+        remove(tmp);
+    }
+    vz_mutex_unlock(&c->lock);
+    free(vz);
+}
+
+static int cache_entry_cmp(const void *a, const void *b)
+{
+    unsigned long sa = ((const CacheEntry *)a)->stamp;
+    unsigned long sb = ((const CacheEntry *)b)->stamp;
+    return (sa > sb) - (sa < sb);
+}
+
+/* Evict beyond the limit, oldest first, and write the index. */
+static void cache_close(Cache *c)
+{
+    char path[CACHE_PATH_MAX], tmp[CACHE_PATH_MAX];
+    size_t i, first = 0;
+    FILE *f;
+
+    qsort(c->ent, c->count, sizeof(*c->ent), cache_entry_cmp);
+    if (c->count > c->max) {
+        first = c->count - c->max;
+        for (i = 0; i < first; i++) {
+            if (cache_path(path, sizeof(path), c, c->ent[i].key, ".vzc") == 0)
+                remove(path);
+        }
+        c->evicted += (unsigned long)first;
+    }
+    c->total_hits += c->hits;
+    c->total_misses += c->misses;
+    c->total_evicted += c->evicted;
+
+    if (snprintf(path, sizeof(path), "%s/index", c->dir) < (int)sizeof(path) &&
+        snprintf(tmp, sizeof(tmp), "%s/index.tmp", c->dir) < (int)sizeof(tmp) &&
+        (f = fopen(tmp, "wb")) != NULL) {
+        fprintf(f, "VZPACK-CACHE 1 %lu %lu %lu\n", c->total_hits, c->total_misses, c->total_evicted);
+        for (i = first; i < c->count; i++)
+            fprintf(f, "%08lx%08lx %lu\n", (unsigned long)(c->ent[i].key >> 32),
+                    (unsigned long)(c->ent[i].key & 0xFFFFFFFFu), (unsigned long)c->ent[i].bytes);
+        if (fclose(f) == 0) {
+            remove(path);
+            if (rename(tmp, path) != 0) remove(tmp);
+        } else {
+            remove(tmp);
+        }
+    } else {
+        fprintf(stderr, "vzpack: warning: could not write cache index in %s\n", c->dir);
+    }
+    c->count -= first;
+    memmove(c->ent, c->ent + first, c->count * sizeof(*c->ent));
+}
+
+static void cache_report(const Cache *c)
+{
+    unsigned long long bytes = 0;
+    size_t i;
+    for (i = 0; i < c->count; i++)
+        bytes += c->ent[i].bytes;
+    printf("Cache     : %lu hits, %lu misses, %lu stored, %lu evicted this run\n",
+           c->hits, c->misses, c->stores, c->evicted);
+    printf("Cache dir : %s, %lu of %lu entries, %llu bytes\n", c->dir, (unsigned long)c->count,
+           (unsigned long)c->max, bytes);
+    printf("Lifetime  : %lu hits, %lu misses, %lu evicted\n",
+           c->total_hits, c->total_misses, c->total_evicted);
+}
+
+static void cache_free(Cache *c)
+{
+    free(c->ent);
+    c->ent = NULL;
+    vz_mutex_destroy(&c->lock);
+}
+
+/* pack_one() behind the cache; key is the job's hash if key_ok. */
+static int pack_cached(Cache *c, PackJob *j, uint64_t key, int key_ok)
+{
+    int rc;
+    j->cached = 0;
+    if (!c || !key_ok) return pack_one(j);
+    if (cache_fetch(c, key, j) == 0) return 0;
+    vz_mutex_lock(&c->lock);
+    c->misses++;
+    vz_mutex_unlock(&c->lock);
+    rc = pack_one(j);
+    if (rc == 0) cache_store(c, key, j);
+    return rc;
+}
+
+/*
+ * Batch packing (--manifest).
+ *
+ * Each manifest line is "KIND INPUT OUTPUT [name=N] [start=A] [fill=B]
+ * [type=T] [compress] [segments]", KIND one of bin|hex|srec|bas; '#' starts a comment and
+ * fields may be double-quoted.  Entries are packed on a small worker
+ * pool and reported in manifest order.  <manifest>.state records an
+ * FNV-1a hash of each entry's settings and input bytes, so an entry whose
+ * hash is unchanged and whose output still exists is skipped.
+ */
+#define BATCH_MAX_THREADS VZ_MAX_THREADS
+#define BATCH_LINE_MAX 4096
+#define FNV64_BASIS 0xCBF29CE484222325ULL
+#define FNV64_PRIME 0x100000001B3ULL
+
+enum { BATCH_PENDING = 0, BATCH_PACKED, BATCH_SKIPPED, BATCH_FAILED };
+
+typedef struct {
+    PackJob job;
+    unsigned long line;
+    char *text;
+    uint64_t hash;
+    int hash_ok;
+    uint64_t prev_hash;
+    int have_prev;
+    int result;
+} BatchEntry;
+
+typedef struct {
+    BatchEntry *entries;
+    size_t count;
+    size_t next;
+    int force;
+    Cache *cache;
+    vz_mutex_t lock;
+} BatchRun;
+
+static uint64_t fnv1a64(uint64_t h, const void *data, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+static uint64_t fnv1a64_u32(uint64_t h, uint32_t v)
+{
+    uint8_t b[4];
+    b[0] = (uint8_t)v;
+    b[1] = (uint8_t)(v >> 8);
+    b[2] = (uint8_t)(v >> 16);
+    b[3] = (uint8_t)(v >> 24);
+    return fnv1a64(h, b, 4);
+}
+
+/*
+ * Hash everything that determines a job's output: tool and tokenizer
+ * version, settings, the VZ name it will get, then the input bytes.
+ * Keys both the manifest state file and the --cache-dir store.
+ */
+static int job_hash(const PackJob *j, uint64_t *out)
+{
+    uint8_t buf[4096];
+    size_t n;
+    uint64_t h = FNV64_BASIS;
     char name[VZ_NAME_LEN];
-    VzType final_type;
-    uint16_t final_start;
+    FILE *f;
+
+    normalize_name(name, j->name_override ? j->name_override : j->in_path);
+    h = fnv1a64(h, TOOL_VERSION, strlen(TOOL_VERSION) + 1u);
+    h = fnv1a64_u32(h, (uint32_t)BASTOK_VERSION);
+    h = fnv1a64_u32(h, (uint32_t)j->kind);
+    h = fnv1a64_u32(h, (uint32_t)j->forced_type);
+    h = fnv1a64(h, name, sizeof(name));
+    h = fnv1a64_u32(h, j->start_set ? j->start : 0xFFFFFFFFu);
+    h = fnv1a64_u32(h, j->fill_set ? j->fill : 0xFFFFFFFFu);
+    h = fnv1a64_u32(h, (uint32_t)j->compress);
+    h = fnv1a64_u32(h, (uint32_t)j->segments);
+
+    f = fopen(j->in_path, "rb");
+    if (!f) return -1;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        h = fnv1a64(h, buf, n);
+    if (ferror(f)) { fclose(f); return -1; }
+    fclose(f);
+    *out = h;
+    return 0;
+}
+
+static int file_exists(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    fclose(f);
+    return 1;
+}
+
+static void batch_process(BatchRun *b, BatchEntry *e)
+{
+    e->hash_ok = (job_hash(&e->job, &e->hash) == 0);
+    if (!b->force && e->hash_ok && e->have_prev && e->prev_hash == e->hash &&
+        file_exists(e->job.out_path)) {
+        e->result = BATCH_SKIPPED;
+        return;
+    }
+    e->result = (pack_cached(b->cache, &e->job, e->hash, e->hash_ok) == 0) ? BATCH_PACKED : BATCH_FAILED;
+}
+
+static void batch_worker(BatchRun *b)
+{
+    for (;;) {
+        size_t i;
+        vz_mutex_lock(&b->lock);
+        i = b->next++;
+        vz_mutex_unlock(&b->lock);
+        if (i >= b->count) break;
+        batch_process(b, &b->entries[i]);
+    }
+}
+
+#if VZ_THREADS && defined(_WIN32)
+static DWORD WINAPI batch_thread(LPVOID arg)
+{
+    batch_worker((BatchRun *)arg);
+    return 0;
+}
+#elif VZ_THREADS
+static void *batch_thread(void *arg)
+{
+    batch_worker((BatchRun *)arg);
+    return NULL;
+}
+#endif
+
+/* Run every entry; the calling thread works too, so a failed spawn only costs speed. */
+static void batch_run(BatchRun *b, int jobs)
+{
+#if VZ_THREADS
+    vz_thread_t th[BATCH_MAX_THREADS];
+    int started = 0, i;
+
+    for (i = 1; i < jobs && (size_t)i < b->count; i++) {
+        if (vz_thread_start(&th[started], batch_thread, b) != 0) break;
+        started++;
+    }
+    batch_worker(b);
+    for (i = 0; i < started; i++)
+        vz_thread_join(th[i]);
+#else
+    (void)jobs;
+    batch_worker(b);
+#endif
+}
+
+/* Split the next whitespace-separated (optionally "quoted") field off *pp, in place. */
+static char *next_field(char **pp)
+{
+    char *p = *pp;
+    char *start;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '\0' || *p == '#') { *pp = p; return NULL; }
+    if (*p == '"') {
+        start = ++p;
+        while (*p && *p != '"') p++;
+    } else {
+        start = p;
+        while (*p && *p != ' ' && *p != '\t') p++;
+    }
+    if (*p) *p++ = '\0';
+    *pp = p;
+    return start;
+}
+
+static int manifest_error(const char *path, unsigned long line, const char *msg, const char *what)
+{
+    fprintf(stderr, "vzpack: %s:%lu: %s%s%s\n", path, line, msg, what ? ": " : "", what ? what : "");
+    return -1;
+}
+
+/* Parse one manifest line into e->job; fields point into e->text. */
+static int manifest_parse_entry(const char *mpath, BatchEntry *e)
+{
+    char *p = e->text;
+    char *kind = next_field(&p);
+    char *f;
+
+    memset(&e->job, 0, sizeof(e->job));
+    e->job.forced_type = TYPE_AUTO;
+    e->job.in_path = next_field(&p);
+    e->job.out_path = next_field(&p);
+    if (!kind || !e->job.in_path || !e->job.out_path)
+        return manifest_error(mpath, e->line, "expected KIND INPUT OUTPUT", NULL);
+
+    if (strcmp(kind, "bin") == 0) e->job.kind = INPUT_BIN;
+    else if (strcmp(kind, "hex") == 0) e->job.kind = INPUT_HEX;
+    else if (strcmp(kind, "srec") == 0) e->job.kind = INPUT_SREC;
+    else if (strcmp(kind, "bas") == 0) e->job.kind = INPUT_BAS;
+    else return manifest_error(mpath, e->line, "unknown input kind (use bin|hex|srec|bas)", kind);
+
+    while ((f = next_field(&p)) != NULL) {
+        if (strncmp(f, "name=", 5) == 0) {
+            e->job.name_override = f + 5;
+        } else if (strncmp(f, "start=", 6) == 0) {
+            if (parse_u32(f + 6, &e->job.start) != 0 || e->job.start > 0xFFFFu)
+                return manifest_error(mpath, e->line, "invalid start value", f + 6);
+            e->job.start_set = 1;
+        } else if (strncmp(f, "fill=", 5) == 0) {
+            if (parse_u32(f + 5, &e->job.fill) != 0 || e->job.fill > 0xFFu)
+                return manifest_error(mpath, e->line, "invalid fill value (expected 0..255)", f + 5);
+            e->job.fill_set = 1;
+        } else if (strcmp(f, "segments") == 0) {
+            e->job.segments = 1;
+        } else if (strcmp(f, "compress") == 0) {
+            e->job.compress = 1;
+        } else if (strncmp(f, "type=", 5) == 0) {
+            if (strcmp(f + 5, "basic") == 0) e->job.forced_type = TYPE_BASIC;
+            else if (strcmp(f + 5, "mc") == 0 || strcmp(f + 5, "machine") == 0) e->job.forced_type = TYPE_MC;
+            else if (strcmp(f + 5, "auto") == 0) e->job.forced_type = TYPE_AUTO;
+            else return manifest_error(mpath, e->line, "invalid type (use basic|mc|auto)", f + 5);
+        } else {
+            return manifest_error(mpath, e->line, "unknown field", f);
+        }
+    }
+    return 0;
+}
+
+static void batch_free(BatchEntry *entries, size_t count)
+{
+    size_t i;
+    for (i = 0; i < count; i++)
+        free(entries[i].text);
+    free(entries);
+}
+
+/* Read all entries; a syntax error anywhere rejects the whole manifest. */
+static int manifest_load(const char *path, BatchEntry **out, size_t *out_count)
+{
+    FILE *f = fopen(path, "rb");
+    char line[BATCH_LINE_MAX];
+    BatchEntry *entries = NULL;
+    size_t count = 0, cap = 0, i;
+    unsigned long lineno = 0;
+    int bad = 0;
+
+    if (!f) {
+        fprintf(stderr, "vzpack: cannot open manifest %s\n", path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strcspn(line, "\r\n");
+        char *p = line;
+        lineno++;
+        if (line[len] == '\0' && !feof(f)) {
+            manifest_error(path, lineno, "line too long", NULL);
+            bad = 1;
+            break;
+        }
+        line[len] = '\0';
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '#') continue;
+
+        if (count == cap) {
+            size_t ncap = cap ? cap * 2u : 32u;
+            BatchEntry *ne = (BatchEntry *)realloc(entries, ncap * sizeof(*ne));
+            if (!ne) { bad = 1; break; }
+            entries = ne;
+            cap = ncap;
+        }
+        memset(&entries[count], 0, sizeof(entries[count]));
+        entries[count].line = lineno;
+        entries[count].text = (char *)malloc(len + 1u);
+        if (!entries[count].text) { bad = 1; break; }
+        memcpy(entries[count].text, line, len + 1u);
+        count++;
+        if (manifest_parse_entry(path, &entries[count - 1]) != 0)
+            bad = 1;
+    }
+    fclose(f);
+
+    /* Two entries writing one file would race; reject that up front. */
+    for (i = 0; !bad && i < count; i++) {
+        size_t k;
+        for (k = 0; k < i; k++) {
+            if (strcmp(entries[i].job.out_path, entries[k].job.out_path) == 0) {
+                manifest_error(path, entries[i].line, "output already produced by an earlier entry", entries[i].job.out_path);
+                bad = 1;
+                break;
+            }
+        }
+    }
+    if (bad) {
+        batch_free(entries, count);
+        return -1;
+    }
+    *out = entries;
+    *out_count = count;
+    return 0;
+}
+
+static int state_path(char *buf, size_t size, const char *manifest, const char *suffix)
+{
+    int n = snprintf(buf, size, "%s%s", manifest, suffix);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/* Attach hashes from the previous run; a missing or foreign state file is just ignored. */
+static void state_load(const char *path, BatchEntry *entries, size_t count)
+{
+    FILE *f = fopen(path, "rb");
+    char line[BATCH_LINE_MAX];
+    if (!f) return;
+    if (!fgets(line, sizeof(line), f) || strncmp(line, "VZPACK-STATE 1", 14) != 0) {
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char *end = NULL;
+        unsigned long long h;
+        size_t i;
+        line[strcspn(line, "\r\n")] = '\0';
+        h = strtoull(line, &end, 16);
+        if (end != line + 16 || *end != ' ') continue;
+        for (i = 0; i < count; i++) {
+            if (strcmp(entries[i].job.out_path, end + 1) == 0) {
+                entries[i].prev_hash = (uint64_t)h;
+                entries[i].have_prev = 1;
+                break;
+            }
+        }
+    }
+    fclose(f);
+}
+
+/* Record entries now known to be up to date; failed ones are left out so they rerun. */
+static int state_save(const char *path, const char *tmp_path, const BatchEntry *entries, size_t count)
+{
+    FILE *f = fopen(tmp_path, "wb");
+    size_t i;
+    if (!f) return -1;
+    fprintf(f, "VZPACK-STATE 1\n");
+    for (i = 0; i < count; i++) {
+        const BatchEntry *e = &entries[i];
+        if (e->result == BATCH_FAILED || !e->hash_ok) continue;
+        fprintf(f, "%08lx%08lx %s\n", (unsigned long)(e->hash >> 32),
+                (unsigned long)(e->hash & 0xFFFFFFFFu), e->job.out_path);
+    }
+    if (fclose(f) != 0) { remove(tmp_path); return -1; }
+    remove(path);
+    if (rename(tmp_path, path) != 0) { remove(tmp_path); return -1; }
+    return 0;
+}
+
+static int run_manifest(const char *mpath, int jobs, int force, Cache *cache)
+{
+    BatchRun b;
+    char spath[1024], stmp[1024];
+    size_t i, packed = 0, skipped = 0, failed = 0;
+
+    if (manifest_load(mpath, &b.entries, &b.count) != 0)
+        return 1;
+    if (state_path(spath, sizeof(spath), mpath, ".state") != 0 ||
+        state_path(stmp, sizeof(stmp), mpath, ".state.tmp") != 0) {
+        batch_free(b.entries, b.count);
+        die("manifest path too long");
+    }
+    state_load(spath, b.entries, b.count);
+
+    /* Shared read-only tables are built before any worker starts. */
+    basic_keywords_init();
+    b.next = 0;
+    b.force = force;
+    b.cache = cache;
+    if (vz_mutex_init(&b.lock) != 0) {
+        batch_free(b.entries, b.count);
+        die("cannot create batch lock");
+    }
+    batch_run(&b, jobs);
+    vz_mutex_destroy(&b.lock);
+
+    for (i = 0; i < b.count; i++) {
+        BatchEntry *e = &b.entries[i];
+        if (e->result == BATCH_PACKED) {
+            printf("Packed  %s -> %s (%s, 0x%04X, %lu bytes%s%s)\n", e->job.in_path, e->job.out_path,
+                   e->job.type == TYPE_BASIC ? "BASIC" : "MC", (unsigned)e->job.load_addr,
+                   (unsigned long)e->job.size, e->job.compressed ? ", compressed" : "",
+                   e->job.cached ? ", cached" : "");
+            packed++;
+        } else if (e->result == BATCH_SKIPPED) {
+            printf("Skipped %s -> %s (unchanged)\n", e->job.in_path, e->job.out_path);
+            skipped++;
+        } else {
+            fprintf(stderr, "vzpack: %s:%lu: %s\n", mpath, e->line, e->job.err);
+            failed++;
+        }
+    }
+    printf("Batch     : %lu packed, %lu unchanged, %lu failed\n",
+           (unsigned long)packed, (unsigned long)skipped, (unsigned long)failed);
+
+    if (state_save(spath, stmp, b.entries, b.count) != 0)
+        fprintf(stderr, "vzpack: warning: could not write %s\n", spath);
+    batch_free(b.entries, b.count);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    PackJob job;
+    const char *manifest = NULL;
+    int jobs = 0;
+    int force = 0;
+    const char *cache_dir = NULL;
+    uint32_t cache_max = CACHE_DEFAULT_MAX;
+    int cache_stats = 0;
+    Cache cache;
+    uint64_t key = 0;
+    int key_ok = 0;
+    int rc;
+    int i;
 
     if (argc < 2) {
         usage(argv[0]);
         return 1;
     }
 
+    memset(&job, 0, sizeof(job));
+    job.kind = INPUT_NONE;
+    job.forced_type = TYPE_AUTO;
+
     /*
      * Option order is free-form; only output path and one input source
-     * are mandatory.
+     * are mandatory (or a manifest, which supplies both per entry).
      */
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
@@ -722,39 +2028,59 @@ int main(int argc, char **argv)
             return 0;
         } else
         if ((strcmp(argv[i], "--in-bin") == 0 || strcmp(argv[i], "-b") == 0) && i + 1 < argc) {
-            if (in_kind != INPUT_NONE) die("multiple input sources specified");
-            in_kind = INPUT_BIN;
-            in_path = argv[++i];
+            if (job.kind != INPUT_NONE) die("multiple input sources specified");
+            job.kind = INPUT_BIN;
+            job.in_path = argv[++i];
         } else if ((strcmp(argv[i], "--in-hex") == 0 || strcmp(argv[i], "-x") == 0) && i + 1 < argc) {
-            if (in_kind != INPUT_NONE) die("multiple input sources specified");
-            in_kind = INPUT_HEX;
-            in_path = argv[++i];
+            if (job.kind != INPUT_NONE) die("multiple input sources specified");
+            job.kind = INPUT_HEX;
+            job.in_path = argv[++i];
         } else if ((strcmp(argv[i], "--in-srec") == 0 || strcmp(argv[i], "-r") == 0) && i + 1 < argc) {
-            if (in_kind != INPUT_NONE) die("multiple input sources specified");
-            in_kind = INPUT_SREC;
-            in_path = argv[++i];
+            if (job.kind != INPUT_NONE) die("multiple input sources specified");
+            job.kind = INPUT_SREC;
+            job.in_path = argv[++i];
         } else if ((strcmp(argv[i], "--in-bas") == 0 || strcmp(argv[i], "-B") == 0) && i + 1 < argc) {
-            if (in_kind != INPUT_NONE) die("multiple input sources specified");
-            in_kind = INPUT_BAS;
-            in_path = argv[++i];
+            if (job.kind != INPUT_NONE) die("multiple input sources specified");
+            job.kind = INPUT_BAS;
+            job.in_path = argv[++i];
+        } else if ((strcmp(argv[i], "--manifest") == 0 || strcmp(argv[i], "-m") == 0) && i + 1 < argc) {
+            manifest = argv[++i];
+        } else if ((strcmp(argv[i], "--jobs") == 0 || strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            uint32_t v;
+            if (parse_u32(argv[++i], &v) != 0 || v < 1u || v > BATCH_MAX_THREADS)
+                die("invalid --jobs value (expected 1..64)");
+            jobs = (int)v;
+        } else if (strcmp(argv[i], "--segments") == 0 || strcmp(argv[i], "-g") == 0) {
+            job.segments = 1;
+        } else if (strcmp(argv[i], "--compress") == 0 || strcmp(argv[i], "-z") == 0) {
+            job.compress = 1;
+        } else if (strcmp(argv[i], "--force") == 0) {
+            force = 1;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-max") == 0 && i + 1 < argc) {
+            if (parse_u32(argv[++i], &cache_max) != 0 || cache_max < 1u)
+                die("invalid --cache-max value (expected at least 1)");
+        } else if (strcmp(argv[i], "--cache-stats") == 0) {
+            cache_stats = 1;
         } else if ((strcmp(argv[i], "--out") == 0 || strcmp(argv[i], "-o") == 0) && i + 1 < argc) {
-            out_path = argv[++i];
+            job.out_path = argv[++i];
         } else if ((strcmp(argv[i], "--name") == 0 || strcmp(argv[i], "-n") == 0) && i + 1 < argc) {
-            name_override = argv[++i];
+            job.name_override = argv[++i];
         } else if ((strcmp(argv[i], "--type") == 0 || strcmp(argv[i], "-t") == 0) && i + 1 < argc) {
             const char *v = argv[++i];
-            if (strcmp(v, "basic") == 0) forced_type = TYPE_BASIC;
-            else if (strcmp(v, "mc") == 0 || strcmp(v, "machine") == 0) forced_type = TYPE_MC;
-            else if (strcmp(v, "auto") == 0) forced_type = TYPE_AUTO;
+            if (strcmp(v, "basic") == 0) job.forced_type = TYPE_BASIC;
+            else if (strcmp(v, "mc") == 0 || strcmp(v, "machine") == 0) job.forced_type = TYPE_MC;
+            else if (strcmp(v, "auto") == 0) job.forced_type = TYPE_AUTO;
             else die("invalid --type (use basic|mc|auto)");
         } else if ((strcmp(argv[i], "--start") == 0 || strcmp(argv[i], "-s") == 0) && i + 1 < argc) {
-            if (parse_u32(argv[++i], &start_override) != 0 || start_override > 0xFFFFu)
+            if (parse_u32(argv[++i], &job.start) != 0 || job.start > 0xFFFFu)
                 die("invalid --start value");
-            start_set = 1;
+            job.start_set = 1;
         } else if ((strcmp(argv[i], "--fill") == 0 || strcmp(argv[i], "-f") == 0) && i + 1 < argc) {
-            if (parse_u32(argv[++i], &fill_override) != 0 || fill_override > 0xFFu)
+            if (parse_u32(argv[++i], &job.fill) != 0 || job.fill > 0xFFu)
                 die("invalid --fill value (expected 0..255)");
-            fill_set = 1;
+            job.fill_set = 1;
         } else if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
             usage(argv[0]);
             return 0;
@@ -764,61 +2090,61 @@ int main(int argc, char **argv)
         }
     }
 
-    if (!out_path) die("missing output path (use -o/--out)");
-    if (in_kind == INPUT_NONE || !in_path) die("missing input source");
-
-    if (in_kind == INPUT_BIN) {
-        if (read_entire_file(in_path, &p.data, &p.size) != 0)
-            die("failed reading binary input");
-        if (!start_set)
-            die("--start is required for --in-bin");
-        p.start = (uint16_t)start_override;
-        p.start_set = 1;
-    } else if (in_kind == INPUT_HEX) {
-        if (load_from_ihex(in_path, &p, fill_set, (uint8_t)fill_override) != 0)
-            die("failed loading Intel HEX (invalid, sparse, or conflicting records)");
-    } else if (in_kind == INPUT_SREC) {
-        if (load_from_srec(in_path, &p, fill_set, (uint8_t)fill_override) != 0)
-            die("failed loading S-record (invalid, sparse, or conflicting records)");
-    } else if (in_kind == INPUT_BAS) {
-        if (load_from_bas(in_path, &p) != 0)
-            die("failed tokenizing BASIC input");
-    } else {
-        die("internal input selection error");
+    if (cache_stats && !cache_dir) die("--cache-stats needs --cache-dir");
+    if (cache_dir) cache_open(&cache, cache_dir, cache_max);
+
+    if (manifest) {
+        if (job.kind != INPUT_NONE || job.out_path || job.name_override || job.start_set ||
+            job.fill_set || job.compress || job.segments || job.forced_type != TYPE_AUTO)
+            die("--manifest takes inputs and per-entry options from the manifest file");
+        rc = run_manifest(manifest, jobs ? jobs : vz_cpu_count(), force, cache_dir ? &cache : NULL);
+        if (cache_dir) {
+            cache_close(&cache);
+            if (cache_stats) cache_report(&cache);
+            cache_free(&cache);
+        }
+        return rc;
     }
 
-    if (p.size > 65535u) {
-        payload_free(&p);
-        die("payload too large for VZ container");
+    /* --cache-dir DIR --cache-stats on its own just reports (and applies --cache-max). */
+    if (cache_stats && job.kind == INPUT_NONE && !job.out_path) {
+        cache_close(&cache);
+        cache_report(&cache);
+        cache_free(&cache);
+        return 0;
     }
 
-    if (start_set)
-        p.start = (uint16_t)start_override;
-
-    final_type = forced_type;
-    if (final_type == TYPE_AUTO)
-        final_type = (in_kind == INPUT_BAS) ? TYPE_BASIC : TYPE_MC;
-
-    if (name_override)
-        normalize_name(name, name_override);
-    else
-        normalize_name(name, in_path);
-
-    final_start = p.start;
-
-    if (write_vz_file(out_path, name, final_type, final_start, p.data, p.size) != 0) {
-        payload_free(&p);
-        die("failed writing output .vz");
+    if (!job.out_path) die("missing output path (use -o/--out)");
+    if (job.kind == INPUT_NONE || !job.in_path) die("missing input source");
+
+    if (cache_dir) key_ok = (job_hash(&job, &key) == 0);
+    rc = pack_cached(cache_dir ? &cache : NULL, &job, key, key_ok);
+    if (cache_dir) cache_close(&cache);
+    if (rc != 0)
+        die(job.err);
+
+    printf("Packed %s -> %s\n", job.in_path, job.out_path);
+    printf("Type      : %s\n", job.type == TYPE_BASIC ? "BASIC (0xF0)" : "Machine code (0xF1)");
+    printf("Name      : %.16s\n", job.name);
+    printf("Start     : 0x%04X\n", (unsigned)job.load_addr);
+    printf("Payload   : %lu bytes\n", (unsigned long)job.size);
+    if ((job.kind == INPUT_HEX || job.kind == INPUT_SREC) && job.fill_set)
+        printf("Fill byte : 0x%02X\n", (unsigned)(job.fill & 0xFFu));
+    if (job.segments)
+        printf("Segments  : %lu, entry 0x%04X\n", (unsigned long)job.seg_count,
+               (unsigned)(job.start_set ? job.start : job.unpack_addr));
+    if (job.compressed)
+        printf("Compressed: %lu -> %lu bytes, unpacks to 0x%04X\n", (unsigned long)job.unpack_size,
+               (unsigned long)job.size, (unsigned)job.unpack_addr);
+    else if (job.compress)
+        printf("Compressed: %s, stored uncompressed\n",
+               job.compress_rc == 2 ? "image would not fit below 0x10000" : "no gain");
+    if (job.cached)
+        printf("Cached    : output copied from %s\n", cache_dir);
+    if (cache_dir) {
+        if (cache_stats) cache_report(&cache);
+        cache_free(&cache);
     }
 
-    printf("Packed %s -> %s\n", in_path, out_path);
-    printf("Type      : %s\n", final_type == TYPE_BASIC ? "BASIC (0xF0)" : "Machine code (0xF1)");
-    printf("Name      : %.16s\n", name);
-    printf("Start     : 0x%04X\n", (unsigned)final_start);
-    printf("Payload   : %lu bytes\n", (unsigned long)p.size);
-    if ((in_kind == INPUT_HEX || in_kind == INPUT_SREC) && fill_set)
-        printf("Fill byte : 0x%02X\n", (unsigned)(fill_override & 0xFFu));
-
-    payload_free(&p);
     return 0;
 }
@@ -0,0 +1,162 @@
+/*
+ * vzstats.h  --  optional run-time instrumentation for vz2wav / wav2vz.
+ *
+ * Counters are plain struct fields bumped with STAT_ADD(); building with
+ * -DVZ_STATS=0 turns every update into a no-op and the tools then report
+ * that --stats is unavailable.  Phase timing is a small table of named
+ * phases, each accumulating wall time, CPU time and samples processed.
+ *
+ * Clock sources:
+ *   Win32/Win64 : QueryPerformanceCounter() wall, GetProcessTimes() CPU
+ *   POSIX       : clock_gettime(CLOCK_MONOTONIC) wall, clock() CPU
+ *                 (the including file defines _POSIX_C_SOURCE so the
+ *                 declaration is visible under -std=c99)
+ *   anything else (ia16 DOS) : clock() for both, ~55 ms resolution
+ *
+ * Header-only; everything is static so each tool gets its own copy.
+ */
+#ifndef VZSTATS_H
+#define VZSTATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+#ifndef VZ_STATS
+#define VZ_STATS 1
+#endif
+
+#if VZ_STATS
+#define STAT_ADD(s, field, n)  ((s).field += (unsigned long long)(n))
+#else
+#define STAT_ADD(s, field, n)  ((void)0)
+#endif
+
+#if VZ_STATS && defined(_WIN32)
+#include <windows.h>
+#endif
+
+/* Wall and CPU time in seconds from an arbitrary origin. */
+typedef struct {
+    double wall;
+    double cpu;
+} StatClock;
+
+typedef struct {
+    const char *name;
+    int    used;
+    double wall;
+    double cpu;
+    unsigned long long samples;
+} StatPhase;
+
+/*
+ * StatTimer -- phases[] is owned by the caller; cur is the running phase
+ * or -1.  Samples are reported by the caller as a running total, so each
+ * phase is credited with the difference between its start and end.
+ */
+typedef struct {
+    StatPhase *phases;
+    int        count;
+    int        cur;
+    StatClock  start;
+    unsigned long long start_samples;
+} StatTimer;
+
+static inline void stat_clock_now(StatClock *c)
+{
+#if !VZ_STATS
+    c->wall = 0.0;
+    c->cpu = 0.0;
+#elif defined(_WIN32)
+    LARGE_INTEGER f, t;
+    FILETIME ct, et, kt, ut;
+
+    QueryPerformanceFrequency(&f);
+    QueryPerformanceCounter(&t);
+    c->wall = (double)t.QuadPart / (double)f.QuadPart;
+    if (GetProcessTimes(GetCurrentProcess(), &ct, &et, &kt, &ut)) {
+        unsigned long long k = ((unsigned long long)kt.dwHighDateTime << 32) | kt.dwLowDateTime;
+        unsigned long long u = ((unsigned long long)ut.dwHighDateTime << 32) | ut.dwLowDateTime;
+        c->cpu = (double)(k + u) * 1e-7;
+    } else {
+        c->cpu = (double)clock() / (double)CLOCKS_PER_SEC;
+    }
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    c->wall = (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+    c->cpu = (double)clock() / (double)CLOCKS_PER_SEC;
+#else
+    c->cpu = (double)clock() / (double)CLOCKS_PER_SEC;
+    c->wall = c->cpu;
+#endif
+}
+
+static inline void stat_timer_init(StatTimer *t, StatPhase *phases, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        phases[i].used = 0;
+        phases[i].wall = 0.0;
+        phases[i].cpu = 0.0;
+        phases[i].samples = 0ULL;
+    }
+    t->phases = phases;
+    t->count = count;
+    t->cur = -1;
+    t->start.wall = 0.0;
+    t->start.cpu = 0.0;
+    t->start_samples = 0ULL;
+}
+
+/* Close the running phase (if any) and open 'phase' (-1 = none). */
+static inline void stat_phase(StatTimer *t, int phase, unsigned long long samples_now)
+{
+#if VZ_STATS
+    StatClock now;
+
+    stat_clock_now(&now);
+    if (t->cur >= 0) {
+        StatPhase *p = &t->phases[t->cur];
+        p->used = 1;
+        p->wall += now.wall - t->start.wall;
+        p->cpu += now.cpu - t->start.cpu;
+        p->samples += samples_now - t->start_samples;
+    }
+    t->cur = (phase >= 0 && phase < t->count) ? phase : -1;
+    t->start = now;
+    t->start_samples = samples_now;
+#else
+    (void)t;
+    (void)phase;
+    (void)samples_now;
+#endif
+}
+
+/* Phase table with a total line; unit names the sample column. */
+static inline void stat_print_phases(const StatTimer *t, const char *unit)
+{
+    double wall = 0.0, cpu = 0.0;
+    unsigned long long samples = 0ULL;
+    int i;
+
+    printf("  %-16s %10s %10s %12s %14s\n", "Phase", "Wall ms", "CPU ms", unit, "Per second");
+    for (i = 0; i < t->count; i++) {
+        const StatPhase *p = &t->phases[i];
+        if (!p->used)
+            continue;
+        printf("  %-16s %10.3f %10.3f %12llu %14.0f\n", p->name,
+               p->wall * 1000.0, p->cpu * 1000.0, p->samples,
+               p->wall > 0.0 ? (double)p->samples / p->wall : 0.0);
+        wall += p->wall;
+        cpu += p->cpu;
+        samples += p->samples;
+    }
+    printf("  %-16s %10.3f %10.3f %12llu %14.0f\n", "total",
+           wall * 1000.0, cpu * 1000.0, samples,
+           wall > 0.0 ? (double)samples / wall : 0.0);
+}
+
+#endif /* VZSTATS_H */
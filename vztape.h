@@ -0,0 +1,239 @@
+/*
+ * vztape.h  --  VZ200/300 cassette byte framing shared by vz2wav, wav2vz
+ * and vzexport (and the .cas files that carry that byte stream unchanged).
+ *
+ * On tape a file is:
+ *
+ *   leader     VZTAPE_LEADER_BYTE x n  (255 from the ROM, 128 in .cas)
+ *   sync       VZTAPE_SYNC_BYTE x 5
+ *   type       0xF0 BASIC, 0xF1 machine code
+ *   name       up to 16 characters, NUL-terminated
+ *   start, end load address and end address + 1, little-endian
+ *   data       end - start bytes
+ *   checksum   16-bit sum of the four address bytes and the data, LE
+ *
+ * vz2wav puts a short silence gap between name and addresses; that is
+ * part of the audio, not of the byte stream.  A .cvz container is the
+ * same stream with any number of files back to back, as they would
+ * follow each other on one cassette.
+ *
+ * Header-only; everything is static so each tool gets its own copy.
+ */
+#ifndef VZTAPE_H
+#define VZTAPE_H
+
+#include <stddef.h>
+#include <string.h>
+
+#define VZTAPE_LEADER_BYTE     0x80
+#define VZTAPE_LEADER_COUNT    255
+#define VZTAPE_CAS_LEADER      128
+#define VZTAPE_SYNC_BYTE       0xFE
+#define VZTAPE_SYNC_COUNT      5
+#define VZTAPE_NAME_LEN        16
+
+/* Longest type + name + addresses block. */
+#define VZTAPE_HEAD_MAX        (1 + VZTAPE_NAME_LEN + 1 + 4)
+
+/* Name bytes on tape, terminator included; name[VZTAPE_NAME_LEN] must be 0. */
+static inline size_t vztape_name_len(const unsigned char *name)
+{
+    size_t n = 0;
+    while (n < VZTAPE_NAME_LEN && name[n] != 0) n++;
+    return n + 1;
+}
+
+static inline unsigned long vztape_sum(unsigned long sum, const unsigned char *p, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; i++)
+        sum += p[i];
+    return sum;
+}
+
+/* Checksum over the address block and a data sum from vztape_sum(0, ...). */
+static inline unsigned vztape_checksum(unsigned start, unsigned end, unsigned long data_sum)
+{
+    return (unsigned)(((start & 0xFFu) + (start >> 8) + (end & 0xFFu) + (end >> 8) +
+                       data_sum) & 0xFFFFu);
+}
+
+/* Type, name and address block into out (VZTAPE_HEAD_MAX bytes); returns its length. */
+static inline size_t vztape_head(unsigned char *out, unsigned type, const unsigned char *name,
+                                 unsigned start, unsigned end)
+{
+    size_t n = vztape_name_len(name);
+    size_t k;
+
+    out[0] = (unsigned char)type;
+    for (k = 0; k < n; k++)
+        out[1 + k] = name[k];
+    out[1 + n] = (unsigned char)(start & 0xFFu);
+    out[2 + n] = (unsigned char)(start >> 8);
+    out[3 + n] = (unsigned char)(end & 0xFFu);
+    out[4 + n] = (unsigned char)(end >> 8);
+    return 5 + n;
+}
+
+/*
+ * Incremental tape stream parser.  Feed the stream in pieces of any size;
+ * vztape_scan() consumes bytes up to the next event and returns how many
+ * it used:
+ *
+ *   VZTAPE_EV_HEAD   header complete, s->ent describes the file
+ *   VZTAPE_EV_DATA   s->chunk/s->chunk_len is a run of payload bytes,
+ *                    pointing into the caller's buffer
+ *   VZTAPE_EV_END    checksum read, s->ent.checksum_ok is set
+ *   VZTAPE_EV_MORE   input used up, feed the next piece
+ *   VZTAPE_EV_ERROR  s->err says why; the stream cannot be resumed
+ *
+ * Offsets in s->ent count from the first byte ever fed, so a caller
+ * holding the whole stream can also use data/len as a view into it.
+ * Bytes other than a leader before a file (and after the last one) are
+ * skipped and counted in s->skipped.
+ */
+#define VZTAPE_EV_MORE   0
+#define VZTAPE_EV_HEAD   1
+#define VZTAPE_EV_DATA   2
+#define VZTAPE_EV_END    3
+#define VZTAPE_EV_ERROR  (-1)
+
+typedef struct {
+    unsigned long offset;       /* first leader byte */
+    unsigned long data;         /* first payload byte */
+    unsigned long size;         /* leader through checksum */
+    unsigned len;               /* payload bytes, end - start */
+    unsigned type, start;
+    unsigned leader, sync;
+    unsigned checksum;          /* as stored */
+    int checksum_ok;
+    unsigned char name[VZTAPE_NAME_LEN + 1];
+} VzTapeEntry;
+
+typedef struct {
+    int state;
+    unsigned long pos;          /* stream offset of the next byte */
+    unsigned long skipped;
+    unsigned k, left;
+    unsigned char addr[4];
+    unsigned long sum;
+    const unsigned char *chunk;
+    size_t chunk_len;
+    const char *err;
+    VzTapeEntry ent;
+} VzTapeScan;
+
+enum { VZTAPE_S_GAP, VZTAPE_S_LEADER, VZTAPE_S_SYNC, VZTAPE_S_NAME, VZTAPE_S_ADDR,
+       VZTAPE_S_DATA, VZTAPE_S_CK };
+
+static inline void vztape_scan_init(VzTapeScan *s)
+{
+    s->state = VZTAPE_S_GAP;
+    s->pos = 0;
+    s->skipped = 0;
+    s->chunk = NULL;
+    s->chunk_len = 0;
+    s->err = NULL;
+}
+
+static inline size_t vztape_scan(VzTapeScan *s, const unsigned char *p, size_t n, int *ev)
+{
+    size_t i = 0;
+
+    while (i < n) {
+        unsigned b = p[i];
+
+        if (s->state == VZTAPE_S_DATA) {
+            size_t take = n - i;
+            if (take > s->left) take = s->left;
+            s->chunk = p + i;
+            s->chunk_len = take;
+            s->sum = vztape_sum(s->sum, p + i, take);
+            s->left -= (unsigned)take;
+            s->pos += take;
+            if (s->left == 0) s->state = VZTAPE_S_CK;
+            *ev = VZTAPE_EV_DATA;
+            return i + take;
+        }
+        i++;
+        s->pos++;
+        switch (s->state) {
+        case VZTAPE_S_GAP:
+            if (b != VZTAPE_LEADER_BYTE) {
+                s->skipped++;
+                break;
+            }
+            memset(&s->ent, 0, sizeof(s->ent));
+            s->ent.offset = s->pos - 1;
+            s->ent.leader = 1;
+            s->state = VZTAPE_S_LEADER;
+            break;
+        case VZTAPE_S_LEADER:
+            if (b == VZTAPE_LEADER_BYTE) {
+                s->ent.leader++;
+            } else if (b == VZTAPE_SYNC_BYTE) {
+                s->ent.sync = 1;
+                s->state = VZTAPE_S_SYNC;
+            } else {
+                s->err = "leader not followed by sync bytes";
+                *ev = VZTAPE_EV_ERROR;
+                return i;
+            }
+            break;
+        case VZTAPE_S_SYNC:
+            if (b == VZTAPE_SYNC_BYTE) {
+                s->ent.sync++;
+            } else {
+                s->ent.type = b;
+                s->k = 0;
+                s->state = VZTAPE_S_NAME;
+            }
+            break;
+        case VZTAPE_S_NAME:
+            if (b == 0) {
+                s->k = 0;
+                s->state = VZTAPE_S_ADDR;
+            } else if (s->k == VZTAPE_NAME_LEN) {
+                s->err = "file name longer than 16 characters";
+                *ev = VZTAPE_EV_ERROR;
+                return i;
+            } else {
+                s->ent.name[s->k++] = (unsigned char)b;
+            }
+            break;
+        case VZTAPE_S_ADDR:
+            s->addr[s->k++] = (unsigned char)b;
+            if (s->k < 4) break;
+            s->ent.start = s->addr[0] | ((unsigned)s->addr[1] << 8);
+            s->ent.len = ((s->addr[2] | ((unsigned)s->addr[3] << 8)) - s->ent.start) & 0xFFFFu;
+            s->ent.data = s->pos;
+            s->left = s->ent.len;
+            s->sum = 0;
+            s->k = 0;
+            s->state = s->left ? VZTAPE_S_DATA : VZTAPE_S_CK;
+            *ev = VZTAPE_EV_HEAD;
+            return i;
+        case VZTAPE_S_CK:
+            s->addr[s->k++] = (unsigned char)b;
+            if (s->k < 2) break;
+            s->ent.checksum = s->addr[0] | ((unsigned)s->addr[1] << 8);
+            s->ent.checksum_ok = s->ent.checksum ==
+                vztape_checksum(s->ent.start, (s->ent.start + s->ent.len) & 0xFFFFu, s->sum);
+            s->ent.size = s->pos - s->ent.offset;
+            s->state = VZTAPE_S_GAP;
+            *ev = VZTAPE_EV_END;
+            return i;
+        }
+    }
+    *ev = VZTAPE_EV_MORE;
+    return i;
+}
+
+/* At end of input: NULL if the stream stopped between files. */
+static inline const char *vztape_scan_finish(const VzTapeScan *s)
+{
+    if (s->err) return s->err;
+    return s->state == VZTAPE_S_GAP ? NULL : "stream ends inside a file";
+}
+
+#endif /* VZTAPE_H */
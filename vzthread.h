@@ -0,0 +1,80 @@
+/*
+ * vzthread.h  --  minimal thread shim for the batch modes of vzpack and
+ * vzexport: Win32 threads on Windows, pthreads on POSIX hosts, and plain
+ * sequential work elsewhere (DOS), or when built with -DVZ_THREADS=0.
+ *
+ * Only a mutex, start/join and a CPU count; thread entry points are
+ * declared per platform by the caller (DWORD WINAPI fn(LPVOID) on
+ * Win32, void *fn(void *) with pthreads).  POSIX callers define
+ * _POSIX_C_SOURCE before their first include so pthreads and sysconf()
+ * are declared under -std=c99.
+ *
+ * Header-only; everything is static so each tool gets its own copy.
+ */
+#ifndef VZTHREAD_H
+#define VZTHREAD_H
+
+#ifndef VZ_THREADS
+#if defined(_WIN32) || ((defined(__unix__) || defined(__APPLE__)) && !defined(__MSDOS__) && !defined(__ia16__))
+#define VZ_THREADS 1
+#else
+#define VZ_THREADS 0
+#endif
+#endif
+
+#define VZ_MAX_THREADS 64
+
+#if VZ_THREADS && defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+typedef HANDLE vz_thread_t;
+typedef CRITICAL_SECTION vz_mutex_t;
+static inline int vz_mutex_init(vz_mutex_t *m) { InitializeCriticalSection(m); return 0; }
+static inline void vz_mutex_destroy(vz_mutex_t *m) { DeleteCriticalSection(m); }
+static inline void vz_mutex_lock(vz_mutex_t *m) { EnterCriticalSection(m); }
+static inline void vz_mutex_unlock(vz_mutex_t *m) { LeaveCriticalSection(m); }
+static inline int vz_thread_start(vz_thread_t *t, LPTHREAD_START_ROUTINE fn, void *arg)
+{
+    *t = CreateThread(NULL, 0, fn, arg, 0, NULL);
+    return *t ? 0 : -1;
+}
+static inline void vz_thread_join(vz_thread_t t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+#elif VZ_THREADS
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t vz_thread_t;
+typedef pthread_mutex_t vz_mutex_t;
+static inline int vz_mutex_init(vz_mutex_t *m) { return pthread_mutex_init(m, NULL); }
+static inline void vz_mutex_destroy(vz_mutex_t *m) { pthread_mutex_destroy(m); }
+static inline void vz_mutex_lock(vz_mutex_t *m) { pthread_mutex_lock(m); }
+static inline void vz_mutex_unlock(vz_mutex_t *m) { pthread_mutex_unlock(m); }
+static inline int vz_thread_start(vz_thread_t *t, void *(*fn)(void *), void *arg)
+{
+    return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+}
+static inline void vz_thread_join(vz_thread_t t) { pthread_join(t, NULL); }
+#else
+typedef int vz_mutex_t;
+static inline int vz_mutex_init(vz_mutex_t *m) { *m = 0; return 0; }
+static inline void vz_mutex_destroy(vz_mutex_t *m) { (void)m; }
+static inline void vz_mutex_lock(vz_mutex_t *m) { (void)m; }
+static inline void vz_mutex_unlock(vz_mutex_t *m) { (void)m; }
+#endif
+
+/* Online CPUs, clamped to 1..VZ_MAX_THREADS; 1 without thread support. */
+static inline int vz_cpu_count(void)
+{
+    long n = 1;
+#if VZ_THREADS && defined(_WIN32)
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    n = (long)si.dwNumberOfProcessors;
+#elif VZ_THREADS && defined(_SC_NPROCESSORS_ONLN)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n < 1) n = 1;
+    if (n > VZ_MAX_THREADS) n = VZ_MAX_THREADS;
+    return (int)n;
+}
+
+#endif /* VZTHREAD_H */
@@ -8,18 +8,30 @@
  *
  * Build:
  *   Linux/macOS : gcc  -std=c99 -O2 -Wall -Wextra -o wav2vz wav2vz.c
+ *   (add -DVZ_STATS=0 to compile the --stats counters out)
  *   MinGW Win32 : gcc  -std=c99 -O2 -Wall -Wextra -o wav2vz.exe wav2vz.c
  *   MinGW Win64 : same -- Win32 ABI honoured via LLP64; 'long' not used
  *
  * Usage:  wav2vz [--legacy|-l] [--gain|-g <percent>] input.wav output.vz
  *         wav2vz [--legacy|-l] [--gain|-g <percent>] --analyze input.wav
+ *                [--window <ms>] [--csv <file>] [--json <file>]
+ *         wav2vz [options] --index input.wav
+ *         wav2vz [options] --program <n>|--name <name> input.wav output.vz
+ *         wav2vz [options] --checkpoint|--resume|--resume-leader input.wav output.vz
+ *         wav2vz [options] --cas output.cas input.wav output.vz
  *
  * -------------------------------------------------------------------------
  * Portability audit (GCC/Linux vs MinGW/Win32 and Win64):
  *
  *  sizeof(int)  = 4 on LP64 Linux AND LLP64 Win32/Win64.  Safe.
  *  sizeof(long) = 8 on LP64 Linux, 4 on LLP64 Win32/Win64.
- *                 'long' is deliberately ABSENT from this file.
+ *                 'long' is kept out of all data structures; it only
+ *                 appears where the C library demands it (strtol() in
+ *                 option parsing, fseek() on the small .vz output).
+ *                 The WAV is positioned through wav_seek()/wav_tell():
+ *                 _fseeki64() on Windows, fseeko() with a 64-bit off_t
+ *                 on POSIX, and fseek() range-checked against LONG_MAX
+ *                 anywhere else.
  *
  *  stdint.h (uint8_t, uint16_t, uint32_t):
  *    Present in MinGW >= GCC 4.x.  No conditional inclusion needed.
@@ -33,18 +45,19 @@
  *    %02X / %04X used for hex; paired with (unsigned) cast.
  *    'long' format modifiers (%lu, %ld, %lX) are NOT used.
  *
- *  fgetc() returns int in [-1..255].  EOF == -1.
+ *  dec_rawgetc() (block-buffered fgetc) returns int in [-1..255].
  *    We check (c == EOF) as an int comparison BEFORE any cast to uint8_t
  *    or unsigned.  Casting EOF to uint8_t yields 0xFF, which is >=
  *    TAPE_LEADER_THRESH (0x90) -- a silent false positive on truncated
  *    files.  The explicit EOF guard prevents this.
  *
  *  fread() / fwrite() return size_t.
- *    Compared only to the literal 1 in a size_t context; no narrowing.
+ *    Compared only to size_t counts; no narrowing.
  *
- *  ungetc():
- *    Called only on files opened in binary mode ("rb").  The Windows CRT
- *    restriction on ungetc() with bytes > 127 applies only to text mode.
+ *  Push-back:
+ *    Samples are pushed back by rewinding the block buffer index, not
+ *    with ungetc(), so there is no one-byte pushback limit and no CRT
+ *    text-mode caveat.
  *
  *  #pragma pack:
  *    Supported identically by GCC and MinGW (MSVC syntax, widely adopted).
@@ -54,10 +67,22 @@
  * -------------------------------------------------------------------------
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L     /* clock_gettime() for --stats, fseeko() */
+#endif
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#define _FILE_OFFSET_BITS 64        /* 64-bit off_t on 32-bit hosts */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+
+#include "vzstats.h"
+#include "vztape.h"
 
 #ifndef TOOL_VERSION
 #define TOOL_VERSION "dev"
@@ -127,6 +152,24 @@
 #define MIN_INPUT_GAIN_PERCENT    -90
 #define MAX_INPUT_GAIN_PERCENT    300
 
+/*
+ * Input is pulled through a fixed block buffer rather than one fgetc()
+ * per sample.  4 KB keeps the context small enough for the ia16 build.
+ */
+#define WAV_BLOCK_SIZE            4096u
+#define WAV_SAMPLE_RATE           22050u
+#define DEFAULT_WINDOW_MS         1000u
+
+/*
+ * Schmitt trigger actions looked up per (smoothed) input level.  Capture
+ * mode indexes by the 3-tap sum (0..765) so the divide folds into the
+ * table as well.
+ */
+#define LEVEL_LOW                 0u
+#define LEVEL_HIGH                1u
+#define LEVEL_HOLD                2u
+#define LEVEL_LUT_SIZE            (3u * 255u + 1u)
+
 /* -----------------------------------------------------------------------
  * WAV RIFF header -- packed struct to match the on-disk RIFF layout.
  *
@@ -194,25 +237,88 @@ typedef struct {
 STATIC_ASSERT(sizeof(VzHeader) == 24u, VzHeader_must_be_24_bytes);
 
 /* -----------------------------------------------------------------------
- * Global file handles.
- * Kept global so fatal() can close them from any call depth.
+ * Decoder status codes.
+ *
+ * Every decode step returns one of these instead of exiting, so callers
+ * own the policy for reporting and cleanup.  The first error is sticky
+ * in the context: once set, further reads short-circuit to CYCLE_ERROR
+ * and the framing loops terminate.
+ * ----------------------------------------------------------------------- */
+typedef enum {
+    DEC_OK = 0,
+    DEC_ERR_EOF,            /* WAV data ended inside a tape frame          */
+    DEC_ERR_NO_SIGNAL,      /* WAV data ended before any leader tone       */
+    DEC_ERR_WAV_HEADER,     /* short read on the 72-byte RIFF header       */
+    DEC_ERR_WAV_FORMAT,     /* not 22050 Hz / 8-bit / mono                 */
+    DEC_ERR_PREAMBLE_START, /* first byte after leader was not 0xFE        */
+    DEC_ERR_PREAMBLE,       /* one of the remaining 4 sync bytes was wrong */
+    DEC_ERR_IO,             /* read error on the WAV stream                */
+    DEC_ERR_NOMEM           /* context buffers could not be allocated      */
+} DecStatus;
+
+/* Hot-path counters for --stats; updates vanish with -DVZ_STATS=0. */
+typedef struct {
+    unsigned long long edges;           /* Schmitt trigger transitions     */
+    unsigned long long cycles_short;
+    unsigned long long cycles_long;
+    unsigned long long cycles_error;
+    unsigned long long skipped_slots;   /* CYCLE_ERROR bit slots in a byte */
+    unsigned long long resyncs;         /* checksum resync fallbacks       */
+} DecCounters;
+
+/* -----------------------------------------------------------------------
+ * Decoder context.
+ *
+ * Holds everything one decode needs: the input stream and its block
+ * buffer, the signal-path settings, the Schmitt/smoothing filter history,
+ * and the EOF/budget bookkeeping used while reading the checksum.
+ * Contexts share nothing, so independent decodes can run side by side in
+ * one process.
+ *
+ * buf_base is the sample index (counted from the end of the 72-byte
+ * header) of buf[0], so buf_base + buf_pos is the next sample to read.
  * ----------------------------------------------------------------------- */
-static FILE *g_wav = NULL;
-static FILE *g_vz  = NULL;
-static int g_allow_eof = 0;
-static int g_hit_eof = 0;
-static int g_budget_active = 0;
-static size_t g_budget_remaining = 0;
-static int g_logic_state = -1;
-static int g_capture_mode = 1;
-static unsigned g_prev_raw1 = LOGIC_CENTER;
-static unsigned g_prev_raw2 = LOGIC_CENTER;
-static int g_input_gain_percent = DEFAULT_INPUT_GAIN_PERCENT;
+typedef struct {
+    FILE    *wav;
+    uint8_t *buf;
+    size_t   buf_len;
+    size_t   buf_pos;
+    unsigned long long buf_base;
+    int      buf_eof;
+    int      capture_mode;          /* 1 = widened windows + 3-tap filter */
+    int      input_gain_percent;
+    uint8_t  gain_lut[256];         /* centre-referenced gain, clamped    */
+    uint8_t  level_lut[LEVEL_LUT_SIZE]; /* LEVEL_* per input level/sum    */
+    int      logic_state;           /* -1 until the first sample is seen  */
+    unsigned prev_raw1;
+    unsigned prev_raw2;
+    int      allow_eof;
+    int      hit_eof;
+    int      budget_active;
+    size_t   budget_remaining;
+    DecStatus status;
+    DecCounters stats;
+    unsigned long long seek_delta;  /* net distance moved by dec_seek()   */
+} WavDecoder;
+
+/* Tape header fields as transmitted after the sync preamble. */
+typedef struct {
+    uint8_t  file_type;
+    uint8_t  filename[17];
+    uint16_t start_addr;
+    uint16_t end_addr;
+} TapeHeader;
 
 static void print_usage(void)
 {
     printf("Usage: WAV2VZ [--legacy|-l] [--gain|-g <percent>] wavfile.wav vzfile.vz\n");
     printf("       WAV2VZ [--legacy|-l] [--gain|-g <percent>] --analyze wavfile.wav\n");
+    printf("              [--window <ms>] [--csv <file>] [--json <file>]\n");
+    printf("       WAV2VZ [options] --index wavfile.wav\n");
+    printf("       WAV2VZ [options] --program <n>|--name <name> wavfile.wav vzfile.vz\n");
+    printf("       WAV2VZ [options] [--checkpoint|--resume|--resume-leader] wavfile.wav vzfile.vz\n");
+    printf("       --cas <file> with a decode also writes the tape bytes as .cas\n");
+    printf("       --stats with any of the above prints phase timing and counters\n");
     printf("       WAV2VZ --version|-V\n\n");
 }
 
@@ -231,263 +337,827 @@ static int parse_gain_percent(const char *s, int *out)
     return 0;
 }
 
-static void get_cycle_window(int *short_lo, int *short_hi, int *long_lo, int *long_hi)
+/* Value of the option at argv[*i]; a missing value is a usage error. */
+static const char *option_value(int argc, char *argv[], int *i)
+{
+    if (*i + 1 >= argc) {
+        printf("error -- %s requires an argument\n", argv[*i]);
+        exit(1);
+    }
+    return argv[++*i];
+}
+
+static void get_cycle_window(const WavDecoder *d,
+                             int *short_lo, int *short_hi, int *long_lo, int *long_hi)
 {
-    *short_lo = g_capture_mode ? CYCLE_SHORT_LO_CAPTURE : CYCLE_SHORT_LO_NORMAL;
-    *short_hi = g_capture_mode ? CYCLE_SHORT_HI_CAPTURE : CYCLE_SHORT_HI_NORMAL;
-    *long_lo  = g_capture_mode ? CYCLE_LONG_LO_CAPTURE  : CYCLE_LONG_LO_NORMAL;
-    *long_hi  = g_capture_mode ? CYCLE_LONG_HI_CAPTURE  : CYCLE_LONG_HI_NORMAL;
+    *short_lo = d->capture_mode ? CYCLE_SHORT_LO_CAPTURE : CYCLE_SHORT_LO_NORMAL;
+    *short_hi = d->capture_mode ? CYCLE_SHORT_HI_CAPTURE : CYCLE_SHORT_HI_NORMAL;
+    *long_lo  = d->capture_mode ? CYCLE_LONG_LO_CAPTURE  : CYCLE_LONG_LO_NORMAL;
+    *long_hi  = d->capture_mode ? CYCLE_LONG_HI_CAPTURE  : CYCLE_LONG_HI_NORMAL;
 }
 
 /* -----------------------------------------------------------------------
- * fatal() -- print error, close files, exit.
+ * dec_strerror() -- message text for a status code.
+ *
+ * Wording matches the messages the tool has always printed.
  * ----------------------------------------------------------------------- */
-static void fatal(const char *msg)
+static const char *dec_strerror(DecStatus st)
+{
+    switch (st) {
+    case DEC_OK:                 return "OK";
+    case DEC_ERR_EOF:            return "\nFATAL ERROR - unexpected end of WAV file";
+    case DEC_ERR_NO_SIGNAL:      return "error -- unexpected end of file while searching for signal";
+    case DEC_ERR_WAV_HEADER:     return "error - could not read WAV header";
+    case DEC_ERR_WAV_FORMAT:     return "error - WAV file must be 22050hz 8 bit mono";
+    case DEC_ERR_PREAMBLE_START: return "error finding preamble";
+    case DEC_ERR_PREAMBLE:       return "error reading preamble";
+    case DEC_ERR_IO:             return "error -- read error on WAV file";
+    case DEC_ERR_NOMEM:          return "error -- out of memory";
+    }
+    return "unknown decoder error";
+}
+
+/* Reset the Schmitt trigger and smoothing history to their idle state. */
+static void dec_reset_filter(WavDecoder *d)
+{
+    d->logic_state = -1;
+    d->prev_raw1 = LOGIC_CENTER;
+    d->prev_raw2 = LOGIC_CENTER;
+}
+
+/*
+ * dec_init() -- bind a context to an open WAV stream.
+ *
+ * The gain stage and the Schmitt thresholds are pure functions of the
+ * (smoothed) sample value, so both are folded into tables once here
+ * instead of a divide, multiply and two compares per sample.  Returns
+ * DEC_ERR_NOMEM if the block buffer cannot be allocated; dec_free() is
+ * safe to call either way.
+ */
+static DecStatus dec_init(WavDecoder *d, FILE *wav, int capture_mode, int input_gain_percent)
+{
+    int v;
+    unsigned k;
+    int gain_num = 100 + input_gain_percent;
+    const unsigned hi_thresh = capture_mode ? LOGIC_HIGH_THRESH_CAPTURE
+                                            : LOGIC_HIGH_THRESH_NORMAL;
+    const unsigned lo_thresh = capture_mode ? LOGIC_LOW_THRESH_CAPTURE
+                                            : LOGIC_LOW_THRESH_NORMAL;
+
+    memset(d, 0, sizeof(*d));
+    d->wav = wav;
+    d->capture_mode = capture_mode;
+    d->input_gain_percent = input_gain_percent;
+    d->status = DEC_OK;
+    dec_reset_filter(d);
+
+    for (v = 0; v < 256; v++) {
+        int centered = v - (int)LOGIC_CENTER;
+        int scaled = (int)LOGIC_CENTER + (centered * gain_num) / 100;
+        if (scaled < 0) scaled = 0;
+        if (scaled > 255) scaled = 255;
+        d->gain_lut[v] = (uint8_t)scaled;
+    }
+    for (k = 0; k < LEVEL_LUT_SIZE; k++) {
+        unsigned uc = capture_mode ? k / 3u : (k > 255u ? 255u : k);
+        uc = d->gain_lut[uc];
+        if (uc >= hi_thresh)
+            d->level_lut[k] = LEVEL_HIGH;
+        else if (uc <= lo_thresh)
+            d->level_lut[k] = LEVEL_LOW;
+        else
+            d->level_lut[k] = LEVEL_HOLD;
+    }
+
+    d->buf = (uint8_t *)malloc(WAV_BLOCK_SIZE);
+    if (!d->buf)
+        d->status = DEC_ERR_NOMEM;
+    return d->status;
+}
+
+static void dec_free(WavDecoder *d)
+{
+    free(d->buf);
+    d->buf = NULL;
+}
+
+/*
+ * dec_fill() -- refill the block buffer.
+ *
+ * Returns the number of samples now available (0 at end of stream).
+ */
+static size_t dec_fill(WavDecoder *d)
+{
+    size_t n;
+
+    if (d->buf_eof)
+        return 0;
+    d->buf_base += (unsigned long long)d->buf_len;
+    d->buf_pos = 0;
+    n = fread(d->buf, 1u, WAV_BLOCK_SIZE, d->wav);
+    d->buf_len = n;
+    if (n < WAV_BLOCK_SIZE) {
+        d->buf_eof = 1;
+        if (ferror(d->wav) && d->status == DEC_OK)
+            d->status = DEC_ERR_IO;
+    }
+    return n;
+}
+
+/* Raw block-buffered fgetc(): [0..255] or EOF, no status side effects. */
+static int dec_rawgetc(WavDecoder *d)
+{
+    if (d->buf_pos >= d->buf_len && dec_fill(d) == 0)
+        return EOF;
+    return (int)d->buf[d->buf_pos++];
+}
+
+/*
+ * dec_ungetc() -- push back the sample just read.
+ *
+ * Only ever called right after a successful read, so the sample is still
+ * in the buffer (a refill leaves buf_pos == 1 after that read).
+ */
+static void dec_ungetc(WavDecoder *d)
+{
+    if (d->buf_pos > 0)
+        d->buf_pos--;
+}
+
+/* Record the first error only; later failures are consequences of it. */
+static void dec_fail(WavDecoder *d, DecStatus st)
 {
-    fprintf(stderr, "%s\n", msg);
-    if (g_wav) { fclose(g_wav); g_wav = NULL; }
-    if (g_vz)  { fclose(g_vz);  g_vz  = NULL; }
-    exit(1);
+    if (d->status == DEC_OK)
+        d->status = st;
 }
 
 /* -----------------------------------------------------------------------
- * safe_fgetc() -- fgetc() with EOF -> fatal().
+ * dec_getc() -- buffered sample read with EOF -> sticky DEC_ERR_EOF.
  *
- * Returns int in [0..255].  Return type is int (not uint8_t) so the
- * caller can pass the value directly to ungetc() without a cast.
- * ungetc() is specified to take an int argument; passing a uint8_t
- * value that has been sign-extended through a char would be wrong on
- * platforms where char is signed.
+ * Returns int in [0..255], or EOF when the stream (or the active sample
+ * budget) is exhausted.  With allow_eof set, EOF only raises hit_eof so
+ * the checksum reader can fall back; otherwise it records DEC_ERR_EOF.
+ * Return type is int (not uint8_t) so EOF stays distinguishable from a
+ * 0xFF sample.
  * ----------------------------------------------------------------------- */
-static int safe_fgetc(void)
+static int dec_getc(WavDecoder *d)
 {
-    if (g_budget_active && g_budget_remaining == 0) {
-        if (g_allow_eof) {
-            g_hit_eof = 1;
-            return EOF;
-        }
-        fatal("\nFATAL ERROR - unexpected end of WAV file");
+    int c;
+
+    if (d->status != DEC_OK)
+        return EOF;
+    if (d->budget_active && d->budget_remaining == 0) {
+        if (d->allow_eof)
+            d->hit_eof = 1;
+        else
+            dec_fail(d, DEC_ERR_EOF);
+        return EOF;
     }
-    int c = fgetc(g_wav);
+    c = dec_rawgetc(d);
     if (c == EOF)
     {
-        if (g_allow_eof) {
-            g_hit_eof = 1;
+        if (d->status != DEC_OK)
             return EOF;
-        }
-        fatal("\nFATAL ERROR - unexpected end of WAV file");
+        if (d->allow_eof)
+            d->hit_eof = 1;
+        else
+            dec_fail(d, DEC_ERR_EOF);
+        return EOF;
     }
-    if (g_budget_active && g_budget_remaining > 0)
-        g_budget_remaining--;
+    if (d->budget_active && d->budget_remaining > 0)
+        d->budget_remaining--;
     return c;   /* guaranteed [0..255] */
 }
 
-static void budget_start(size_t samples)
+static void budget_start(WavDecoder *d, size_t samples)
 {
-    g_budget_active = 1;
-    g_budget_remaining = samples;
+    d->budget_active = 1;
+    d->budget_remaining = samples;
 }
 
-static void budget_stop(void)
+static void budget_stop(WavDecoder *d)
 {
-    g_budget_active = 0;
+    d->budget_active = 0;
 }
 
-static int sample_is_high(int c)
+/* -----------------------------------------------------------------------
+ * sample_is_high() -- one step of the smoothing filter + Schmitt trigger.
+ *
+ * Capture mode averages the last three raw samples (suppressing one-
+ * sample spikes from noisy captures); the sum indexes level_lut directly.
+ * ----------------------------------------------------------------------- */
+static int sample_is_high(WavDecoder *d, int c)
 {
-    unsigned uc = (unsigned)c;
-    const unsigned hi_thresh = g_capture_mode ? LOGIC_HIGH_THRESH_CAPTURE
-                                              : LOGIC_HIGH_THRESH_NORMAL;
-    const unsigned lo_thresh = g_capture_mode ? LOGIC_LOW_THRESH_CAPTURE
-                                              : LOGIC_LOW_THRESH_NORMAL;
+    unsigned idx = (unsigned)c;
+    uint8_t act;
 
-    if (g_capture_mode) {
-        /* 3-tap smoothing suppresses one-sample spikes from noisy captures. */
-        unsigned raw = uc;
-        uc = (uc + g_prev_raw1 + g_prev_raw2) / 3u;
-        g_prev_raw2 = g_prev_raw1;
-        g_prev_raw1 = raw;
+    if (d->capture_mode) {
+        idx = (unsigned)c + d->prev_raw1 + d->prev_raw2;
+        d->prev_raw2 = d->prev_raw1;
+        d->prev_raw1 = (unsigned)c;
     }
 
-    {
-        int gain_num = 100 + g_input_gain_percent;
-        int centered = (int)uc - (int)LOGIC_CENTER;
-        int scaled = (int)LOGIC_CENTER + (centered * gain_num) / 100;
-        if (scaled < 0) scaled = 0;
-        if (scaled > 255) scaled = 255;
-        uc = (unsigned)scaled;
+    if (d->logic_state < 0) {
+        unsigned uc = d->capture_mode ? idx / 3u : idx;
+        d->logic_state = (d->gain_lut[uc] >= LOGIC_CENTER) ? 1 : 0;
     }
 
-    if (g_logic_state < 0)
-        g_logic_state = (uc >= LOGIC_CENTER) ? 1 : 0;
-
-    if (uc >= hi_thresh)
-        g_logic_state = 1;
-    else if (uc <= lo_thresh)
-        g_logic_state = 0;
+    act = d->level_lut[idx];
+    if (act != LEVEL_HOLD) {
+        STAT_ADD(d->stats, edges, (int)act != d->logic_state);
+        d->logic_state = (int)act;
+    }
+    return d->logic_state;
+}
 
-    return g_logic_state;
+/* -----------------------------------------------------------------------
+ * dec_levels() -- sample_is_high() over a whole span.
+ *
+ * Same filter, with the history held in locals so the serial loop stays
+ * in registers.  states[i] receives 0 or 1 for p[i].
+ * ----------------------------------------------------------------------- */
+static void dec_levels(WavDecoder *d, const uint8_t *p, size_t n, uint8_t *states)
+{
+    const uint8_t *lut = d->level_lut;
+    unsigned r1 = d->prev_raw1;
+    unsigned r2 = d->prev_raw2;
+    size_t i = 0;
+    int ls;
+
+    if (n == 0)
+        return;
+    if (d->logic_state < 0)
+        states[i++] = (uint8_t)sample_is_high(d, (int)p[0]);
+    r1 = d->prev_raw1;
+    r2 = d->prev_raw2;
+    ls = d->logic_state;
+
+    if (d->capture_mode) {
+        for (; i < n; i++) {
+            unsigned raw = p[i];
+            uint8_t act = lut[raw + r1 + r2];
+            r2 = r1;
+            r1 = raw;
+            if (act != LEVEL_HOLD) ls = (int)act;
+            states[i] = (uint8_t)ls;
+        }
+    } else {
+        for (; i < n; i++) {
+            uint8_t act = lut[p[i]];
+            if (act != LEVEL_HOLD) ls = (int)act;
+            states[i] = (uint8_t)ls;
+        }
+    }
+    d->prev_raw1 = r1;
+    d->prev_raw2 = r2;
+    d->logic_state = ls;
 }
 
-static int resync_to_high(void)
+static int resync_to_high(WavDecoder *d)
 {
     int c;
     do {
-        c = safe_fgetc();
+        c = dec_getc(d);
         if (c == EOF)
             return -1;
-    } while (!sample_is_high(c));
-    ungetc(c, g_wav);
+    } while (!sample_is_high(d, c));
+    dec_ungetc(d);
     return 0;
 }
 
-static void analyze_wav_stream(void)
+/* -----------------------------------------------------------------------
+ * Run-length histogram with one bin per sample count.
+ *
+ * Bins grow on demand, so a long dropout is recorded at its exact length
+ * instead of being folded into an overflow bucket.  top is one past the
+ * highest populated bin, which keeps clearing and printing cheap.
+ * ----------------------------------------------------------------------- */
+typedef struct {
+    unsigned long long *bins;
+    size_t cap;
+    size_t top;
+} RunHist;
+
+static int hist_add(RunHist *h, size_t len)
 {
-    int c;
-    unsigned long long sum = 0ULL;
-    unsigned long long sample_count = 0ULL;
-    unsigned long long hi_samples = 0ULL;
-    unsigned long long hi_runs = 0ULL;
-    unsigned long long lo_runs = 0ULL;
-    unsigned long long hi_run_sum = 0ULL;
-    unsigned long long lo_run_sum = 0ULL;
-    unsigned long long cycle_pairs = 0ULL;
-    unsigned long long short_cycles = 0ULL;
-    unsigned long long long_cycles = 0ULL;
-    unsigned long long err_cycles = 0ULL;
-    unsigned long long hist[81] = {0ULL};
-    int min_sample = 255;
-    int max_sample = 0;
+    if (len >= h->cap) {
+        size_t ncap = h->cap ? h->cap : 64u;
+        unsigned long long *nb;
+        while (ncap <= len) {
+            if (ncap > ((size_t)-1) / 2u / sizeof(*nb))
+                return -1;
+            ncap *= 2u;
+        }
+        nb = (unsigned long long *)realloc(h->bins, ncap * sizeof(*nb));
+        if (!nb)
+            return -1;
+        memset(nb + h->cap, 0, (ncap - h->cap) * sizeof(*nb));
+        h->bins = nb;
+        h->cap = ncap;
+    }
+    h->bins[len]++;
+    if (len + 1u > h->top)
+        h->top = len + 1u;
+    return 0;
+}
+
+static void hist_clear(RunHist *h)
+{
+    if (h->top > 0)
+        memset(h->bins, 0, h->top * sizeof(*h->bins));
+    h->top = 0;
+}
+
+/* dst += src, bin by bin. */
+static int hist_merge(RunHist *dst, const RunHist *src)
+{
+    size_t k;
+
+    if (src->top == 0)
+        return 0;
+    if (hist_add(dst, src->top - 1u) != 0)
+        return -1;
+    dst->bins[src->top - 1u]--;
+    for (k = 1; k < src->top; k++)
+        dst->bins[k] += src->bins[k];
+    return 0;
+}
+
+static void hist_free(RunHist *h)
+{
+    free(h->bins);
+    memset(h, 0, sizeof(*h));
+}
+
+/* -----------------------------------------------------------------------
+ * Capture statistics for one span of samples.
+ *
+ * The same structure holds the whole-file totals and each time window.
+ * Runs and cycles are credited to the window in which they end; closed
+ * windows are folded into the totals with span_merge().
+ * ----------------------------------------------------------------------- */
+typedef struct {
+    unsigned long long start;
+    unsigned long long samples;
+    unsigned long long sum;
+    unsigned long long hi_samples;
+    unsigned long long hi_runs;
+    unsigned long long lo_runs;
+    unsigned long long hi_run_sum;
+    unsigned long long lo_run_sum;
+    unsigned long long cycle_pairs;
+    unsigned long long short_cycles;
+    unsigned long long long_cycles;
+    unsigned long long err_cycles;
+    unsigned min_sample;
+    unsigned max_sample;
+    RunHist hist_hi;
+    RunHist hist_lo;
+    RunHist hist_cycle;
+    int     oom;
+} SpanStats;
+
+static void span_reset(SpanStats *s, unsigned long long start)
+{
+    RunHist hi = s->hist_hi, lo = s->hist_lo, cy = s->hist_cycle;
+    int oom = s->oom;
+
+    hist_clear(&hi);
+    hist_clear(&lo);
+    hist_clear(&cy);
+    memset(s, 0, sizeof(*s));
+    s->hist_hi = hi;
+    s->hist_lo = lo;
+    s->hist_cycle = cy;
+    s->oom = oom;
+    s->start = start;
+    s->min_sample = 255u;
+}
+
+static void span_free(SpanStats *s)
+{
+    hist_free(&s->hist_hi);
+    hist_free(&s->hist_lo);
+    hist_free(&s->hist_cycle);
+}
+
+static void span_add_run(SpanStats *s, int high, size_t len)
+{
+    if (high) {
+        s->hi_runs++;
+        s->hi_run_sum += (unsigned long long)len;
+        if (hist_add(&s->hist_hi, len) != 0) s->oom = 1;
+    } else {
+        s->lo_runs++;
+        s->lo_run_sum += (unsigned long long)len;
+        if (hist_add(&s->hist_lo, len) != 0) s->oom = 1;
+    }
+}
+
+/* win[] is {short_lo, short_hi, long_lo, long_hi} from get_cycle_window(). */
+static void span_add_cycle(SpanStats *s, const int win[4], size_t total)
+{
+    int t = (total > 0x7FFFu) ? 0x7FFF : (int)total;
+
+    s->cycle_pairs++;
+    if (hist_add(&s->hist_cycle, total) != 0) s->oom = 1;
+    if (t > win[0] && t <= win[1])
+        s->short_cycles++;
+    else if (t > win[2] && t <= win[3])
+        s->long_cycles++;
+    else
+        s->err_cycles++;
+}
+
+static void span_merge(SpanStats *dst, const SpanStats *src)
+{
+    dst->samples      += src->samples;
+    dst->sum          += src->sum;
+    dst->hi_samples   += src->hi_samples;
+    dst->hi_runs      += src->hi_runs;
+    dst->lo_runs      += src->lo_runs;
+    dst->hi_run_sum   += src->hi_run_sum;
+    dst->lo_run_sum   += src->lo_run_sum;
+    dst->cycle_pairs  += src->cycle_pairs;
+    dst->short_cycles += src->short_cycles;
+    dst->long_cycles  += src->long_cycles;
+    dst->err_cycles   += src->err_cycles;
+    if (src->min_sample < dst->min_sample) dst->min_sample = src->min_sample;
+    if (src->max_sample > dst->max_sample) dst->max_sample = src->max_sample;
+    if (hist_merge(&dst->hist_hi, &src->hist_hi) != 0 ||
+        hist_merge(&dst->hist_lo, &src->hist_lo) != 0 ||
+        hist_merge(&dst->hist_cycle, &src->hist_cycle) != 0 ||
+        src->oom)
+        dst->oom = 1;
+}
+
+/* -----------------------------------------------------------------------
+ * block_minmaxsum() -- raw amplitude statistics for one buffer span.
+ *
+ * Kept branch-free over uint8_t so GCC/MinGW vectorize it at -O2; the
+ * ia16 build simply gets the scalar loop.  block_count_high() is the
+ * same idea over the 0/1 logic states.
+ * ----------------------------------------------------------------------- */
+static void block_minmaxsum(const uint8_t *p, size_t n,
+                            unsigned *mn, unsigned *mx, unsigned long long *sum)
+{
+    uint8_t  lo = 255u;
+    uint8_t  hi = 0u;
+    uint32_t acc = 0u;
+    size_t   i;
+
+    for (i = 0; i < n; i++) {
+        uint8_t v = p[i];
+        lo = (v < lo) ? v : lo;
+        hi = (v > hi) ? v : hi;
+        acc += v;
+    }
+    if (lo < *mn) *mn = lo;
+    if (hi > *mx) *mx = hi;
+    *sum += (unsigned long long)acc;
+}
+
+static uint32_t block_count_high(const uint8_t *states, size_t n)
+{
+    uint32_t acc = 0u;
+    size_t   i;
+
+    for (i = 0; i < n; i++)
+        acc += states[i];
+    return acc;
+}
+
+/* Options for --analyze; window_samples == 0 disables per-window output. */
+typedef struct {
+    const char *input_path;
+    const char *csv_path;
+    const char *json_path;
+    unsigned    window_ms;
+    unsigned long long window_samples;
+} AnalyzeOptions;
+
+typedef struct {
+    FILE *csv;
+    FILE *json;
+    unsigned long long windows_written;
+} AnalyzeSinks;
+
+static void csv_write_hist(FILE *f, const char *window, const SpanStats *s,
+                           const char *kind, const RunHist *h)
+{
+    size_t k;
+    for (k = 1; k < h->top; k++) {
+        if (h->bins[k] == 0ULL)
+            continue;
+        fprintf(f, "%s,%llu,%llu,%s,%u,%llu\n", window,
+                s->start, s->start + s->samples, kind, (unsigned)k, h->bins[k]);
+    }
+}
+
+static void csv_write_span(FILE *f, const char *window, const SpanStats *s)
+{
+    csv_write_hist(f, window, s, "high", &s->hist_hi);
+    csv_write_hist(f, window, s, "low", &s->hist_lo);
+    csv_write_hist(f, window, s, "cycle", &s->hist_cycle);
+}
+
+static void json_write_hist(FILE *f, const char *key, const RunHist *h, int last)
+{
+    size_t k;
+    int first = 1;
+
+    fprintf(f, "\"%s\": [", key);
+    for (k = 1; k < h->top; k++) {
+        if (h->bins[k] == 0ULL)
+            continue;
+        fprintf(f, "%s[%u, %llu]", first ? "" : ", ", (unsigned)k, h->bins[k]);
+        first = 0;
+    }
+    fprintf(f, "]%s", last ? "" : ", ");
+}
+
+/* One JSON object for a span; indent is the leading whitespace. */
+static void json_write_span(FILE *f, const char *indent, const SpanStats *s)
+{
+    fprintf(f, "%s\"start_sample\": %llu,\n", indent, s->start);
+    fprintf(f, "%s\"start_seconds\": %.3f,\n", indent, (double)s->start / (double)WAV_SAMPLE_RATE);
+    fprintf(f, "%s\"samples\": %llu,\n", indent, s->samples);
+    if (s->samples > 0ULL) {
+        fprintf(f, "%s\"min\": %u,\n", indent, s->min_sample);
+        fprintf(f, "%s\"max\": %u,\n", indent, s->max_sample);
+        fprintf(f, "%s\"mean\": %.3f,\n", indent, (double)s->sum / (double)s->samples);
+        fprintf(f, "%s\"high_ratio\": %.5f,\n", indent, (double)s->hi_samples / (double)s->samples);
+    }
+    fprintf(f, "%s\"high_runs\": %llu,\n", indent, s->hi_runs);
+    fprintf(f, "%s\"low_runs\": %llu,\n", indent, s->lo_runs);
+    fprintf(f, "%s\"cycle_pairs\": %llu,\n", indent, s->cycle_pairs);
+    fprintf(f, "%s\"short\": %llu,\n", indent, s->short_cycles);
+    fprintf(f, "%s\"long\": %llu,\n", indent, s->long_cycles);
+    fprintf(f, "%s\"error\": %llu,\n", indent, s->err_cycles);
+    fprintf(f, "%s\"hist\": {", indent);
+    json_write_hist(f, "high", &s->hist_hi, 0);
+    json_write_hist(f, "low", &s->hist_lo, 0);
+    json_write_hist(f, "cycle", &s->hist_cycle, 1);
+    fprintf(f, "}\n");
+}
+
+static void flush_window(AnalyzeSinks *out, const SpanStats *w)
+{
+    char label[24];
+
+    if (w->samples == 0ULL)
+        return;
+    sprintf(label, "%llu", out->windows_written);
+    if (out->csv)
+        csv_write_span(out->csv, label, w);
+    if (out->json) {
+        fprintf(out->json, "%s    {\n      \"index\": %llu,\n",
+                out->windows_written ? ",\n" : "", out->windows_written);
+        json_write_span(out->json, "      ", w);
+        fprintf(out->json, "    }");
+    }
+    out->windows_written++;
+}
+
+static void print_hist_line(const char *label, const RunHist *h)
+{
+    size_t k;
+    int printed = 0;
+
+    printf("  %-17s:", label);
+    for (k = 1; k < h->top; k++) {
+        if (h->bins[k] == 0ULL)
+            continue;
+        if (printed > 0 && printed % 8 == 0)
+            printf("\n  %-17s ", "");
+        printf(" %u:%llu", (unsigned)k, h->bins[k]);
+        printed++;
+    }
+    if (printed == 0)
+        printf(" none");
+    printf("\n");
+}
+
+/* -----------------------------------------------------------------------
+ * analyze_wav_stream() -- capture diagnostics without decoding.
+ *
+ * Walks the block buffer span by span.  Amplitude statistics are taken
+ * over the whole span at once; the Schmitt trigger is inherently serial,
+ * so dec_levels() turns the span into a 0/1 state array first and run
+ * extraction then only looks for edges in that array.  Spans are clipped
+ * at window boundaries so each window is flushed to CSV/JSON as soon as
+ * it closes; events go into the current window only and are merged into
+ * the totals when it closes.
+ *
+ * Returns 0 on success, -1 if a histogram could not grow or an export
+ * file could not be written.
+ * ----------------------------------------------------------------------- */
+static int analyze_wav_stream(WavDecoder *d, const AnalyzeOptions *opt)
+{
+    SpanStats total;
+    SpanStats win;
+    AnalyzeSinks out;
     long long first_signal_idx = -1;
     int prev_state = -1;
-    int run_len = 0;
-    int pending_hi_len = 0;
-    int short_lo, short_hi, long_lo, long_hi;
+    size_t run_len = 0;
+    size_t pending_hi_len = 0;
+    unsigned long long win_end = opt->window_samples;
+    int cw[4];
+    uint8_t *states;
+    int rc = 0;
+
+    states = (uint8_t *)malloc(WAV_BLOCK_SIZE);
+    if (!states) {
+        printf("error -- out of memory\n");
+        return -1;
+    }
+    memset(&total, 0, sizeof(total));
+    memset(&win, 0, sizeof(win));
+    memset(&out, 0, sizeof(out));
+    span_reset(&total, 0ULL);
+    span_reset(&win, 0ULL);
+
+    if (opt->csv_path) {
+        out.csv = fopen(opt->csv_path, "w");
+        if (!out.csv) {
+            printf("error -- couldn't create %s\n", opt->csv_path);
+            free(states);
+            return -1;
+        }
+        fprintf(out.csv, "window,start_sample,end_sample,kind,length,count\n");
+    }
+    if (opt->json_path) {
+        out.json = fopen(opt->json_path, "w");
+        if (!out.json) {
+            printf("error -- couldn't create %s\n", opt->json_path);
+            if (out.csv) fclose(out.csv);
+            free(states);
+            return -1;
+        }
+        fprintf(out.json, "{\n  \"file\": \"");
+        {
+            const char *p;
+            for (p = opt->input_path; *p; p++) {
+                unsigned char c = (unsigned char)*p;
+                if (c < 0x20u)
+                    fprintf(out.json, "\\u%04X", (unsigned)c);
+                else if (c == '"' || c == '\\')
+                    fprintf(out.json, "\\%c", c);
+                else
+                    fputc(c, out.json);
+            }
+        }
+        fprintf(out.json, "\",\n  \"sample_rate\": %u,\n", WAV_SAMPLE_RATE);
+        fprintf(out.json, "  \"mode\": \"%s\",\n", d->capture_mode ? "capture" : "legacy");
+        fprintf(out.json, "  \"gain_percent\": %d,\n", d->input_gain_percent);
+        fprintf(out.json, "  \"window_ms\": %u,\n", opt->window_samples ? opt->window_ms : 0u);
+        fprintf(out.json, "  \"windows\": [\n");
+    }
 
-    get_cycle_window(&short_lo, &short_hi, &long_lo, &long_hi);
+    get_cycle_window(d, &cw[0], &cw[1], &cw[2], &cw[3]);
 
-    g_logic_state = -1;
-    g_prev_raw1 = LOGIC_CENTER;
-    g_prev_raw2 = LOGIC_CENTER;
+    dec_reset_filter(d);
 
-    while ((c = fgetc(g_wav)) != EOF) {
-        unsigned uc = (unsigned)c;
-        int state = sample_is_high(c);
+    for (;;) {
+        const uint8_t *p;
+        size_t n, i;
+        unsigned long long pos;
 
-        if (first_signal_idx < 0 && uc >= TAPE_LEADER_THRESH)
-            first_signal_idx = (long long)sample_count;
+        if (d->buf_pos >= d->buf_len && dec_fill(d) == 0)
+            break;
+        p = d->buf + d->buf_pos;
+        n = d->buf_len - d->buf_pos;
+        pos = d->buf_base + (unsigned long long)d->buf_pos;
+
+        if (opt->window_samples && (unsigned long long)n > win_end - pos)
+            n = (size_t)(win_end - pos);
+
+        block_minmaxsum(p, n, &win.min_sample, &win.max_sample, &win.sum);
+        win.samples += (unsigned long long)n;
+
+        if (first_signal_idx < 0) {
+            for (i = 0; i < n; i++) {
+                if ((unsigned)p[i] >= TAPE_LEADER_THRESH) {
+                    first_signal_idx = (long long)(pos + (unsigned long long)i);
+                    break;
+                }
+            }
+        }
 
-        if ((int)uc < min_sample) min_sample = (int)uc;
-        if ((int)uc > max_sample) max_sample = (int)uc;
-        sum += uc;
-        sample_count++;
-        if (state) hi_samples++;
+        dec_levels(d, p, n, states);
+        win.hi_samples += block_count_high(states, n);
 
+        i = 0;
         if (prev_state < 0) {
-            prev_state = state;
-            run_len = 1;
-            continue;
+            prev_state = states[0];
+            run_len = 0;
         }
+        while (i < n) {
+            size_t j = i;
 
-        if (state == prev_state) {
-            run_len++;
-            continue;
-        }
+            while (j < n && (int)states[j] == prev_state)
+                j++;
+            run_len += j - i;
+            if (j == n)
+                break;
 
-        if (prev_state) {
-            hi_runs++;
-            hi_run_sum += (unsigned long long)run_len;
-            pending_hi_len = run_len;
-        } else {
-            lo_runs++;
-            lo_run_sum += (unsigned long long)run_len;
-            if (pending_hi_len > 0) {
-                int total = pending_hi_len + run_len;
-                cycle_pairs++;
-                if (total >= 0 && total <= 80)
-                    hist[total]++;
-                if (total > short_lo && total <= short_hi)
-                    short_cycles++;
-                else if (total > long_lo && total <= long_hi)
-                    long_cycles++;
-                else
-                    err_cycles++;
+            span_add_run(&win, prev_state, run_len);
+            if (prev_state) {
+                pending_hi_len = run_len;
+            } else if (pending_hi_len > 0) {
+                span_add_cycle(&win, cw, pending_hi_len + run_len);
                 pending_hi_len = 0;
             }
+            prev_state = states[j];
+            run_len = 0;
+            i = j;
         }
 
-        prev_state = state;
-        run_len = 1;
+        d->buf_pos += n;
+
+        if (opt->window_samples && pos + (unsigned long long)n == win_end) {
+            flush_window(&out, &win);
+            span_merge(&total, &win);
+            span_reset(&win, win_end);
+            win_end += opt->window_samples;
+        }
     }
 
     if (run_len > 0) {
-        if (prev_state) {
-            hi_runs++;
-            hi_run_sum += (unsigned long long)run_len;
-        } else {
-            lo_runs++;
-            lo_run_sum += (unsigned long long)run_len;
-            if (pending_hi_len > 0) {
-                int total = pending_hi_len + run_len;
-                cycle_pairs++;
-                if (total >= 0 && total <= 80)
-                    hist[total]++;
-                if (total > short_lo && total <= short_hi)
-                    short_cycles++;
-                else if (total > long_lo && total <= long_hi)
-                    long_cycles++;
-                else
-                    err_cycles++;
-            }
-        }
+        span_add_run(&win, prev_state, run_len);
+        if (!prev_state && pending_hi_len > 0)
+            span_add_cycle(&win, cw, pending_hi_len + run_len);
     }
+    if (opt->window_samples)
+        flush_window(&out, &win);
+    span_merge(&total, &win);
+    free(states);
+    if (total.hi_runs + total.lo_runs > 0ULL)
+        STAT_ADD(d->stats, edges, total.hi_runs + total.lo_runs - 1ULL);
 
     printf("Analysis Summary:\n");
-    printf("  Mode             : %s\n", g_capture_mode ? "capture (filtered)" : "legacy");
-    printf("  Samples          : %llu\n", sample_count);
-    if (sample_count > 0ULL) {
-        printf("  Min/Max          : %d / %d\n", min_sample, max_sample);
-        printf("  Mean             : %.2f\n", (double)sum / (double)sample_count);
-        printf("  High ratio       : %.2f%%\n", 100.0 * (double)hi_samples / (double)sample_count);
+    printf("  Mode             : %s\n", d->capture_mode ? "capture (filtered)" : "legacy");
+    printf("  Samples          : %llu\n", total.samples);
+    if (total.samples > 0ULL) {
+        printf("  Min/Max          : %d / %d\n", (int)total.min_sample, (int)total.max_sample);
+        printf("  Mean             : %.2f\n", (double)total.sum / (double)total.samples);
+        printf("  High ratio       : %.2f%%\n", 100.0 * (double)total.hi_samples / (double)total.samples);
     }
     if (first_signal_idx >= 0)
         printf("  First signal @   : sample %lld\n", first_signal_idx);
     else
         printf("  First signal @   : not found (>=0x%02X)\n", TAPE_LEADER_THRESH);
 
-    printf("  High runs        : %llu", hi_runs);
-    if (hi_runs > 0ULL)
-        printf(" (avg %.2f)", (double)hi_run_sum / (double)hi_runs);
+    printf("  High runs        : %llu", total.hi_runs);
+    if (total.hi_runs > 0ULL)
+        printf(" (avg %.2f)", (double)total.hi_run_sum / (double)total.hi_runs);
     printf("\n");
-    printf("  Low runs         : %llu", lo_runs);
-    if (lo_runs > 0ULL)
-        printf(" (avg %.2f)", (double)lo_run_sum / (double)lo_runs);
+    printf("  Low runs         : %llu", total.lo_runs);
+    if (total.lo_runs > 0ULL)
+        printf(" (avg %.2f)", (double)total.lo_run_sum / (double)total.lo_runs);
     printf("\n");
     printf("  Cycle window     : short (%d,%d], long (%d,%d]\n",
-           short_lo, short_hi, long_lo, long_hi);
-    printf("  Cycle pairs      : %llu\n", cycle_pairs);
-    if (cycle_pairs > 0ULL) {
+           cw[0], cw[1], cw[2], cw[3]);
+    printf("  Cycle pairs      : %llu\n", total.cycle_pairs);
+    if (total.cycle_pairs > 0ULL) {
         printf("  Classified       : short=%llu long=%llu error=%llu\n",
-               short_cycles, long_cycles, err_cycles);
+               total.short_cycles, total.long_cycles, total.err_cycles);
     }
 
-    printf("  Cycle histogram  :");
-    {
-        int k, printed = 0;
-        for (k = 1; k <= 80; k++) {
-            if (hist[k] == 0ULL)
-                continue;
-            if (printed == 12) {
-                printf(" ...");
-                break;
-            }
-            printf(" %d:%llu", k, hist[k]);
-            printed++;
+    print_hist_line("Cycle histogram", &total.hist_cycle);
+    print_hist_line("High run lengths", &total.hist_hi);
+    print_hist_line("Low run lengths", &total.hist_lo);
+    if (opt->window_samples)
+        printf("  Windows          : %llu x %u ms\n", out.windows_written, opt->window_ms);
+
+    if (out.csv) {
+        csv_write_span(out.csv, "all", &total);
+        if (fclose(out.csv) != 0) {
+            printf("error -- write failed on %s\n", opt->csv_path);
+            rc = -1;
         }
-        if (printed == 0)
-            printf(" none");
     }
-    printf("\n");
+    if (out.json) {
+        fprintf(out.json, "\n  ],\n  \"summary\": {\n");
+        if (first_signal_idx >= 0)
+            fprintf(out.json, "    \"first_signal\": %lld,\n", first_signal_idx);
+        else
+            fprintf(out.json, "    \"first_signal\": null,\n");
+        json_write_span(out.json, "    ", &total);
+        fprintf(out.json, "  }\n}\n");
+        if (fclose(out.json) != 0) {
+            printf("error -- write failed on %s\n", opt->json_path);
+            rc = -1;
+        }
+    }
+
+    if (total.oom) {
+        printf("error -- out of memory growing run-length histogram\n");
+        rc = -1;
+    }
+    span_free(&total);
+    span_free(&win);
+    return rc;
 }
 
 /* -----------------------------------------------------------------------
@@ -496,54 +1166,60 @@ static void analyze_wav_stream(void)
  * Faithful to the original two-counter loop structure in _FindCycle
  * (0AE3:000F).  register di = hi_count, [bp-2] = lo_count in the asm.
  *
- * All comparisons use (unsigned)c to avoid -Wsign-compare; fgetc()
+ * All comparisons use (unsigned)c to avoid -Wsign-compare; dec_getc()
  * returns int but we have already excluded EOF above so the value is
  * always in [0..255], making the (unsigned) cast safe and portable.
  * ----------------------------------------------------------------------- */
-static uint8_t FindCycle(void)
+static uint8_t FindCycle(WavDecoder *d)
 {
     int c;
     int hi_count;
     int lo_count;
     int total;
-    const int short_lo = g_capture_mode ? CYCLE_SHORT_LO_CAPTURE : CYCLE_SHORT_LO_NORMAL;
-    const int short_hi = g_capture_mode ? CYCLE_SHORT_HI_CAPTURE : CYCLE_SHORT_HI_NORMAL;
-    const int long_lo  = g_capture_mode ? CYCLE_LONG_LO_CAPTURE  : CYCLE_LONG_LO_NORMAL;
-    const int long_hi  = g_capture_mode ? CYCLE_LONG_HI_CAPTURE  : CYCLE_LONG_HI_NORMAL;
+    int short_lo, short_hi, long_lo, long_hi;
+
+    get_cycle_window(d, &short_lo, &short_hi, &long_lo, &long_hi);
 
     /* Advance to the next high sample (> 0x7F) */
     do {
-        c = safe_fgetc();
+        c = dec_getc(d);
         if (c == EOF) return CYCLE_ERROR;
-    } while (!sample_is_high(c));
+    } while (!sample_is_high(d, c));
 
     /* Count consecutive high samples; c holds the first one already */
     hi_count = 1;
     for (;;) {
-        c = safe_fgetc();
+        c = dec_getc(d);
         if (c == EOF) return CYCLE_ERROR;
-        if (!sample_is_high(c)) break;
+        if (!sample_is_high(d, c)) break;
         hi_count++;
     }
 
     /* Count consecutive low samples; c holds the first one already */
     lo_count = 1;
     for (;;) {
-        c = safe_fgetc();
+        c = dec_getc(d);
         if (c == EOF) return CYCLE_ERROR;
-        if (sample_is_high(c)) break;
+        if (sample_is_high(d, c)) break;
         lo_count++;
     }
 
     /* Push back the first high sample of the next cycle */
     if (c == EOF) return CYCLE_ERROR;
-    ungetc(c, g_wav);
+    dec_ungetc(d);
 
     /* Classify */
     total = hi_count + lo_count;
 
-    if (total > short_lo && total <= short_hi) return CYCLE_SHORT;
-    if (total > long_lo  && total <= long_hi)  return CYCLE_LONG;
+    if (total > short_lo && total <= short_hi) {
+        STAT_ADD(d->stats, cycles_short, 1);
+        return CYCLE_SHORT;
+    }
+    if (total > long_lo && total <= long_hi) {
+        STAT_ADD(d->stats, cycles_long, 1);
+        return CYCLE_LONG;
+    }
+    STAT_ADD(d->stats, cycles_error, 1);
     return CYCLE_ERROR;
 }
 
@@ -554,18 +1230,18 @@ static uint8_t FindCycle(void)
  *   FindCycle() -> SHORT + SHORT + SHORT => bit 1
  *   anything else                        => CYCLE_ERROR
  * ----------------------------------------------------------------------- */
-static uint8_t ReadVZBit(void)
+static uint8_t ReadVZBit(WavDecoder *d)
 {
     uint8_t c1, c2, c3;
 
-    c1 = FindCycle();
+    c1 = FindCycle(d);
     if (c1 != CYCLE_SHORT) return CYCLE_ERROR;
 
-    c2 = FindCycle();
+    c2 = FindCycle(d);
     if (c2 == CYCLE_LONG)  return 0u;   /* bit 0 */
     if (c2 != CYCLE_SHORT) return CYCLE_ERROR;
 
-    c3 = FindCycle();
+    c3 = FindCycle(d);
     if (c3 == CYCLE_SHORT) return 1u;   /* bit 1 */
 
     return CYCLE_ERROR;
@@ -580,16 +1256,18 @@ static uint8_t ReadVZBit(void)
  * Shifts and ORs are done in (unsigned) width to avoid -Wconversion
  * on the narrowing truncation back to uint8_t.
  * ----------------------------------------------------------------------- */
-static uint8_t ReadVZbyte(void)
+static uint8_t ReadVZbyte(WavDecoder *d)
 {
     int     i;
     uint8_t result = 0u;
     uint8_t bit;
 
     for (i = 0; i < 8; i++) {
-        bit = ReadVZBit();
+        bit = ReadVZBit(d);
         if (bit != CYCLE_ERROR)
             result = (uint8_t)(((unsigned)result << 1u) | (unsigned)bit);
+        else
+            STAT_ADD(d->stats, skipped_slots, 1);
     }
     return result;
 }
@@ -601,69 +1279,1002 @@ static uint8_t ReadVZbyte(void)
  * platform) before truncation to uint16_t, avoiding implementation-
  * defined behaviour on narrow shift operations.
  * ----------------------------------------------------------------------- */
-static uint16_t read_u16_le(void)
+static uint16_t read_u16_le(WavDecoder *d)
 {
-    unsigned lo = (unsigned)ReadVZbyte();
-    unsigned hi = (unsigned)ReadVZbyte();
+    unsigned lo = (unsigned)ReadVZbyte(d);
+    unsigned hi = (unsigned)ReadVZbyte(d);
     return (uint16_t)(lo | (hi << 8u));
 }
 
 /* -----------------------------------------------------------------------
- * main()
+ * dec_read_wav_header() -- read and validate the RIFF header.
+ *
+ * Only the four fields the original EXE checked are validated.
  * ----------------------------------------------------------------------- */
-int main(int argc, char *argv[])
+static DecStatus dec_read_wav_header(WavDecoder *d, WavHeader *hdr)
 {
-    const char *input_path = NULL;
-    const char *output_path = NULL;
-    int analyze_mode = 0;
-    WavHeader  wav_hdr;
-    VzHeader   vz_hdr;
-    uint8_t    b;               /* decoded tape byte                        */
-    int        c;               /* raw fgetc result -- MUST stay int        */
-    int        i;
-    uint8_t    file_type;
-    uint8_t    filename_buf[17];
-    uint16_t   start_addr, end_addr, data_size;
-    uint16_t   checksum_calc, checksum_tape;
-
-    for (i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
-            printf("wav2vz version %s\n", TOOL_VERSION);
-            return 0;
-        }
-        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
-            print_usage();
-            return 0;
-        }
+    if (fread(hdr, sizeof(WavHeader), 1u, d->wav) != 1u) {
+        dec_fail(d, DEC_ERR_WAV_HEADER);
+        return d->status;
     }
 
-    /* ------------------------------------------------------------------ */
-    /* Banner (strings from 0B42 data segment of the original EXE)         */
-    /* ------------------------------------------------------------------ */
-    printf("\t\tWAV2VZ v%s - ", TOOL_VERSION);
-    printf("WAV file to .VZ converter\n\n");
-    print_usage();
+    if (hdr->sample_rate_hi  != 0u    ||
+        hdr->sample_rate_lo  != 22050u ||
+        hdr->bits_per_sample != 8u    ||
+        hdr->num_channels    != 1u)
+        dec_fail(d, DEC_ERR_WAV_FORMAT);
+    return d->status;
+}
 
-    /* ------------------------------------------------------------------ */
-    /* Argument check                                                       */
-    /* ------------------------------------------------------------------ */
-    for (i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "--legacy") == 0 || strcmp(argv[i], "-l") == 0) {
-            g_capture_mode = 0;
-        } else if (strcmp(argv[i], "--gain") == 0 || strcmp(argv[i], "-g") == 0) {
-            if (i + 1 >= argc || parse_gain_percent(argv[++i], &g_input_gain_percent) != 0) {
-                printf("error -- invalid --gain value\n");
+/* -----------------------------------------------------------------------
+ * dec_find_signal() -- skip raw samples until the leader threshold.
+ *
+ * c is kept as int and EOF is checked before the (unsigned) cast.
+ * Casting EOF(-1) to unsigned gives 0xFFFFFFFF >= 0x90, which would
+ * silently exit the loop on a truncated file -- the int check stops
+ * this.
+ * ----------------------------------------------------------------------- */
+static DecStatus dec_find_signal(WavDecoder *d)
+{
+    int c;
+
+    if (d->status != DEC_OK)
+        return d->status;
+    do {
+        c = dec_rawgetc(d);
+        if (c == EOF) {
+            dec_fail(d, DEC_ERR_NO_SIGNAL);
+            return d->status;
+        }
+    } while ((unsigned)c < TAPE_LEADER_THRESH);
+    return DEC_OK;
+}
+
+/* Sync to leader: decode bytes until TAPE_START_BYTE (0x80). */
+static DecStatus dec_sync_leader(WavDecoder *d)
+{
+    while (d->status == DEC_OK && ReadVZbyte(d) != (uint8_t)TAPE_START_BYTE)
+        ;
+    return d->status;
+}
+
+/*
+ * Locate preamble: skip 0x80 bytes, then verify 0xFE * 5.  *leader (if
+ * given) gets the number of whole leader bytes decoded, counting the one
+ * dec_sync_leader() stopped on.
+ */
+static DecStatus dec_read_preamble(WavDecoder *d, unsigned *leader)
+{
+    unsigned n = 0;
+    uint8_t b;
+    int i;
+
+    do { b = ReadVZbyte(d); n++; } while (d->status == DEC_OK && b == (uint8_t)TAPE_START_BYTE);
+    if (leader)
+        *leader = n;
+    if (d->status != DEC_OK)
+        return d->status;
+
+    if (b != (uint8_t)TAPE_PREAMBLE_BYTE) {
+        dec_fail(d, DEC_ERR_PREAMBLE_START);
+        return d->status;
+    }
+
+    for (i = 0; i < 4; i++) {
+        b = ReadVZbyte(d);
+        if (d->status != DEC_OK)
+            return d->status;
+        if (b != (uint8_t)TAPE_PREAMBLE_BYTE) {
+            dec_fail(d, DEC_ERR_PREAMBLE);
+            return d->status;
+        }
+    }
+    return DEC_OK;
+}
+
+/* -----------------------------------------------------------------------
+ * dec_read_header() -- file type, NUL-terminated name, start/end address.
+ * ----------------------------------------------------------------------- */
+static DecStatus dec_read_header(WavDecoder *d, TapeHeader *th)
+{
+    int i;
+
+    memset(th, 0, sizeof(*th));
+    th->file_type = ReadVZbyte(d);
+
+    for (i = 0; i < 17 && d->status == DEC_OK; i++) {
+        th->filename[i] = ReadVZbyte(d);
+        if (th->filename[i] == 0u) break;
+    }
+    th->filename[16] = 0u;                          /* unconditional NUL   */
+
+    th->start_addr = read_u16_le(d);
+    th->end_addr   = read_u16_le(d);
+    return d->status;
+}
+
+/* -----------------------------------------------------------------------
+ * dec_read_payload() -- decode len bytes into buf.
+ *
+ * *got receives the number of bytes decoded before any error so the
+ * caller can still keep a partial image.  Loop index i (size_t) holds
+ * values up to data_size (uint16_t <= 65535): no overflow.
+ * ----------------------------------------------------------------------- */
+static DecStatus dec_read_payload(WavDecoder *d, uint8_t *buf, size_t len, size_t *got)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        uint8_t b = ReadVZbyte(d);
+        if (d->status != DEC_OK)
+            break;
+        buf[i] = b;
+    }
+    *got = i;
+    return d->status;
+}
+
+/* -----------------------------------------------------------------------
+ * dec_read_checksum() -- read the trailing little-endian uint16 checksum.
+ *
+ * The read is bounded by a one-second sample budget.  If the stream or
+ * budget runs out, one resync to the next high edge is attempted.
+ * Returns 1 when a checksum was read, 0 when it was missing/malformed;
+ * *resync_used reports whether the fallback path was taken.
+ * ----------------------------------------------------------------------- */
+static int dec_read_checksum(WavDecoder *d, uint16_t *checksum_tape, int *resync_used)
+{
+    const size_t checksum_budget = 22050u;
+    int checksum_ok = 0;
+
+    *resync_used = 0;
+    d->allow_eof = 1;
+    d->hit_eof = 0;
+    budget_start(d, checksum_budget);
+    *checksum_tape = read_u16_le(d);
+    budget_stop(d);
+
+    if (!d->hit_eof) {
+        checksum_ok = 1;
+    } else {
+        d->hit_eof = 0;
+        *resync_used = 1;
+        STAT_ADD(d->stats, resyncs, 1);
+        budget_start(d, checksum_budget);
+        if (resync_to_high(d) == 0) {
+            *checksum_tape = read_u16_le(d);
+        }
+        budget_stop(d);
+        if (!d->hit_eof)
+            checksum_ok = 1;
+    }
+    d->allow_eof = 0;
+    return checksum_ok;
+}
+
+/* -----------------------------------------------------------------------
+ * Tape index (<wav>.vzi sidecar).
+ *
+ * A full scan decodes every program on the capture once and records the
+ * sample offsets of each framing phase plus the decoded header.  Later
+ * runs seek straight to a program's signal offset instead of scanning
+ * from the start.
+ *
+ * Offsets are sample indices counted from the end of the 72-byte RIFF
+ * header, i.e. the same numbering as buf_base.  'signal' is where
+ * dec_find_signal() stopped; the scan resets the filter there, so a
+ * seek + dec_reset_filter() reproduces the scan's decode exactly.
+ *
+ * The file is plain text so it survives being copied between hosts:
+ *
+ *   VZI 2
+ *   wav_bytes <file size>
+ *   fingerprint <hash of the first and last 4 KB, hex>
+ *   mode capture|legacy
+ *   gain <percent>
+ *   programs <count>
+ *   <n> <signal> <preamble> <header> <payload> <checksum> <end>
+ *       <type> <start> <end_addr> <status> <name>
+ *
+ * Addresses are hex; the name is %XX-escaped outside printable ASCII.
+ * The index is only trusted when wav_bytes, fingerprint, mode and gain
+ * all match; otherwise it is rebuilt.
+ * ----------------------------------------------------------------------- */
+#define INDEX_VERSION      2
+#define INDEX_SUFFIX       ".vzi"
+
+typedef enum {
+    IX_OK = 0,          /* checksum read and matched                 */
+    IX_MISMATCH,        /* checksum read but differs                 */
+    IX_MISSING,         /* checksum missing / malformed              */
+    IX_TRUNCATED        /* capture ended inside the payload          */
+} IndexStatus;
+
+static const char *const index_status_names[] = {
+    "ok", "mismatch", "missing", "truncated"
+};
+
+typedef struct {
+    unsigned long long signal;
+    unsigned long long preamble;
+    unsigned long long header;
+    unsigned long long payload;
+    unsigned long long checksum;
+    unsigned long long end;
+    TapeHeader  hdr;
+    IndexStatus status;
+} IndexEntry;
+
+typedef struct {
+    unsigned long long wav_bytes;
+    unsigned long long fingerprint;
+    int         capture_mode;
+    int         input_gain_percent;
+    IndexEntry *entries;
+    size_t      count;
+    size_t      cap;
+} TapeIndex;
+
+static void index_free(TapeIndex *ix)
+{
+    free(ix->entries);
+    memset(ix, 0, sizeof(*ix));
+}
+
+static int index_append(TapeIndex *ix, const IndexEntry *e)
+{
+    if (ix->count == ix->cap) {
+        size_t ncap = ix->cap ? ix->cap * 2u : 16u;
+        IndexEntry *ne = (IndexEntry *)realloc(ix->entries, ncap * sizeof(*ne));
+        if (!ne)
+            return -1;
+        ix->entries = ne;
+        ix->cap = ncap;
+    }
+    ix->entries[ix->count++] = *e;
+    return 0;
+}
+
+/* Next sample to be read, in buf_base numbering. */
+static unsigned long long dec_tell(const WavDecoder *d)
+{
+    return d->buf_base + (unsigned long long)d->buf_pos;
+}
+
+/* Samples actually read so far: position minus any distance seeked. */
+static unsigned long long dec_consumed(const WavDecoder *d)
+{
+    return dec_tell(d) - d->seek_delta;
+}
+
+/*
+ * 64-bit WAV positioning.  Plain fseek()/ftell() take a 'long', which is
+ * 32 bits on Windows; offsets the host cannot represent are rejected
+ * rather than truncated.
+ */
+static int wav_seek(FILE *f, unsigned long long off, int whence)
+{
+#if defined(_WIN32)
+    if (off > (unsigned long long)LLONG_MAX)
+        return -1;
+    return _fseeki64(f, (long long)off, whence);
+#elif defined(__unix__) || defined(__APPLE__)
+    if ((off_t)off < 0 || (unsigned long long)(off_t)off != off)
+        return -1;
+    return fseeko(f, (off_t)off, whence);
+#else
+    if (off > (unsigned long long)LONG_MAX)
+        return -1;
+    return fseek(f, (long)off, whence);
+#endif
+}
+
+static int wav_tell(FILE *f, unsigned long long *out)
+{
+#if defined(_WIN32)
+    long long pos = _ftelli64(f);
+#elif defined(__unix__) || defined(__APPLE__)
+    off_t pos = ftello(f);
+#else
+    long pos = ftell(f);
+#endif
+    if (pos < 0)
+        return -1;
+    *out = (unsigned long long)pos;
+    return 0;
+}
+
+/* dec_seek() -- reposition to a sample index and reset the filter. */
+static DecStatus dec_seek(WavDecoder *d, unsigned long long sample)
+{
+    unsigned long long off = sample + (unsigned long long)sizeof(WavHeader);
+
+    if (wav_seek(d->wav, off, SEEK_SET) != 0) {
+        dec_fail(d, DEC_ERR_IO);
+        return d->status;
+    }
+    d->seek_delta += sample - dec_tell(d);    /* modulo 2^64 by design */
+    d->buf_base = sample;
+    d->buf_len = 0;
+    d->buf_pos = 0;
+    d->buf_eof = 0;
+    dec_reset_filter(d);
+    return d->status;
+}
+
+/* Size of the WAV file in bytes; leaves the stream position undefined. */
+static int wav_file_bytes(FILE *f, unsigned long long *out)
+{
+    if (wav_seek(f, 0ULL, SEEK_END) != 0)
+        return -1;
+    return wav_tell(f, out);
+}
+
+/*
+ * FNV-1a over the first and last WAV_BLOCK_SIZE bytes.  A re-recorded
+ * capture of the same length almost always differs there, and it costs
+ * two block reads.  Leaves the stream position undefined.
+ */
+static int wav_fingerprint(FILE *f, unsigned long long bytes, unsigned long long *out)
+{
+    unsigned char buf[WAV_BLOCK_SIZE];
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    unsigned long long at[2];
+    size_t want, k;
+    int pass;
+
+    want = bytes < WAV_BLOCK_SIZE ? (size_t)bytes : (size_t)WAV_BLOCK_SIZE;
+    at[0] = 0ULL;
+    at[1] = bytes - want;
+    for (pass = 0; pass < 2; pass++) {
+        if (wav_seek(f, at[pass], SEEK_SET) != 0 || fread(buf, 1u, want, f) != want)
+            return -1;
+        for (k = 0; k < want; k++) {
+            h ^= buf[k];
+            h *= 0x100000001B3ULL;
+        }
+    }
+    *out = h;
+    return 0;
+}
+
+/*
+ * dec_scan_tape() -- decode every program on the capture into an index.
+ *
+ * A bad preamble is treated as a false start (noise or a trailer after
+ * the previous program) and the scan carries on from there.  The scan
+ * ends at the first point the capture runs out; a program cut off in its
+ * payload is still recorded as truncated.  Returns DEC_OK or
+ * DEC_ERR_NOMEM/DEC_ERR_IO; running out of samples is the normal end.
+ */
+static DecStatus dec_scan_tape(WavDecoder *d, TapeIndex *ix)
+{
+    for (;;) {
+        IndexEntry e;
+        DecStatus st;
+        uint16_t data_size, checksum_calc, checksum_tape;
+        size_t i;
+        int resync_used;
+
+        memset(&e, 0, sizeof(e));
+        d->status = DEC_OK;
+        if (dec_find_signal(d) != DEC_OK)
+            break;
+        e.signal = dec_tell(d);
+        dec_reset_filter(d);
+
+        if (dec_sync_leader(d) != DEC_OK)
+            break;
+        e.preamble = dec_tell(d);
+
+        st = dec_read_preamble(d, NULL);
+        if (st == DEC_ERR_PREAMBLE_START || st == DEC_ERR_PREAMBLE)
+            continue;
+        if (st != DEC_OK)
+            break;
+        e.header = dec_tell(d);
+
+        if (dec_read_header(d, &e.hdr) != DEC_OK)
+            break;
+        e.payload = dec_tell(d);
+
+        data_size = (uint16_t)(e.hdr.end_addr - e.hdr.start_addr);
+        checksum_calc = (uint16_t)(
+              (e.hdr.start_addr & 0x00FFu) + ((e.hdr.start_addr >> 8) & 0x00FFu)
+            + (e.hdr.end_addr & 0x00FFu)   + ((e.hdr.end_addr >> 8) & 0x00FFu));
+        for (i = 0; i < (size_t)data_size; i++) {
+            uint8_t b = ReadVZbyte(d);
+            if (d->status != DEC_OK)
+                break;
+            checksum_calc = (uint16_t)(checksum_calc + b);
+        }
+        e.checksum = dec_tell(d);
+        if (d->status != DEC_OK) {
+            e.status = IX_TRUNCATED;
+            e.end = e.checksum;
+            if (index_append(ix, &e) != 0) {
+                d->status = DEC_ERR_NOMEM;
+                return d->status;
+            }
+            break;
+        }
+
+        if (!dec_read_checksum(d, &checksum_tape, &resync_used))
+            e.status = IX_MISSING;
+        else
+            e.status = (checksum_tape == checksum_calc) ? IX_OK : IX_MISMATCH;
+        e.end = dec_tell(d);
+        if (index_append(ix, &e) != 0) {
+            d->status = DEC_ERR_NOMEM;
+            return d->status;
+        }
+    }
+
+    if (d->status == DEC_ERR_NOMEM || d->status == DEC_ERR_IO)
+        return d->status;
+    d->status = DEC_OK;
+    return DEC_OK;
+}
+
+/* Tape name as one whitespace-free token: %XX outside printable ASCII. */
+static void write_tape_name(FILE *f, const uint8_t *name)
+{
+    for (; *name; name++) {
+        if (*name > 0x20u && *name < 0x7Fu && *name != '%')
+            fputc(*name, f);
+        else
+            fprintf(f, "%%%02X", (unsigned)*name);
+    }
+}
+
+/* Inverse of write_tape_name(); stops at end of line, 16 bytes max. */
+static void parse_tape_name(const char *p, uint8_t name[17])
+{
+    size_t len = 0;
+
+    memset(name, 0, 17u);
+    for (; *p && *p != '\n' && *p != '\r' && len < 16u; p++) {
+        unsigned v;
+        if (*p == '%' && sscanf(p + 1, "%2x", &v) == 1) {
+            name[len++] = (uint8_t)v;
+            p += 2;
+        } else {
+            name[len++] = (uint8_t)*p;
+        }
+    }
+}
+
+static int index_write(const char *path, const TapeIndex *ix)
+{
+    FILE *f = fopen(path, "w");
+    size_t n;
+
+    if (!f)
+        return -1;
+    fprintf(f, "VZI %d\n", INDEX_VERSION);
+    fprintf(f, "wav_bytes %llu\n", ix->wav_bytes);
+    fprintf(f, "fingerprint %016llx\n", ix->fingerprint);
+    fprintf(f, "mode %s\n", ix->capture_mode ? "capture" : "legacy");
+    fprintf(f, "gain %d\n", ix->input_gain_percent);
+    fprintf(f, "programs %u\n", (unsigned)ix->count);
+    for (n = 0; n < ix->count; n++) {
+        const IndexEntry *e = &ix->entries[n];
+
+        fprintf(f, "%u %llu %llu %llu %llu %llu %llu %02X %04X %04X %s ",
+                (unsigned)(n + 1u), e->signal, e->preamble, e->header,
+                e->payload, e->checksum, e->end,
+                (unsigned)e->hdr.file_type, (unsigned)e->hdr.start_addr,
+                (unsigned)e->hdr.end_addr, index_status_names[e->status]);
+        write_tape_name(f, e->hdr.filename);
+        fputc('\n', f);
+    }
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * index_read() -- load a sidecar.
+ *
+ * Returns 0 when the file parsed and matches want (size, fingerprint,
+ * mode, gain);
+ * -1 when it is missing, malformed or stale.
+ */
+static int index_read(const char *path, const TapeIndex *want, TapeIndex *ix)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    char mode[16];
+    unsigned count = 0, k;
+    int version = 0;
+
+    memset(ix, 0, sizeof(*ix));
+    if (!f)
+        return -1;
+    if (!fgets(line, sizeof(line), f) || sscanf(line, "VZI %d", &version) != 1 ||
+        version != INDEX_VERSION ||
+        !fgets(line, sizeof(line), f) || sscanf(line, "wav_bytes %llu", &ix->wav_bytes) != 1 ||
+        !fgets(line, sizeof(line), f) || sscanf(line, "fingerprint %llx", &ix->fingerprint) != 1 ||
+        !fgets(line, sizeof(line), f) || sscanf(line, "mode %15s", mode) != 1 ||
+        !fgets(line, sizeof(line), f) || sscanf(line, "gain %d", &ix->input_gain_percent) != 1 ||
+        !fgets(line, sizeof(line), f) || sscanf(line, "programs %u", &count) != 1)
+        goto bad;
+    ix->capture_mode = (strcmp(mode, "capture") == 0);
+    if (ix->wav_bytes != want->wav_bytes ||
+        ix->fingerprint != want->fingerprint ||
+        ix->capture_mode != want->capture_mode ||
+        ix->input_gain_percent != want->input_gain_percent)
+        goto bad;
+
+    for (k = 0; k < count; k++) {
+        IndexEntry e;
+        unsigned n, type, start, end, s;
+        char status[16];
+        int name_at = 0;
+
+        memset(&e, 0, sizeof(e));
+        if (!fgets(line, sizeof(line), f) ||
+            sscanf(line, "%u %llu %llu %llu %llu %llu %llu %x %x %x %15s %n",
+                   &n, &e.signal, &e.preamble, &e.header, &e.payload,
+                   &e.checksum, &e.end, &type, &start, &end, status,
+                   &name_at) != 11 || name_at == 0 || n != k + 1u)
+            goto bad;
+        for (s = 0; s < sizeof(index_status_names) / sizeof(index_status_names[0]); s++)
+            if (strcmp(status, index_status_names[s]) == 0)
+                break;
+        if (s == sizeof(index_status_names) / sizeof(index_status_names[0]))
+            goto bad;
+        e.status = (IndexStatus)s;
+        e.hdr.file_type = (uint8_t)type;
+        e.hdr.start_addr = (uint16_t)start;
+        e.hdr.end_addr = (uint16_t)end;
+        parse_tape_name(line + name_at, e.hdr.filename);
+        if (index_append(ix, &e) != 0)
+            goto bad;
+    }
+    fclose(f);
+    return 0;
+
+bad:
+    fclose(f);
+    index_free(ix);
+    return -1;
+}
+
+/*
+ * index_load_or_build() -- trusted sidecar, or a fresh scan saved beside
+ * the WAV.  *rebuilt reports which.  A sidecar that cannot be written
+ * (read-only archive) only costs a warning.
+ */
+static DecStatus index_load_or_build(WavDecoder *d, const char *wav_path,
+                                     TapeIndex *ix, int *rebuilt)
+{
+    TapeIndex want;
+    char *path;
+    DecStatus st;
+
+    memset(&want, 0, sizeof(want));
+    if (wav_file_bytes(d->wav, &want.wav_bytes) != 0 ||
+        wav_fingerprint(d->wav, want.wav_bytes, &want.fingerprint) != 0)
+        return DEC_ERR_IO;
+    want.capture_mode = d->capture_mode;
+    want.input_gain_percent = d->input_gain_percent;
+
+    path = (char *)malloc(strlen(wav_path) + sizeof(INDEX_SUFFIX));
+    if (!path)
+        return DEC_ERR_NOMEM;
+    strcpy(path, wav_path);
+    strcat(path, INDEX_SUFFIX);
+
+    *rebuilt = 0;
+    if (index_read(path, &want, ix) == 0) {
+        free(path);
+        return DEC_OK;
+    }
+
+    *rebuilt = 1;
+    *ix = want;
+    st = dec_seek(d, 0ULL);
+    if (st == DEC_OK)
+        st = dec_scan_tape(d, ix);
+    if (st == DEC_OK && index_write(path, ix) != 0)
+        printf("warning -- couldn't write index %s\n", path);
+    free(path);
+    return st;
+}
+
+/* Case-insensitive match of a tape filename against --name. */
+static int name_matches(const uint8_t *tape_name, const char *want)
+{
+    size_t i;
+
+    for (i = 0; want[i] && tape_name[i]; i++)
+        if (toupper((unsigned char)want[i]) != toupper(tape_name[i]))
+            return 0;
+    return want[i] == '\0' && tape_name[i] == 0u;
+}
+
+static void print_index(const TapeIndex *ix)
+{
+    size_t n;
+
+    printf("  #  Signal @     Type Start End   Size   Checksum  Name\n");
+    for (n = 0; n < ix->count; n++) {
+        const IndexEntry *e = &ix->entries[n];
+        printf("%3u  %-12llu %02X   %04X  %04X  %-6u %-9s %s\n",
+               (unsigned)(n + 1u), e->signal, (unsigned)e->hdr.file_type,
+               (unsigned)e->hdr.start_addr, (unsigned)e->hdr.end_addr,
+               (unsigned)(uint16_t)(e->hdr.end_addr - e->hdr.start_addr),
+               index_status_names[e->status], (const char *)e->hdr.filename);
+    }
+}
+
+/* -----------------------------------------------------------------------
+ * Decoder snapshots and checkpoints (<vz>.ckpt).
+ *
+ * Between two ReadVZbyte() calls the whole decoder state is the next
+ * sample index plus the filter history: FindCycle() pushes back into the
+ * buffer, so nothing else is in flight.  A DecSnapshot captures exactly
+ * that, and dec_restore() seeks back to it.
+ *
+ * With --checkpoint the decode saves two snapshots beside the output:
+ * the leader (where the signal was found) and the latest payload byte
+ * boundary, refreshed every CKPT_INTERVAL_BYTES together with the tape
+ * header and the number of payload bytes already flushed to the .vz.
+ *
+ *   --resume         continue from the latest snapshot
+ *   --resume-leader  restart at the leader, e.g. with another --gain
+ *
+ * Mode and gain come from the command line on resume, so either may be
+ * changed; the filter history carries over as raw sample values.  The
+ * checkpoint is removed once a decode ends with a good checksum.
+ *
+ *   VZC 1
+ *   wav_bytes <file size>
+ *   mode capture|legacy
+ *   gain <percent>
+ *   leader <sample> <logic> <raw1> <raw2>
+ *   at <sample> <logic> <raw1> <raw2>
+ *   phase leader|payload
+ *   header <type> <start> <end_addr> <payload bytes written>
+ *   name <tape name, %XX-escaped>
+ * ----------------------------------------------------------------------- */
+#define CKPT_VERSION         1
+#define CKPT_SUFFIX          ".ckpt"
+#define CKPT_INTERVAL_BYTES  1024u
+
+typedef struct {
+    unsigned long long sample;
+    int      logic_state;
+    unsigned prev_raw1;
+    unsigned prev_raw2;
+} DecSnapshot;
+
+typedef enum {
+    CKPT_PHASE_LEADER = 0,      /* signal found, nothing decoded yet    */
+    CKPT_PHASE_PAYLOAD          /* header decoded, payload in progress  */
+} CkptPhase;
+
+typedef struct {
+    unsigned long long wav_bytes;
+    int         capture_mode;
+    int         input_gain_percent;
+    DecSnapshot leader;
+    DecSnapshot at;
+    CkptPhase   phase;
+    TapeHeader  hdr;
+    unsigned    got;
+} Checkpoint;
+
+static void dec_snapshot(const WavDecoder *d, DecSnapshot *s)
+{
+    s->sample = dec_tell(d);
+    s->logic_state = d->logic_state;
+    s->prev_raw1 = d->prev_raw1;
+    s->prev_raw2 = d->prev_raw2;
+}
+
+static DecStatus dec_restore(WavDecoder *d, const DecSnapshot *s)
+{
+    if (dec_seek(d, s->sample) != DEC_OK)
+        return d->status;
+    d->logic_state = s->logic_state;
+    d->prev_raw1 = s->prev_raw1;
+    d->prev_raw2 = s->prev_raw2;
+    return DEC_OK;
+}
+
+/*
+ * checkpoint_save() -- write via a temporary and rename, so an
+ * interruption mid-write leaves the previous checkpoint intact.
+ */
+static int checkpoint_save(const char *path, const Checkpoint *ck)
+{
+    char *tmp = (char *)malloc(strlen(path) + 5u);
+    FILE *f;
+    int rc = -1;
+
+    if (!tmp)
+        return -1;
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+    f = fopen(tmp, "w");
+    if (f) {
+        fprintf(f, "VZC %d\n", CKPT_VERSION);
+        fprintf(f, "wav_bytes %llu\n", ck->wav_bytes);
+        fprintf(f, "mode %s\n", ck->capture_mode ? "capture" : "legacy");
+        fprintf(f, "gain %d\n", ck->input_gain_percent);
+        fprintf(f, "leader %llu %d %u %u\n", ck->leader.sample,
+                ck->leader.logic_state, ck->leader.prev_raw1, ck->leader.prev_raw2);
+        fprintf(f, "at %llu %d %u %u\n", ck->at.sample,
+                ck->at.logic_state, ck->at.prev_raw1, ck->at.prev_raw2);
+        fprintf(f, "phase %s\n", ck->phase == CKPT_PHASE_PAYLOAD ? "payload" : "leader");
+        fprintf(f, "header %02X %04X %04X %u\n", (unsigned)ck->hdr.file_type,
+                (unsigned)ck->hdr.start_addr, (unsigned)ck->hdr.end_addr, ck->got);
+        fprintf(f, "name ");
+        write_tape_name(f, ck->hdr.filename);
+        fputc('\n', f);
+        if (fclose(f) == 0) {
+            remove(path);   /* rename() will not replace on Win32 */
+            rc = rename(tmp, path) == 0 ? 0 : -1;
+        }
+    }
+    if (rc != 0)
+        remove(tmp);
+    free(tmp);
+    return rc;
+}
+
+static int snapshot_parse(const char *line, const char *key, DecSnapshot *s)
+{
+    char fmt[32];
+
+    sprintf(fmt, "%s %%llu %%d %%u %%u", key);
+    if (sscanf(line, fmt, &s->sample, &s->logic_state,
+               &s->prev_raw1, &s->prev_raw2) != 4)
+        return -1;
+    if (s->logic_state < -1 || s->logic_state > 1 ||
+        s->prev_raw1 > 255u || s->prev_raw2 > 255u)
+        return -1;
+    return 0;
+}
+
+/* Returns 0 on success, -1 if missing or malformed. */
+static int checkpoint_load(const char *path, Checkpoint *ck)
+{
+    FILE *f = fopen(path, "r");
+    char line[256];
+    char word[16];
+    unsigned type, start, end;
+    int version = 0;
+    int ok;
+
+    memset(ck, 0, sizeof(*ck));
+    if (!f)
+        return -1;
+    ok = fgets(line, sizeof(line), f) && sscanf(line, "VZC %d", &version) == 1 &&
+         version == CKPT_VERSION &&
+         fgets(line, sizeof(line), f) && sscanf(line, "wav_bytes %llu", &ck->wav_bytes) == 1 &&
+         fgets(line, sizeof(line), f) && sscanf(line, "mode %15s", word) == 1;
+    if (ok)
+        ck->capture_mode = (strcmp(word, "capture") == 0);
+    ok = ok &&
+         fgets(line, sizeof(line), f) && sscanf(line, "gain %d", &ck->input_gain_percent) == 1 &&
+         fgets(line, sizeof(line), f) && snapshot_parse(line, "leader", &ck->leader) == 0 &&
+         fgets(line, sizeof(line), f) && snapshot_parse(line, "at", &ck->at) == 0 &&
+         fgets(line, sizeof(line), f) && sscanf(line, "phase %15s", word) == 1;
+    if (ok)
+        ck->phase = (strcmp(word, "payload") == 0) ? CKPT_PHASE_PAYLOAD : CKPT_PHASE_LEADER;
+    ok = ok &&
+         fgets(line, sizeof(line), f) &&
+         sscanf(line, "header %x %x %x %u", &type, &start, &end, &ck->got) == 4 &&
+         fgets(line, sizeof(line), f) && strncmp(line, "name ", 5) == 0;
+    fclose(f);
+    if (!ok)
+        return -1;
+    ck->hdr.file_type = (uint8_t)type;
+    ck->hdr.start_addr = (uint16_t)start;
+    ck->hdr.end_addr = (uint16_t)end;
+    parse_tape_name(line + 5, ck->hdr.filename);
+    if (ck->got > (unsigned)(uint16_t)(ck->hdr.end_addr - ck->hdr.start_addr))
+        return -1;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------
+ * --stats reporting.
+ *
+ * Phases follow the order main() runs them in; only the ones actually
+ * entered are printed.  Sample counts are samples read from the WAV,
+ * so seeks via the index or a checkpoint do not inflate throughput.
+ * ----------------------------------------------------------------------- */
+enum {
+    PH_INDEX = 0,
+    PH_ANALYZE,
+    PH_SEARCH,
+    PH_LEADER,
+    PH_PREAMBLE,
+    PH_HEADER,
+    PH_PAYLOAD,
+    PH_CHECKSUM,
+    PH_COUNT
+};
+
+static const char *const phase_names[PH_COUNT] = {
+    "index scan", "analyze", "signal search", "leader sync",
+    "preamble", "header", "payload", "checksum"
+};
+
+static void print_decoder_stats(const StatTimer *t, const WavDecoder *d)
+{
+    printf("\nDecoder statistics:\n");
+#if VZ_STATS
+    stat_print_phases(t, "Samples");
+    printf("  Samples read     : %llu\n", dec_consumed(d));
+    printf("  Edges            : %llu\n", d->stats.edges);
+    printf("  Cycles           : short=%llu long=%llu error=%llu\n",
+           d->stats.cycles_short, d->stats.cycles_long, d->stats.cycles_error);
+    printf("  Skipped bit slots: %llu\n", d->stats.skipped_slots);
+    printf("  Checksum resyncs : %llu\n", d->stats.resyncs);
+#else
+    (void)t;
+    (void)d;
+    printf("  not available (built with VZ_STATS=0)\n");
+#endif
+}
+
+/* -----------------------------------------------------------------------
+ * write_cas() -- the decoded tape byte stream as a .cas image, in one
+ * write: leader as decoded, sync, header, payload and the checksum that
+ * was on tape.
+ * ----------------------------------------------------------------------- */
+static int write_cas(const char *path, unsigned leader, const TapeHeader *th,
+                     const uint8_t *payload, size_t len, uint16_t checksum)
+{
+    size_t n = (size_t)leader + VZTAPE_SYNC_COUNT;
+    uint8_t *buf = (uint8_t *)malloc(n + VZTAPE_HEAD_MAX + len + 2u);
+    FILE *f;
+    int rc = -1;
+
+    if (!buf)
+        return -1;
+    memset(buf, VZTAPE_LEADER_BYTE, leader);
+    memset(buf + leader, VZTAPE_SYNC_BYTE, VZTAPE_SYNC_COUNT);
+    n += vztape_head(buf + n, th->file_type, th->filename, th->start_addr, th->end_addr);
+    if (len)
+        memcpy(buf + n, payload, len);
+    n += len;
+    buf[n++] = (uint8_t)(checksum & 0xFFu);
+    buf[n++] = (uint8_t)(checksum >> 8);
+
+    f = fopen(path, "wb");
+    if (f) {
+        rc = (fwrite(buf, 1u, n, f) == n) ? 0 : -1;
+        if (fclose(f) != 0)
+            rc = -1;
+    }
+    free(buf);
+    return rc;
+}
+
+/* -----------------------------------------------------------------------
+ * main()
+ * ----------------------------------------------------------------------- */
+int main(int argc, char *argv[])
+{
+    const char *input_path = NULL;
+    const char *output_path = NULL;
+    int analyze_mode = 0;
+    int index_mode = 0;
+    unsigned program_no = 0;
+    const char *program_name = NULL;
+    const char *cas_path = NULL;
+    unsigned   leader_bytes = VZTAPE_CAS_LEADER;
+    TapeIndex  tape_index;
+    const IndexEntry *selected = NULL;
+    int checkpoint_mode = 0;
+    int resume_mode = 0;            /* 1 = latest snapshot, 2 = leader */
+    int resume_payload = 0;
+    char *ckpt_path = NULL;
+    Checkpoint ckpt;
+    AnalyzeOptions analyze_opt;
+    int stats_mode = 0;
+    StatPhase  phases[PH_COUNT];
+    StatTimer  timer;
+    int capture_mode = 1;
+    int input_gain_percent = DEFAULT_INPUT_GAIN_PERCENT;
+    WavDecoder dec;
+    FILE      *wav = NULL;
+    FILE      *vz = NULL;
+    WavHeader  wav_hdr;
+    VzHeader   vz_hdr;
+    TapeHeader tape_hdr;
+    DecStatus  st;
+    int        i;
+    uint8_t   *payload = NULL;
+    size_t     payload_got = 0;
+    uint16_t   data_size;
+    uint16_t   checksum_calc, checksum_tape;
+    int        cas_failed = 0;
+
+    memset(&analyze_opt, 0, sizeof(analyze_opt));
+    memset(&tape_index, 0, sizeof(tape_index));
+    memset(&ckpt, 0, sizeof(ckpt));
+    for (i = 0; i < PH_COUNT; i++)
+        phases[i].name = phase_names[i];
+    stat_timer_init(&timer, phases, PH_COUNT);
+    analyze_opt.window_ms = DEFAULT_WINDOW_MS;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--version") == 0 || strcmp(argv[i], "-V") == 0) {
+            printf("wav2vz version %s\n", TOOL_VERSION);
+            return 0;
+        }
+        if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
+            print_usage();
+            return 0;
+        }
+    }
+
+    /* ------------------------------------------------------------------ */
+    /* Banner (strings from 0B42 data segment of the original EXE)         */
+    /* ------------------------------------------------------------------ */
+    printf("\t\tWAV2VZ v%s - ", TOOL_VERSION);
+    printf("WAV file to .VZ converter\n\n");
+    print_usage();
+
+    /* ------------------------------------------------------------------ */
+    /* Argument check                                                       */
+    /* ------------------------------------------------------------------ */
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--legacy") == 0 || strcmp(argv[i], "-l") == 0) {
+            capture_mode = 0;
+        } else if (strcmp(argv[i], "--gain") == 0 || strcmp(argv[i], "-g") == 0) {
+            if (i + 1 >= argc || parse_gain_percent(argv[++i], &input_gain_percent) != 0) {
+                printf("error -- invalid --gain value\n");
                 exit(1);
             }
         } else if (strncmp(argv[i], "--gain=", 7) == 0) {
-            if (parse_gain_percent(argv[i] + 7, &g_input_gain_percent) != 0) {
+            if (parse_gain_percent(argv[i] + 7, &input_gain_percent) != 0) {
                 printf("error -- invalid --gain value\n");
                 exit(1);
             }
         } else if (strcmp(argv[i], "--analyze") == 0 || strcmp(argv[i], "-a") == 0) {
             analyze_mode = 1;
         } else if (strcmp(argv[i], "--capture") == 0 || strcmp(argv[i], "-c") == 0) {
-            g_capture_mode = 1;
+            capture_mode = 1;
+        } else if (strcmp(argv[i], "--window") == 0 || strcmp(argv[i], "-w") == 0) {
+            char *end = NULL;
+            long v = (i + 1 < argc) ? strtol(argv[++i], &end, 10) : -1;
+            if (!end || *end != '\0' || v < 0 || v > 3600000L) {
+                printf("error -- invalid --window value\n");
+                exit(1);
+            }
+            analyze_opt.window_ms = (unsigned)v;
+        } else if (strcmp(argv[i], "--index") == 0) {
+            index_mode = 1;
+        } else if (strcmp(argv[i], "--program") == 0 || strcmp(argv[i], "-p") == 0) {
+            char *end = NULL;
+            long v = (i + 1 < argc) ? strtol(argv[++i], &end, 10) : -1;
+            if (!end || *end != '\0' || v < 1 || v > 65535L) {
+                printf("error -- invalid --program value\n");
+                exit(1);
+            }
+            program_no = (unsigned)v;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats_mode = 1;
+        } else if (strcmp(argv[i], "--checkpoint") == 0) {
+            checkpoint_mode = 1;
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            resume_mode = 1;
+        } else if (strcmp(argv[i], "--resume-leader") == 0) {
+            resume_mode = 2;
+        } else if (strcmp(argv[i], "--name") == 0) {
+            program_name = option_value(argc, argv, &i);
+        } else if (strcmp(argv[i], "--cas") == 0) {
+            cas_path = option_value(argc, argv, &i);
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            analyze_opt.csv_path = option_value(argc, argv, &i);
+        } else if (strcmp(argv[i], "--json") == 0) {
+            analyze_opt.json_path = option_value(argc, argv, &i);
         } else if (!input_path) {
             input_path = argv[i];
         } else if (!output_path) {
@@ -674,24 +2285,45 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (!input_path || (!analyze_mode && !output_path) || (analyze_mode && output_path)) {
+    if (!input_path || (!analyze_mode && !index_mode && !output_path) ||
+        ((analyze_mode || index_mode) && output_path)) {
         printf("error -- must specify input & output file\n");
         print_usage();
         exit(1);
     }
 
+    if (!analyze_mode && (analyze_opt.csv_path || analyze_opt.json_path)) {
+        printf("error -- --csv/--json require --analyze\n");
+        exit(1);
+    }
+    if ((analyze_mode && index_mode) ||
+        ((analyze_mode || index_mode) && (program_no || program_name)) ||
+        (program_no && program_name)) {
+        printf("error -- --analyze, --index and --program/--name are exclusive\n");
+        exit(1);
+    }
+    if (cas_path && (analyze_mode || index_mode)) {
+        printf("error -- --cas needs a decode run, not --analyze/--index\n");
+        exit(1);
+    }
+    if (resume_mode && (analyze_mode || index_mode || program_no || program_name)) {
+        printf("error -- --resume cannot be combined with --analyze/--index/--program/--name\n");
+        exit(1);
+    }
+    analyze_opt.input_path = input_path;
+    analyze_opt.window_samples =
+        (unsigned long long)WAV_SAMPLE_RATE * analyze_opt.window_ms / 1000u;
+
     if (analyze_mode)
         printf("Operation          : analyze-only\n");
-    if (g_capture_mode)
+    if (index_mode)
+        printf("Operation          : index-only\n");
+    if (capture_mode)
         printf("Decode mode        : capture (noise-tolerant)\n\n");
     else
         printf("Decode mode        : legacy (original thresholds)\n\n");
     printf("Input gain         : %+d%% (scale %.2fx)\n\n",
-           g_input_gain_percent, (100.0 + (double)g_input_gain_percent) / 100.0);
-
-    g_logic_state = -1;
-    g_prev_raw1 = LOGIC_CENTER;
-    g_prev_raw2 = LOGIC_CENTER;
+           input_gain_percent, (100.0 + (double)input_gain_percent) / 100.0);
 
     /* ------------------------------------------------------------------ */
     /* Open WAV input                                                       */
@@ -699,8 +2331,8 @@ int main(int argc, char *argv[])
     printf("Opening WAV file......");
     fflush(stdout);
 
-    g_wav = fopen(input_path, "rb");
-    if (!g_wav) {
+    wav = fopen(input_path, "rb");
+    if (!wav) {
         printf("error -- file doesn't exist\n");
         exit(1);
     }
@@ -709,66 +2341,173 @@ int main(int argc, char *argv[])
     /* ------------------------------------------------------------------ */
     /* Validate WAV header                                                  */
     /* ------------------------------------------------------------------ */
-    if (fread(&wav_hdr, sizeof(WavHeader), 1u, g_wav) != 1u) {
-        printf("error - could not read WAV header\n");
-        fclose(g_wav);
+    if (dec_init(&dec, wav, capture_mode, input_gain_percent) != DEC_OK ||
+        dec_read_wav_header(&dec, &wav_hdr) != DEC_OK) {
+        printf("%s\n", dec_strerror(dec.status));
+        dec_free(&dec);
+        fclose(wav);
         exit(1);
     }
 
-    if (wav_hdr.sample_rate_hi  != 0u    ||
-        wav_hdr.sample_rate_lo  != 22050u ||
-        wav_hdr.bits_per_sample != 8u    ||
-        wav_hdr.num_channels    != 1u)
-    {
-        printf("error - WAV file must be 22050hz 8 bit mono\n");
-        fclose(g_wav);
-        exit(1);
+    if (analyze_mode) {
+        int rc;
+        stat_phase(&timer, PH_ANALYZE, dec_consumed(&dec));
+        rc = analyze_wav_stream(&dec, &analyze_opt);
+        stat_phase(&timer, -1, dec_consumed(&dec));
+        if (stats_mode)
+            print_decoder_stats(&timer, &dec);
+        dec_free(&dec);
+        fclose(wav);
+        return rc == 0 ? 0 : 1;
     }
 
-    if (analyze_mode) {
-        analyze_wav_stream();
-        fclose(g_wav);
-        g_wav = NULL;
-        return 0;
+    /* ------------------------------------------------------------------ */
+    /* Tape index: list it, or pick the program to decode                  */
+    /* ------------------------------------------------------------------ */
+    if (index_mode || program_no || program_name) {
+        int rebuilt = 0;
+
+        printf("Reading tape index....");
+        fflush(stdout);
+        stat_phase(&timer, PH_INDEX, dec_consumed(&dec));
+        st = index_load_or_build(&dec, input_path, &tape_index, &rebuilt);
+        stat_phase(&timer, -1, dec_consumed(&dec));
+        if (st != DEC_OK) {
+            printf("%s\n", dec_strerror(st));
+            index_free(&tape_index);
+            dec_free(&dec);
+            fclose(wav);
+            exit(1);
+        }
+        printf("%s (%u programs)\n\n", rebuilt ? "rebuilt" : "OK!",
+               (unsigned)tape_index.count);
+
+        if (index_mode) {
+            print_index(&tape_index);
+            if (stats_mode)
+                print_decoder_stats(&timer, &dec);
+            index_free(&tape_index);
+            dec_free(&dec);
+            fclose(wav);
+            return 0;
+        }
+
+        for (i = 0; i < (int)tape_index.count; i++) {
+            const IndexEntry *e = &tape_index.entries[i];
+            if ((program_no && (unsigned)i + 1u == program_no) ||
+                (program_name && name_matches(e->hdr.filename, program_name))) {
+                selected = e;
+                break;
+            }
+        }
+        if (!selected) {
+            printf("error -- program not found in index\n");
+            index_free(&tape_index);
+            dec_free(&dec);
+            fclose(wav);
+            exit(1);
+        }
     }
 
     /* ------------------------------------------------------------------ */
-    /* Open VZ output                                                       */
+    /* Checkpoint: load it for --resume, or note the WAV size for saving   */
     /* ------------------------------------------------------------------ */
-    g_vz = fopen(output_path, "wb");
-    if (!g_vz) {
+    if (checkpoint_mode || resume_mode) {
+        ckpt_path = (char *)malloc(strlen(output_path) + sizeof(CKPT_SUFFIX));
+        if (!ckpt_path) {
+            printf("%s\n", dec_strerror(DEC_ERR_NOMEM));
+            index_free(&tape_index);
+            dec_free(&dec);
+            fclose(wav);
+            exit(1);
+        }
+        strcpy(ckpt_path, output_path);
+        strcat(ckpt_path, CKPT_SUFFIX);
+
+        if (resume_mode) {
+            unsigned long long wav_bytes = 0;
+            if (checkpoint_load(ckpt_path, &ckpt) != 0 ||
+                wav_file_bytes(wav, &wav_bytes) != 0 || wav_bytes != ckpt.wav_bytes) {
+                printf("error -- no usable checkpoint %s for this WAV\n", ckpt_path);
+                free(ckpt_path);
+                dec_free(&dec);
+                fclose(wav);
+                exit(1);
+            }
+            if (ckpt.capture_mode != capture_mode || ckpt.input_gain_percent != input_gain_percent)
+                printf("note -- checkpoint was taken in %s mode at %+d%% gain\n\n",
+                       ckpt.capture_mode ? "capture" : "legacy", ckpt.input_gain_percent);
+            resume_payload = (resume_mode == 1 && ckpt.phase == CKPT_PHASE_PAYLOAD);
+        } else if (wav_file_bytes(wav, &ckpt.wav_bytes) != 0 ||
+                   dec_seek(&dec, 0ULL) != DEC_OK) {
+            printf("%s\n", dec_strerror(DEC_ERR_IO));
+            free(ckpt_path);
+            index_free(&tape_index);
+            dec_free(&dec);
+            fclose(wav);
+            exit(1);
+        }
+        ckpt.capture_mode = capture_mode;
+        ckpt.input_gain_percent = input_gain_percent;
+    }
+
+    /* ------------------------------------------------------------------ */
+    /* Open VZ output (reopened for update when resuming mid-payload)      */
+    /* ------------------------------------------------------------------ */
+    vz = fopen(output_path, resume_payload ? "r+b" : "wb");
+    if (!vz) {
         printf("error -- couldn't create output file\n");
-        fclose(g_wav);
+        free(ckpt_path);
+        index_free(&tape_index);
+        dec_free(&dec);
+        fclose(wav);
         exit(1);
     }
 
     /* ------------------------------------------------------------------ */
     /* Search for leader tone in raw WAV bytes                              */
-    /*                                                                      */
-    /* c is kept as int and EOF is checked before the (unsigned) cast.     */
-    /* Casting EOF(-1) to unsigned gives 0xFFFFFFFF >= 0x90, which would   */
-    /* silently exit the loop on a truncated file -- the int check stops   */
-    /* this.                                                                */
     /* ------------------------------------------------------------------ */
-    printf("Searching for signal..");
-    fflush(stdout);
-
-    do {
-        c = fgetc(g_wav);
-        if (c == EOF)
-            fatal("error -- unexpected end of file while searching for signal");
-    } while ((unsigned)c < TAPE_LEADER_THRESH);
-
+    stat_phase(&timer, PH_SEARCH, dec_consumed(&dec));
+    if (resume_mode) {
+        const DecSnapshot *snap = resume_payload ? &ckpt.at : &ckpt.leader;
+        printf("Resuming at %llu..", snap->sample);
+        fflush(stdout);
+        if (dec_restore(&dec, snap) != DEC_OK)
+            goto decode_fail;
+    } else if (selected) {
+        printf("Seeking to program %u.", (unsigned)(selected - tape_index.entries) + 1u);
+        fflush(stdout);
+        if (dec_seek(&dec, selected->signal) != DEC_OK)
+            goto decode_fail;
+    } else {
+        printf("Searching for signal..");
+        fflush(stdout);
+        if (dec_find_signal(&dec) != DEC_OK)
+            goto decode_fail;
+    }
     printf("OK!\n");
 
+    if (resume_payload) {
+        tape_hdr = ckpt.hdr;
+        printf("Reading tape header....(from checkpoint)\n\n");
+        goto have_header;
+    }
+    if (ckpt_path) {
+        dec_snapshot(&dec, &ckpt.leader);
+        ckpt.at = ckpt.leader;
+        ckpt.phase = CKPT_PHASE_LEADER;
+        if (checkpoint_save(ckpt_path, &ckpt) != 0)
+            printf("warning -- couldn't write checkpoint %s\n", ckpt_path);
+    }
+
     /* ------------------------------------------------------------------ */
     /* Sync to leader: decode bytes until TAPE_START_BYTE (0x80)           */
     /* ------------------------------------------------------------------ */
     printf("Synching to leader.....");
     fflush(stdout);
-
-    do { b = ReadVZbyte(); } while (b != (uint8_t)TAPE_START_BYTE);
-
+    stat_phase(&timer, PH_LEADER, dec_consumed(&dec));
+    if (dec_sync_leader(&dec) != DEC_OK)
+        goto decode_fail;
     printf("OK!\n");
 
     /* ------------------------------------------------------------------ */
@@ -776,22 +2515,18 @@ int main(int argc, char *argv[])
     /* ------------------------------------------------------------------ */
     printf("Finding preamble......");
     fflush(stdout);
-
-    do { b = ReadVZbyte(); } while (b == (uint8_t)TAPE_START_BYTE);
-
-    if (b != (uint8_t)TAPE_PREAMBLE_BYTE) {
-        printf("error finding preamble\n");
-        fclose(g_wav); fclose(g_vz);
+    stat_phase(&timer, PH_PREAMBLE, dec_consumed(&dec));
+    st = dec_read_preamble(&dec, &leader_bytes);
+    if (st == DEC_ERR_PREAMBLE_START || st == DEC_ERR_PREAMBLE) {
+        printf("%s\n", dec_strerror(st));
+        free(ckpt_path);
+        index_free(&tape_index);
+        dec_free(&dec);
+        fclose(wav); fclose(vz);
         exit(1);
     }
-
-    for (i = 0; i < 4; i++) {
-        if (ReadVZbyte() != (uint8_t)TAPE_PREAMBLE_BYTE) {
-            printf("error reading preamble\n");
-            fclose(g_wav); fclose(g_vz);
-            exit(1);
-        }
-    }
+    if (st != DEC_OK)
+        goto decode_fail;
 
     printf("OK!\n");
     printf("Reading tape header....\n\n");
@@ -799,29 +2534,21 @@ int main(int argc, char *argv[])
     /* ------------------------------------------------------------------ */
     /* Read tape header fields                                              */
     /* ------------------------------------------------------------------ */
+    stat_phase(&timer, PH_HEADER, dec_consumed(&dec));
+    if (dec_read_header(&dec, &tape_hdr) != DEC_OK)
+        goto decode_fail;
 
-    file_type = ReadVZbyte();
+have_header:
     /* (unsigned) cast: uint8_t promotes through varargs to int; making it
      * explicitly unsigned ensures %02X prints the correct 2-digit hex on
      * all platforms including MinGW where MSVC-style printf is used.      */
-    printf("File type         : %02X\n", (unsigned)file_type);
-
-    memset(filename_buf, 0, sizeof(filename_buf));
-    for (i = 0; i < 17; i++) {
-        filename_buf[i] = ReadVZbyte();
-        if (filename_buf[i] == 0u) break;
-    }
-    filename_buf[16] = 0u;                          /* unconditional NUL   */
-    printf("Filename          : %s\n", (const char *)filename_buf);
-
-    start_addr = read_u16_le();
-    printf("Start Address     : %04X\n", (unsigned)start_addr);
-
-    end_addr   = read_u16_le();
-    printf("End Address       : %04X\n", (unsigned)end_addr);
+    printf("File type         : %02X\n", (unsigned)tape_hdr.file_type);
+    printf("Filename          : %s\n", (const char *)tape_hdr.filename);
+    printf("Start Address     : %04X\n", (unsigned)tape_hdr.start_addr);
+    printf("End Address       : %04X\n", (unsigned)tape_hdr.end_addr);
 
     /* uint16_t subtraction wraps mod 65536, matching original 16-bit DOS */
-    data_size  = (uint16_t)(end_addr - start_addr);
+    data_size  = (uint16_t)(tape_hdr.end_addr - tape_hdr.start_addr);
     printf("Size in bytes     : %u\n\n", (unsigned)data_size);
 
     /* ------------------------------------------------------------------ */
@@ -838,37 +2565,78 @@ int main(int argc, char *argv[])
     vz_hdr.magic[0] = (uint8_t)'V';
     vz_hdr.magic[1] = (uint8_t)'Z';
     vz_hdr.magic[2] = (uint8_t)'F';
-    vz_hdr.magic[3] = (file_type == 0xF0u) ? (uint8_t)'0' : (uint8_t)'O';
-    memcpy(vz_hdr.filename, filename_buf, sizeof(filename_buf));
-    vz_hdr.file_type  = file_type;
-    vz_hdr.start_addr = start_addr;
+    vz_hdr.magic[3] = (tape_hdr.file_type == 0xF0u) ? (uint8_t)'0' : (uint8_t)'O';
+    memcpy(vz_hdr.filename, tape_hdr.filename, sizeof(tape_hdr.filename));
+    vz_hdr.file_type  = tape_hdr.file_type;
+    vz_hdr.start_addr = tape_hdr.start_addr;
+
+    payload = (uint8_t *)malloc(data_size ? (size_t)data_size : 1u);
+    if (!payload) {
+        fprintf(stderr, "error -- out of memory\n");
+        goto fail;
+    }
 
-    if (fwrite(&vz_hdr, sizeof(VzHeader), 1u, g_vz) != 1u)
-        fatal("error writing VZ header");
+    if (resume_payload) {
+        /* Header and the first ckpt.got bytes are already on disk. */
+        payload_got = ckpt.got;
+        if (fseek(vz, (long)sizeof(VzHeader), SEEK_SET) != 0 ||
+            fread(payload, 1u, payload_got, vz) != payload_got ||
+            fseek(vz, (long)(sizeof(VzHeader) + payload_got), SEEK_SET) != 0) {
+            fprintf(stderr, "error -- %s is shorter than its checkpoint\n", output_path);
+            goto fail;
+        }
+    } else if (fwrite(&vz_hdr, sizeof(VzHeader), 1u, vz) != 1u) {
+        fprintf(stderr, "error writing VZ header\n");
+        goto fail;
+    }
 
     /* ------------------------------------------------------------------ */
-    /* Decode and write data payload; accumulate checksum                  */
-    /*                                                                      */
-    /* Loop index i (int) holds values up to data_size (uint16_t <= 65535):*/
-    /* no overflow.  checksum_calc wraps at 65536 (uint16_t arithmetic)   */
-    /* matching the original 16-bit DOS accumulator.                       */
+    /* Decode the data payload, then write whatever was recovered.          */
+    /* A truncated capture still leaves the partial image on disk.  With   */
+    /* a checkpoint the payload goes out in CKPT_INTERVAL_BYTES slices,    */
+    /* each flushed before the checkpoint that covers it is saved.         */
     /* ------------------------------------------------------------------ */
+    stat_phase(&timer, PH_PAYLOAD, dec_consumed(&dec));
+    if (ckpt_path) {
+        ckpt.phase = CKPT_PHASE_PAYLOAD;
+        ckpt.hdr = tape_hdr;
+    }
+    while (payload_got < (size_t)data_size) {
+        size_t chunk = (size_t)data_size - payload_got;
+        size_t n = 0;
+
+        if (ckpt_path && chunk > CKPT_INTERVAL_BYTES)
+            chunk = CKPT_INTERVAL_BYTES;
+        st = dec_read_payload(&dec, payload + payload_got, chunk, &n);
+        if (n > 0 && fwrite(payload + payload_got, 1u, n, vz) != n) {
+            fprintf(stderr, "error writing data byte\n");
+            goto fail;
+        }
+        payload_got += n;
+        if (st != DEC_OK)
+            goto decode_fail;
+        if (ckpt_path) {
+            ckpt.got = (unsigned)payload_got;
+            dec_snapshot(&dec, &ckpt.at);
+            if (fflush(vz) != 0 || checkpoint_save(ckpt_path, &ckpt) != 0)
+                printf("warning -- couldn't write checkpoint %s\n", ckpt_path);
+        }
+    }
+
     /*
      * Tape checksum includes start/end address bytes plus payload bytes.
-     * This matches the encoder and original DOS behaviour.
+     * This matches the encoder and original DOS behaviour.  checksum_calc
+     * wraps at 65536 (uint16_t arithmetic) matching the original 16-bit
+     * DOS accumulator.
      */
     checksum_calc = (uint16_t)(
-          (start_addr & 0x00FFu)
-        + ((start_addr >> 8) & 0x00FFu)
-        + (end_addr & 0x00FFu)
-        + ((end_addr >> 8) & 0x00FFu)
+          (tape_hdr.start_addr & 0x00FFu)
+        + ((tape_hdr.start_addr >> 8) & 0x00FFu)
+        + (tape_hdr.end_addr & 0x00FFu)
+        + ((tape_hdr.end_addr >> 8) & 0x00FFu)
     );
-    for (i = 0; i < (int)data_size; i++) {
-        b = ReadVZbyte();
-        checksum_calc = (uint16_t)(checksum_calc + (uint16_t)b);
-        if (fwrite(&b, 1u, 1u, g_vz) != 1u)
-            fatal("error writing data byte");
-    }
+    for (i = 0; i < (int)data_size; i++)
+        checksum_calc = (uint16_t)(checksum_calc + (uint16_t)payload[i]);
 
     printf("OK!\n");
     printf("Comparing checksum....");
@@ -877,31 +2645,12 @@ int main(int argc, char *argv[])
     /* ------------------------------------------------------------------ */
     /* Read and verify tape checksum (little-endian uint16)                */
     /* ------------------------------------------------------------------ */
+    stat_phase(&timer, PH_CHECKSUM, dec_consumed(&dec));
     {
-        const size_t checksum_budget = 22050u;
-        int checksum_ok = 0;
         int resync_used = 0;
+        int checksum_ok = dec_read_checksum(&dec, &checksum_tape, &resync_used);
 
-        g_allow_eof = 1;
-        g_hit_eof = 0;
-        budget_start(checksum_budget);
-        checksum_tape = read_u16_le();
-        budget_stop();
-
-        if (!g_hit_eof) {
-            checksum_ok = 1;
-        } else {
-            g_hit_eof = 0;
-            resync_used = 1;
-            budget_start(checksum_budget);
-            if (resync_to_high() == 0) {
-                checksum_tape = read_u16_le();
-            }
-            budget_stop();
-            if (!g_hit_eof)
-                checksum_ok = 1;
-        }
-        g_allow_eof = 0;
+        stat_phase(&timer, -1, dec_consumed(&dec));
 
         if (!checksum_ok) {
             printf("warning -- checksum missing / malformed\n");
@@ -916,11 +2665,47 @@ int main(int argc, char *argv[])
                 printf("OK!\n");
             }
         }
+        if (cas_path) {
+            printf("Creating CAS file.....");
+            if (write_cas(cas_path, leader_bytes, &tape_hdr, payload, data_size,
+                          checksum_ok ? checksum_tape : checksum_calc) != 0) {
+                printf("error -- couldn't write %s\n", cas_path);
+                cas_failed = 1;
+            } else {
+                printf("OK!\n");
+            }
+        }
+        if (ckpt_path) {
+            if (checksum_ok && checksum_calc == checksum_tape)
+                remove(ckpt_path);
+            else
+                printf("checkpoint kept: %s (--resume-leader to retry)\n", ckpt_path);
+        }
     }
 
     printf("\n*** Operation completed ***\n");
-
-    fclose(g_wav);
-    fclose(g_vz);
-    return 0;
+    if (stats_mode)
+        print_decoder_stats(&timer, &dec);
+
+    free(payload);
+    free(ckpt_path);
+    index_free(&tape_index);
+    dec_free(&dec);
+    fclose(wav);
+    fclose(vz);
+    return cas_failed ? 1 : 0;
+
+decode_fail:
+    fprintf(stderr, "%s\n", dec_strerror(dec.status));
+fail:
+    stat_phase(&timer, -1, dec_consumed(&dec));
+    if (stats_mode)
+        print_decoder_stats(&timer, &dec);
+    free(payload);
+    free(ckpt_path);
+    index_free(&tape_index);
+    dec_free(&dec);
+    fclose(wav);
+    fclose(vz);
+    return 1;
 }